@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+#include <shardcache.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "volatile_store.h"
+
+/*
+ * Log-structured storage module.
+ *
+ * Values are appended to segment files (<path>/segment.<id>) which are
+ * memory-mapped, so that fetching a value costs a lookup in the in-memory
+ * index and a copy out of the page cache (no syscalls involved).
+ * Overwrites and removals only append new records (removals append a
+ * tombstone), the space used by the stale records is reclaimed by a background
+ * thread compacting the segments whose garbage exceeds the configured ratio.
+ *
+ * At startup the index is rebuilt by replaying the segments in order,
+ * and new records are appended to the last one.
+ *
+ * Options:
+ *    path           the directory holding the segments (mandatory)
+ *    segment_size   the size of a segment in bytes (defaults to 64MB)
+ *    compact_ratio  the percentage of stale data in a segment
+ *                   triggering its compaction (defaults to 50)
+ */
+
+int storage_version = SHARDCACHE_STORAGE_API_VERSION;
+
+#define MMST_MAGIC 0x4d4d5354 // "MMST"
+#define MMST_TOMBSTONE 0xffffffff
+#define MMST_SEGMENT_SIZE_DEFAULT (64<<20)
+#define MMST_COMPACT_RATIO_DEFAULT 50
+// how often (in seconds) the compactor looks for segments to compact
+#define MMST_COMPACT_INTERVAL 1
+
+typedef struct {
+    uint32_t magic; // written last, so partial records are ignored at startup
+    uint32_t klen;
+    uint32_t vlen;  // MMST_TOMBSTONE for removals
+    uint32_t reserved;
+} mmst_record_t; // followed by the key and the value
+
+#define MMST_RECORD_SIZE(_klen, _vlen) \
+    ((sizeof(mmst_record_t) + (_klen) + (_vlen) + 7) & ~((size_t)7))
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    char *map;
+    size_t size; // the size of the file (and of the mapping)
+    size_t used; // the offset where the next record will be appended
+    size_t live; // the bytes used by the records still referenced by the index
+} mmst_segment_t;
+
+// what the index holds for each key
+typedef struct {
+    uint32_t segment;
+    uint32_t vlen;
+    uint64_t offset;
+} mmst_location_t;
+
+typedef struct {
+    char *path;
+    size_t segment_size;
+    int compact_ratio;
+
+    pthread_rwlock_t lock;      // protects the segments and the index
+    mmst_segment_t **segments;  // indexed by id (NULL if removed)
+    uint32_t num_segments;
+    mmst_segment_t *active;     // the segment new records are appended to
+    volatile_store_t *index;
+
+    pthread_t compactor;
+    pthread_mutex_t compactor_lock;
+    pthread_cond_t compactor_cond;
+    int quit;
+} mmst_t;
+
+static void
+mmst_segment_path(mmst_t *st, uint32_t id, char *path, size_t len)
+{
+    snprintf(path, len, "%s/segment.%08u", st->path, id);
+}
+
+static mmst_segment_t *
+mmst_segment_open(mmst_t *st, uint32_t id, size_t min_size)
+{
+    char path[PATH_MAX];
+    mmst_segment_path(st, id, path, sizeof(path));
+
+    int fd = open(path, O_RDWR|O_CREAT, 0644);
+    if (fd == -1) {
+        SHC_ERROR("Can't open segment %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat stat;
+    if (fstat(fd, &stat) != 0) {
+        SHC_ERROR("Can't stat segment %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = stat.st_size;
+    if (size < min_size) {
+        if (ftruncate(fd, min_size) != 0) {
+            SHC_ERROR("Can't resize segment %s: %s", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        size = min_size;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        SHC_ERROR("Can't map segment %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    mmst_segment_t *segment = calloc(1, sizeof(mmst_segment_t));
+    segment->id = id;
+    segment->fd = fd;
+    segment->map = map;
+    segment->size = size;
+
+    if (id >= st->num_segments) {
+        uint32_t num_segments = id + 1;
+        st->segments = realloc(st->segments, num_segments * sizeof(mmst_segment_t *));
+        memset(&st->segments[st->num_segments], 0,
+               (num_segments - st->num_segments) * sizeof(mmst_segment_t *));
+        st->num_segments = num_segments;
+    }
+    st->segments[id] = segment;
+
+    return segment;
+}
+
+static void
+mmst_segment_close(mmst_t *st, mmst_segment_t *segment, int remove)
+{
+    if (!remove)
+        msync(segment->map, segment->used, MS_SYNC);
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    if (remove) {
+        char path[PATH_MAX];
+        mmst_segment_path(st, segment->id, path, sizeof(path));
+        unlink(path);
+    }
+    free(segment);
+}
+
+static inline mmst_record_t *
+mmst_record(mmst_segment_t *segment, uint64_t offset)
+{
+    return (mmst_record_t *)(segment->map + offset);
+}
+
+static void
+mmst_index_copy_location(void *value, size_t vlen, void *priv)
+{
+    memcpy(priv, value, sizeof(mmst_location_t));
+}
+
+static int
+mmst_index_lookup(mmst_t *st, void *key, size_t klen, mmst_location_t *location)
+{
+    return volatile_store_get(st->index, key, klen, mmst_index_copy_location, location);
+}
+
+// points the key to a new record, accounting the previous one (if any)
+// as garbage. The storage must be write-locked
+static void
+mmst_index_update(mmst_t *st, void *key, size_t klen, mmst_location_t *location)
+{
+    mmst_location_t prev;
+    if (mmst_index_lookup(st, key, klen, &prev) == 0) {
+        mmst_segment_t *segment = st->segments[prev.segment];
+        segment->live -= MMST_RECORD_SIZE(klen, prev.vlen);
+    }
+
+    if (location) {
+        volatile_store_set(st->index, key, klen, location, sizeof(mmst_location_t), 0, 0, NULL);
+        st->segments[location->segment]->live += MMST_RECORD_SIZE(klen, location->vlen);
+    } else {
+        volatile_store_delete(st->index, key, klen, NULL);
+    }
+}
+
+// appends a new record to the active segment (switching to a new segment
+// if there is no room left). The storage must be write-locked
+static int
+mmst_append(mmst_t *st, void *key, size_t klen, void *value, uint32_t vlen, mmst_location_t *location)
+{
+    size_t size = MMST_RECORD_SIZE(klen, vlen == MMST_TOMBSTONE ? 0 : vlen);
+    mmst_segment_t *segment = st->active;
+
+    if (segment->used + size > segment->size) {
+        mmst_segment_t *next = mmst_segment_open(st,
+                                                 segment->id + 1,
+                                                 size > st->segment_size ? size : st->segment_size);
+        if (!next)
+            return -1;
+        msync(segment->map, segment->used, MS_ASYNC);
+        st->active = segment = next;
+    }
+
+    mmst_record_t *record = mmst_record(segment, segment->used);
+    memcpy((char *)(record + 1), key, klen);
+    if (vlen != MMST_TOMBSTONE)
+        memcpy((char *)(record + 1) + klen, value, vlen);
+    record->klen = klen;
+    record->vlen = vlen;
+    __sync_synchronize();
+    record->magic = MMST_MAGIC;
+
+    if (location) {
+        location->segment = segment->id;
+        location->vlen = vlen;
+        location->offset = segment->used;
+    }
+    segment->used += size;
+    return 0;
+}
+
+static int
+mmst_has_older_segments(mmst_t *st, uint32_t id)
+{
+    uint32_t i;
+    for (i = 0; i < id && i < st->num_segments; i++) {
+        if (st->segments[i])
+            return 1;
+    }
+    return 0;
+}
+
+// flushes to disk the segments from first_id up to the active one
+// (the ones the compactor might have appended records to)
+static int
+mmst_sync_segments(mmst_t *st, uint32_t first_id)
+{
+    int rc = 0;
+
+    // only the compactor removes segments, so they can be
+    // synced without holding the lock once they have been collected
+    pthread_rwlock_rdlock(&st->lock);
+    uint32_t last_id = st->active->id;
+    uint32_t count = last_id >= first_id ? last_id - first_id + 1 : 0;
+    mmst_segment_t **segments = calloc(count ? count : 1, sizeof(mmst_segment_t *));
+    size_t *used = calloc(count ? count : 1, sizeof(size_t));
+    if (!segments || !used) {
+        pthread_rwlock_unlock(&st->lock);
+        free(segments);
+        free(used);
+        return -1;
+    }
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        segments[i] = st->segments[first_id + i];
+        if (segments[i])
+            used[i] = segments[i]->used;
+    }
+    pthread_rwlock_unlock(&st->lock);
+
+    for (i = 0; i < count && rc == 0; i++) {
+        if (!segments[i])
+            continue;
+        if (msync(segments[i]->map, used[i], MS_SYNC) != 0 || fsync(segments[i]->fd) != 0) {
+            SHC_ERROR("Can't sync segment %u: %s", segments[i]->id, strerror(errno));
+            rc = -1;
+        }
+    }
+    free(segments);
+    free(used);
+
+    // the segments created meanwhile must be found at startup
+    if (rc == 0) {
+        int fd = open(st->path, O_RDONLY);
+        if (fd == -1 || fsync(fd) != 0) {
+            SHC_ERROR("Can't sync directory %s: %s", st->path, strerror(errno));
+            rc = -1;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+
+    return rc;
+}
+
+// moves the records still referenced by the index to the active segment
+// and removes the segment
+static void
+mmst_compact_segment(mmst_t *st, mmst_segment_t *segment)
+{
+    pthread_rwlock_rdlock(&st->lock);
+    uint32_t first_id = st->active->id;
+    pthread_rwlock_unlock(&st->lock);
+
+    // the segment is not active anymore, so its records can't change
+    // and can be read without holding the lock
+    uint64_t offset = 0;
+    while (offset < segment->used) {
+        mmst_record_t *record = mmst_record(segment, offset);
+        void *key = (char *)(record + 1);
+        int tombstone = (record->vlen == MMST_TOMBSTONE);
+
+        pthread_rwlock_wrlock(&st->lock);
+        if (tombstone) {
+            // the tombstone must survive as long as
+            // an older segment might hold the removed value
+            if (!volatile_store_exists(st->index, key, record->klen) &&
+                mmst_has_older_segments(st, segment->id))
+            {
+                mmst_append(st, key, record->klen, NULL, MMST_TOMBSTONE, NULL);
+            }
+        } else {
+            mmst_location_t location;
+            if (mmst_index_lookup(st, key, record->klen, &location) == 0 &&
+                location.segment == segment->id && location.offset == offset)
+            {
+                mmst_location_t new_location;
+                if (mmst_append(st, key, record->klen, (char *)key + record->klen,
+                                record->vlen, &new_location) != 0)
+                {
+                    // keep the segment, it will be tried again later
+                    pthread_rwlock_unlock(&st->lock);
+                    return;
+                }
+                mmst_index_update(st, key, record->klen, &new_location);
+            }
+        }
+        pthread_rwlock_unlock(&st->lock);
+
+        offset += MMST_RECORD_SIZE(record->klen, tombstone ? 0 : record->vlen);
+    }
+
+    // the moved records must be on disk before the
+    // only other copy of them is removed
+    if (mmst_sync_segments(st, first_id) != 0) {
+        // keep the segment, it will be tried again later
+        return;
+    }
+
+    pthread_rwlock_wrlock(&st->lock);
+    st->segments[segment->id] = NULL;
+    pthread_rwlock_unlock(&st->lock);
+
+    SHC_DEBUG("Compacted segment %u", segment->id);
+    mmst_segment_close(st, segment, 1);
+}
+
+static void *
+mmst_compactor(void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+
+    while (!__sync_fetch_and_add(&st->quit, 0)) {
+        struct timespec abstime = { time(NULL) + MMST_COMPACT_INTERVAL, 0 };
+        pthread_mutex_lock(&st->compactor_lock);
+        pthread_cond_timedwait(&st->compactor_cond, &st->compactor_lock, &abstime);
+        pthread_mutex_unlock(&st->compactor_lock);
+
+        // pick the segment with most garbage
+        mmst_segment_t *candidate = NULL;
+        size_t candidate_garbage = 0;
+        pthread_rwlock_rdlock(&st->lock);
+        uint32_t i;
+        for (i = 0; i < st->num_segments; i++) {
+            mmst_segment_t *segment = st->segments[i];
+            if (!segment || segment == st->active)
+                continue;
+            size_t garbage = segment->used - segment->live;
+            if (garbage * 100 >= segment->used * st->compact_ratio && garbage >= candidate_garbage) {
+                candidate = segment;
+                candidate_garbage = garbage;
+            }
+        }
+        pthread_rwlock_unlock(&st->lock);
+
+        if (candidate)
+            mmst_compact_segment(st, candidate);
+    }
+    return NULL;
+}
+
+static int
+mmst_compare_ids(const void *a, const void *b)
+{
+    uint32_t id_a = *(uint32_t *)a;
+    uint32_t id_b = *(uint32_t *)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+// rebuilds the index replaying all the existing segments in order
+static int
+mmst_load(mmst_t *st)
+{
+    DIR *dir = opendir(st->path);
+    if (!dir) {
+        SHC_ERROR("Can't open directory %s: %s", st->path, strerror(errno));
+        return -1;
+    }
+
+    uint32_t *ids = NULL;
+    int num_ids = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        uint32_t id;
+        if (sscanf(entry->d_name, "segment.%u", &id) == 1) {
+            ids = realloc(ids, (num_ids + 1) * sizeof(uint32_t));
+            ids[num_ids++] = id;
+        }
+    }
+    closedir(dir);
+
+    qsort(ids, num_ids, sizeof(uint32_t), mmst_compare_ids);
+
+    int i;
+    for (i = 0; i < num_ids; i++) {
+        mmst_segment_t *segment = mmst_segment_open(st, ids[i], 0);
+        if (!segment) {
+            free(ids);
+            return -1;
+        }
+
+        uint64_t offset = 0;
+        while (offset + sizeof(mmst_record_t) <= segment->size) {
+            mmst_record_t *record = mmst_record(segment, offset);
+            if (record->magic != MMST_MAGIC)
+                break;
+            int tombstone = (record->vlen == MMST_TOMBSTONE);
+            size_t size = MMST_RECORD_SIZE(record->klen, tombstone ? 0 : record->vlen);
+            if (offset + size > segment->size)
+                break;
+
+            void *key = (char *)(record + 1);
+            if (tombstone) {
+                mmst_index_update(st, key, record->klen, NULL);
+            } else {
+                mmst_location_t location = {
+                    .segment = segment->id,
+                    .vlen = record->vlen,
+                    .offset = offset
+                };
+                mmst_index_update(st, key, record->klen, &location);
+            }
+            offset += size;
+        }
+        segment->used = offset;
+        st->active = segment;
+    }
+    free(ids);
+
+    if (!st->active) {
+        st->active = mmst_segment_open(st, 0, st->segment_size);
+        if (!st->active)
+            return -1;
+    }
+
+    SHC_NOTICE("Loaded %zu items from %d segments in %s",
+               volatile_store_count(st->index), num_ids, st->path);
+    return 0;
+}
+
+static int
+st_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    mmst_location_t location;
+
+    *value = NULL;
+    if (vlen)
+        *vlen = 0;
+
+    pthread_rwlock_rdlock(&st->lock);
+    if (mmst_index_lookup(st, key, klen, &location) == 0) {
+        mmst_record_t *record = mmst_record(st->segments[location.segment], location.offset);
+        // the caller takes ownership of the value so it has to be copied
+        // out of the mapping
+        *value = malloc(location.vlen);
+        if (!*value) {
+            pthread_rwlock_unlock(&st->lock);
+            SHC_ERROR("Can't allocate %u bytes for the value", location.vlen);
+            return -1;
+        }
+        memcpy(*value, (char *)(record + 1) + klen, location.vlen);
+        if (vlen)
+            *vlen = location.vlen;
+    }
+    pthread_rwlock_unlock(&st->lock);
+
+    return 0;
+}
+
+static int
+st_store(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    mmst_location_t location;
+
+    if (vlen >= MMST_TOMBSTONE)
+        return -1;
+
+    pthread_rwlock_wrlock(&st->lock);
+    int rc = mmst_append(st, key, klen, value, vlen, &location);
+    if (rc == 0)
+        mmst_index_update(st, key, klen, &location);
+    pthread_rwlock_unlock(&st->lock);
+
+    return rc;
+}
+
+static int
+st_remove(void *key, size_t klen, void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&st->lock);
+    if (volatile_store_exists(st->index, key, klen)) {
+        rc = mmst_append(st, key, klen, NULL, MMST_TOMBSTONE, NULL);
+        if (rc == 0)
+            mmst_index_update(st, key, klen, NULL);
+    }
+    pthread_rwlock_unlock(&st->lock);
+
+    return rc;
+}
+
+static int
+st_exist(void *key, size_t klen, void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    return volatile_store_exists(st->index, key, klen);
+}
+
+static size_t
+st_count(void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    return volatile_store_count(st->index);
+}
+
+typedef struct {
+    shardcache_storage_index_item_t *index;
+    size_t isize;
+    size_t count;
+} st_index_arg_t;
+
+static volatile_store_iterator_status_t
+st_index_item(void *key, size_t klen, void *value, size_t vlen, time_t expire, void *priv)
+{
+    st_index_arg_t *arg = (st_index_arg_t *)priv;
+    if (arg->count == arg->isize)
+        return VOLATILE_STORE_ITERATOR_STOP;
+
+    mmst_location_t *location = (mmst_location_t *)value;
+    shardcache_storage_index_item_t *item = &arg->index[arg->count++];
+    item->key = malloc(klen);
+    memcpy(item->key, key, klen);
+    item->klen = klen;
+    item->vlen = location->vlen;
+    return VOLATILE_STORE_ITERATOR_CONTINUE;
+}
+
+static size_t
+st_index(shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+    st_index_arg_t arg = {
+        .index = index,
+        .isize = isize,
+        .count = 0
+    };
+    volatile_store_foreach(st->index, st_index_item, &arg);
+    return arg.count;
+}
+
+static void
+mmst_destroy(mmst_t *st)
+{
+    uint32_t i;
+    for (i = 0; i < st->num_segments; i++) {
+        if (st->segments[i])
+            mmst_segment_close(st, st->segments[i], 0);
+    }
+    free(st->segments);
+    if (st->index)
+        volatile_store_destroy(st->index);
+    pthread_rwlock_destroy(&st->lock);
+    pthread_mutex_destroy(&st->compactor_lock);
+    pthread_cond_destroy(&st->compactor_cond);
+    free(st->path);
+    free(st);
+}
+
+int
+storage_init(shardcache_storage_t *storage, char **options)
+{
+    mmst_t *st = calloc(1, sizeof(mmst_t));
+    st->segment_size = MMST_SEGMENT_SIZE_DEFAULT;
+    st->compact_ratio = MMST_COMPACT_RATIO_DEFAULT;
+
+    if (options) {
+        while (*options) {
+            char *name = *options++;
+            char *value = *options;
+            if (!value) {
+                SHC_ERROR("Odd element in the options array");
+                continue;
+            }
+            options++;
+            if (strcmp(name, "path") == 0) {
+                st->path = strdup(value);
+            } else if (strcmp(name, "segment_size") == 0) {
+                st->segment_size = strtoull(value, NULL, 10);
+            } else if (strcmp(name, "compact_ratio") == 0) {
+                st->compact_ratio = strtol(value, NULL, 10);
+            } else {
+                SHC_ERROR("Unknown option name %s", name);
+            }
+        }
+    }
+
+    if (!st->path) {
+        SHC_ERROR("The path option is mandatory");
+        free(st);
+        return -1;
+    }
+
+    if (st->segment_size < sizeof(mmst_record_t))
+        st->segment_size = MMST_SEGMENT_SIZE_DEFAULT;
+
+    if (st->compact_ratio <= 0 || st->compact_ratio > 100)
+        st->compact_ratio = MMST_COMPACT_RATIO_DEFAULT;
+
+    pthread_rwlock_init(&st->lock, NULL);
+    pthread_mutex_init(&st->compactor_lock, NULL);
+    pthread_cond_init(&st->compactor_cond, NULL);
+    st->index = volatile_store_create(64, 0, NULL, NULL, NULL);
+
+    if (mmst_load(st) != 0) {
+        mmst_destroy(st);
+        return -1;
+    }
+
+    if (pthread_create(&st->compactor, NULL, mmst_compactor, st) != 0) {
+        SHC_ERROR("Can't create the compactor thread");
+        mmst_destroy(st);
+        return -1;
+    }
+
+    storage->fetch  = st_fetch;
+    storage->store  = st_store;
+    storage->remove = st_remove;
+    storage->exist  = st_exist;
+    storage->count  = st_count;
+    storage->index  = st_index;
+    storage->priv   = st;
+
+    return 0;
+}
+
+void
+storage_destroy(void *priv)
+{
+    mmst_t *st = (mmst_t *)priv;
+
+    __sync_fetch_and_add(&st->quit, 1);
+    pthread_mutex_lock(&st->compactor_lock);
+    pthread_cond_signal(&st->compactor_cond);
+    pthread_mutex_unlock(&st->compactor_lock);
+    pthread_join(st->compactor, NULL);
+
+    mmst_destroy(st);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
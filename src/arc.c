@@ -11,6 +11,7 @@
 #include "shardcache_internal.h" // for MUTEX_* macros
 
 #include "arc.h"
+#include "arc_slab.h"
 
 
 #define LIKELY(_e) __builtin_expect((_e), 1)
@@ -43,19 +44,52 @@ typedef struct _arc_state {
     arc_list_t head;
     size_t size; // note must be accessed only via atomic functions
     uint64_t count; // note must be accessed only via atomic functions
+    struct _arc_state *total; // the cache-wide state aggregating this one
+                              // (NULL if this is already an aggregate)
 } arc_state_t;
 #pragma pack(pop)
 
+// the number of hits which can be buffered (per partition)
+// before being applied to the lists (only used in buffered mode)
+#define ARC_HITS_BUFFER_SIZE 64
+
+/**********************************************************************
+ * A partition holds its own set of lists, its own balance markers and
+ * its own lock. Keys are spread among the partitions by hashing, so
+ * concurrent lookups on different keys will (most likely) not contend
+ * on the same mutex.
+ */
+typedef struct _arc_partition {
+    struct _arc *cache;
+    size_t c, p;
+    struct _arc_state mrug, mru, mfu, mfug;
+
+    int needs_balance;
+
+    pthread_mutex_t lock;
+
+    // hits recorded (and not yet applied) in buffered mode,
+    // each object in the buffer is retained until the buffer is drained
+    struct _arc_object *hits[ARC_HITS_BUFFER_SIZE];
+    int hits_index;
+} arc_partition_t;
+
 /* This structure represents an object that is stored in the cache. Consider
  * this structure private, don't access the fields directly. When creating
- * a new object, use the arc_object_create() function to allocate and initialize it. */
+ * a new object, use the arc_object_create() function to allocate and initialize it.
+ *
+ * Each object is a single allocation laid out as:
+ *   [ arc_object_t | cached object (cos bytes) | key | inline buffer ]
+ * where the inline buffer is whatever is left in the slab chunk
+ * (at least ARC_INLINE_MIN_SIZE bytes) and can be used by the cached
+ * object to hold small values without further allocations */
 #pragma pack(push, 1)
 typedef struct _arc_object {
     arc_state_t *state;
+    arc_partition_t *part;
     arc_list_t head;
     size_t size;
     void *ptr;
-    char buf[32];
     void *key;
     size_t klen;
     refcnt_node_t *node;
@@ -69,14 +103,19 @@ struct _arc {
     struct _arc_ops *ops;
     hashtable_t *hash;
 
-    size_t c, p;
+    size_t c;
     size_t cos;
+
+    // aggregated sizes/counts of the lists in all the partitions
+    // (only the size and count members are used)
     struct _arc_state mrug, mru, mfu, mfug;
 
-    int needs_balance;
+    arc_partition_t *parts;
+    int num_parts;
+
     int mode;
 
-    pthread_mutex_t lock;
+    arc_slab_t *slab; // the arena holding the objects and their payloads
 
     refcnt_t *refcnt;
 };
@@ -85,10 +124,66 @@ struct _arc {
 #define MAX(a, b) ( (a) > (b) ? (a) : (b) )
 #define MIN(a, b) ( (a) < (b) ? (a) : (b) )
 
-#define ARC_OBJ_BASE_SIZE(o) (sizeof(arc_object_t) + (((o)->key == (o)->buf) ? 0 : (o)->klen))
+// the maximum number of objects moved while holding the partition lock
+// when shrinking the cache (see arc_set_size())
+#define ARC_BALANCE_BATCH_SIZE 128
+
+// the minimum size (in bytes) of a single partition
+#define ARC_PARTITION_MIN_SIZE (1<<20)
+
+// the size requested to the arena for an object with a key of length klen
+#define ARC_OBJ_ALLOC_SIZE(c, klen) (sizeof(arc_object_t) + (c)->cos + (klen) + ARC_INLINE_MIN_SIZE)
+
+// the actual amount of memory used by an object (and its key) in the arena
+#define ARC_OBJ_BASE_SIZE(c, o) arc_slab_chunk_size(ARC_OBJ_ALLOC_SIZE(c, (o)->klen))
 
 static int arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state);
 
+static inline void
+arc_state_increase(arc_state_t *state, size_t size)
+{
+    ATOMIC_INCREASE(state->size, size);
+    ATOMIC_INCREASE(state->total->size, size);
+}
+
+static inline void
+arc_state_decrease(arc_state_t *state, size_t size)
+{
+    ATOMIC_DECREASE(state->size, size);
+    ATOMIC_DECREASE(state->total->size, size);
+}
+
+static inline void
+arc_state_increment(arc_state_t *state)
+{
+    ATOMIC_INCREMENT(state->count);
+    ATOMIC_INCREMENT(state->total->count);
+}
+
+static inline void
+arc_state_decrement(arc_state_t *state)
+{
+    ATOMIC_DECREMENT(state->count);
+    ATOMIC_DECREMENT(state->total->count);
+}
+
+// FNV-1a, only used to spread the keys among the partitions
+static inline arc_partition_t *
+arc_partition_select(arc_t *cache, const void *key, size_t len)
+{
+    if (cache->num_parts == 1)
+        return &cache->parts[0];
+
+    uint32_t hash = 2166136261U;
+    const unsigned char *p = (const unsigned char *)key;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+    return &cache->parts[hash % cache->num_parts];
+}
+
 
 
 static inline void
@@ -162,42 +257,60 @@ arc_state_lru(arc_state_t *state)
 }
 
 /* Balance the lists so that we can fit an object with the given size into
- * the cache. */
-static inline void
-arc_balance(arc_t *cache)
+ * the cache. If max_moves is not 0, at most max_moves objects will be moved
+ * and 1 will be returned if the partition still needs to be balanced */
+static inline int
+arc_balance_step(arc_t *cache, arc_partition_t *part, int max_moves)
 {
-    if (!ATOMIC_READ(cache->needs_balance))
-        return;
+    if (!ATOMIC_READ(part->needs_balance))
+        return 0;
+
+    int moves = 0;
 
-    MUTEX_LOCK(cache->lock);
+    MUTEX_LOCK(part->lock);
     /* First move objects from MRU/MFU to their respective ghost lists. */
-    while (cache->mru.size + cache->mfu.size > cache->c) {
-        if (cache->mru.size > cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mru);
-            arc_move(cache, obj, &cache->mrug);
-        } else if (cache->mfu.size > cache->c - cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mfu);
-            arc_move(cache, obj, &cache->mfug);
+    while (part->mru.size + part->mfu.size > part->c) {
+        if (max_moves && moves++ == max_moves) {
+            MUTEX_UNLOCK(part->lock);
+            return 1;
+        }
+        if (part->mru.size > part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mru);
+            arc_move(cache, obj, &part->mrug);
+        } else if (part->mfu.size > part->c - part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mfu);
+            arc_move(cache, obj, &part->mfug);
         } else {
             break;
         }
     }
 
     /* Then start removing objects from the ghost lists. */
-    while (cache->mrug.size + cache->mfug.size > cache->c) {
-        if (cache->mfug.size > cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mfug);
+    while (part->mrug.size + part->mfug.size > part->c) {
+        if (max_moves && moves++ == max_moves) {
+            MUTEX_UNLOCK(part->lock);
+            return 1;
+        }
+        if (part->mfug.size > part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mfug);
             arc_move(cache, obj, NULL);
-        } else if (cache->mrug.size > cache->c - cache->p) {
-            arc_object_t *obj = arc_state_lru(&cache->mrug);
+        } else if (part->mrug.size > part->c - part->p) {
+            arc_object_t *obj = arc_state_lru(&part->mrug);
             arc_move(cache, obj, NULL);
         } else {
             break;
         }
     }
 
-    ATOMIC_SET(cache->needs_balance, 0);
-    MUTEX_UNLOCK(cache->lock);
+    ATOMIC_SET(part->needs_balance, 0);
+    MUTEX_UNLOCK(part->lock);
+    return 0;
+}
+
+static inline void
+arc_balance(arc_t *cache, arc_partition_t *part)
+{
+    arc_balance_step(cache, part, 0);
 }
 
 void
@@ -205,15 +318,16 @@ arc_update_resource_size(arc_t *cache, arc_resource_t res, size_t size)
 {
     arc_object_t *obj = (arc_object_t *)res;
     if (obj) {
-        MUTEX_LOCK(cache->lock);
+        arc_partition_t *part = obj->part;
+        MUTEX_LOCK(part->lock);
         arc_state_t *state = ATOMIC_READ(obj->state);
-        if (LIKELY(state == &cache->mru || state == &cache->mfu)) {
-            ATOMIC_DECREASE(state->size, obj->size);
-            obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
-            ATOMIC_INCREASE(state->size, obj->size);
+        if (LIKELY(state == &part->mru || state == &part->mfu)) {
+            arc_state_decrease(state, obj->size);
+            obj->size = ARC_OBJ_BASE_SIZE(cache, obj) + size;
+            arc_state_increase(state, obj->size);
         }
-        ATOMIC_INCREMENT(cache->needs_balance);
-        MUTEX_UNLOCK(cache->lock);
+        ATOMIC_INCREMENT(part->needs_balance);
+        MUTEX_UNLOCK(part->lock);
     }
 }
 
@@ -243,10 +357,12 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
     // before it's being deleted it will try putting the object to the mfu list without checking first
     // if it was already in a list or not (new objects should be first moved to the 
     // mru list and not the mfu one)
-    if (UNLIKELY(obj->locked || (state == &cache->mfu && ATOMIC_READ(obj->state) == NULL)))
+    arc_partition_t *part = obj->part;
+
+    if (UNLIKELY(obj->locked || (state == &part->mfu && ATOMIC_READ(obj->state) == NULL)))
         return 0;
 
-    MUTEX_LOCK(cache->lock);
+    MUTEX_LOCK(part->lock);
 
     arc_state_t *obj_state = ATOMIC_READ(obj->state);
 
@@ -257,7 +373,7 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
             // (those in the mfu list being hit again)
             if (LIKELY(state->head.next != &obj->head))
                 arc_list_move_to_head(&obj->head, &state->head);
-            MUTEX_UNLOCK(cache->lock);
+            MUTEX_UNLOCK(part->lock);
             return 0;
         }
 
@@ -265,38 +381,38 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         // (and the object is not going to be being removed)
         // move the ^ (p) marker
         if (LIKELY(state != NULL)) {
-            if (obj_state == &cache->mrug) {
-                size_t csize = cache->mrug.size
-                             ? (cache->mfug.size / cache->mrug.size)
-                             : cache->mfug.size / 2;
-                cache->p = MIN(cache->c, cache->p + MAX(csize, 1));
-            } else if (obj_state == &cache->mfug) {
-                size_t csize = cache->mfug.size
-                             ? (cache->mrug.size / cache->mfug.size)
-                             : cache->mrug.size / 2;
+            if (obj_state == &part->mrug) {
+                size_t csize = part->mrug.size
+                             ? (part->mfug.size / part->mrug.size)
+                             : part->mfug.size / 2;
+                part->p = MIN(part->c, part->p + MAX(csize, 1));
+            } else if (obj_state == &part->mfug) {
+                size_t csize = part->mfug.size
+                             ? (part->mrug.size / part->mfug.size)
+                             : part->mrug.size / 2;
                 size_t diff = MAX(csize, 1);
-                if (cache->p > diff)
-                    cache->p -= diff;
+                if (part->p > diff)
+                    part->p -= diff;
                 else
-                    cache->p = 0;
+                    part->p = 0;
             }
         }
 
-        ATOMIC_DECREASE(obj_state->size, obj->size);
+        arc_state_decrease(obj_state, obj->size);
         arc_list_remove(&obj->head);
-        ATOMIC_DECREMENT(obj_state->count);
+        arc_state_decrement(obj_state);
         ATOMIC_SET(obj->state, NULL);
     }
 
     if (state == NULL) {
         if (ht_delete_if_equals(cache->hash, (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
             release_ref(cache->refcnt, obj->node);
-    } else if (state == &cache->mrug || state == &cache->mfug) {
+    } else if (state == &part->mrug || state == &part->mfug) {
         obj->async = 0;
         arc_list_prepend(&obj->head, &state->head);
-        ATOMIC_INCREMENT(state->count);
+        arc_state_increment(state);
         ATOMIC_SET(obj->state, state);
-        ATOMIC_INCREASE(state->size, obj->size);
+        arc_state_increase(state, obj->size);
     } else if (obj_state == NULL) {
 
         obj->locked = 1;
@@ -304,7 +420,7 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         // unlock the cache while the backend is fetching the data
         // (the object has been locked while being fetched so nobody
         // will change its state)
-        MUTEX_UNLOCK(cache->lock);
+        MUTEX_UNLOCK(part->lock);
         size_t size = 0;
         int rc = cache->ops->fetch(obj->ptr, &size, cache->ops->priv);
         switch (rc) {
@@ -317,20 +433,20 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
             }
             default:
             {
-                if (size >= cache->c) {
-                    // the (single) object doesn't fit in the cache, let's return it
+                if (size >= part->c) {
+                    // the (single) object doesn't fit in its partition, let's return it
                     // to the getter without (re)adding it to the cache
                     if (ht_delete_if_equals(cache->hash, (void *)obj->key, obj->klen, obj, sizeof(arc_object_t)) == 0)
                         release_ref(cache->refcnt, obj->node);
                     return 1;
                 }
-                MUTEX_LOCK(cache->lock);
-                obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos + size;
+                MUTEX_LOCK(part->lock);
+                obj->size = ARC_OBJ_BASE_SIZE(cache, obj) + size;
                 arc_list_prepend(&obj->head, &state->head);
-                ATOMIC_INCREMENT(state->count);
+                arc_state_increment(state);
                 ATOMIC_SET(obj->state, state);
-                ATOMIC_INCREASE(state->size, obj->size);
-                ATOMIC_INCREMENT(cache->needs_balance);
+                arc_state_increase(state, obj->size);
+                ATOMIC_INCREMENT(part->needs_balance);
                 break;
             }
         }
@@ -340,11 +456,11 @@ arc_move(arc_t *cache, arc_object_t *obj, arc_state_t *state)
         obj->locked = 0;
     } else {
         arc_list_prepend(&obj->head, &state->head);
-        ATOMIC_INCREMENT(state->count);
+        arc_state_increment(state);
         ATOMIC_SET(obj->state, state);
-        ATOMIC_INCREASE(state->size, obj->size);
+        arc_state_increase(state, obj->size);
     }
-    MUTEX_UNLOCK(cache->lock);
+    MUTEX_UNLOCK(part->lock);
     return 0;
 }
 
@@ -355,11 +471,9 @@ free_node_ptr_callback(void *node)
 {
     // we don't need locks here .... nobody references obj anymore
     arc_object_t *obj = (arc_object_t *)node;
+    arc_t *cache = obj->part->cache;
 
-    if (obj->key != obj->buf)
-        free(obj->key);
-
-    free(obj);
+    arc_slab_free(cache->slab, obj, ARC_OBJ_ALLOC_SIZE(cache, obj->klen));
 }
 
 // this is called when the refcount of the node drops to 0
@@ -378,9 +492,96 @@ terminate_node_callback(refcnt_node_t *node, void *priv)
     obj->state = NULL;
 }
 
+/* Apply all the buffered hits to the lists of a partition.
+ * Objects hit are moved to the head of the mfu list (exactly as arc_lookup()
+ * would do in strict mode) */
+static void
+arc_drain_hits(arc_t *cache, arc_partition_t *part)
+{
+    int i;
+    MUTEX_LOCK(part->lock);
+    for (i = 0; i < ARC_HITS_BUFFER_SIZE; i++) {
+        arc_object_t *obj = __sync_lock_test_and_set(&part->hits[i], NULL);
+        if (!obj)
+            continue;
+        // objects dropped or moved to a ghost list in the meanwhile
+        // must not be promoted (they would need to be fetched again)
+        arc_state_t *state = ATOMIC_READ(obj->state);
+        if (state == &part->mru || state == &part->mfu)
+            arc_move(cache, obj, &part->mfu);
+        release_ref(cache->refcnt, obj->node);
+    }
+    ATOMIC_SET(part->hits_index, 0);
+    MUTEX_UNLOCK(part->lock);
+    arc_balance(cache, part);
+}
+
+/* Record a hit on an object which is already in the mru or mfu list.
+ * The partition lock is taken only by the thread filling the last slot
+ * in the buffer, which will then apply all the buffered hits at once.
+ * If the buffer is full (and being drained) the hit is simply discarded */
+static inline void
+arc_record_hit(arc_t *cache, arc_partition_t *part, arc_object_t *obj)
+{
+    int idx = __sync_fetch_and_add(&part->hits_index, 1);
+    if (idx >= ARC_HITS_BUFFER_SIZE)
+        return;
+
+    retain_ref(cache->refcnt, obj->node);
+    if (!ATOMIC_CAS(part->hits[idx], NULL, obj)) {
+        // the slot is still occupied by a hit recorded
+        // while the buffer was being drained
+        release_ref(cache->refcnt, obj->node);
+    }
+
+    if (idx == ARC_HITS_BUFFER_SIZE - 1)
+        arc_drain_hits(cache, part);
+}
+
+static inline size_t
+arc_partition_size(arc_t *cache, int index)
+{
+    // the first partition takes the remainder so that the sum
+    // of all the partition sizes is exactly the total size
+    size_t part_c = cache->c / cache->num_parts;
+    if (index == 0)
+        part_c += cache->c % cache->num_parts;
+    // the number of partitions is chosen at creation time, if the cache
+    // shrinks afterwards each partition must still be able to hold at least
+    // a few objects (so the sum might exceed the total size)
+    if (cache->num_parts > 1)
+        part_c = MAX(part_c, ARC_PARTITION_MIN_SIZE);
+    return part_c;
+}
+
+static void
+arc_partition_init(arc_t *cache, arc_partition_t *part, size_t c)
+{
+    part->cache = cache;
+    part->c = c;
+    part->p = part->c >> 1;
+
+    arc_list_init(&part->mrug.head);
+    arc_list_init(&part->mru.head);
+    arc_list_init(&part->mfu.head);
+    arc_list_init(&part->mfug.head);
+
+    part->mrug.total = &cache->mrug;
+    part->mru.total = &cache->mru;
+    part->mfu.total = &cache->mfu;
+    part->mfug.total = &cache->mfug;
+
+    MUTEX_INIT_RECURSIVE(part->lock);
+}
+
 /* Create a new cache. */
 arc_t *
-arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, size_t *lists_size[4], arc_mode_t mode)
+arc_create(arc_ops_t *ops,
+           size_t c,
+           size_t cached_object_size,
+           size_t *lists_size[4],
+           arc_mode_t mode,
+           int num_partitions)
 {
     arc_t *cache = calloc(1, sizeof(arc_t));
 
@@ -390,22 +591,29 @@ arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, size_t *lists_si
 
     cache->hash = ht_create(1<<16, 1<<22, NULL);
 
+    cache->slab = arc_slab_create();
+
     cache->c = c >> 1;
-    cache->p = cache->c >> 1;
     cache->cos = cached_object_size;
 
-    arc_list_init(&cache->mrug.head);
-    arc_list_init(&cache->mru.head);
-    arc_list_init(&cache->mfu.head);
-    arc_list_init(&cache->mfug.head);
+    if (num_partitions < 1)
+        num_partitions = 1;
+    // each partition must be able to hold at least a few objects
+    while (num_partitions > 1 && cache->c / num_partitions < ARC_PARTITION_MIN_SIZE)
+        num_partitions--;
+
+    cache->num_parts = num_partitions;
+    cache->parts = calloc(num_partitions, sizeof(arc_partition_t));
+
+    int i;
+    for (i = 0; i < num_partitions; i++)
+        arc_partition_init(cache, &cache->parts[i], arc_partition_size(cache, i));
 
     lists_size[0] = &cache->mru.size;
     lists_size[1] = &cache->mfu.size;
     lists_size[2] = &cache->mrug.size;
     lists_size[3] = &cache->mfug.size;
 
-    MUTEX_INIT_RECURSIVE(cache->lock);
-
     cache->refcnt = refcnt_create(1<<8, terminate_node_callback, free_node_ptr_callback);
     return cache;
 }
@@ -414,13 +622,22 @@ arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, size_t *lists_si
 void
 arc_destroy(arc_t *cache)
 {
-    arc_list_destroy(cache, &cache->mrug.head);
-    arc_list_destroy(cache, &cache->mru.head);
-    arc_list_destroy(cache, &cache->mfu.head);
-    arc_list_destroy(cache, &cache->mfug.head);
+    int i;
+    for (i = 0; i < cache->num_parts; i++) {
+        arc_partition_t *part = &cache->parts[i];
+        arc_drain_hits(cache, part);
+        arc_list_destroy(cache, &part->mrug.head);
+        arc_list_destroy(cache, &part->mru.head);
+        arc_list_destroy(cache, &part->mfu.head);
+        arc_list_destroy(cache, &part->mfug.head);
+        MUTEX_DESTROY(part->lock);
+    }
     ht_destroy(cache->hash);
+    // NOTE: the refcnt must be destroyed before the arena since it
+    //       might still need to release some objects
     refcnt_destroy(cache->refcnt);
-    MUTEX_DESTROY(cache->lock);
+    arc_slab_destroy(cache->slab);
+    free(cache->parts);
     free(cache);
 }
 
@@ -472,21 +689,66 @@ arc_retain_resource(arc_t *cache, arc_resource_t res)
 static inline arc_object_t *
 arc_object_create(arc_t *cache, const void *key, size_t len)
 {
-    arc_object_t *obj = calloc(1, sizeof(arc_object_t) + cache->cos);
+    arc_object_t *obj = arc_slab_alloc(cache->slab, ARC_OBJ_ALLOC_SIZE(cache, len));
+    if (!obj)
+        return NULL;
+
+    memset(obj, 0, sizeof(arc_object_t) + cache->cos);
 
     arc_list_init(&obj->head);
 
+    obj->part = arc_partition_select(cache, key, len);
+
     obj->node = new_node(cache->refcnt, obj, cache);
-    if (len > sizeof(obj->buf))
-        obj->key = malloc(len);
-    else
-        obj->key = obj->buf;
+
+    obj->ptr = (void *)((char *)obj + sizeof(arc_object_t));
+
+    // the key is stored right after the cached object
+    obj->key = (char *)obj->ptr + cache->cos;
     memcpy(obj->key, key, len);
     obj->klen = len;
 
-    obj->size = ARC_OBJ_BASE_SIZE(obj) + cache->cos;
+    obj->size = ARC_OBJ_BASE_SIZE(cache, obj);
 
-    obj->ptr = (void *)((char *)obj + sizeof(arc_object_t));
+    return obj;
+}
+
+static inline int
+arc_hit(arc_t *cache, arc_object_t *obj)
+{
+    int mode = ATOMIC_READ(cache->mode);
+    arc_state_t *state = ATOMIC_READ(obj->state);
+    if (mode == SHARDCACHE_ARC_MODE_BUFFERED &&
+        LIKELY(state == &obj->part->mru || state == &obj->part->mfu))
+    {
+        // the object is already cached, the promotion
+        // can be deferred without touching the lists now
+        arc_record_hit(cache, obj->part, obj);
+    } else if (mode == SHARDCACHE_ARC_MODE_STRICT || UNLIKELY(state != &obj->part->mfu)) {
+        if (UNLIKELY(arc_move(cache, obj, &obj->part->mfu) == -1)) {
+            fprintf(stderr, "Can't move the object into the cache\n");
+            return -1;
+        }
+        arc_balance(cache, obj->part);
+    }
+    return 0;
+}
+
+// the returned object is retained, the caller must call arc_release_resource(obj) to release it
+arc_resource_t
+arc_lookup_cached(arc_t *cache, const void *key, size_t len, void **valuep)
+{
+    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, len, NULL, retain_obj_cb, cache);
+    if (!obj)
+        return NULL;
+
+    if (arc_hit(cache, obj) != 0) {
+        release_ref(cache->refcnt, obj->node);
+        return NULL;
+    }
+
+    if (valuep)
+        *valuep = obj->ptr;
 
     return obj;
 }
@@ -500,13 +762,8 @@ arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async)
     //       of the object (if found)
     arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, len, NULL, retain_obj_cb, cache);
     if (obj) {
-        if (!ATOMIC_READ(cache->mode) || UNLIKELY(ATOMIC_READ(obj->state) != &cache->mfu)) {
-            if (UNLIKELY(arc_move(cache, obj, &cache->mfu) == -1)) {
-                fprintf(stderr, "Can't move the object into the cache\n");
-                return NULL;
-            }
-            arc_balance(cache);
-        }
+        if (arc_hit(cache, obj) != 0)
+            return NULL;
 
         if (valuep)
             *valuep = obj->ptr;
@@ -519,7 +776,7 @@ arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async)
         return NULL;
 
     // let our cache user initialize the underlying object
-    cache->ops->init(key, len, async, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
+    cache->ops->init(obj->key, len, async, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
     obj->async = async;
 
     retain_ref(cache->refcnt, obj->node);
@@ -538,9 +795,9 @@ arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async)
             return arc_lookup(cache, key, len, valuep, async);
         case 0:
             /* New objects are always moved to the MRU list. */
-            rc  = arc_move(cache, obj, &cache->mru);
+            rc  = arc_move(cache, obj, &obj->part->mru);
             if (rc >= 0) {
-                arc_balance(cache);
+                arc_balance(cache, obj->part);
                 *valuep = obj->ptr;
                 return obj;
             }
@@ -554,32 +811,31 @@ arc_lookup(arc_t *cache, const void *key, size_t len, void **valuep, int async)
     return NULL;
 }
 
-static void *
-update_obj_cb(void *data, size_t dlen, void *user)
-{
-    arc_object_t *obj = (arc_object_t *)data;
-    arc_t *cache = (arc_t *)user;
-    cache->ops->store(obj->ptr, data, dlen, cache->ops->priv);
-    //retain_ref(cache->refcnt, obj->node);
-    return data;
-}
-
 int
 arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen)
 {
-    arc_object_t *obj = ht_get_deep_copy(cache->hash, (void *)key, klen, NULL, update_obj_cb, cache);
-    if (obj) {
-        //release_ref(cache->refcnt, obj->node);
-        return 1;
-    }
+    // an existing object is replaced instead of being updated in place
+    // since its data might still be referenced by retained resources
+    // (the old object will be released once nobody references it anymore)
+    arc_remove(cache, key, klen);
 
-    obj = arc_object_create(cache, key, klen);
+    arc_object_t *obj = arc_object_create(cache, key, klen);
     if (!obj)
         return -1;
 
     // let our cache user initialize the underlying object
-    cache->ops->init(key, klen, 0, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
-    cache->ops->store(obj->ptr, valuep, vlen, cache->ops->priv);
+    cache->ops->init(obj->key, klen, 0, (arc_resource_t)obj, obj->ptr, cache->ops->priv);
+    size_t size = cache->ops->store(obj->ptr, valuep, vlen, cache->ops->priv);
+
+    arc_partition_t *part = obj->part;
+    if (size >= part->c) {
+        // the object doesn't fit in its partition
+        release_ref(cache->refcnt, obj->node);
+        return 1;
+    }
+
+    // nobody must move the object until it's in the mru list
+    obj->locked = 1;
 
     retain_ref(cache->refcnt, obj->node);
     // NOTE: atomicity here is ensured by the hashtable implementation
@@ -596,6 +852,18 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen)
             release_ref(cache->refcnt, obj->node);
             return arc_load(cache, key, klen, valuep, vlen);
         case 0:
+            // the object is complete already, so it goes straight
+            // into the mru list as if it had just been fetched
+            MUTEX_LOCK(part->lock);
+            obj->size = ARC_OBJ_BASE_SIZE(cache, obj) + size;
+            arc_list_prepend(&obj->head, &part->mru.head);
+            arc_state_increment(&part->mru);
+            ATOMIC_SET(obj->state, &part->mru);
+            arc_state_increase(&part->mru, obj->size);
+            ATOMIC_INCREMENT(part->needs_balance);
+            obj->locked = 0;
+            MUTEX_UNLOCK(part->lock);
+            arc_balance(cache, part);
             break;
         default:
             fprintf(stderr, "Unknown return code from ht_set_if_not_exists() : %d\n", rc);
@@ -607,6 +875,51 @@ arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen)
     return rc;
 }
 
+void
+arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv)
+{
+    int i;
+    for (i = 0; i < cache->num_parts; i++) {
+        arc_partition_t *part = &cache->parts[i];
+        arc_state_t *states[4] = { &part->mru, &part->mfu, &part->mrug, &part->mfug };
+
+        // retain all the objects of the partition so that the callback
+        // can be called without holding the lock
+        MUTEX_LOCK(part->lock);
+        uint64_t count = part->mru.count + part->mfu.count + part->mrug.count + part->mfug.count;
+        arc_object_t **objs = malloc(count * sizeof(arc_object_t *));
+        arc_list_id_t *lists = malloc(count * sizeof(arc_list_id_t));
+        uint64_t num_objs = 0;
+        int l;
+        for (l = ARC_LIST_MRU; l <= ARC_LIST_MFUG && num_objs < count; l++) {
+            arc_list_t *pos;
+            arc_list_each_prev(pos, &states[l]->head) {
+                if (num_objs == count)
+                    break;
+                arc_object_t *obj = arc_list_entry(pos, arc_object_t, head);
+                retain_ref(cache->refcnt, obj->node);
+                objs[num_objs] = obj;
+                lists[num_objs] = l;
+                num_objs++;
+            }
+        }
+        MUTEX_UNLOCK(part->lock);
+
+        int stop = 0;
+        uint64_t j;
+        for (j = 0; j < num_objs; j++) {
+            if (!stop && !cb(objs[j]->key, objs[j]->klen, objs[j]->ptr, lists[j], priv))
+                stop = 1;
+            release_ref(cache->refcnt, objs[j]->node);
+        }
+        free(objs);
+        free(lists);
+
+        if (stop)
+            break;
+    }
+}
+
 size_t
 arc_size(arc_t *cache)
 {
@@ -659,10 +972,105 @@ arc_get_resource_ptr(arc_resource_t res)
     return ((arc_object_t *)res)->ptr;
 }
 
+void *
+arc_get_resource_inline_buffer(arc_resource_t res, size_t *size)
+{
+    arc_object_t *obj = (arc_object_t *)res;
+    arc_t *cache = obj->part->cache;
+    if (size) {
+        size_t used = sizeof(arc_object_t) + cache->cos + obj->klen;
+        *size = arc_slab_chunk_size(ARC_OBJ_ALLOC_SIZE(cache, obj->klen)) - used;
+    }
+    return (char *)obj->key + obj->klen;
+}
+
+void
+arc_set_size(arc_t *cache, size_t c)
+{
+    int i;
+
+    ATOMIC_SET(cache->c, c >> 1);
+
+    for (i = 0; i < cache->num_parts; i++) {
+        arc_partition_t *part = &cache->parts[i];
+
+        MUTEX_LOCK(part->lock);
+        part->c = arc_partition_size(cache, i);
+        if (part->p > part->c)
+            part->p = part->c;
+        ATOMIC_INCREMENT(part->needs_balance);
+        MUTEX_UNLOCK(part->lock);
+
+        // if the cache is shrinking, objects are evicted in small batches
+        // releasing the partition lock in between, so that concurrent
+        // lookups are not blocked until the whole partition is balanced
+        while (arc_balance_step(cache, part, ARC_BALANCE_BATCH_SIZE))
+            ;
+    }
+
+    // give back to the system the memory released by the evicted objects
+    arc_slab_trim(cache->slab);
+}
+
+size_t
+arc_get_max_size(arc_t *cache)
+{
+    return ATOMIC_READ(cache->c) << 1;
+}
+
+void *
+arc_alloc(arc_t *cache, size_t size)
+{
+    return arc_slab_alloc(cache->slab, size);
+}
+
+void *
+arc_realloc(arc_t *cache, void *ptr, size_t old_size, size_t new_size)
+{
+    return arc_slab_realloc(cache->slab, ptr, old_size, new_size);
+}
+
+void
+arc_free(arc_t *cache, void *ptr, size_t size)
+{
+    arc_slab_free(cache->slab, ptr, size);
+}
+
+void *
+arc_adopt(arc_t *cache, void *ptr, size_t size)
+{
+    return arc_slab_adopt(cache->slab, ptr, size);
+}
+
+size_t
+arc_alloc_size(size_t size)
+{
+    return arc_slab_chunk_size(size);
+}
+
+size_t
+arc_arena_used(arc_t *cache)
+{
+    return arc_slab_used(cache->slab);
+}
+
+size_t
+arc_arena_reserved(arc_t *cache)
+{
+    return arc_slab_reserved(cache->slab);
+}
+
 void
 arc_set_mode(arc_t *cache, arc_mode_t mode)
 {
+    int old_mode = ATOMIC_READ(cache->mode);
     ATOMIC_SET(cache->mode, mode);
+    // apply the pending hits if we are leaving the buffered mode
+    if (old_mode == SHARDCACHE_ARC_MODE_BUFFERED && mode != SHARDCACHE_ARC_MODE_BUFFERED) {
+        int i;
+        for (i = 0; i < cache->num_parts; i++)
+            arc_drain_hits(cache, &cache->parts[i]);
+    }
 }
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -20,7 +20,9 @@ typedef struct _arc_ops {
      *
      * The size of the new object has been provided to arc_create()
      * ptr will point to a prealloc'd memory where the cached object is stored
-     * and needs to be initialized by this callback
+     * and needs to be initialized by this callback.
+     * key points to the copy of the key owned by the object,
+     * which remains valid as long as the object itself
      */
     void (*init) (const void *key, size_t klen, int async, arc_resource_t res, void *ptr, void *priv);
     
@@ -33,7 +35,11 @@ typedef struct _arc_ops {
      */
     int (*fetch) (void *obj, size_t *size, void *priv);
 
-    void (*store) (void *obj, void *data, size_t size, void *priv);
+    /**
+     * @brief Store the provided data in the object (see arc_load()).
+     * @return the size of the stored data (as reported by fetch())
+     */
+    size_t (*store) (void *obj, void *data, size_t size, void *priv);
     
     /**
      * @brief This function is called when the cache is full and we need to evict
@@ -52,10 +58,23 @@ typedef struct _arc_ops {
  *
  * @param ops : A valid pointer to an initialized arc_ops_t structure
  * @param c   : The size of the cache
- * @param mode : 0 for strict mode, 1 for loose_mode
+ * @param mode : 0 for strict mode, 1 for loose_mode, 2 for buffered mode
+ * @param num_partitions : The number of partitions the cache will be split into.
+ *                         Each partition has its own lists and its own lock and
+ *                         gets an equal share of the total size @c.
+ *                         Keys are assigned to partitions by hashing.
+ *                         (1 means a single partition as in the non-partitioned ARC)
  * @return    : A valid pointer to an initialized arc_t structure
+ *
+ * @note The number of partitions might be reduced if the resulting
+ *       partitions would be too small to be useful
  */
-arc_t *arc_create(arc_ops_t *ops, size_t c, size_t cached_object_size, size_t *lists_size[4], arc_mode_t mode);
+arc_t *arc_create(arc_ops_t *ops,
+                  size_t c,
+                  size_t cached_object_size,
+                  size_t *lists_size[4],
+                  arc_mode_t mode,
+                  int num_partitions);
 
 /**
  * @brief Release an existing ARC cache instance
@@ -82,8 +101,67 @@ void arc_destroy(arc_t *cache);
  */
 arc_resource_t arc_lookup(arc_t *cache, const void *key, size_t klen, void **valuep, int async);
 
+/**
+ * @brief Lookup an object already present in the cache
+ *
+ *        Behaves like arc_lookup() but never creates (and fetches) the
+ *        object if it's not in the cache already
+ *
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param key    : The key
+ * @param klen   : The length of the key
+ * @param valuep : a reference to the pointer where to copy the retrieved value
+ * @return An opaque ARC resource which needs to be released using arc_release_resource()
+ *         or NULL if the object is not in the cache
+ */
+arc_resource_t arc_lookup_cached(arc_t *cache, const void *key, size_t klen, void **valuep);
+
+/**
+ * @brief Load an object in the cache providing its data
+ *
+ * The object (replacing any existing one for the same key) is initialized,
+ * filled using the store() callback and put in the mru list as if it had
+ * just been fetched
+ *
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param key    : The key
+ * @param klen   : The length of the key
+ * @param valuep : The data to store in the object
+ * @param vlen   : The length of the data
+ * @return 0 on success, 1 if the object doesn't fit in the cache, -1 otherwise
+ */
 int arc_load(arc_t *cache, const void *key, size_t klen, void *valuep, size_t vlen);
 
+typedef enum {
+    ARC_LIST_MRU = 0,
+    ARC_LIST_MFU,
+    ARC_LIST_MRUG,
+    ARC_LIST_MFUG
+} arc_list_id_t;
+
+/**
+ * @brief Callback called by arc_foreach() for each object in the lists
+ * @param key   : The key of the object
+ * @param klen  : The length of the key
+ * @param ptr   : The cached object (retained until the callback returns)
+ * @param list  : The list holding the object
+ * @param priv  : The priv pointer provided to arc_foreach()
+ * @return 1 to go ahead with the iteration, 0 to stop it
+ */
+typedef int (*arc_foreach_callback_t)(const void *key, size_t klen, void *ptr, arc_list_id_t list, void *priv);
+
+/**
+ * @brief Iterate over the objects in all the lists (mru, mfu and ghosts)
+ * @param cache  : A valid pointer to an initialized arc_t structure
+ * @param cb     : The callback to call for each object
+ * @param priv   : A pointer to pass to the callback
+ * @note Each list is traversed from the least to the most recently used object,
+ *       so loading the objects in the same order reproduces the lists.
+ *       The partition lock is only held while collecting its objects,
+ *       the callback is called with no locks held
+ */
+void arc_foreach(arc_t *cache, arc_foreach_callback_t cb, void *priv);
+
 /**
  * @brief Release the resource previously alloc'd by arc_lookup()
  * @note  The retain count will be decreased by 1.\nThe underlying
@@ -107,6 +185,24 @@ void arc_drop_resource(arc_t *cache, arc_resource_t res);
 
 void *arc_get_resource_ptr(arc_resource_t res);
 
+// the minimum amount of spare space available in each object's allocation
+#define ARC_INLINE_MIN_SIZE 16
+
+/**
+ * @brief Get the spare space available in the allocation of a resource
+ *
+ * Objects are stored together with their key in a single allocation,
+ * the space left in the allocation (at least ARC_INLINE_MIN_SIZE bytes)
+ * is available to the cached object to hold small values.
+ * The buffer immediately follows the key passed to the init() callback
+ * and stays valid as long as the resource itself
+ *
+ * @param res    : An opaque ARC resource
+ * @param size   : If not NULL the size of the buffer will be stored here
+ * @return A pointer to the inline buffer
+ */
+void *arc_get_resource_inline_buffer(arc_resource_t res, size_t *size);
+
 /**
  * @brief Force complete removal of an item from the cache
  * @note the item will be completely removed from the cache and not moved
@@ -192,6 +288,86 @@ uint64_t arc_count(arc_t *cache);
 
 void arc_set_mode(arc_t *cache, arc_mode_t mode);
 
+/**
+ * @brief Change the size of the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param c     : The new size of the cache
+ * @note If the cache is shrinking, the exceeding objects are evicted before
+ *       returning, but in small batches (one partition at a time) so that
+ *       concurrent lookups are not blocked until all evictions are done
+ * @note The number of partitions doesn't change, so if the new size is too
+ *       small each partition keeps its minimum size (1MB)
+ */
+void arc_set_size(arc_t *cache, size_t c);
+
+/**
+ * @brief Returns the configured size of the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @return The size of the cache (as provided to arc_create() or arc_set_size())
+ */
+size_t arc_get_max_size(arc_t *cache);
+
+/**
+ * @brief Allocate memory from the arena owned by the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param size  : The amount of bytes to allocate
+ * @return A pointer to the allocated memory, NULL in case of errors
+ * @note The memory must be released using arc_free() providing the same size
+ */
+void *arc_alloc(arc_t *cache, size_t size);
+
+/**
+ * @brief Resize memory previously allocated with arc_alloc()
+ * @param cache    : A valid pointer to an initialized arc_t structure
+ * @param ptr      : The memory to resize (or NULL)
+ * @param old_size : The size used when allocating ptr
+ * @param new_size : The new size
+ * @return A pointer to the resized memory, NULL in case of errors
+ */
+void *arc_realloc(arc_t *cache, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Release memory previously allocated with arc_alloc()
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param ptr   : The memory to release
+ * @param size  : The size used when allocating ptr
+ */
+void arc_free(arc_t *cache, void *ptr, size_t size);
+
+/**
+ * @brief Move a buffer allocated with malloc() into the arena owned by the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @param ptr   : A buffer allocated with malloc()
+ * @param size  : The size of the data in the buffer
+ * @return A pointer to memory owned by the arena and holding the data,
+ *         to be released using arc_free()
+ * @note ptr must not be accessed anymore after this call
+ */
+void *arc_adopt(arc_t *cache, void *ptr, size_t size);
+
+/**
+ * @brief Returns the real footprint of an allocation of the given size
+ *        (to be used when reporting object sizes to arc_update_resource_size()
+ *        or from the fetch callback)
+ * @param size : The requested size
+ * @return The amount of memory actually used in the arena
+ */
+size_t arc_alloc_size(size_t size);
+
+/**
+ * @brief Returns the amount of memory in use in the arena owned by the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @return The number of bytes in use
+ */
+size_t arc_arena_used(arc_t *cache);
+
+/**
+ * @brief Returns the amount of memory obtained from the OS by the arena owned by the cache
+ * @param cache : A valid pointer to an initialized arc_t structure
+ * @return The number of bytes reserved
+ */
+size_t arc_arena_reserved(arc_t *cache);
+
 #endif /* SHARDCACHE_ARC_H */
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -59,6 +59,9 @@ typedef struct
     shardcache_t *cache;
     char *peer_addr;
     int fd;
+    struct timeval start; // when the request has been sent to the peer
+    uint64_t latency;     // the time (in microseconds) until the first response
+                          // from the peer (0 if nothing has been received yet)
 } shc_fetch_async_arg_t;
 
 static int
@@ -77,31 +80,44 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
     int fd = arg->fd;
     int total_len = 0;
 
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(obj);
 
     if (!obj->res) {
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         return -1;
     }
     if (!obj->listeners) {
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         free(arg);
         arc_release_resource(cache->arc, obj->res);
         return -1;
     }
+    // the latency reported for the peer is the time to the first byte,
+    // the time needed to transfer the whole value depends on its size.
+    // NOTE: requests which joined an in-flight fetch didn't talk to the peer themselves
+    if (peer_addr && !arg->latency) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        arg->latency = shardcache_elapsed_usecs(&arg->start, &now);
+        if (!arg->latency)
+            arg->latency = 1;
+    }
+    if (peer_addr && (status == -1 || status == 1))
+        shardcache_report_peer(cache, peer_addr, status == 1, arg->latency);
+
     if (status == -1) {
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         if (fd >= 0)
             close(fd);
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         arc_drop_resource(cache->arc, obj->res);
         free(arg);
         return -1;
@@ -114,7 +130,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         int drop = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) || !obj->dlen);
 
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
 
         if (drop)
             arc_drop_resource(cache->arc, obj->res);
@@ -124,26 +140,51 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         return 0;
     } else if (len) {
         size_t olen = obj->dlen;
+        int detach = 0;
         obj->dlen += len;
-        if (obj->dlen > sizeof(obj->dbuf)) {
-            if (obj->data == obj->dbuf) {
-                obj->data = malloc(obj->dlen);
-                if (olen)
-                    memcpy(obj->data, obj->dbuf, olen);
+
+        int threshold = ATOMIC_READ(cache->streaming_threshold);
+        if (threshold > 0 && obj->dlen > (size_t)threshold && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_STREAMING)) {
+            // the value is too big to be kept in memory while being received,
+            // from now on the chunks are only forwarded to the listeners.
+            // The object can't be cached nor serve new getters (which would
+            // miss the data received so far) so it's detached from the arc
+            if (obj->data && !COBJ_DATA_IS_INLINE(obj))
+                arc_free(cache->arc, obj->data, olen);
+            obj->data = NULL;
+            COBJ_SET_FLAG(obj, COBJ_FLAG_STREAMING|COBJ_FLAG_DROP|COBJ_FLAG_EVICTED);
+            detach = 1;
+        }
+
+        if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_STREAMING)) {
+            if (obj->dlen > obj->isize) {
+                if (!obj->data || COBJ_DATA_IS_INLINE(obj)) {
+                    obj->data = arc_alloc(cache->arc, obj->dlen);
+                    if (olen)
+                        memcpy(obj->data, COBJ_INLINE_BUFFER(obj), olen);
+                } else {
+                    obj->data = arc_realloc(cache->arc, obj->data, olen, obj->dlen);
+                }
             } else {
-                obj->data = realloc(obj->data, obj->dlen);
+                obj->data = COBJ_INLINE_BUFFER(obj);
             }
-        } else {
-            obj->data = obj->dbuf;
+            memcpy(obj->data + olen, data, len);
         }
-        memcpy(obj->data + olen, data, len);
         shardcache_fetch_from_peer_notify_arg arg = {
             .obj = obj,
             .data = data,
             .len = len
         };
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &arg);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
+
+        if (detach) {
+            // removes the object from the arc, the reference
+            // held by the fetch is released once complete
+            arc_retain_resource(cache->arc, obj->res);
+            arc_drop_resource(cache->arc, obj->res);
+            ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_STREAMED].value);
+        }
         return 0;
     } else {
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
@@ -155,7 +196,7 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
                       COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED);
 
         if (total_len && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP)) {
-            arc_update_resource_size(cache->arc, obj->res, (obj->data == obj->dbuf) ? 0 : total_len);
+            arc_update_resource_size(cache->arc, obj->res, COBJ_DATA_IS_INLINE(obj) ? 0 : arc_alloc_size(total_len));
 
             if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
                 shardcache_schedule_expiration(cache, key, klen, cache->expire_time, 0);
@@ -164,11 +205,231 @@ arc_ops_fetch_from_peer_async_cb(char *peer,
         if (!total_len)
             COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
 
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         return 0;
     }
 }
 
+/*
+ * Single-flight for the async fetches from peers.
+ *
+ * Concurrent misses on the same remote key are already coalesced by the arc
+ * as long as the object stays resident, but objects fetched only to be served
+ * once (flagged as DROP) or evicted while the fetch is still running would
+ * otherwise trigger a new request to the peer for each miss.
+ * The first fetch (the leader) registers itself in cache->inflight_fetches,
+ * subsequent fetches of the same key join it as followers and are completed
+ * using the data received by the leader, without sending any request.
+ * The data is buffered only once the first follower joined (starting with
+ * the data already received by the leader object).
+ */
+typedef struct {
+    shardcache_t *cache;
+    void *key;
+    size_t klen;
+    pthread_mutex_t lock;
+    shc_fetch_async_arg_t *leader; // NULL once the leader has been detached
+    linked_list_t *followers;      // the shc_fetch_async_arg_t of the joined fetches
+    fbuf_t data;                   // the data received so far (if buffering)
+    size_t received;               // the amount of data received so far
+    int buffering;                 // the data is being buffered for the followers
+    int streaming;                 // the value can't be buffered for the followers
+                                   // (too big or not available to the late followers)
+    int complete;                  // the whole value has been received
+    int finished;                  // the fetch is over, no more followers can join
+} shc_inflight_fetch_t;
+
+static shc_inflight_fetch_t *
+arc_ops_inflight_fetch_create(shardcache_t *cache, void *key, size_t klen, shc_fetch_async_arg_t *leader)
+{
+    shc_inflight_fetch_t *inflight = calloc(1, sizeof(shc_inflight_fetch_t));
+    inflight->cache = cache;
+    inflight->key = malloc(klen);
+    memcpy(inflight->key, key, klen);
+    inflight->klen = klen;
+    MUTEX_INIT(inflight->lock);
+    inflight->leader = leader;
+    inflight->followers = list_create();
+    fbuf_t data = FBUF_STATIC_INITIALIZER;
+    inflight->data = data;
+    return inflight;
+}
+
+static void
+arc_ops_inflight_fetch_destroy(shc_inflight_fetch_t *inflight)
+{
+    list_destroy(inflight->followers);
+    fbuf_destroy(&inflight->data);
+    MUTEX_DESTROY(inflight->lock);
+    free(inflight->key);
+    free(inflight);
+}
+
+// NOTE: called by ht_get_deep_copy() with the inflight_fetches table locked,
+//       so the entry can't be finished and released underneath us
+static void *
+arc_ops_inflight_fetch_join(void *data, size_t dlen, void *user)
+{
+    shc_inflight_fetch_t *inflight = (shc_inflight_fetch_t *)data;
+    void *joined = NULL;
+    MUTEX_LOCK(inflight->lock);
+    if (!inflight->finished) {
+        list_push_value(inflight->followers, user);
+        joined = inflight;
+    }
+    MUTEX_UNLOCK(inflight->lock);
+    return joined;
+}
+
+// unregisters the fetch and completes the followers (outside of any lock)
+// with the received data, or with an error if the value is incomplete
+static void
+arc_ops_inflight_fetch_finish(shc_inflight_fetch_t *inflight, char *peer)
+{
+    MUTEX_LOCK(inflight->lock);
+    inflight->finished = 1;
+    MUTEX_UNLOCK(inflight->lock);
+
+    // once removed from the table nobody else can reach the entry
+    // (a join can't be in progress since it holds the table lock)
+    void *prev = NULL;
+    ht_delete(inflight->cache->inflight_fetches, inflight->key, inflight->klen, &prev, NULL);
+
+    shc_fetch_async_arg_t *follower = list_shift_value(inflight->followers);
+    while (follower) {
+        if (inflight->complete && !inflight->streaming) {
+            int rc = 0;
+            if (fbuf_used(&inflight->data))
+                rc = arc_ops_fetch_from_peer_async_cb(peer, inflight->key, inflight->klen,
+                                                      fbuf_data(&inflight->data),
+                                                      fbuf_used(&inflight->data), 0, follower);
+            if (rc == 0)
+                rc = arc_ops_fetch_from_peer_async_cb(peer, inflight->key, inflight->klen,
+                                                      NULL, 0, 0, follower);
+            if (rc == 0)
+                arc_ops_fetch_from_peer_async_cb(peer, inflight->key, inflight->klen,
+                                                 NULL, 0, 1, follower);
+        } else {
+            arc_ops_fetch_from_peer_async_cb(peer, inflight->key, inflight->klen,
+                                             NULL, 0, -1, follower);
+        }
+        follower = list_shift_value(inflight->followers);
+    }
+
+    arc_ops_inflight_fetch_destroy(inflight);
+}
+
+// starts buffering the data for the followers copying what the leader
+// object received so far.
+// NOTE: must be called by the reader of the response (before handling
+//       the next chunk) and not holding the inflight lock
+static void
+arc_ops_inflight_fetch_seed(shc_inflight_fetch_t *inflight, shc_fetch_async_arg_t *leader)
+{
+    fbuf_t seed = FBUF_STATIC_INITIALIZER;
+    int seeded = 0;
+    if (leader) {
+        // only the reader appends data to the object,
+        // so it can't change before the next chunk is handled
+        cached_object_t *obj = leader->obj;
+        COBJ_LOCK(obj);
+        if (obj->dlen == inflight->received && (obj->data || !obj->dlen)) {
+            if (obj->dlen)
+                fbuf_add_binary(&seed, obj->data, obj->dlen);
+            seeded = 1;
+        }
+        COBJ_UNLOCK(obj);
+    }
+
+    MUTEX_LOCK(inflight->lock);
+    if (seeded) {
+        fbuf_destroy(&inflight->data);
+        inflight->data = seed;
+        inflight->buffering = 1;
+    } else {
+        // the data received so far is gone, the followers will fail
+        fbuf_destroy(&seed);
+        inflight->finished = 1;
+        inflight->streaming = 1;
+    }
+    MUTEX_UNLOCK(inflight->lock);
+}
+
+static int
+arc_ops_inflight_fetch_cb(char *peer,
+                          void *key,
+                          size_t klen,
+                          void *data,
+                          size_t len,
+                          int status, // 0 OK, -1 ERR, 1 DONE
+                          void *priv)
+{
+    shc_inflight_fetch_t *inflight = (shc_inflight_fetch_t *)priv;
+
+    MUTEX_LOCK(inflight->lock);
+    shc_fetch_async_arg_t *leader = inflight->leader;
+    int seed = (status == 0 && !inflight->buffering && !inflight->streaming &&
+                list_count(inflight->followers));
+    MUTEX_UNLOCK(inflight->lock);
+
+    // nothing is buffered until somebody joins the fetch
+    if (seed)
+        arc_ops_inflight_fetch_seed(inflight, leader);
+
+    MUTEX_LOCK(inflight->lock);
+    if (status == 0) {
+        if (len) {
+            int threshold = ATOMIC_READ(inflight->cache->streaming_threshold);
+            if (!inflight->finished && threshold > 0 &&
+                inflight->received + len > (size_t)threshold)
+            {
+                // don't let more followers join a big value, the ones already
+                // waiting (if any) still need the data to be buffered for them
+                inflight->finished = 1;
+                if (!list_count(inflight->followers)) {
+                    inflight->streaming = 1;
+                    fbuf_destroy(&inflight->data);
+                }
+            }
+            if (inflight->buffering && !inflight->streaming)
+                fbuf_add_binary(&inflight->data, data, len);
+            inflight->received += len;
+        } else {
+            // followers joining from now on wouldn't get the data
+            inflight->complete = 1;
+            inflight->finished = 1;
+        }
+    }
+    MUTEX_UNLOCK(inflight->lock);
+
+    if (leader) {
+        int fd = leader->fd;
+        int rc = arc_ops_fetch_from_peer_async_cb(peer, key, klen, data, len, status, leader);
+        if (rc != 0 || status != 0) {
+            // the leader has released its argument and won't be called anymore,
+            // if nothing has been buffered new followers can't be served
+            MUTEX_LOCK(inflight->lock);
+            inflight->leader = NULL;
+            if (!inflight->buffering)
+                inflight->finished = 1;
+            MUTEX_UNLOCK(inflight->lock);
+
+            // the leader closed its dedicated connection, the followers can't
+            // be served from it either
+            if (rc != 0 && status == 0 && fd >= 0) {
+                arc_ops_inflight_fetch_finish(inflight, peer);
+                return -1;
+            }
+        }
+    }
+
+    if (status != 0) {
+        arc_ops_inflight_fetch_finish(inflight, peer);
+        return status == -1 ? -1 : 0;
+    }
+
+    return 0;
+}
 
 static int
 arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
@@ -181,44 +442,106 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
     }
 
     shardcache_node_t *node = shardcache_node_select(cache, peer);
-    if (!peer) {
+    if (!node) {
         SHC_ERROR("Can't find address for node %s\n", peer);
         return rc;
     }
-    char *peer_addr = shardcache_node_get_address(node);
+    char *peer_addr = shardcache_node_select_address(cache, node);
 
     // another peer is responsible for this item, let's get the value from there
 
-    int fd = shardcache_get_connection_for_peer(cache, peer_addr);
+    int fd = -1;
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
         shc_fetch_async_arg_t *arg = malloc(sizeof(shc_fetch_async_arg_t));
         arg->obj = obj;
         arg->cache = cache;
         arg->peer_addr = peer_addr;
-        arg->fd = fd;
+        arg->fd = -1;
+        arg->latency = 0;
+        gettimeofday(&arg->start, NULL);
         async_read_wrk_t *wrk = NULL;
         arc_retain_resource(cache->arc, obj->res);
-        rc = fetch_from_peer_async(peer_addr,
-                                   (char *)cache->auth,
-                                   SHC_HDR_CSIGNATURE_SIP,
-                                   obj->key,
-                                   obj->klen,
-                                   0,
-                                   0,
-                                   arc_ops_fetch_from_peer_async_cb,
-                                   arg,
-                                   fd,
-                                   &wrk);
+
+        // join the fetch of the same key already in flight (if any),
+        // our callback will be called once the leader receives the data
+        shc_inflight_fetch_t *inflight = ht_get_deep_copy(cache->inflight_fetches,
+                                                          obj->key,
+                                                          obj->klen,
+                                                          NULL,
+                                                          arc_ops_inflight_fetch_join,
+                                                          arg);
+        int joined = (inflight != NULL);
+        if (joined) {
+            arg->peer_addr = NULL;
+            rc = 0;
+        } else {
+            inflight = arc_ops_inflight_fetch_create(cache, obj->key, obj->klen, arg);
+            if (ht_set_if_not_exists(cache->inflight_fetches,
+                                     obj->key,
+                                     obj->klen,
+                                     inflight,
+                                     sizeof(shc_inflight_fetch_t)) != 0)
+            {
+                // somebody registered the same key in the meanwhile
+                // (or the table is full), just do the fetch on our own
+                arc_ops_inflight_fetch_destroy(inflight);
+                inflight = NULL;
+            }
+        }
+        fetch_from_peer_async_cb cb = inflight ? arc_ops_inflight_fetch_cb : arc_ops_fetch_from_peer_async_cb;
+        void *cb_arg = inflight ? (void *)inflight : (void *)arg;
+
+        // try first pushing the request to a connection already shared with
+        // the peer, a dedicated one will be used if that's not possible.
+        // NOTE: the response can't be processed before we return since
+        //       the callback needs to acquire the object lock
+        if (!joined && ATOMIC_READ(cache->use_persistent_connections)) {
+            rc = connections_pipeline_fetch(cache->connections_pipeline,
+                                            peer_addr,
+                                            shardcache_sig_hdr(cache, 1),
+                                            obj->key,
+                                            obj->klen,
+                                            cb,
+                                            cb_arg);
+        }
+
+        if (rc != 0) {
+            fd = shardcache_get_connection_for_peer(cache, peer_addr);
+            arg->fd = fd;
+            rc = fetch_from_peer_async(peer_addr,
+                                       (char *)cache->auth,
+                                       shardcache_sig_hdr(cache, 1),
+                                       obj->key,
+                                       obj->klen,
+                                       0,
+                                       0,
+                                       cb,
+                                       cb_arg,
+                                       fd,
+                                       &wrk);
+        }
+
+        if (rc != 0 && inflight) {
+            // fail the fetches which joined us in the meanwhile,
+            // our own arg is released below
+            MUTEX_LOCK(inflight->lock);
+            inflight->leader = NULL;
+            MUTEX_UNLOCK(inflight->lock);
+            arc_ops_inflight_fetch_finish(inflight, peer_addr);
+        }
+
         if (rc == 0) {
-            // Keep the remote object in the cache only 10% of the time.
-            // This is the same logic applied by groupcache to determine hot keys.
-            // Better approaches are possible but maybe unnecessary.
-            if (!cache->force_caching && random() % 10 != 0)
+            // Keep the remote object in the cache only if admitted by the
+            // admission policy (by default once it has been requested often
+            // enough recently), otherwise it will be dropped once served
+            if (!shardcache_admit(cache, obj->key, obj->klen))
                 COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
             else
                 COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
 
-            shardcache_queue_async_read_wrk(cache, wrk);
+            // no worker is returned if the request has been pipelined
+            if (wrk)
+                shardcache_queue_async_read_wrk(cache, wrk);
         } else {
             // if the storage is flagged as 'global' we don't want to notify the listeners yet
             // because an attempt of fetching form the local storage will be done in arc_ops_fetch()
@@ -237,16 +560,28 @@ arc_ops_fetch_from_peer(shardcache_t *cache, cached_object_t *obj, char *peer)
             free(arg);
         }
     } else { 
+        fd = shardcache_get_connection_for_peer(cache, peer_addr);
         fbuf_t value = FBUF_STATIC_INITIALIZER;
-        rc = fetch_from_peer(peer_addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, obj->key, obj->klen, &value, fd);
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        rc = fetch_from_peer(peer_addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), obj->key, obj->klen, &value, fd);
+        gettimeofday(&end, NULL);
+        shardcache_report_peer(cache, peer_addr, rc == 0, shardcache_elapsed_usecs(&start, &end));
         COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
         if (rc == 0) {
             shardcache_release_connection_for_peer(cache, peer_addr, fd);
             if (fbuf_used(&value)) {
-                obj->data = fbuf_data(&value);
                 obj->dlen = fbuf_used(&value);
+                if (obj->dlen > obj->isize) {
+                    // the fbuf buffer is now owned by the arena
+                    obj->data = arc_adopt(cache->arc, fbuf_data(&value), obj->dlen);
+                } else {
+                    obj->data = COBJ_INLINE_BUFFER(obj);
+                    memcpy(obj->data, fbuf_data(&value), obj->dlen);
+                    fbuf_destroy(&value);
+                }
                 COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
-                if (!cache->force_caching && rand() % 10 != 0)
+                if (!shardcache_admit(cache, obj->key, obj->klen))
                     COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
                 else
                     COBJ_UNSET_FLAG(obj, COBJ_FLAG_DROP);
@@ -270,13 +605,17 @@ arc_ops_init(const void *key, size_t len, int async, arc_resource_t res, void *p
     // as argument to arc_create()
     cached_object_t *obj = (cached_object_t *)ptr;
 
+    // the key is owned by the arc resource, which also provides
+    // the buffer where to store small values
+    obj->key = (void *)key;
     obj->klen = len;
-    if (obj->klen > sizeof(obj->kbuf))
-        obj->key = malloc(obj->klen);
-    else
-        obj->key = obj->kbuf;
-    memcpy(obj->key, key, obj->klen);
+    size_t isize = 0;
+    arc_get_resource_inline_buffer(res, &isize);
+    obj->isize = (isize > UINT16_MAX) ? UINT16_MAX : isize;
     obj->data = NULL;
+    obj->owner = NULL;
+    obj->migration_owner = NULL;
+    obj->owner_gen = 0;
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_COMPLETE);
     obj->res = res;
     if (async) {
@@ -284,20 +623,161 @@ arc_ops_init(const void *key, size_t len, int async, arc_resource_t res, void *p
         obj->listeners = list_create();
         list_set_free_value_callback(obj->listeners, free);
     }
-    MUTEX_INIT(obj->lock);
+    COBJ_LOCK_INIT(obj);
 }
 
-static void *
-arc_ops_fetch_copy_volatile_object_cb(void *ptr, size_t len, void *user)
+typedef struct {
+    shardcache_t *cache;
+    cached_object_t *obj;
+} arc_ops_fetch_copy_volatile_arg_t;
+
+static void
+arc_ops_fetch_copy_volatile_object_cb(void *value, size_t vlen, void *user)
 {
-    cached_object_t *obj = (cached_object_t *)user;
-    volatile_object_t *item = (volatile_object_t *)ptr;
-    if (item->dlen) {
-        obj->data = (item->dlen > sizeof(obj->dbuf)) ? malloc(item->dlen) : obj->dbuf;
-        memcpy(obj->data, item->data, item->dlen);
-        obj->dlen = item->dlen;
+    arc_ops_fetch_copy_volatile_arg_t *arg = (arc_ops_fetch_copy_volatile_arg_t *)user;
+    cached_object_t *obj = arg->obj;
+    if (vlen) {
+        obj->data = (vlen > obj->isize) ? arc_alloc(arg->cache->arc, vlen) : COBJ_INLINE_BUFFER(obj);
+        memcpy(obj->data, value, vlen);
+        obj->dlen = vlen;
+    }
+}
+
+// move the data returned by the storage into the arena
+// (or into the internal buffer if small enough)
+static void
+arc_ops_set_fetched_value(shardcache_t *cache, cached_object_t *obj, void *value, size_t vlen)
+{
+    obj->dlen = vlen;
+    if (!value) {
+        obj->data = NULL;
+    } else if (vlen > obj->isize) {
+        obj->data = arc_adopt(cache->arc, value, vlen);
+    } else {
+        if (vlen)
+            memcpy(COBJ_INLINE_BUFFER(obj), value, vlen);
+        free(value);
+        obj->data = COBJ_INLINE_BUFFER(obj);
+    }
+}
+
+#define SHC_STORAGE_FETCH_PENDING   0 // fetch_async() didn't return yet
+#define SHC_STORAGE_FETCH_STARTED   1 // fetch_async() returned, the callback will complete the object
+#define SHC_STORAGE_FETCH_COMPLETED 2 // the callback has been called before fetch_async() returned
+
+typedef struct
+{
+    cached_object_t *obj;
+    shardcache_t *cache;
+    void *value;
+    size_t vlen;
+    int status;
+    int state;
+} shc_fetch_storage_async_arg_t;
+
+static void
+arc_ops_fetch_from_storage_async_cb(void *key,
+                                    size_t klen,
+                                    void *value,
+                                    size_t vlen,
+                                    int status,
+                                    void *cb_priv)
+{
+    shc_fetch_storage_async_arg_t *arg = (shc_fetch_storage_async_arg_t *)cb_priv;
+    cached_object_t *obj = arg->obj;
+    shardcache_t *cache = arg->cache;
+
+    arg->value = value;
+    arg->vlen = vlen;
+    arg->status = status;
+
+    // if we are still within fetch_async() the object lock is being
+    // held by arc_ops_fetch() which will take care of the result
+    if (ATOMIC_CAS(arg->state, SHC_STORAGE_FETCH_PENDING, SHC_STORAGE_FETCH_COMPLETED))
+        return;
+
+    free(arg);
+
+    COBJ_LOCK(obj);
+
+    COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
+
+    if (status == -1) {
+        SHC_ERROR("Fetch storage callback notified an error");
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
+        if (obj->listeners)
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
+        COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+        COBJ_UNLOCK(obj);
+        free(value);
+        arc_drop_resource(cache->arc, obj->res);
+        return;
+    }
+
+    arc_ops_set_fetched_value(cache, obj, value, vlen);
+    gettimeofday(&obj->ts, NULL);
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+
+    if (obj->listeners) {
+        if (obj->data && obj->dlen) {
+            shardcache_fetch_from_peer_notify_arg notify_arg = {
+                .obj = obj,
+                .data = obj->data,
+                .len = obj->dlen
+            };
+            list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener, &notify_arg);
+        }
+        list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
     }
-    return (void *)obj;
+
+    int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+                   COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
+
+    int drop = (!obj->data || evicted || COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP));
+    if (!obj->data) {
+        ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
+        COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
+    } else if (!drop) {
+        arc_update_resource_size(cache->arc, obj->res, COBJ_DATA_IS_INLINE(obj) ? 0 : arc_alloc_size(obj->dlen));
+        if (cache->expire_time > 0 && !cache->lazy_expiration)
+            shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
+    }
+
+    COBJ_UNLOCK(obj);
+
+    if (drop)
+        arc_drop_resource(cache->arc, obj->res);
+    else
+        arc_release_resource(cache->arc, obj->res);
+
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+}
+
+// returns the node responsible for the object (in the migration continuum
+// if migration is true) resolving it only if the hint kept by the object
+// refers to continua which have been replaced in the meanwhile.
+// NOTE: must be called holding the object lock
+static const char *
+arc_ops_get_owner(shardcache_t *cache, cached_object_t *obj, int migration)
+{
+    uint32_t gen = ATOMIC_READ(cache->continuum_gen);
+    if (obj->owner_gen != gen) {
+        obj->owner = NULL;
+        obj->migration_owner = NULL;
+        obj->owner_gen = gen;
+    }
+
+    const char **hint = migration ? &obj->migration_owner : &obj->owner;
+    if (!*hint) {
+        const char *owner = NULL;
+        uint32_t lookup_gen = 0;
+        shardcache_get_owner(cache, obj->key, obj->klen, migration, &owner, &lookup_gen);
+        // don't remember owners resolved while the continua were being replaced
+        if (lookup_gen != gen)
+            return owner;
+        *hint = owner;
+    }
+    return *hint;
 }
 
 int
@@ -306,13 +786,13 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     cached_object_t *obj = (cached_object_t *)item;
     shardcache_t *cache = (shardcache_t *)priv;
 
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(obj);
 
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_FETCHING)) {
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         return 1;
     } else if (obj->data) {
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         return 0;
     }
 
@@ -323,22 +803,17 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     // this object is not evicted anymore (if it eventually was)
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICTED);
     COBJ_UNSET_FLAG(obj, COBJ_FLAG_EVICT);
-    char node_name[1024];
-    size_t node_len = sizeof(node_name);
-    memset(node_name, 0, node_len);
+    const char *owner = arc_ops_get_owner(cache, obj, 0);
     // if we are not the owner try asking to the peer responsible for this data
-    if (!shardcache_test_ownership(cache, obj->key, obj->klen, node_name, &node_len))
+    if (owner != cache->me_label)
     {
         int done = 1;
-        int ret = arc_ops_fetch_from_peer(cache, obj, node_name);
+        int ret = arc_ops_fetch_from_peer(cache, obj, (char *)owner);
         if (ret == -1) {
-            int check = shardcache_test_migration_ownership(cache,
-                                                            obj->key,
-                                                            obj->klen,
-                                                            node_name,
-                                                            &node_len);
+            const char *migration_owner = arc_ops_get_owner(cache, obj, 1);
+            int check = migration_owner ? (migration_owner == cache->me_label) : -1;
             if (check == 0) {
-                ret = arc_ops_fetch_from_peer(cache, obj, node_name);
+                ret = arc_ops_fetch_from_peer(cache, obj, (char *)migration_owner);
             }
 
             if (check == 1 || (ret == -1 && cache->storage.global)) {
@@ -354,13 +829,13 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
             if (ret == 0) {
                 ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
                 gettimeofday(&obj->ts, NULL);
-                *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
+                *size = COBJ_DATA_IS_INLINE(obj) ? 0 : arc_alloc_size(obj->dlen);
                 int drop = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP|COBJ_FLAG_COMPLETE);
-                MUTEX_UNLOCK(obj->lock);
+                COBJ_UNLOCK(obj);
                 ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
                 return drop ? 1 : 0;
             }
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
             return -1;
         }
@@ -375,18 +850,53 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     // we are responsible for this item ... 
     // let's first check if it's among the volatile keys otherwise
     // fetch it from the storage
-    ht_get_deep_copy(cache->volatile_storage,
-                     obj->key,
-                     obj->klen,
-                     NULL,
-                     arc_ops_fetch_copy_volatile_object_cb,
-                     obj);
+    arc_ops_fetch_copy_volatile_arg_t copy_arg = {
+        .cache = cache,
+        .obj = obj
+    };
+    volatile_store_get(cache->volatile_storage,
+                       obj->key,
+                       obj->klen,
+                       arc_ops_fetch_copy_volatile_object_cb,
+                       &copy_arg);
     if (obj->data && obj->dlen) {
         SHC_DEBUG3("Found volatile value %s (%lu) for key %s",
                shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
                (unsigned long)obj->dlen, keystr);
     } else if (cache->use_persistent_storage && cache->storage.fetch) {
-        int rc = cache->storage.fetch(obj->key, obj->klen, &obj->data, &obj->dlen, cache->storage.priv);
+        void *value = NULL;
+        size_t vlen = 0;
+        int rc = -1;
+        if (cache->storage.fetch_async && COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC)) {
+            shc_fetch_storage_async_arg_t *arg = calloc(1, sizeof(shc_fetch_storage_async_arg_t));
+            arg->obj = obj;
+            arg->cache = cache;
+            arc_retain_resource(cache->arc, obj->res);
+            rc = cache->storage.fetch_async(obj->key,
+                                            obj->klen,
+                                            arc_ops_fetch_from_storage_async_cb,
+                                            arg,
+                                            cache->storage.priv);
+            if (rc == 0 && ATOMIC_CAS(arg->state, SHC_STORAGE_FETCH_PENDING, SHC_STORAGE_FETCH_STARTED)) {
+                // the callback will complete the object (and notify the listeners)
+                // once the storage is done, the object is going to be cached
+                // as it is for now (the size will be updated later)
+                *size = 0;
+                COBJ_UNLOCK(obj);
+                return 0;
+            }
+            // either the storage refused the request or it
+            // already completed it before fetch_async() returned
+            arc_release_resource(cache->arc, obj->res);
+            if (rc == 0) {
+                rc = arg->status;
+                value = arg->value;
+                vlen = arg->vlen;
+            }
+            free(arg);
+        } else {
+            rc = cache->storage.fetch(obj->key, obj->klen, &value, &vlen, cache->storage.priv);
+        }
         if (rc == -1) {
             if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
                 list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
@@ -394,9 +904,11 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_ERRORS].value);
             COBJ_UNSET_FLAG(obj, COBJ_FLAG_FETCHING);
             COBJ_SET_FLAG(obj, COBJ_FLAG_DROP);
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
+            free(value);
             return -1;
         }
+        arc_ops_set_fetched_value(cache, obj, value, vlen);
         if (obj->data && obj->dlen) {
             SHC_DEBUG3("Fetch storage callback returned value %s (%lu) for key %s",
                    shardcache_hex_escape(obj->data, obj->dlen, DEBUG_DUMP_MAXSIZE, 0),
@@ -415,7 +927,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
         if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_ASYNC) && obj->listeners)
             list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
 
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         SHC_DEBUG("Item not found for key %s", keystr);
         ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_NOT_FOUND].value);
         return 1;
@@ -431,7 +943,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_complete, obj);
     }
 
-    *size = (obj->data == obj->dbuf) ? 0 : obj->dlen;
+    *size = COBJ_DATA_IS_INLINE(obj) ? 0 : arc_alloc_size(obj->dlen);
 
     int evicted = (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
                    COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED));
@@ -439,7 +951,7 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
     if (cache->expire_time > 0 && !evicted && !cache->lazy_expiration)
         shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
 
-    MUTEX_UNLOCK(obj->lock);
+    COBJ_UNLOCK(obj);
 
     ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
 
@@ -447,21 +959,30 @@ arc_ops_fetch(void *item, size_t *size, void * priv)
 }
 
 
-void
+size_t
 arc_ops_store(void *item, void *data, size_t size, void *priv)
 {
     cached_object_t *obj = (cached_object_t *)item;
-    //shardcache_t *cache = (shardcache_t *)priv;
-    MUTEX_LOCK(obj->lock); // XXX - this shouldn't be really necessary
+    shardcache_t *cache = (shardcache_t *)priv;
+    COBJ_LOCK(obj);
 
-    if (obj->data != obj->dbuf)
-        free(obj->data);
+    if (obj->data && !COBJ_DATA_IS_INLINE(obj))
+        arc_free(cache->arc, obj->data, obj->dlen);
 
-    obj->data = (size > sizeof(obj->dbuf)) ? malloc(size) : obj->dbuf;
+    obj->data = (size > obj->isize) ? arc_alloc(cache->arc, size) : COBJ_INLINE_BUFFER(obj);
     memcpy(obj->data, data, size);
     obj->dlen = size;
 
-    MUTEX_UNLOCK(obj->lock);
+    // the object is now served exactly as if it had been fetched
+    gettimeofday(&obj->ts, NULL);
+    COBJ_SET_FLAG(obj, COBJ_FLAG_COMPLETE);
+
+    if (cache->expire_time > 0 && !cache->lazy_expiration)
+        shardcache_schedule_expiration(cache, obj->key, obj->klen, cache->expire_time, 0);
+
+    COBJ_UNLOCK(obj);
+
+    return COBJ_DATA_IS_INLINE(obj) ? 0 : arc_alloc_size(obj->dlen);
 }
 
 void
@@ -470,9 +991,7 @@ arc_ops_evict(void *item, void *priv)
     cached_object_t *obj = (cached_object_t *)item;
     shardcache_t *cache = (shardcache_t *)priv;
 
-    MUTEX_LOCK(obj->lock); // XXX - this shouldn't be really necessary
-                            // TODO : try removing it and see what happens
-                            //        during stress tests
+    COBJ_LOCK(obj);
 
     if (!cache->lazy_expiration)
         shardcache_unschedule_expiration(cache, obj->key, obj->klen, 0);
@@ -487,20 +1006,16 @@ arc_ops_evict(void *item, void *priv)
         list_foreach_value(obj->listeners, arc_ops_fetch_from_peer_notify_listener_error, obj);
         list_destroy(obj->listeners);
     }
-    MUTEX_UNLOCK(obj->lock);
+    COBJ_UNLOCK(obj);
 
     if (obj->data)
         ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EVICTS].value);
 
     // no lock is necessary here ... if we are here
     // nobody is referencing us anymore
-    if (obj->data != obj->dbuf)
-        free(obj->data);
-
-    if (obj->key != obj->kbuf)
-        free(obj->key);
+    if (obj->data && !COBJ_DATA_IS_INLINE(obj))
+        arc_free(cache->arc, obj->data, obj->dlen);
 
-    MUTEX_DESTROY(obj->lock);
     // NOTE : we don't need to free the memory used to store the actual cached_object_t
     // structure because it's managed by the arc subsystem, which provided us a pointer
     // to the prealloc'd memory as argument to the arc_ops_init() callback
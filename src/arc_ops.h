@@ -3,22 +3,21 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
-#pragma pack(push, 1)
+#include "futex_lock.h"
+
+// NOTE: the members are ordered to keep the padding to a minimum without
+//       packing the structure, the lock and the flags are accessed atomically
+//       and need to be properly aligned
 typedef struct {
     void *key;   // The key (weak reference to the actual key stored in the arc resource)
     size_t klen; // The length of the key
-    char kbuf[32];
-
-    // internal storage for data which doesn't exceeds 256 bytes.
-    // If the complete data is bigger than 256 bytes, the required
-    // memory will be allocated and the data pointer will be set
-    // to point to the newly allocated memory.
-    char dbuf[32];
 
     void *data;  // The data (if any, NULL otherwise)
-                 // Note that if the data is less than 256 bytes this pointer
-                 // will point back to the internal buffer (buf pointer)
+                 // Note that if the data fits in the inline buffer this pointer
+                 // will point to it (see COBJ_INLINE_BUFFER()), otherwise the
+                 // required memory will be allocated from the arc arena
 
     size_t dlen; // The length of the data (if any, 0 otherwise)
 
@@ -28,24 +27,53 @@ typedef struct {
     linked_list_t *listeners; // list of listeners which will be notified
                               // while the object data is being retreived
 
-    uint16_t flags;
+    // hints about the nodes responsible for the key (labels interned by the
+    // cache, NULL if not resolved yet), valid as long as owner_gen matches
+    // the generation of the continua (see shardcache_get_owner())
+    const char *owner;
+    const char *migration_owner;
+
+    arc_resource_t res;
+
+    uint32_t owner_gen;
+
+    futex_lock_t lock; // Serializes the fetch of the object and the access
+                       // to the listeners (using COBJ_LOCK()/COBJ_UNLOCK()).
+                       // Once the object is complete its data is never
+                       // modified, so it can be served checking only the flags
+
+    uint16_t isize; // the size of the inline buffer
+
+    uint16_t flags; // (to be accessed using the COBJ_*_FLAG(S) macros)
     #define COBJ_FLAG_ASYNC    (1)
     #define COBJ_FLAG_COMPLETE (1<<1)
     #define COBJ_FLAG_EVICTED  (1<<2)
     #define COBJ_FLAG_EVICT    (1<<3)
     #define COBJ_FLAG_DROP     (1<<4)
     #define COBJ_FLAG_FETCHING (1<<5)
+    #define COBJ_FLAG_STREAMING (1<<6) // too big to be cached, the data received
+                                       // is only forwarded to the listeners
+} cached_object_t;
 
-    pthread_mutex_t lock; // All operations on this structure should be
-                          // synchronized using this lock
+_Static_assert(offsetof(cached_object_t, lock) % sizeof(futex_lock_t) == 0,
+               "the lock of the cached objects must be aligned");
+_Static_assert(offsetof(cached_object_t, flags) % sizeof(uint16_t) == 0,
+               "the flags of the cached objects must be aligned");
 
-    arc_resource_t res;
-} cached_object_t;
-#pragma pack(pop)
+// the buffer (provided by the arc resource right after the key)
+// where values not exceeding isize bytes are stored
+#define COBJ_INLINE_BUFFER(_o) ((char *)(_o)->key + (_o)->klen)
+#define COBJ_DATA_IS_INLINE(_o) ((_o)->data == COBJ_INLINE_BUFFER(_o))
+
+// the flags are updated atomically, so the state of an object
+// can be checked without holding its lock
+#define COBJ_CHECK_FLAGS(_o, _f) ((ATOMIC_READ((_o)->flags) & (_f)) == (_f))
+#define COBJ_SET_FLAG(_o, _f) ((void)__sync_fetch_and_or(&(_o)->flags, (_f)))
+#define COBJ_UNSET_FLAG(_o, _f) ((void)__sync_fetch_and_and(&(_o)->flags, (uint16_t)~(_f)))
 
-#define COBJ_CHECK_FLAGS(_o, _f) ((((_o)->flags) & (_f)) == (_f))
-#define COBJ_SET_FLAG(_o, _f) ((_o)->flags |= (_f))
-#define COBJ_UNSET_FLAG(_o, _f) ((_o)->flags &= ~(_f))
+#define COBJ_LOCK_INIT(_o) futex_lock_init(&(_o)->lock)
+#define COBJ_LOCK(_o) futex_lock_acquire(&(_o)->lock)
+#define COBJ_UNLOCK(_o) futex_lock_release(&(_o)->lock)
 
 typedef struct {
     shardcache_get_async_callback_t cb;
@@ -55,7 +83,7 @@ typedef struct {
 void arc_ops_init(const void *key, size_t len, int async, arc_resource_t res, void *ptr, void *priv);
 int arc_ops_fetch(void *item, size_t *size, void * priv);
 void arc_ops_evict(void *item, void *priv);
-void arc_ops_store(void *item, void *data, size_t size, void *priv);
+size_t arc_ops_store(void *item, void *data, size_t size, void *priv);
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
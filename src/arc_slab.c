@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shardcache_internal.h" // for MUTEX_* macros
+
+#include "arc_slab.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// NOTE: must be a power of 2, slabs are aligned to their size so that
+//       the slab owning a chunk can be found by masking the chunk address
+#define ARC_SLAB_PAGE_SIZE (1<<16)
+
+// the first bytes of each slab are used by the slab header
+#define ARC_SLAB_HEADER_SIZE 64
+
+#define ARC_SLAB_PAGE(_p) \
+    ((arc_slab_page_t *)((uintptr_t)(_p) & ~((uintptr_t)ARC_SLAB_PAGE_SIZE - 1)))
+
+static const size_t arc_slab_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+    1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384
+};
+
+#define ARC_SLAB_NUM_CLASSES (sizeof(arc_slab_sizes) / sizeof(size_t))
+#define ARC_SLAB_MAX_CHUNK_SIZE (arc_slab_sizes[ARC_SLAB_NUM_CLASSES - 1])
+
+struct _arc_slab_class;
+
+typedef struct _arc_slab_page {
+    struct _arc_slab_class *class;
+    struct _arc_slab_page *prev, *next; // links in the list of non-full slabs
+    void *free_list;   // released chunks (the first word of each points to the next one)
+    char *unused;      // the first chunk which has never been used
+    int num_chunks;
+    int num_used;
+} arc_slab_page_t;
+
+typedef struct _arc_slab_class {
+    size_t size;
+    arc_slab_page_t *pages; // slabs with at least one free chunk
+    arc_slab_page_t *empty; // a completely free slab kept to avoid
+                            // mapping/unmapping a slab on each alloc/free
+    pthread_mutex_t lock;
+    arc_slab_t *slab;
+} arc_slab_class_t;
+
+struct _arc_slab_s {
+    arc_slab_class_t classes[ARC_SLAB_NUM_CLASSES];
+    size_t used;     // bytes handed out (note: accessed via atomic builtins)
+    size_t reserved; // bytes obtained from the OS (note: accessed via atomic builtins)
+};
+
+static inline int
+arc_slab_class_index(size_t size)
+{
+    int i;
+    for (i = 0; i < ARC_SLAB_NUM_CLASSES; i++) {
+        if (size <= arc_slab_sizes[i])
+            return i;
+    }
+    return -1;
+}
+
+static arc_slab_page_t *
+arc_slab_page_create(arc_slab_class_t *class)
+{
+    // map twice the size and trim it to get a slab aligned to its size
+    size_t map_size = ARC_SLAB_PAGE_SIZE << 1;
+    char *map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char *aligned = (char *)ARC_SLAB_PAGE(map + ARC_SLAB_PAGE_SIZE - 1);
+    size_t head = aligned - map;
+    size_t tail = map_size - head - ARC_SLAB_PAGE_SIZE;
+    if (head)
+        munmap(map, head);
+    if (tail)
+        munmap(aligned + ARC_SLAB_PAGE_SIZE, tail);
+
+    arc_slab_page_t *page = (arc_slab_page_t *)aligned;
+    page->class = class;
+    page->prev = page->next = NULL;
+    page->free_list = NULL;
+    page->unused = aligned + ARC_SLAB_HEADER_SIZE;
+    page->num_chunks = (ARC_SLAB_PAGE_SIZE - ARC_SLAB_HEADER_SIZE) / class->size;
+    page->num_used = 0;
+
+    ATOMIC_INCREASE(class->slab->reserved, ARC_SLAB_PAGE_SIZE);
+    return page;
+}
+
+static void
+arc_slab_page_destroy(arc_slab_page_t *page)
+{
+    ATOMIC_DECREASE(page->class->slab->reserved, ARC_SLAB_PAGE_SIZE);
+    munmap(page, ARC_SLAB_PAGE_SIZE);
+}
+
+static inline void
+arc_slab_page_link(arc_slab_class_t *class, arc_slab_page_t *page)
+{
+    page->prev = NULL;
+    page->next = class->pages;
+    if (class->pages)
+        class->pages->prev = page;
+    class->pages = page;
+}
+
+static inline void
+arc_slab_page_unlink(arc_slab_class_t *class, arc_slab_page_t *page)
+{
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        class->pages = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+arc_slab_t *
+arc_slab_create()
+{
+    arc_slab_t *slab = calloc(1, sizeof(arc_slab_t));
+    int i;
+    for (i = 0; i < ARC_SLAB_NUM_CLASSES; i++) {
+        arc_slab_class_t *class = &slab->classes[i];
+        class->size = arc_slab_sizes[i];
+        class->slab = slab;
+        MUTEX_INIT(class->lock);
+    }
+    return slab;
+}
+
+void
+arc_slab_destroy(arc_slab_t *slab)
+{
+    int i;
+    for (i = 0; i < ARC_SLAB_NUM_CLASSES; i++) {
+        arc_slab_class_t *class = &slab->classes[i];
+        // NOTE: completely used slabs are not linked anywhere,
+        //       all the chunks must have been released before
+        //       destroying the arena
+        arc_slab_page_t *page = class->pages;
+        while (page) {
+            arc_slab_page_t *next = page->next;
+            arc_slab_page_destroy(page);
+            page = next;
+        }
+        if (class->empty)
+            arc_slab_page_destroy(class->empty);
+        MUTEX_DESTROY(class->lock);
+    }
+    free(slab);
+}
+
+void *
+arc_slab_alloc(arc_slab_t *slab, size_t size)
+{
+    int idx = arc_slab_class_index(size);
+    if (idx < 0) {
+        void *ptr = malloc(size);
+        if (ptr) {
+            ATOMIC_INCREASE(slab->used, size);
+            ATOMIC_INCREASE(slab->reserved, size);
+        }
+        return ptr;
+    }
+
+    arc_slab_class_t *class = &slab->classes[idx];
+
+    MUTEX_LOCK(class->lock);
+    arc_slab_page_t *page = class->pages;
+    if (!page) {
+        if (class->empty) {
+            page = class->empty;
+            class->empty = NULL;
+        } else {
+            page = arc_slab_page_create(class);
+            if (!page) {
+                MUTEX_UNLOCK(class->lock);
+                return NULL;
+            }
+        }
+        arc_slab_page_link(class, page);
+    }
+
+    void *chunk = NULL;
+    if (page->free_list) {
+        chunk = page->free_list;
+        page->free_list = *((void **)chunk);
+    } else {
+        chunk = page->unused;
+        page->unused += class->size;
+    }
+
+    if (++page->num_used == page->num_chunks)
+        arc_slab_page_unlink(class, page);
+
+    MUTEX_UNLOCK(class->lock);
+
+    ATOMIC_INCREASE(slab->used, class->size);
+    return chunk;
+}
+
+void
+arc_slab_free(arc_slab_t *slab, void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+    int idx = arc_slab_class_index(size);
+    if (idx < 0) {
+        ATOMIC_DECREASE(slab->used, size);
+        ATOMIC_DECREASE(slab->reserved, size);
+        free(ptr);
+        return;
+    }
+
+    arc_slab_page_t *page = ARC_SLAB_PAGE(ptr);
+    arc_slab_class_t *class = page->class;
+
+    MUTEX_LOCK(class->lock);
+    *((void **)ptr) = page->free_list;
+    page->free_list = ptr;
+
+    if (page->num_used-- == page->num_chunks)
+        arc_slab_page_link(class, page);
+
+    if (page->num_used == 0) {
+        arc_slab_page_unlink(class, page);
+        if (!class->empty) {
+            page->free_list = NULL;
+            page->unused = (char *)page + ARC_SLAB_HEADER_SIZE;
+            class->empty = page;
+        } else {
+            arc_slab_page_destroy(page);
+        }
+    }
+    MUTEX_UNLOCK(class->lock);
+
+    ATOMIC_DECREASE(slab->used, class->size);
+}
+
+void *
+arc_slab_realloc(arc_slab_t *slab, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!ptr)
+        return arc_slab_alloc(slab, new_size);
+
+    int old_idx = arc_slab_class_index(old_size);
+    int new_idx = arc_slab_class_index(new_size);
+
+    if (old_idx >= 0 && old_idx == new_idx)
+        return ptr; // the chunk is already big enough
+
+    if (old_idx < 0 && new_idx < 0) {
+        void *new_ptr = realloc(ptr, new_size);
+        if (new_ptr) {
+            if (new_size > old_size) {
+                ATOMIC_INCREASE(slab->used, new_size - old_size);
+                ATOMIC_INCREASE(slab->reserved, new_size - old_size);
+            } else {
+                ATOMIC_DECREASE(slab->used, old_size - new_size);
+                ATOMIC_DECREASE(slab->reserved, old_size - new_size);
+            }
+        }
+        return new_ptr;
+    }
+
+    void *new_ptr = arc_slab_alloc(slab, new_size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    arc_slab_free(slab, ptr, old_size);
+    return new_ptr;
+}
+
+void *
+arc_slab_adopt(arc_slab_t *slab, void *ptr, size_t size)
+{
+    if (!ptr)
+        return NULL;
+
+    if (arc_slab_class_index(size) < 0) {
+        // big allocations are delegated to malloc() anyway,
+        // so the buffer can be simply taken over
+        ATOMIC_INCREASE(slab->used, size);
+        ATOMIC_INCREASE(slab->reserved, size);
+        return ptr;
+    }
+
+    void *chunk = arc_slab_alloc(slab, size);
+    if (chunk)
+        memcpy(chunk, ptr, size);
+    free(ptr);
+    return chunk;
+}
+
+size_t
+arc_slab_chunk_size(size_t size)
+{
+    int idx = arc_slab_class_index(size);
+    return (idx < 0) ? size : arc_slab_sizes[idx];
+}
+
+void
+arc_slab_trim(arc_slab_t *slab)
+{
+    int i;
+    for (i = 0; i < ARC_SLAB_NUM_CLASSES; i++) {
+        arc_slab_class_t *class = &slab->classes[i];
+        MUTEX_LOCK(class->lock);
+        if (class->empty) {
+            arc_slab_page_destroy(class->empty);
+            class->empty = NULL;
+        }
+        MUTEX_UNLOCK(class->lock);
+    }
+}
+
+size_t
+arc_slab_used(arc_slab_t *slab)
+{
+    return ATOMIC_READ(slab->used);
+}
+
+size_t
+arc_slab_reserved(arc_slab_t *slab)
+{
+    return ATOMIC_READ(slab->reserved);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
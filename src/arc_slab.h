@@ -0,0 +1,106 @@
+/**
+ * @file arc_slab.h
+ * @brief Size-classed slab arena used by the ARC cache
+ *
+ * Small allocations are served from fixed-size chunks carved out of
+ * page-aligned slabs (one set of slabs for each size class).
+ * Slabs which become completely free are given back to the OS.
+ * Allocations bigger than the biggest size class are delegated to malloc()
+ * (but still accounted by the arena).
+ *
+ * @note The size of an allocation must be provided also when releasing
+ *       (or reallocating) it, the arena doesn't store any per-chunk header
+ */
+#ifndef SHARDCACHE_ARC_SLAB_H
+#define SHARDCACHE_ARC_SLAB_H
+
+#include <sys/types.h>
+
+typedef struct _arc_slab_s arc_slab_t;
+
+/**
+ * @brief Create a new arena
+ * @return A valid pointer to an initialized arc_slab_t structure
+ */
+arc_slab_t *arc_slab_create();
+
+/**
+ * @brief Release an arena and all the slabs still owned by it
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ */
+void arc_slab_destroy(arc_slab_t *slab);
+
+/**
+ * @brief Allocate size bytes from the arena
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ * @param size : The amount of bytes to allocate
+ * @return A pointer to the allocated memory, NULL in case of errors
+ * @note The returned memory is not initialized
+ */
+void *arc_slab_alloc(arc_slab_t *slab, size_t size);
+
+/**
+ * @brief Resize a chunk previously allocated with arc_slab_alloc()
+ * @param slab     : A valid pointer to an initialized arc_slab_t structure
+ * @param ptr      : The chunk to resize (or NULL)
+ * @param old_size : The size used when allocating ptr
+ * @param new_size : The new size
+ * @return A pointer to the resized memory, NULL in case of errors
+ *         (in which case ptr is left untouched)
+ */
+void *arc_slab_realloc(arc_slab_t *slab, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Release a chunk previously allocated with arc_slab_alloc()
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ * @param ptr  : The chunk to release
+ * @param size : The size used when allocating ptr
+ */
+void arc_slab_free(arc_slab_t *slab, void *ptr, size_t size);
+
+/**
+ * @brief Take ownership of a buffer allocated with malloc()
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ * @param ptr  : A buffer allocated with malloc()
+ * @param size : The size of the data in the buffer
+ * @return A pointer to the memory (owned by the arena) now holding the data,
+ *         which must be released using arc_slab_free().
+ *         NULL in case of errors
+ * @note ptr can't be accessed anymore after this call
+ *       (if the size fits in one of the size classes the data will be
+ *       copied into a chunk and the original buffer released)
+ */
+void *arc_slab_adopt(arc_slab_t *slab, void *ptr, size_t size);
+
+/**
+ * @brief Returns the amount of memory actually used to hold an allocation
+ *        of the given size (which is the size of the chunk serving it)
+ * @param size : The requested size
+ * @return The real footprint in bytes of an allocation of the given size
+ */
+size_t arc_slab_chunk_size(size_t size);
+
+/**
+ * @brief Give back to the OS all the free slabs kept by the arena
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ */
+void arc_slab_trim(arc_slab_t *slab);
+
+/**
+ * @brief Returns the amount of memory handed out by the arena
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ * @return The number of bytes in use
+ */
+size_t arc_slab_used(arc_slab_t *slab);
+
+/**
+ * @brief Returns the amount of memory obtained from the OS by the arena
+ * @param slab : A valid pointer to an initialized arc_slab_t structure
+ * @return The number of bytes reserved
+ */
+size_t arc_slab_reserved(arc_slab_t *slab);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -112,17 +112,8 @@ string2sockaddr(const char *host, int port, struct sockaddr_in *sockaddr)
 
     return 0;
 }
-/*!
- * \brief Open a listen socket.
- * \param host hostname to listen on
- * \param port port to listen on
- * \returns file handle for socket to call accept() on or -1 otherwise (errno is set).
- *
- * \note Examples of valid port combinations: ("*", 3456), ("localhost", 3456),
- * or ("10.0.0.9", 4546).
- */
-int
-open_socket(const char *host, int port)
+static int
+open_socket_internal(const char *host, int port, int reuseport)
 {
     int val = 1;
     struct sockaddr_in sockaddr;
@@ -133,11 +124,24 @@ open_socket(const char *host, int port)
     if ((host == NULL || !*host) && port == 0)
         return -1;
 
+#ifndef SO_REUSEPORT
+    if (reuseport) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
     sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (sock == -1)
         return -1;
 
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0) {
+        close(sock);
+        return -1;
+    }
+#endif
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val,  sizeof(val));
     setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
 
@@ -155,6 +159,36 @@ open_socket(const char *host, int port)
     return sock;
 }
 
+/*!
+ * \brief Open a listen socket.
+ * \param host hostname to listen on
+ * \param port port to listen on
+ * \returns file handle for socket to call accept() on or -1 otherwise (errno is set).
+ *
+ * \note Examples of valid port combinations: ("*", 3456), ("localhost", 3456),
+ * or ("10.0.0.9", 4546).
+ */
+int
+open_socket(const char *host, int port)
+{
+    return open_socket_internal(host, port, 0);
+}
+
+/*!
+ * \brief Open a listen socket which can share the address with other sockets
+ *        opened the same way (SO_REUSEPORT), the kernel spreads the incoming
+ *        connections among them.
+ * \param host hostname to listen on
+ * \param port port to listen on
+ * \returns file handle for socket to call accept() on or -1 otherwise (errno is set,
+ *          ENOTSUP if SO_REUSEPORT is not supported).
+ */
+int
+open_reuseport_socket(const char *host, int port)
+{
+    return open_socket_internal(host, port, 1);
+}
+
 /*!
  * \brief Writes to a socket
  * \param fd socket
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <hashtable.h>
+#include <bsd_queue.h>
+#include <iomux.h>
+
+#include "connections_pipeline.h"
+#include "shardcache_internal.h" // for the MUTEX_* macros
+
+typedef struct _pipeline_request_s {
+    void *key;
+    size_t klen;
+    fetch_from_peer_async_cb cb;
+    void *priv;
+    char kbuf[32];
+    TAILQ_ENTRY(_pipeline_request_s) next;
+} pipeline_request_t;
+
+typedef struct _pipeline_connection_s {
+    connections_pipeline_t *pipeline;
+    char *peer;
+    int fd;
+    async_read_ctx_t *reader;
+    pthread_mutex_t wlock; // serializes the writers so that requests are
+                           // written in the same order they are queued
+    pthread_mutex_t lock;  // protects the requests queue
+    TAILQ_HEAD(pipeline_requests_s, _pipeline_request_s) requests;
+    int num_requests;
+    int closed;
+    int refcnt;
+    struct timeval last_activity;
+    TAILQ_ENTRY(_pipeline_connection_s) next;
+} pipeline_connection_t;
+
+typedef struct {
+    TAILQ_HEAD(, _pipeline_connection_s) connections;
+    int num_connections;
+} pipeline_peer_t;
+
+struct _connections_pipeline_s {
+    hashtable_t *peers;
+    pthread_mutex_t lock;
+    char *auth;
+    int max_connections;
+    int max_depth;
+    connections_pipeline_attach_cb attach;
+    void *attach_priv;
+};
+
+static void
+pipeline_connection_release(pipeline_connection_t *conn)
+{
+    if (ATOMIC_DECREASE(conn->refcnt, 1) > 0)
+        return;
+
+    MUTEX_DESTROY(conn->lock);
+    MUTEX_DESTROY(conn->wlock);
+    free(conn->peer);
+    free(conn);
+}
+
+// NOTE: must be called with the pipeline lock held
+static void
+pipeline_connection_unlink(pipeline_peer_t *entry, pipeline_connection_t *conn)
+{
+    if (conn->closed)
+        return;
+
+    if (entry) {
+        TAILQ_REMOVE(&entry->connections, conn, next);
+        entry->num_connections--;
+    }
+
+    MUTEX_LOCK(conn->lock);
+    conn->closed = 1;
+    MUTEX_UNLOCK(conn->lock);
+
+    // release the reference held by the pipeline
+    pipeline_connection_release(conn);
+}
+
+static int
+pipeline_connection_read_cb(void *data, size_t len, int idx, void *priv)
+{
+    pipeline_connection_t *conn = (pipeline_connection_t *)priv;
+
+    // idx == -1 means that the response to the first pending request
+    // has been fully read, idx == -2 means error and any idx >= 0
+    // refers to the record index (see fetch_from_peer_helper())
+    MUTEX_LOCK(conn->lock);
+    pipeline_request_t *req = TAILQ_FIRST(&conn->requests);
+    if (req && idx < 0) {
+        TAILQ_REMOVE(&conn->requests, req, next);
+        conn->num_requests--;
+    }
+    MUTEX_UNLOCK(conn->lock);
+
+    if (!req) {
+        if (idx != -2)
+            SHC_WARNING("Unexpected response from peer %s", conn->peer);
+        return -1;
+    }
+
+    // NOTE: errors returned by the request callback are not propagated
+    //       to the reader, the rest of the response must still be consumed
+    //       to keep the connection in sync with the pending requests
+    if (idx >= 0) {
+        if (req->cb && req->cb(conn->peer, req->key, req->klen, data, len, idx, req->priv) != 0)
+            req->cb = NULL;
+        return 0;
+    }
+
+    if (req->cb) {
+        if (idx == -1) {
+            if (req->cb(conn->peer, req->key, req->klen, NULL, 0, 0, req->priv) == 0)
+                req->cb(conn->peer, req->key, req->klen, NULL, 0, 1, req->priv);
+        } else {
+            req->cb(conn->peer, req->key, req->klen, NULL, 0, -1, req->priv);
+        }
+    }
+
+    if (req->key != req->kbuf)
+        free(req->key);
+    free(req);
+
+    return 0;
+}
+
+static int
+pipeline_connection_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    pipeline_connection_t *conn = (pipeline_connection_t *)priv;
+    int processed = 0;
+
+    MUTEX_LOCK(conn->lock);
+    gettimeofday(&conn->last_activity, NULL);
+    MUTEX_UNLOCK(conn->lock);
+
+    async_read_context_state_t state =
+        async_read_context_input_data(conn->reader, data, len, &processed);
+
+    // more responses might have been received at once
+    while (state == SHC_STATE_READING_DONE)
+        state = async_read_context_update(conn->reader);
+
+    if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR) {
+        SHC_WARNING("Bad response from peer %s, closing the pipelined connection", conn->peer);
+        iomux_close(iomux, fd);
+    }
+
+    return processed;
+}
+
+static void
+pipeline_connection_eof(iomux_t *iomux, int fd, void *priv)
+{
+    pipeline_connection_t *conn = (pipeline_connection_t *)priv;
+    connections_pipeline_t *pipeline = conn->pipeline;
+
+    close(fd);
+
+    MUTEX_LOCK(pipeline->lock);
+    pipeline_connection_unlink(ht_get(pipeline->peers, conn->peer, strlen(conn->peer), NULL), conn);
+    MUTEX_UNLOCK(pipeline->lock);
+
+    // no more requests can be queued at this point,
+    // all the pending ones can now be failed
+    MUTEX_LOCK(conn->lock);
+    pipeline_request_t *req = TAILQ_FIRST(&conn->requests);
+    TAILQ_INIT(&conn->requests);
+    conn->num_requests = 0;
+    MUTEX_UNLOCK(conn->lock);
+
+    while (req) {
+        pipeline_request_t *next = TAILQ_NEXT(req, next);
+        if (req->cb)
+            req->cb(conn->peer, req->key, req->klen, NULL, 0, -1, req->priv);
+        if (req->key != req->kbuf)
+            free(req->key);
+        free(req);
+        req = next;
+    }
+
+    async_read_context_destroy(conn->reader);
+
+    // release the reference held by the iomux
+    pipeline_connection_release(conn);
+}
+
+static void
+pipeline_connection_timeout(iomux_t *iomux, int fd, void *priv)
+{
+    pipeline_connection_t *conn = (pipeline_connection_t *)priv;
+    connections_pipeline_t *pipeline = conn->pipeline;
+    int tcp_timeout = global_tcp_timeout(-1);
+    struct timeval maxwait = { tcp_timeout / 1000, (tcp_timeout % 1000) * 1000 };
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+
+    MUTEX_LOCK(pipeline->lock);
+    MUTEX_LOCK(conn->lock);
+    timersub(&now, &conn->last_activity, &diff);
+    int expired = timercmp(&diff, &maxwait, >);
+    int idle = (conn->num_requests == 0);
+    MUTEX_UNLOCK(conn->lock);
+    // an idle connection is unlinked while still holding the pipeline lock
+    // so that no new request can be queued on it before it's closed
+    if (expired && idle)
+        pipeline_connection_unlink(ht_get(pipeline->peers, conn->peer, strlen(conn->peer), NULL), conn);
+    MUTEX_UNLOCK(pipeline->lock);
+
+    if (expired) {
+        if (!idle)
+            SHC_WARNING("Timeout while waiting for responses from %s (timeout: %d milliseconds)",
+                        conn->peer, tcp_timeout);
+        iomux_close(iomux, fd);
+    } else {
+        iomux_set_timeout(iomux, fd, &maxwait);
+    }
+}
+
+static pipeline_connection_t *
+pipeline_connection_create(connections_pipeline_t *pipeline, char *peer)
+{
+    int fd = connect_to_peer(peer, global_tcp_timeout(-1));
+    if (fd < 0)
+        return NULL;
+
+    pipeline_connection_t *conn = calloc(1, sizeof(pipeline_connection_t));
+    conn->pipeline = pipeline;
+    conn->peer = strdup(peer);
+    conn->fd = fd;
+    conn->reader = async_read_context_create(pipeline->auth, pipeline_connection_read_cb, conn);
+    MUTEX_INIT(conn->lock);
+    MUTEX_INIT(conn->wlock);
+    TAILQ_INIT(&conn->requests);
+    gettimeofday(&conn->last_activity, NULL);
+    // one reference is held by the pipeline and one by the iomux
+    conn->refcnt = 2;
+    return conn;
+}
+
+// NOTE: must be called with the pipeline lock held
+static pipeline_peer_t *
+pipeline_peer_get(connections_pipeline_t *pipeline, char *peer)
+{
+    pipeline_peer_t *entry = ht_get(pipeline->peers, peer, strlen(peer), NULL);
+    if (!entry) {
+        entry = calloc(1, sizeof(pipeline_peer_t));
+        TAILQ_INIT(&entry->connections);
+        if (ht_set(pipeline->peers, peer, strlen(peer), entry, 0) != 0) {
+            free(entry);
+            return NULL;
+        }
+    }
+    return entry;
+}
+
+// NOTE: must be called with the pipeline lock held
+static pipeline_connection_t *
+pipeline_connection_select(pipeline_peer_t *entry)
+{
+    pipeline_connection_t *selected = NULL;
+    pipeline_connection_t *conn;
+    TAILQ_FOREACH(conn, &entry->connections, next) {
+        if (!selected || ATOMIC_READ(conn->num_requests) < ATOMIC_READ(selected->num_requests))
+            selected = conn;
+    }
+    return selected;
+}
+
+int
+connections_pipeline_fetch(connections_pipeline_t *pipeline,
+                           char *peer,
+                           unsigned char sig_hdr,
+                           void *key,
+                           size_t klen,
+                           fetch_from_peer_async_cb cb,
+                           void *priv)
+{
+    int max_depth = ATOMIC_READ(pipeline->max_depth);
+    if (!max_depth)
+        return -1;
+
+    MUTEX_LOCK(pipeline->lock);
+    pipeline_peer_t *entry = pipeline_peer_get(pipeline, peer);
+    if (!entry) {
+        MUTEX_UNLOCK(pipeline->lock);
+        return -1;
+    }
+
+    pipeline_connection_t *conn = pipeline_connection_select(entry);
+    int busy = (conn && ATOMIC_READ(conn->num_requests) >= max_depth);
+    if (!conn || (busy && entry->num_connections < pipeline->max_connections)) {
+        // don't block the other requests while connecting
+        MUTEX_UNLOCK(pipeline->lock);
+        pipeline_connection_t *new_conn = pipeline_connection_create(pipeline, peer);
+        if (!new_conn)
+            return -1;
+
+        async_read_wrk_t *wrk = calloc(1, sizeof(async_read_wrk_t));
+        wrk->ctx = new_conn->reader;
+        wrk->cbs.mux_input = pipeline_connection_input;
+        wrk->cbs.mux_eof = pipeline_connection_eof;
+        wrk->cbs.mux_timeout = pipeline_connection_timeout;
+        wrk->cbs.priv = new_conn;
+        wrk->fd = new_conn->fd;
+
+        MUTEX_LOCK(pipeline->lock);
+        // NOTE: the peer entry is never removed from the table
+        //       until the pipeline is destroyed
+        TAILQ_INSERT_TAIL(&entry->connections, new_conn, next);
+        entry->num_connections++;
+        conn = new_conn;
+        busy = 0;
+
+        pipeline->attach(wrk, pipeline->attach_priv);
+    }
+
+    if (busy) {
+        MUTEX_UNLOCK(pipeline->lock);
+        return -1;
+    }
+
+    ATOMIC_INCREMENT(conn->refcnt);
+    MUTEX_UNLOCK(pipeline->lock);
+
+    pipeline_request_t *req = calloc(1, sizeof(pipeline_request_t));
+    if (klen > sizeof(req->kbuf))
+        req->key = malloc(klen);
+    else
+        req->key = req->kbuf;
+    memcpy(req->key, key, klen);
+    req->klen = klen;
+    req->cb = cb;
+    req->priv = priv;
+
+    int rc = 0;
+
+    // the request must be queued before being written, the response
+    // might be read by the async i/o thread before the write returns
+    MUTEX_LOCK(conn->wlock);
+    MUTEX_LOCK(conn->lock);
+    if (conn->closed) {
+        rc = -1;
+    } else {
+        TAILQ_INSERT_TAIL(&conn->requests, req, next);
+        ATOMIC_INCREMENT(conn->num_requests);
+        gettimeofday(&conn->last_activity, NULL);
+    }
+    MUTEX_UNLOCK(conn->lock);
+
+    if (rc == 0) {
+        shardcache_record_t record = {
+            .v = key,
+            .l = klen
+        };
+        if (write_message(conn->fd, conn->pipeline->auth, sig_hdr, SHC_HDR_GET_ASYNC, &record, 1) != 0) {
+            MUTEX_LOCK(conn->lock);
+            // NOTE: no other request can have been queued after this one
+            //       since we are still holding the write lock, so if it's not
+            //       the last one anymore it has been already released by the
+            //       async i/o thread (and the callback notified)
+            if (TAILQ_LAST(&conn->requests, pipeline_requests_s) == req) {
+                TAILQ_REMOVE(&conn->requests, req, next);
+                ATOMIC_DECREMENT(conn->num_requests);
+                rc = -1;
+            } else {
+                req = NULL;
+            }
+            MUTEX_UNLOCK(conn->lock);
+            // let the async i/o thread fail all the other pending requests
+            shutdown(conn->fd, SHUT_RDWR);
+        } else {
+            req = NULL;
+        }
+    }
+    MUTEX_UNLOCK(conn->wlock);
+
+    if (req) {
+        if (req->key != req->kbuf)
+            free(req->key);
+        free(req);
+    }
+
+    pipeline_connection_release(conn);
+
+    return rc;
+}
+
+static int
+pipeline_peer_clear(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    pipeline_peer_t *entry = (pipeline_peer_t *)value;
+    pipeline_connection_t *conn = TAILQ_FIRST(&entry->connections);
+    while (conn) {
+        pipeline_connection_t *next = TAILQ_NEXT(conn, next);
+        pipeline_connection_unlink(entry, conn);
+        conn = next;
+    }
+    return 1;
+}
+
+connections_pipeline_t *
+connections_pipeline_create(char *auth,
+                            int max_connections,
+                            int max_depth,
+                            connections_pipeline_attach_cb attach,
+                            void *priv)
+{
+    connections_pipeline_t *pipeline = calloc(1, sizeof(connections_pipeline_t));
+    pipeline->peers = ht_create(128, 65535, free);
+    pipeline->auth = auth;
+    pipeline->max_connections = max_connections > 0 ? max_connections : 1;
+    pipeline->max_depth = max_depth;
+    pipeline->attach = attach;
+    pipeline->attach_priv = priv;
+    MUTEX_INIT(pipeline->lock);
+    return pipeline;
+}
+
+void
+connections_pipeline_destroy(connections_pipeline_t *pipeline)
+{
+    MUTEX_LOCK(pipeline->lock);
+    ht_foreach_value(pipeline->peers, pipeline_peer_clear, NULL);
+    MUTEX_UNLOCK(pipeline->lock);
+    ht_destroy(pipeline->peers);
+    MUTEX_DESTROY(pipeline->lock);
+    free(pipeline);
+}
+
+int
+connections_pipeline_max_depth(connections_pipeline_t *pipeline, int new_value)
+{
+    int old_value = ATOMIC_READ(pipeline->max_depth);
+
+    if (new_value >= 0)
+        ATOMIC_SET(pipeline->max_depth, new_value);
+
+    return old_value;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
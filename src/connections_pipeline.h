@@ -0,0 +1,56 @@
+#ifndef CONNECTIONS_PIPELINE_H
+#define CONNECTIONS_PIPELINE_H
+
+#include "messaging.h"
+
+/*
+ * Multiplexes the asynchronous fetches directed to the same peer over
+ * one (or a few) persistent connections.
+ * Requests are written on the shared connection as soon as they are queued
+ * and the responses, which peers always send in the same order the requests
+ * have been received, are matched with the pending requests in FIFO order.
+ */
+typedef struct _connections_pipeline_s connections_pipeline_t;
+
+/*
+ * The callback used to hand the async read worker of a newly created
+ * connection to the iomux which is going to read the responses from it
+ */
+typedef void (*connections_pipeline_attach_cb)(async_read_wrk_t *wrk, void *priv);
+
+connections_pipeline_t *connections_pipeline_create(char *auth,
+                                                    int max_connections,
+                                                    int max_depth,
+                                                    connections_pipeline_attach_cb attach,
+                                                    void *priv);
+
+// NOTE: must be called only once all the connections have been closed
+//       (which means once all the async workers have been released)
+void connections_pipeline_destroy(connections_pipeline_t *pipeline);
+
+/*
+ * Queues a fetch request for key on a connection already established with
+ * peer (or on a new one if there is none or all of them are busy).
+ * Returns 0 if the request has been queued, in which case the callback
+ * will be called exactly as it would have been by fetch_from_peer_async()
+ * (but status 1 won't ever refer to a filedescriptor owned by the caller).
+ * Returns -1 if the request can't be pipelined (too many outstanding
+ * requests or errors while connecting/writing), in which case the callback
+ * will never be called and the caller is free to use a dedicated connection
+ */
+int connections_pipeline_fetch(connections_pipeline_t *pipeline,
+                               char *peer,
+                               unsigned char sig_hdr,
+                               void *key,
+                               size_t klen,
+                               fetch_from_peer_async_cb cb,
+                               void *priv);
+
+// NOTE: a max_depth of 0 disables pipelining
+//       (connections_pipeline_fetch() will always return -1)
+int connections_pipeline_max_depth(connections_pipeline_t *pipeline, int new_value);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,118 @@
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "crc32c.h"
+
+// the Castagnoli polynomial (reversed)
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+typedef uint32_t (*crc32c_impl_t)(uint32_t crc, const unsigned char *data, size_t len);
+static crc32c_impl_t crc32c_impl = NULL;
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *data, size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+#endif
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t
+crc32c_armv8(uint32_t crc, const unsigned char *data, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#endif
+
+static void
+crc32c_init(void)
+{
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        int j;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        int k;
+        for (k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k-1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_sse42;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, (const unsigned char *)data, len);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,26 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * CRC32C (Castagnoli polynomial) checksum, used as integrity check
+ * by the V2 message framing.
+ *
+ * The crc32 instruction is used when the cpu supports it (SSE4.2 on x86-64,
+ * detected at runtime, or the CRC32 extension on ARMv8 if enabled at compile
+ * time), otherwise a table driven implementation processing 8 bytes at once.
+ *
+ * The checksum can be computed incrementally passing the value returned
+ * for the previous data as crc (0 for the first call), so:
+ *   crc32c(crc32c(0, a, alen), b, blen) == crc32c(0, ab, alen + blen)
+ *
+ * NOTE: the function is thread-safe
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,92 @@
+#ifndef FUTEX_LOCK_H
+#define FUTEX_LOCK_H
+
+#include <stdint.h>
+#include <sched.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/*
+ * A compact (4 bytes) non-recursive mutex meant to be embedded in structures
+ * which exist in large numbers (like the cached objects) where a pthread mutex
+ * would be a significant part of the memory footprint.
+ *
+ * The uncontended path is a single CAS, contended lockers spin for a while
+ * and then sleep on a futex (on systems without futexes they just yield).
+ *
+ * The lock word is:
+ *   0 unlocked
+ *   1 locked, no waiters
+ *   2 locked, there might be waiters
+ */
+typedef uint32_t futex_lock_t;
+
+// the number of attempts before going to sleep
+#define FUTEX_LOCK_SPINS 64
+
+static inline void
+futex_lock_init(futex_lock_t *lock)
+{
+    __sync_lock_release(lock);
+}
+
+static inline void
+futex_lock_wait(futex_lock_t *lock, uint32_t value)
+{
+#ifdef __linux__
+    syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+    sched_yield();
+#endif
+}
+
+static inline void
+futex_lock_wake(futex_lock_t *lock)
+{
+#ifdef __linux__
+    syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+static inline void
+futex_lock_acquire(futex_lock_t *lock)
+{
+    uint32_t c = __sync_val_compare_and_swap(lock, 0, 1);
+    if (__builtin_expect(c == 0, 1))
+        return;
+
+    int i;
+    for (i = 0; i < FUTEX_LOCK_SPINS; i++) {
+        if (c == 2)
+            break;
+        c = __sync_val_compare_and_swap(lock, 0, 1);
+        if (c == 0)
+            return;
+    }
+
+    // flag the lock as contended so that the owner will wake us up
+    if (c != 2)
+        c = __sync_lock_test_and_set(lock, 2);
+    while (c != 0) {
+        futex_lock_wait(lock, 2);
+        c = __sync_lock_test_and_set(lock, 2);
+    }
+}
+
+static inline void
+futex_lock_release(futex_lock_t *lock)
+{
+    if (__sync_fetch_and_sub(lock, 1) != 1) {
+        // somebody might be waiting
+        __sync_lock_release(lock);
+        futex_lock_wake(lock);
+    }
+}
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
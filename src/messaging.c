@@ -16,6 +16,7 @@
 
 #include "messaging.h"
 #include "connections.h"
+#include "crc32c.h"
 #include "shardcache.h"
 #include "shardcache_internal.h"
 
@@ -42,6 +43,8 @@ struct _async_read_ctx_s {
     char version;
     int moff;
     sip_hash *shash;
+    int checksum; // V2 message, crc is being computed instead of the signature
+    uint32_t crc;
     int blocking;
     struct timeval last_update;
 };
@@ -60,6 +63,31 @@ global_tcp_timeout(int timeout)
     return old_value;
 }
 
+void
+build_message_trailer(uint32_t crc, fbuf_t *out)
+{
+    uint32_t crc_nbo = htonl(crc);
+    fbuf_add_binary(out, (char *)&crc_nbo, sizeof(crc_nbo));
+}
+
+// returns 1 if the received trailer matches the computed crc, 0 otherwise
+static int
+check_message_trailer(uint32_t crc, char *trailer)
+{
+    uint32_t received_crc;
+    memcpy(&received_crc, trailer, sizeof(received_crc));
+    return (ntohl(received_crc) == crc);
+}
+
+static inline void
+async_read_context_digest(async_read_ctx_t *ctx, void *data, size_t len)
+{
+    if (ctx->checksum)
+        ctx->crc = crc32c(ctx->crc, data, len);
+    else if (ctx->shash)
+        sip_hash_update(ctx->shash, data, len);
+}
+
 int
 async_read_context_state(async_read_ctx_t *ctx)
 {
@@ -91,6 +119,8 @@ async_read_context_update(async_read_ctx_t *ctx)
         ctx->moff = 0;
         ctx->version = 0;
         ctx->csig = 0;
+        ctx->checksum = 0;
+        ctx->crc = 0;
         ctx->clen = 0;
         ctx->coff = 0;
         memset(ctx->magic, 0, sizeof(ctx->magic));
@@ -147,7 +177,24 @@ async_read_context_update(async_read_ctx_t *ctx)
             if (rbuf_used(ctx->buf) < 1)
                 return ctx->state;
             rbuf_read(ctx->buf, (unsigned char *)&ctx->sig_hdr, 1);
-            if (ctx->sig_hdr == SHC_HDR_SIGNATURE_SIP || ctx->sig_hdr == SHC_HDR_CSIGNATURE_SIP)
+            if (ctx->version > 1 || SHC_HDR_IS_CHECKSUM(ctx->sig_hdr)) {
+                // V2 messages always carry the checksum header and,
+                // not being signed, are refused if we have a secret
+                if (ctx->version < 2 || !SHC_HDR_IS_CHECKSUM(ctx->sig_hdr)) {
+                    ctx->state = SHC_STATE_READING_ERR;
+                    if (ctx->cb)
+                        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                    return ctx->state;
+                }
+                if (ctx->auth) {
+                    ctx->state = SHC_STATE_AUTH_ERR;
+                    if (ctx->cb)
+                        ctx->cb(NULL, 0, -2, ctx->cb_priv);
+                    return ctx->state;
+                }
+                ctx->checksum = 1;
+                ctx->state = SHC_STATE_READING_HDR;
+            } else if (ctx->sig_hdr == SHC_HDR_SIGNATURE_SIP || ctx->sig_hdr == SHC_HDR_CSIGNATURE_SIP)
             {
                 if (!ctx->auth) {
                     ctx->state = SHC_STATE_AUTH_ERR;
@@ -180,7 +227,10 @@ async_read_context_update(async_read_ctx_t *ctx)
         }
 
         ctx->state = SHC_STATE_READING_RECORD;
-        if (ctx->auth) {
+        if (ctx->checksum) {
+            unsigned char hdr = ctx->hdr;
+            ctx->crc = crc32c(0, &hdr, 1);
+        } else if (ctx->auth) {
             ctx->shash = sip_hash_new((uint8_t *)ctx->auth, 2, 4);
             sip_hash_update(ctx->shash, (unsigned char *)&ctx->hdr, 1);
         }
@@ -242,13 +292,11 @@ async_read_context_update(async_read_ctx_t *ctx)
             ctx->clen = ntohs(nlen);
             ctx->rlen += ctx->clen;
             ctx->coff = 0;
-            if (ctx->shash)
-                sip_hash_update(ctx->shash, (uint8_t *)&nlen, 2);
+            async_read_context_digest(ctx, &nlen, 2);
         }
         if (ctx->clen > ctx->coff) {
             int rb = rbuf_read(ctx->buf, (u_char *)ctx->chunk + ctx->coff, ctx->clen - ctx->coff);
-            if (ctx->shash)
-                sip_hash_update(ctx->shash, (u_char *)ctx->chunk + ctx->coff, rb);
+            async_read_context_digest(ctx, ctx->chunk + ctx->coff, rb);
             ctx->coff += rb;
             if (!rbuf_used(ctx->buf))
                 break; // TRUNCATED - we need more data
@@ -261,8 +309,7 @@ async_read_context_update(async_read_ctx_t *ctx)
 
             u_char bsep = 0;
             rbuf_read(ctx->buf, &bsep, 1);
-            if (ctx->shash)
-                sip_hash_update(ctx->shash, (uint8_t *)&bsep, 1);
+            async_read_context_digest(ctx, &bsep, 1);
 
             if (bsep == SHARDCACHE_RSEP) {
                 ctx->state = SHC_STATE_READING_RECORD;
@@ -276,7 +323,7 @@ async_read_context_update(async_read_ctx_t *ctx)
                 ctx->rnum++;
                 ctx->rlen = 0;
             } else if (bsep == 0) {
-                if (ctx->auth)
+                if (ctx->auth || ctx->checksum)
                     ctx->state = SHC_STATE_READING_AUTH;
                 else
                     ctx->state = SHC_STATE_READING_DONE;
@@ -297,7 +344,21 @@ async_read_context_update(async_read_ctx_t *ctx)
         }
     }
 
-    if (ctx->state == SHC_STATE_READING_AUTH) {
+    if (ctx->state == SHC_STATE_READING_AUTH && ctx->checksum) {
+        char trailer[SHARDCACHE_MSG_CRC_LEN];
+        if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_CRC_LEN)
+            return ctx->state;
+
+        rbuf_read(ctx->buf, (u_char *)trailer, SHARDCACHE_MSG_CRC_LEN);
+        if (!check_message_trailer(ctx->crc, trailer)) {
+            SHC_WARNING("Bad checksum in received message");
+            ctx->state = SHC_STATE_AUTH_ERR;
+            if (ctx->cb)
+                ctx->cb(NULL, 0, -2, ctx->cb_priv);
+            return ctx->state;
+        }
+        ctx->state = SHC_STATE_READING_DONE;
+    } else if (ctx->state == SHC_STATE_READING_AUTH) {
         if (rbuf_used(ctx->buf) < SHARDCACHE_MSG_SIG_LEN)
             return ctx->state;
 
@@ -664,6 +725,25 @@ read_and_check_siphash_signature(int fd, sip_hash *shash)
     return match;
 }
 
+static int
+read_and_check_message_trailer(int fd, uint32_t crc)
+{
+    char trailer[SHARDCACHE_MSG_CRC_LEN];
+    int tlen = SHARDCACHE_MSG_CRC_LEN;
+    int rb = 0;
+
+    while (rb < tlen) {
+        int n = read_socket(fd, trailer + rb, tlen - rb, 0);
+        if (n <= 0) {
+            SHC_WARNING("Truncated message (expected checksum)");
+            return 0;
+        }
+        rb += n;
+    }
+
+    return check_message_trailer(crc, trailer);
+}
+
 // synchronous (blocking)  message reading
 int
 read_message(int fd,
@@ -678,6 +758,8 @@ read_message(int fd,
     unsigned char hdr;
     int csig = 0;
     sip_hash *shash = NULL;
+    int checksum = 0;
+    uint32_t crc = 0;
     char version = 0;
 
     // there is no point in reading the message
@@ -733,7 +815,23 @@ read_message(int fd,
             }
 
             if (rb == 1) {
-                if ((hdr&0xFE) == SHC_HDR_SIGNATURE_SIP) {
+                if (version > 1 || SHC_HDR_IS_CHECKSUM(hdr)) {
+                    // V2 messages always carry the checksum header and,
+                    // not being signed, are refused if we have a secret
+                    if (version < 2 || !SHC_HDR_IS_CHECKSUM(hdr) || auth) {
+                        if (shash)
+                            sip_hash_free(shash);
+                        return -1;
+                    }
+                    if (shash) {
+                        sip_hash_free(shash);
+                        shash = NULL;
+                    }
+                    checksum = 1;
+                    rb = read_socket(fd, (char *)&hdr, 1, ignore_timeout);
+                    if (rb != 1)
+                        return -1;
+                } else if ((hdr&0xFE) == SHC_HDR_SIGNATURE_SIP) {
                     if (!shash) // no secred is configured but the message is signed
                         return -1;
                     csig = (hdr&0x01);
@@ -762,6 +860,9 @@ read_message(int fd,
                 hdr != SHC_HDR_ADD &&
                 hdr != SHC_HDR_EXISTS &&
                 hdr != SHC_HDR_TOUCH &&
+                hdr != SHC_HDR_GET_MULTI &&
+                hdr != SHC_HDR_SET_MULTI &&
+                hdr != SHC_HDR_EVICT_MULTI &&
                 hdr != SHC_HDR_MIGRATION_BEGIN &&
                 hdr != SHC_HDR_MIGRATION_ABORT &&
                 hdr != SHC_HDR_MIGRATION_END &&
@@ -780,6 +881,8 @@ read_message(int fd,
                 fprintf(stderr, "Unknown message type %02x in read_message()\n", hdr);
                 return -1;
             }
+            if (checksum)
+                crc = crc32c(0, &hdr, 1);
             if (shash) {
                 sip_hash_update(shash, &hdr, 1);
                 if (csig) {
@@ -799,7 +902,9 @@ read_message(int fd,
         rb = read_socket(fd, (char *)&clen, 2, ignore_timeout);
         // XXX - bug if read only one byte at this point
         if (rb == 2) {
-            if (shash)
+            if (checksum)
+                crc = crc32c(crc, &clen, 2);
+            else if (shash)
                 sip_hash_update(shash, (uint8_t *)&clen, 2);
             uint16_t chunk_len = ntohs(clen);
 
@@ -813,7 +918,9 @@ read_message(int fd,
                     return -1;
                 }
 
-                if (shash)
+                if (checksum)
+                    crc = crc32c(crc, &rsep, 1);
+                else if (shash)
                     sip_hash_update(shash, &rsep, 1);
 
                 if (rsep == SHARDCACHE_RSEP) {
@@ -834,6 +941,11 @@ read_message(int fd,
                     }
                     out = records[record_index];
                 } else if (rsep == 0) {
+                    if (checksum && !read_and_check_message_trailer(fd, crc)) {
+                        fbuf_set_used(out, initial_len);
+                        SHC_WARNING("Bad checksum (message type %02x) in read_message()", hdr);
+                        return -1;
+                    }
                     if (shash) {
                         if (!read_and_check_siphash_signature(fd, shash)) {
                             sip_hash_free(shash);
@@ -875,7 +987,9 @@ read_message(int fd,
                 }
                 chunk_len -= rb;
                 fbuf_add_binary(out, buf, rb);
-                if (shash)
+                if (checksum)
+                    crc = crc32c(crc, buf, rb);
+                else if (shash)
                     sip_hash_update(shash, (uint8_t *)buf, rb);
                 if (fbuf_used(out) > SHARDCACHE_MSG_MAX_RECORD_LEN) {
                     // we have exceeded the maximum size for a record
@@ -965,18 +1079,28 @@ int build_message(char *auth,
     static char sep = SHARDCACHE_RSEP;
     uint16_t    eor = 0;
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    // V2 messages aren't signed, if we have a secret they
+    // are sent as V1 messages (signed) in any case
+    if (SHC_HDR_IS_CHECKSUM(sig_hdr) && auth)
+        sig_hdr = SHC_HDR_SIGNATURE_SIP;
+
+    int checksum = SHC_HDR_IS_CHECKSUM(sig_hdr);
+
+    uint32_t magic = htonl(checksum ? SHC_MAGIC_V2 : SHC_MAGIC);
     fbuf_add_binary(out, (char *)&magic, sizeof(magic));
 
     sip_hash *shash = NULL;
-    if (auth) {
+    if (checksum) {
+        unsigned char hdr_sig = SHC_HDR_CHECKSUM_CRC32C;
+        fbuf_add_binary(out, (char *)&hdr_sig, 1);
+    } else if (auth) {
         unsigned char hdr_sig = sig_hdr ? sig_hdr : SHC_HDR_SIGNATURE_SIP;
         fbuf_add_binary(out, (char *)&hdr_sig, 1);
         shash = sip_hash_new((uint8_t *)auth, 2, 4);
 
     }
 
-    uint16_t out_initial_offset = fbuf_used(out);
+    size_t out_initial_offset = fbuf_used(out);
     fbuf_add_binary(out, (char *)&hdr, 1);
     if (auth && sig_hdr == SHC_HDR_CSIGNATURE_SIP) {
         uint64_t digest = _sign_chunk(shash, &hdr, 1);
@@ -1009,7 +1133,10 @@ int build_message(char *auth,
 
     fbuf_add_binary(out, &eom, 1);
 
-    if (auth) {
+    if (checksum) {
+        uint32_t crc = crc32c(0, fbuf_data(out) + out_initial_offset, fbuf_used(out) - out_initial_offset);
+        build_message_trailer(crc, out);
+    } else if (auth) {
         if (sig_hdr == SHC_HDR_CSIGNATURE_SIP) {
             uint64_t digest = _sign_chunk(shash, fbuf_data(out) + fbuf_used(out) - 3, 3);
             fbuf_add_binary(out, (char *)&digest, sizeof(digest));
@@ -1047,6 +1174,8 @@ write_message(int fd,
 
     size_t mlen = fbuf_used(&msg);
     size_t dlen = auth ? sizeof(uint64_t) : 0;
+    if (SHC_HDR_IS_CHECKSUM(sig_hdr) && !auth)
+        dlen = SHARDCACHE_MSG_CRC_LEN;
     SHC_DEBUG2("sending message: %s",
            shardcache_hex_escape(fbuf_data(&msg), mlen-dlen, DEBUG_DUMP_MAXSIZE, 0));
 
@@ -1330,6 +1459,155 @@ fetch_from_peer(char *peer,
     return -1;
 }
 
+void
+pack_multi_record(shardcache_record_t *fields, int num_fields, fbuf_t *out)
+{
+    int i;
+    for (i = 0; i < num_fields; i++) {
+        uint32_t len_nbo = htonl(fields[i].l);
+        fbuf_add_binary(out, (char *)&len_nbo, sizeof(len_nbo));
+        if (fields[i].l)
+            fbuf_add_binary(out, fields[i].v, fields[i].l);
+    }
+}
+
+int
+unpack_multi_record(void *data, size_t len, shardcache_record_t **fields)
+{
+    char *p = (char *)data;
+    char *end = p + len;
+    int num_fields = 0;
+    shardcache_record_t *list = NULL;
+
+    while (p < end) {
+        uint32_t flen;
+        if ((size_t)(end - p) < sizeof(flen)) {
+            free(list);
+            return -1;
+        }
+        memcpy(&flen, p, sizeof(flen));
+        flen = ntohl(flen);
+        p += sizeof(flen);
+        if ((size_t)(end - p) < flen) {
+            free(list);
+            return -1;
+        }
+        list = realloc(list, sizeof(shardcache_record_t) * (num_fields + 1));
+        list[num_fields].v = p;
+        list[num_fields].l = flen;
+        num_fields++;
+        p += flen;
+    }
+
+    *fields = list;
+    return num_fields;
+}
+
+int
+get_multi_from_peer(char *peer,
+                    char *auth,
+                    unsigned char sig_hdr,
+                    shardcache_record_t *keys,
+                    int num_keys,
+                    fbuf_t **out,
+                    int fd)
+{
+    int rc = -1;
+    int should_close = 0;
+
+    if (num_keys < 1)
+        return -1;
+
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd >= 0) {
+        fbuf_t keys_list = FBUF_STATIC_INITIALIZER;
+        pack_multi_record(keys, num_keys, &keys_list);
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys_list),
+            .l = fbuf_used(&keys_list)
+        };
+        rc = write_message(fd, auth, sig_hdr, SHC_HDR_GET_MULTI, &record, 1);
+        fbuf_destroy(&keys_list);
+        if (rc == 0) {
+            shardcache_hdr_t hdr = 0;
+            int num_records = read_message(fd, auth, out, num_keys, &hdr, 0);
+            if (hdr != SHC_HDR_RESPONSE || num_records != num_keys) {
+                SHC_DEBUG("Bad response to GET_MULTI from peer %s (%d records, %d expected)",
+                          peer, num_records, num_keys);
+                rc = -1;
+            }
+        }
+        if (should_close)
+            close(fd);
+    }
+    return rc;
+}
+
+int
+set_multi_to_peer(char *peer,
+                  char *auth,
+                  unsigned char sig_hdr,
+                  shardcache_record_t *keys,
+                  shardcache_record_t *values,
+                  int num_items,
+                  uint32_t expire,
+                  char *results,
+                  int fd)
+{
+    int rc = -1;
+    int should_close = 0;
+
+    if (num_items < 1)
+        return -1;
+
+    if (fd < 0) {
+        fd = connect_to_peer(peer, ATOMIC_READ(_tcp_timeout));
+        should_close = 1;
+    }
+
+    if (fd >= 0) {
+        fbuf_t items_list = FBUF_STATIC_INITIALIZER;
+        int i;
+        for (i = 0; i < num_items; i++) {
+            pack_multi_record(&keys[i], 1, &items_list);
+            pack_multi_record(&values[i], 1, &items_list);
+        }
+        uint32_t expire_nbo = htonl(expire);
+        shardcache_record_t record[2] = {
+            {
+                .v = fbuf_data(&items_list),
+                .l = fbuf_used(&items_list)
+            },
+            {
+                .v = &expire_nbo,
+                .l = sizeof(uint32_t)
+            }
+        };
+        rc = write_message(fd, auth, sig_hdr, SHC_HDR_SET_MULTI, record, expire ? 2 : 1);
+        fbuf_destroy(&items_list);
+        if (rc == 0) {
+            shardcache_hdr_t hdr = 0;
+            fbuf_t resp = FBUF_STATIC_INITIALIZER;
+            fbuf_t *respp = &resp;
+            int num_records = read_message(fd, auth, &respp, 1, &hdr, 0);
+            if (hdr == SHC_HDR_RESPONSE && num_records == 1 && fbuf_used(&resp) == num_items) {
+                memcpy(results, fbuf_data(&resp), num_items);
+            } else {
+                SHC_DEBUG("Bad response to SET_MULTI from peer %s", peer);
+                rc = -1;
+            }
+            fbuf_destroy(&resp);
+        }
+        if (should_close)
+            close(fd);
+    }
+    return rc;
+}
+
 int
 offset_from_peer(char *peer,
                  char *auth,
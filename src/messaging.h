@@ -13,11 +13,13 @@
 
 // in bytes
 #define SHARDCACHE_MSG_SIG_LEN 8
+#define SHARDCACHE_MSG_CRC_LEN 4
 #define SHARDCACHE_MSG_MAX_RECORD_LEN (1<<28) // 256MB
 
 // last byte holds the protocol version
-#define SHC_PROTOCOL_VERSION 1
+#define SHC_PROTOCOL_VERSION 2 // the highest version understood
 #define SHC_MAGIC 0x73686301
+#define SHC_MAGIC_V2 0x73686302 // messages using the checksum framing
 
 typedef enum {
     // data commands
@@ -30,6 +32,9 @@ typedef enum {
     SHC_HDR_ADD              = 0x07,
     SHC_HDR_EXISTS           = 0x08,
     SHC_HDR_TOUCH            = 0x09,
+    SHC_HDR_GET_MULTI        = 0x0A,
+    SHC_HDR_SET_MULTI        = 0x0B,
+    SHC_HDR_EVICT_MULTI      = 0x0C,
 
     // migration commands
     SHC_HDR_MIGRATION_ABORT  = 0x21,
@@ -57,10 +62,19 @@ typedef enum {
 
     // signature headers
     SHC_HDR_SIGNATURE_SIP    = 0xF0,
-    SHC_HDR_CSIGNATURE_SIP   = 0xF1
+    SHC_HDR_CSIGNATURE_SIP   = 0xF1,
+
+    // checksum headers (V2)
+    SHC_HDR_CHECKSUM_CRC32C  = 0xF4
 
 } shardcache_hdr_t;
 
+// V2 messages are checksummed (crc32c) but not signed, so they are used
+// only if no secret is configured (and refused by the receivers otherwise).
+// Passing SHC_HDR_CHECKSUM_CRC32C as sig_hdr together with a secret
+// produces a V1 (signed) message
+#define SHC_HDR_IS_CHECKSUM(_h) ((_h) == SHC_HDR_CHECKSUM_CRC32C)
+
 typedef enum {
     SHC_RES_OK     = 0x00,
     SHC_RES_YES    = 0x01,
@@ -80,7 +94,8 @@ typedef struct _shardcache_record_s {
 
 int global_tcp_timeout(int tcp_timeout);
 
-// synchronously read a message (blocking)
+// synchronously read a message (blocking), if a secret is provided
+// V2 messages are refused
 int read_message(int fd,
                  char *auth,
                  fbuf_t **out,
@@ -88,6 +103,10 @@ int read_message(int fd,
                  shardcache_hdr_t *hdr,
                  int ignore_timeout);
 
+// append the trailer of a V2 message : the crc32c computed over the message
+// (from the message header to the terminator)
+void build_message_trailer(uint32_t crc, fbuf_t *out);
+
 // synchronously write a message (blocking)
 int write_message(int fd,
                   char *auth,
@@ -159,6 +178,41 @@ int fetch_from_peer(char *peer,
                     fbuf_t *out,
                     int fd);
 
+// fetch the values for multiple keys at once from a peer
+// (which will take care of fetching the keys it doesn't own from
+// the responsible nodes). 'out' must point to an array of num_keys
+// fbuf_t pointers, values will be stored in the same order of the keys
+int get_multi_from_peer(char *peer,
+                        char *auth,
+                        unsigned char sig_hdr,
+                        shardcache_record_t *keys,
+                        int num_keys,
+                        fbuf_t **out,
+                        int fd);
+
+// send multiple key/value pairs at once to a peer
+// (which will take care of forwarding them to the responsible nodes).
+// 'results' must point to an array of num_items bytes which will be
+// filled with the response byte (SHC_RES_OK or SHC_RES_ERR) for each item
+int set_multi_to_peer(char *peer,
+                      char *auth,
+                      unsigned char sig_hdr,
+                      shardcache_record_t *keys,
+                      shardcache_record_t *values,
+                      int num_items,
+                      uint32_t expire,
+                      char *results,
+                      int fd);
+
+// pack a list of fields into the record format used by GET_MULTI/SET_MULTI
+// (each field is prefixed by its length as a 32bit integer in network byte order)
+void pack_multi_record(shardcache_record_t *fields, int num_fields, fbuf_t *out);
+
+// unpack a record built using pack_multi_record(), the returned fields
+// point to the data in the record (the array itself needs to be released
+// using free()). Returns the number of fields or -1 if the record is malformed
+int unpack_multi_record(void *data, size_t len, shardcache_record_t **fields);
+
 // fetch part of the value for a given key from a peer
 int offset_from_peer(char *peer,
                      char *auth,
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <hashtable.h>
+#include <linklist.h>
+#include <atomic_defs.h>
+
+#include "peer_selector.h"
+
+// the weight of a new sample in the moving average (1/8)
+#define PEER_SELECTOR_EWMA_SHIFT 3
+
+// the number of consecutive failures after which an address is considered unhealthy
+#define PEER_SELECTOR_MAX_FAILURES 3
+
+// how long (in microseconds) an unhealthy address is avoided,
+// the period doubles for each further failure (up to the max)
+#define PEER_SELECTOR_BACKOFF_MIN 1000000
+#define PEER_SELECTOR_BACKOFF_MAX 30000000
+
+// one request out of PEER_SELECTOR_EXPLORE_RATE is sent to a random healthy
+// address so that the latency of the slower ones is still refreshed
+#define PEER_SELECTOR_EXPLORE_RATE 64
+
+// the stats of addresses not reported for longer than PEER_SELECTOR_IDLE_TIMEOUT
+// (in microseconds) are dropped, the check runs at most once per prune interval
+#define PEER_SELECTOR_IDLE_TIMEOUT 600000000
+#define PEER_SELECTOR_PRUNE_INTERVAL 60000000
+
+typedef struct {
+    uint64_t latency;      // the moving average of the latency (0 if unknown)
+    uint32_t failures;     // the number of consecutive failures
+    uint64_t last_failure; // the time (in microseconds) of the last failure
+    uint64_t last_report;  // the time (in microseconds) of the last report
+} peer_stats_t;
+
+struct _peer_selector_s {
+    hashtable_t *stats;      // the peer_stats_t for each address
+    linked_list_t *retired;  // the stats removed by the last prune, released by the
+                             // next one since concurrent callers might still use them
+    uint64_t last_prune;     // the time (in microseconds) of the last prune
+};
+
+static inline uint64_t
+peer_selector_now()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+peer_selector_t *
+peer_selector_create()
+{
+    peer_selector_t *selector = calloc(1, sizeof(peer_selector_t));
+    // the stats are released explicitly (see peer_selector_prune())
+    selector->stats = ht_create(128, 0, NULL);
+    selector->retired = list_create();
+    list_set_free_value_callback(selector->retired, free);
+    selector->last_prune = peer_selector_now();
+    return selector;
+}
+
+void
+peer_selector_destroy(peer_selector_t *selector)
+{
+    ht_set_free_item_callback(selector->stats, free);
+    ht_destroy(selector->stats);
+    list_destroy(selector->retired);
+    free(selector);
+}
+
+typedef struct {
+    linked_list_t *retired;
+    uint64_t now;
+} peer_selector_prune_arg_t;
+
+static int
+peer_selector_prune_idle(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    peer_selector_prune_arg_t *arg = (peer_selector_prune_arg_t *)user;
+    peer_stats_t *stats = (peer_stats_t *)value;
+    if (arg->now - ATOMIC_READ(stats->last_report) < PEER_SELECTOR_IDLE_TIMEOUT)
+        return 1;
+    // removed from the table but not released yet
+    list_push_value(arg->retired, stats);
+    return -1;
+}
+
+// drops the stats of the addresses which haven't been used for a while
+// (like the ones of nodes removed from the continuum)
+static void
+peer_selector_prune(peer_selector_t *selector, uint64_t now)
+{
+    uint64_t last_prune = ATOMIC_READ(selector->last_prune);
+    if (now - last_prune < PEER_SELECTOR_PRUNE_INTERVAL)
+        return;
+
+    // only one of the callers takes care of the prune
+    if (!ATOMIC_CAS(selector->last_prune, last_prune, now))
+        return;
+
+    // the stats retired by the previous prune can't be referenced anymore
+    list_clear(selector->retired);
+
+    peer_selector_prune_arg_t arg = {
+        .retired = selector->retired,
+        .now = now
+    };
+    ht_foreach_value(selector->stats, peer_selector_prune_idle, &arg);
+}
+
+static peer_stats_t *
+peer_selector_stats(peer_selector_t *selector, char *address, int create)
+{
+    size_t len = strlen(address);
+    peer_stats_t *stats = ht_get(selector->stats, address, len, NULL);
+    if (!stats && create) {
+        stats = calloc(1, sizeof(peer_stats_t));
+        stats->last_report = peer_selector_now();
+        if (ht_set_if_not_exists(selector->stats, address, len, stats, sizeof(peer_stats_t)) != 0) {
+            // someone else created the stats in the meanwhile
+            free(stats);
+            stats = ht_get(selector->stats, address, len, NULL);
+        }
+    }
+    return stats;
+}
+
+static inline int
+peer_selector_is_healthy(peer_stats_t *stats, uint64_t now)
+{
+    uint32_t failures = ATOMIC_READ(stats->failures);
+    if (failures < PEER_SELECTOR_MAX_FAILURES)
+        return 1;
+
+    uint32_t shift = failures - PEER_SELECTOR_MAX_FAILURES;
+    uint64_t backoff = PEER_SELECTOR_BACKOFF_MAX;
+    if (shift < 5 && (PEER_SELECTOR_BACKOFF_MIN << shift) < PEER_SELECTOR_BACKOFF_MAX)
+        backoff = PEER_SELECTOR_BACKOFF_MIN << shift;
+
+    // once the backoff period is over the address can be tried again
+    return (now - ATOMIC_READ(stats->last_failure) > backoff);
+}
+
+char *
+peer_selector_pick(peer_selector_t *selector, char **addresses, int num_addresses)
+{
+    if (num_addresses == 1)
+        return addresses[0];
+
+    uint64_t now = peer_selector_now();
+    int healthy[num_addresses];
+    int num_healthy = 0;
+    int best = -1;
+    uint64_t best_latency = 0;
+    int fallback = 0;
+    uint64_t fallback_failure = UINT64_MAX;
+
+    int i;
+    for (i = 0; i < num_addresses; i++) {
+        peer_stats_t *stats = peer_selector_stats(selector, addresses[i], 0);
+        // addresses never used before are worth a try
+        uint64_t latency = 0;
+        if (stats) {
+            if (!peer_selector_is_healthy(stats, now)) {
+                uint64_t last_failure = ATOMIC_READ(stats->last_failure);
+                if (last_failure < fallback_failure) {
+                    fallback = i;
+                    fallback_failure = last_failure;
+                }
+                continue;
+            }
+            latency = ATOMIC_READ(stats->latency);
+        }
+        healthy[num_healthy++] = i;
+        if (best == -1 || latency < best_latency) {
+            best = i;
+            best_latency = latency;
+        }
+    }
+
+    // if all the addresses are failing let's try the one which failed least recently
+    if (best == -1)
+        return addresses[fallback];
+
+    if (num_healthy > 1 && random() % PEER_SELECTOR_EXPLORE_RATE == 0)
+        return addresses[healthy[random() % num_healthy]];
+
+    return addresses[best];
+}
+
+void
+peer_selector_report(peer_selector_t *selector, char *address, int success, uint64_t latency)
+{
+    uint64_t now = peer_selector_now();
+    peer_selector_prune(selector, now);
+
+    peer_stats_t *stats = peer_selector_stats(selector, address, 1);
+    if (!stats)
+        return;
+
+    ATOMIC_SET(stats->last_report, now);
+
+    if (!success) {
+        ATOMIC_SET(stats->last_failure, now);
+        ATOMIC_INCREMENT(stats->failures);
+        return;
+    }
+
+    ATOMIC_SET(stats->failures, 0);
+
+    if (!latency)
+        return;
+
+    uint64_t old_value, new_value;
+    do {
+        old_value = ATOMIC_READ(stats->latency);
+        new_value = old_value
+                  ? old_value - (old_value >> PEER_SELECTOR_EWMA_SHIFT) + (latency >> PEER_SELECTOR_EWMA_SHIFT)
+                  : latency;
+    } while (!ATOMIC_CAS(stats->latency, old_value, new_value));
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
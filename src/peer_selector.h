@@ -0,0 +1,35 @@
+#ifndef PEER_SELECTOR_H
+#define PEER_SELECTOR_H
+
+#include <stdint.h>
+
+/*
+ * Keeps track of the latency (as an exponentially weighted moving average)
+ * and of the failures observed for each peer address, so that requests
+ * to a node reachable at multiple addresses can be routed to the fastest
+ * healthy one.
+ * An address failing too many times in a row is avoided for a while
+ * (the period grows with the number of failures) unless all the addresses
+ * of the node are failing.
+ * The stats of addresses which are not reported for a long time
+ * (like the ones of nodes not part of the continuum anymore) are dropped.
+ *
+ * NOTE: all the functions are thread-safe
+ */
+typedef struct _peer_selector_s peer_selector_t;
+
+peer_selector_t *peer_selector_create();
+
+void peer_selector_destroy(peer_selector_t *selector);
+
+// returns the fastest healthy address among the provided ones
+char *peer_selector_pick(peer_selector_t *selector, char **addresses, int num_addresses);
+
+// reports the outcome of a request sent to an address.
+// The latency (in microseconds) is ignored if 0 or if the request failed
+void peer_selector_report(peer_selector_t *selector, char *address, int success, uint64_t latency);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -8,6 +8,8 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <iomux.h>
 #include <queue.h>
@@ -21,6 +23,7 @@
 #include "counters.h"
 
 #include "serving.h"
+#include "crc32c.h"
 
 #include "shardcache_internal.h" // for the replica memeber
 
@@ -29,37 +32,94 @@
 #endif
 #include <siphash.h>
 
+#ifndef MIN
+#define MIN(a, b) ( (a) < (b) ? (a) : (b) )
+#endif
+
+// not exposed by limits.h unless _XOPEN_SOURCE (or _GNU_SOURCE) is defined
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define SHARDCACHE_CACHE_LINE_SIZE 64
+
+// the counters of a worker updated (using the atomic builtins) by other
+// threads as well, kept out of the packed worker context and aligned
+// to a cache line of their own
+typedef struct {
+    uint64_t numfds;
+    // the load of the worker, used to select the worker for new connections
+    uint64_t num_connections; // connections assigned to the worker (queued or in the iomux)
+    uint64_t num_requests;    // requests received and not yet completely served
+} __attribute__((aligned(SHARDCACHE_CACHE_LINE_SIZE))) shardcache_worker_stats_t;
+
 #pragma pack(push, 1)
 typedef struct {
     pthread_t thread;
     queue_t *jobs;
     int leave;
+    int retire; // the worker has been removed from the pool and will exit
+                // as soon as all its connections have been handed over
+    struct timeval retire_deadline; // when the connections still busy are closed
+    int exited; // the worker thread has left its loop and can be joined
+    int index;
     pthread_cond_t wakeup_cond;
     pthread_mutex_t wakeup_lock;
     shardcache_serving_t *serv;
     iomux_t *iomux;
     linked_list_t *prune;
-    uint64_t numfds;
+    // the connections actually handled by this worker's iomux
+    // (accessed only by the worker thread itself)
+    TAILQ_HEAD(, _shardcache_connection_context_s) connections;
+    shardcache_worker_stats_t *stats;
+    int listener; // the listening socket owned by the worker when listening
+                  // per worker (SO_REUSEPORT), -1 otherwise
+                  // (accessed only by the worker thread itself)
+    queue_t *listen_jobs; // changes to the listening socket requested to the worker
+                          // (see shardcache_worker_listen()/shardcache_worker_unlisten())
+    int listening; // the worker has been asked to listen on its own socket
+                   // (accessed holding the workers_lock of the serving instance)
     //uint64_t pruning;
 } shardcache_worker_context_t;
 
 struct _shardcache_serving_s {
     shardcache_t *cache;
-    int sock;
+    int sock; // the shared listening socket (-1 when listening per worker),
+              // accessed only by the listener thread once started
+    queue_t *listen_jobs; // changes to the shared listening socket requested
+                          // to the listener thread (see shardcache_serving_listen())
+    char *listen_host;
+    int listen_port;
+    int listen_per_worker; // each worker accepts connections on its own socket
+    pthread_mutex_t workers_lock; // serializes changes to the workers pool
+                                  // and to the listening sockets
+    pthread_mutex_t select_lock;  // held while selecting a worker and queueing
+                                  // a connection to it, so that the selected
+                                  // worker can't be removed in the meanwhile
     pthread_t io_thread;
     iomux_t *io_mux;
     int leave;
     int num_workers;
     int next_worker_index;
     linked_list_t *workers;
+    linked_list_t *retiring; // the workers removed from the pool but not yet
+                             // collected (accessed holding the workers_lock)
     uint64_t num_connections;
     uint64_t total_workers;
+    uint64_t paused_requests; // GET requests paused because the client was too slow
 };
 
 typedef struct _shardcache_connection_context_s shardcache_connection_context_t;
 
 #define SHARDCACHE_REQUEST_RECORDS_MAX 4
 
+// how many idle connections a pending request is worth when selecting a worker
+#define SHARDCACHE_WORKER_REQUEST_LOAD 4
+
+// how long (in seconds) a retiring worker waits for its busy connections
+// to become idle before closing them
+#define SHARDCACHE_WORKER_RETIRE_TIMEOUT 10
+
 typedef struct _shardcache_request_s {
     fbuf_t records[SHARDCACHE_REQUEST_RECORDS_MAX];
     int fd;
@@ -73,11 +133,21 @@ typedef struct _shardcache_request_s {
 #endif
     fbuf_t output;
     sip_hash *fetch_shash;
+    uint32_t fetch_crc; // the checksum of the GET response (V2)
     int error;
     int skipped;
     int copied;
     int done;
+    int paused;     // stopped reading the value until the client catches up
+    size_t discard; // bytes of the value already sent before the pause
     fbuf_t fetch_accumulator;
+    // zero-copy responses are written straight from the retained value,
+    // the framing buffer holds everything surrounding the value chunks
+    shardcache_resource_t *resource;
+    fbuf_t framing;
+    struct iovec *iov;
+    int iovcnt;
+    int iov_index;
     TAILQ_ENTRY(_shardcache_request_s) next;
 } shardcache_request_t;
 
@@ -97,6 +167,9 @@ struct _shardcache_connection_context_s {
     int retries;
     struct timeval retry_timeout;
     shardcache_worker_context_t *worker;
+    int attached; // the connection is in the worker's iomux (and connections list)
+    int writing;  // the output callback is set on the worker's iomux
+    TAILQ_ENTRY(_shardcache_connection_context_s) wnext;
     int closed;
     struct timeval in_prune_since;
 };
@@ -153,23 +226,68 @@ shardcache_request_destroy(shardcache_request_t *req)
     if (req->fetch_shash)
         sip_hash_free(req->fetch_shash);
     fbuf_destroy(&req->fetch_accumulator);
+    if (req->resource)
+        shardcache_resource_release(req->resource);
+    fbuf_destroy(&req->framing);
+    free(req->iov);
     free(req);
 }
 
+static inline void
+shardcache_connection_context_set_worker(shardcache_connection_context_t *ctx,
+                                         shardcache_worker_context_t *wrk)
+{
+    if (ctx->worker)
+        ATOMIC_DECREMENT(ctx->worker->stats->num_connections);
+    ctx->worker = wrk;
+    if (wrk)
+        ATOMIC_INCREMENT(wrk->stats->num_connections);
+}
+
+static inline void
+shardcache_connection_context_add_request(shardcache_connection_context_t *ctx,
+                                          shardcache_request_t *req)
+{
+    TAILQ_INSERT_TAIL(&ctx->requests, req, next);
+    ctx->num_requests++;
+    if (ctx->worker)
+        ATOMIC_INCREMENT(ctx->worker->stats->num_requests);
+}
+
+static inline void
+shardcache_connection_context_remove_request(shardcache_connection_context_t *ctx,
+                                             shardcache_request_t *req)
+{
+    TAILQ_REMOVE(&ctx->requests, req, next);
+    ctx->num_requests--;
+    if (ctx->worker)
+        ATOMIC_DECREMENT(ctx->worker->stats->num_requests);
+}
+
+static inline void
+shardcache_connection_context_detach(shardcache_connection_context_t *ctx)
+{
+    if (ctx->attached) {
+        TAILQ_REMOVE(&ctx->worker->connections, ctx, wnext);
+        ctx->attached = 0;
+    }
+}
+
 static void
 shardcache_connection_context_destroy(shardcache_connection_context_t *ctx)
 {
     int i;
+    shardcache_connection_context_detach(ctx);
     for (i = 0; i < SHARDCACHE_REQUEST_RECORDS_MAX; i++) {
         fbuf_destroy(&ctx->records[i]);
     }
     shardcache_request_t *req = TAILQ_FIRST(&ctx->requests);
     while(req) {
-        TAILQ_REMOVE(&ctx->requests, req, next);
+        shardcache_connection_context_remove_request(ctx, req);
         shardcache_request_destroy(req);
-        ctx->num_requests--;
         req = TAILQ_FIRST(&ctx->requests);
     }
+    shardcache_connection_context_set_worker(ctx, NULL);
     async_read_context_destroy(ctx->reader_ctx);
     ATOMIC_DECREMENT(ctx->serv->num_connections);
     free(ctx);
@@ -222,7 +340,9 @@ write_status(shardcache_request_t *req, int rc, char mode)
         }
     }
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    char *auth = (char *)req->ctx->serv->cache->auth;
+    int checksum = SHC_HDR_IS_CHECKSUM(req->sig_hdr);
+    uint32_t magic = htonl(checksum ? SHC_MAGIC_V2 : SHC_MAGIC);
     fbuf_t output = FBUF_STATIC_INITIALIZER;
     fbuf_minlen(&output, 64);
     fbuf_fastgrowsize(&output, 1024);
@@ -231,7 +351,10 @@ write_status(shardcache_request_t *req, int rc, char mode)
     fbuf_add_binary(&output, (char *)&magic, sizeof(magic));
 
     sip_hash *shash = NULL;
-    if (req->ctx->serv->cache->auth) {
+    if (checksum) {
+        unsigned char hdr_sig = SHC_HDR_CHECKSUM_CRC32C;
+        fbuf_add_binary(&output, (char *)&hdr_sig, 1);
+    } else if (auth) {
         unsigned char hdr_sig = SHC_HDR_SIGNATURE_SIP;
         fbuf_add_binary(&output, (char *)&hdr_sig, 1);
         shash = sip_hash_new((uint8_t *)req->ctx->serv->cache->auth, 2, 4);
@@ -245,7 +368,10 @@ write_status(shardcache_request_t *req, int rc, char mode)
 
     fbuf_add_binary(&output, out, sizeof(out) - (no_data ? 3 : 0));
 
-    if (req->ctx->serv->cache->auth) {
+    if (checksum) {
+        uint32_t crc = crc32c(0, fbuf_data(&output) + initial_offset, fbuf_used(&output) - initial_offset);
+        build_message_trailer(crc, &output);
+    } else if (auth) {
         uint64_t digest;
         sip_hash_digest_integer(shash,
                                 (uint8_t *)fbuf_data(&output) + initial_offset,
@@ -262,12 +388,23 @@ write_status(shardcache_request_t *req, int rc, char mode)
     ATOMIC_INCREMENT(req->done);
 }
 
+// updates the checksum (V2) or the signature of the GET response being sent
+static inline void
+response_digest_update(shardcache_request_t *req, void *data, size_t len)
+{
+    if (SHC_HDR_IS_CHECKSUM(req->sig_hdr))
+        req->fetch_crc = crc32c(req->fetch_crc, data, len);
+    else if (req->fetch_shash)
+        sip_hash_update(req->fetch_shash, data, len);
+}
+
 static inline int
 send_async_data_response_preamble(shardcache_request_t *req)
 {
-    shardcache_hdr_t hdr = SHC_HDR_RESPONSE;
+    unsigned char hdr = SHC_HDR_RESPONSE;
+    int checksum = SHC_HDR_IS_CHECKSUM(req->sig_hdr);
 
-    uint32_t magic = htonl(SHC_MAGIC);
+    uint32_t magic = htonl(checksum ? SHC_MAGIC_V2 : SHC_MAGIC);
 
     fbuf_t output = FBUF_STATIC_INITIALIZER;
     fbuf_minlen(&output, 64);
@@ -275,7 +412,11 @@ send_async_data_response_preamble(shardcache_request_t *req)
     fbuf_slowgrowsize(&output, 512);
     fbuf_add_binary(&output, (char *)&magic, sizeof(magic));
 
-    if (req->ctx->serv->cache->auth) {
+    if (checksum) {
+        unsigned char hdr_sig = SHC_HDR_CHECKSUM_CRC32C;
+        fbuf_add_binary(&output, (void *)&hdr_sig, 1);
+        req->fetch_crc = crc32c(0, &hdr, 1);
+    } else if (req->ctx->serv->cache->auth) {
         if (req->fetch_shash) {
             sip_hash_free(req->fetch_shash);
             req->fetch_shash = NULL;
@@ -318,7 +459,11 @@ send_async_data_response_epilogue(shardcache_request_t *req)
 
     fbuf_add_binary(&output, (void *)&eor, 2);
     fbuf_add_binary(&output, &eom, 1);
-    if (req->fetch_shash) {
+    if (SHC_HDR_IS_CHECKSUM(req->sig_hdr)) {
+        response_digest_update(req, (void *)&eor, 2);
+        response_digest_update(req, &eom, 1);
+        build_message_trailer(req->fetch_crc, &output);
+    } else if (req->fetch_shash) {
         uint64_t digest;
         sip_hash_update(req->fetch_shash, (void *)&eor, 2);
         sip_hash_update(req->fetch_shash, (uint8_t *)&eom, 1);
@@ -361,6 +506,17 @@ get_async_data_handler(void *key,
         }
     }
 
+    if (req->discard && dlen) {
+        // the request has been resumed after a pause,
+        // skip the part of the value already sent to the client
+        size_t drop = MIN(req->discard, dlen);
+        req->discard -= drop;
+        data += drop;
+        dlen -= drop;
+        if (!dlen && !total_size)
+            return 0;
+    }
+
     if (dlen == 0 && total_size == 0) {
         if (!timestamp && (req->skipped || req->copied)) {
             // if there is no timestamp here it means there was an
@@ -380,6 +536,26 @@ get_async_data_handler(void *key,
         return !timestamp ? -1 : 0;
     }
 
+    if (!total_size && req->hdr == SHC_HDR_GET) {
+        // the value is still being received, if the client doesn't keep up
+        // we can't buffer an unbounded amount of data on its behalf
+        int threshold = ATOMIC_READ(req->ctx->serv->cache->streaming_threshold);
+        SPIN_LOCK(req->output_lock);
+        size_t pending = fbuf_used(&req->output);
+        SPIN_UNLOCK(req->output_lock);
+        if (threshold > 0 && pending > (size_t)threshold) {
+            // stop listening to the fetch (which goes on for the other
+            // listeners), shardcache_output_handler() resumes the request
+            // from the current position once the client drained its output.
+            // NOTE: nothing can touch the request after setting the flag
+            SHC_DEBUG("Client too slow while streaming a value (%zu bytes pending), "
+                      "pausing the request", pending);
+            ATOMIC_INCREMENT(req->ctx->serv->paused_requests);
+            ATOMIC_SET(req->paused, 1);
+            return -1;
+        }
+    }
+
     uint32_t offset = 0;
     uint32_t size = 0;
 
@@ -390,7 +566,7 @@ get_async_data_handler(void *key,
         size = ntohl(size);
     }
 
-    if (offset && (req->skipped + dlen) < offset) {
+    if (offset && !req->copied && (req->skipped + dlen) < offset) {
         req->skipped += dlen;
         return 0;
     }
@@ -408,21 +584,18 @@ get_async_data_handler(void *key,
 
         fbuf_add_binary(&output, (void *)&clen, sizeof(clen));
 
-        if (req->fetch_shash)
-            sip_hash_update(req->fetch_shash, (void *)&clen, sizeof(clen));
+        response_digest_update(req, (void *)&clen, sizeof(clen));
 
         if (accumulated_size) {
             int copied = fbuf_concat(&output, &req->fetch_accumulator);
-            if (req->fetch_shash)
-                sip_hash_update(req->fetch_shash, fbuf_data(&req->fetch_accumulator), copied);
+            response_digest_update(req, fbuf_data(&req->fetch_accumulator), copied);
             copy_size -= copied;
             accumulated_size -= copied;
             fbuf_remove(&req->fetch_accumulator, copied);
         }
         if (dlen - data_offset >= copy_size) {
             fbuf_add_binary(&output, data + data_offset, copy_size);
-            if (req->fetch_shash)
-                sip_hash_update(req->fetch_shash, data + data_offset, copy_size);
+            response_digest_update(req, data + data_offset, copy_size);
             data_offset += copy_size;
             req->copied += copy_size;
         }
@@ -461,11 +634,10 @@ get_async_data_handler(void *key,
             // flush what we have left in the accumulator
             uint16_t clen = htons(accumulated_size);
             fbuf_add_binary(&output, (void *)&clen, sizeof(clen));
-            if (req->fetch_shash)
-                sip_hash_update(req->fetch_shash, (void *)&clen, sizeof(clen));
+            response_digest_update(req, (void *)&clen, sizeof(clen));
             int copied = fbuf_concat(&output, &req->fetch_accumulator);
+            response_digest_update(req, fbuf_data(&req->fetch_accumulator), copied);
             if (req->fetch_shash) {
-                sip_hash_update(req->fetch_shash, fbuf_data(&req->fetch_accumulator), copied);
                 if (req->sig_hdr&0x01) {
                     uint64_t digest;
                     if (!sip_hash_final_integer(req->fetch_shash, &digest)) {
@@ -495,6 +667,170 @@ get_async_data_handler(void *key,
     return 0;
 }
 
+static void
+response_iov_add(shardcache_request_t *req, void *data, size_t len)
+{
+    // framing bytes (data == NULL) are consecutive in the framing buffer,
+    // the actual pointers are set once the buffer won't be reallocated anymore
+    if (!data && req->iovcnt && !req->iov[req->iovcnt-1].iov_base) {
+        req->iov[req->iovcnt-1].iov_len += len;
+        return;
+    }
+    req->iov = realloc(req->iov, sizeof(struct iovec) * (req->iovcnt + 1));
+    req->iov[req->iovcnt].iov_base = data;
+    req->iov[req->iovcnt].iov_len = len;
+    req->iovcnt++;
+}
+
+static void
+response_add_framing(shardcache_request_t *req, void *data, size_t len)
+{
+    fbuf_add_binary(&req->framing, data, len);
+    response_iov_add(req, NULL, len);
+}
+
+static int
+response_add_digest(shardcache_request_t *req, sip_hash *shash)
+{
+    uint64_t digest;
+    if (!sip_hash_final_integer(shash, &digest)) {
+        SHC_ERROR("Can't compute the siphash digest!\n");
+        return -1;
+    }
+    response_add_framing(req, (void *)&digest, sizeof(digest));
+    return 0;
+}
+
+/*
+ * Prepares a GET response referencing the value held by the (retained)
+ * resource instead of copying it into the output buffer.
+ * The response is then written by shardcache_output_handler() using writev()
+ */
+static int
+send_resource_response(shardcache_request_t *req, shardcache_resource_t *resource)
+{
+    static size_t max_chunk_size = (1<<16)-1;
+    char *auth = (char *)req->ctx->serv->cache->auth;
+    int checksum = SHC_HDR_IS_CHECKSUM(req->sig_hdr);
+    uint32_t magic = htonl(checksum ? SHC_MAGIC_V2 : SHC_MAGIC);
+    unsigned char hdr = SHC_HDR_RESPONSE;
+    sip_hash *shash = NULL;
+    uint32_t crc = 0;
+    int csig = 0;
+
+    response_add_framing(req, (void *)&magic, sizeof(magic));
+
+    if (checksum) {
+        unsigned char hdr_sig = SHC_HDR_CHECKSUM_CRC32C;
+        response_add_framing(req, (void *)&hdr_sig, 1);
+    } else if (auth) {
+        shash = sip_hash_new((uint8_t *)req->ctx->serv->cache->auth, 2, 4);
+        csig = (req->sig_hdr&0x01);
+        response_add_framing(req, (void *)&req->sig_hdr, 1);
+    }
+
+    response_add_framing(req, (void *)&hdr, 1);
+
+    if (checksum) {
+        crc = crc32c(0, &hdr, 1);
+    } else if (shash) {
+        sip_hash_update(shash, (uint8_t *)&hdr, 1);
+        if (csig && response_add_digest(req, shash) != 0)
+            goto error;
+    }
+
+    size_t dlen = 0;
+    char *data = (char *)shardcache_resource_data(resource, &dlen);
+    size_t offset = 0;
+    while (offset < dlen) {
+        size_t chunk_size = MIN(dlen - offset, max_chunk_size);
+        uint16_t clen = htons((uint16_t)chunk_size);
+        response_add_framing(req, (void *)&clen, sizeof(clen));
+        response_iov_add(req, data + offset, chunk_size);
+        if (checksum) {
+            crc = crc32c(crc, &clen, sizeof(clen));
+            crc = crc32c(crc, data + offset, chunk_size);
+        } else if (shash) {
+            sip_hash_update(shash, (void *)&clen, sizeof(clen));
+            sip_hash_update(shash, (uint8_t *)data + offset, chunk_size);
+            if (csig && response_add_digest(req, shash) != 0)
+                goto error;
+        }
+        offset += chunk_size;
+    }
+
+    uint16_t eor = 0;
+    char eom = 0;
+    response_add_framing(req, (void *)&eor, sizeof(eor));
+    response_add_framing(req, &eom, 1);
+    if (checksum) {
+        crc = crc32c(crc, &eor, sizeof(eor));
+        crc = crc32c(crc, &eom, 1);
+        fbuf_t trailer = FBUF_STATIC_INITIALIZER;
+        build_message_trailer(crc, &trailer);
+        response_add_framing(req, fbuf_data(&trailer), fbuf_used(&trailer));
+        fbuf_destroy(&trailer);
+    } else if (shash) {
+        sip_hash_update(shash, (void *)&eor, sizeof(eor));
+        sip_hash_update(shash, (uint8_t *)&eom, 1);
+        if (response_add_digest(req, shash) != 0)
+            goto error;
+        sip_hash_free(shash);
+    }
+
+    char *framing = fbuf_data(&req->framing);
+    int i;
+    for (i = 0; i < req->iovcnt; i++) {
+        if (!req->iov[i].iov_base) {
+            req->iov[i].iov_base = framing;
+            framing += req->iov[i].iov_len;
+        }
+    }
+
+    req->resource = resource;
+    ATOMIC_INCREMENT(req->done);
+    return 0;
+
+error:
+    if (shash)
+        sip_hash_free(shash);
+    free(req->iov);
+    req->iov = NULL;
+    req->iovcnt = 0;
+    fbuf_clear(&req->framing);
+    return -1;
+}
+
+// returns 1 if the whole response has been written, 0 if the socket is not
+// writable at the moment and -1 in case of errors
+static int
+write_resource_response(int fd, shardcache_request_t *req)
+{
+    while (req->iov_index < req->iovcnt) {
+        int cnt = MIN(req->iovcnt - req->iov_index, IOV_MAX);
+        ssize_t wb = writev(fd, &req->iov[req->iov_index], cnt);
+        if (wb == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        while (wb > 0) {
+            struct iovec *iov = &req->iov[req->iov_index];
+            if ((size_t)wb >= iov->iov_len) {
+                wb -= iov->iov_len;
+                req->iov_index++;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + wb;
+                iov->iov_len -= wb;
+                wb = 0;
+            }
+        }
+    }
+    return 1;
+}
+
 static int
 get_async_data(shardcache_t *cache,
                void *key,
@@ -526,6 +862,23 @@ get_async_data(shardcache_t *cache,
     return rc;
 }
 
+// resumes a request paused by get_async_data_handler() because the client
+// was too slow, the value is fetched again and the part already sent skipped
+static void
+resume_async_data(shardcache_request_t *req)
+{
+    shardcache_t *cache = req->ctx->serv->cache;
+    void *key = fbuf_data(&req->records[0]);
+    size_t klen = fbuf_used(&req->records[0]);
+
+    req->discard = req->skipped + req->copied;
+    ATOMIC_SET(req->paused, 0);
+    if (shardcache_get_async(cache, key, klen, get_async_data_handler, req) != 0) {
+        SHC_ERROR("Can't resume the paused request");
+        ATOMIC_INCREMENT(req->error);
+    }
+}
+
 static void
 shardcache_async_command_response(void *key, size_t klen, int ret, void *priv)
 {
@@ -538,6 +891,191 @@ shardcache_async_command_response(void *key, size_t klen, int ret, void *priv)
                              : WRITE_STATUS_MODE_SIMPLE);
 }
 
+/*
+ * GET_MULTI/SET_MULTI requests are split in one command per item which
+ * are all issued at once (so that items owned by different peers are
+ * fetched/stored in parallel). The response is built and sent by whichever
+ * command completes last.
+ */
+typedef struct _shardcache_multi_request_s shardcache_multi_request_t;
+
+typedef struct {
+    shardcache_multi_request_t *mreq;
+    fbuf_t value;
+    int status;
+    int done;
+} shardcache_multi_item_t;
+
+struct _shardcache_multi_request_s {
+    shardcache_request_t *req;
+    shardcache_record_t *fields;
+    int num_items;
+    int pending;
+    shardcache_multi_item_t *items;
+};
+
+static void
+multi_request_complete(shardcache_multi_request_t *mreq)
+{
+    shardcache_request_t *req = mreq->req;
+    fbuf_t out = FBUF_STATIC_INITIALIZER_PARAMS(FBUF_MAXLEN_NONE, 64, 1024, 512);
+    int rc;
+    int i;
+
+    if (req->hdr == SHC_HDR_GET_MULTI) {
+        shardcache_record_t *records = calloc(mreq->num_items, sizeof(shardcache_record_t));
+        for (i = 0; i < mreq->num_items; i++) {
+            records[i].v = fbuf_data(&mreq->items[i].value);
+            records[i].l = fbuf_used(&mreq->items[i].value);
+        }
+        rc = build_message((char *)req->ctx->serv->cache->auth,
+                           req->sig_hdr,
+                           SHC_HDR_RESPONSE,
+                           records, mreq->num_items, &out);
+        free(records);
+    } else {
+        char *results = malloc(mreq->num_items);
+        for (i = 0; i < mreq->num_items; i++)
+            results[i] = (mreq->items[i].status == 0) ? SHC_RES_OK : SHC_RES_ERR;
+        shardcache_record_t record = {
+            .v = results,
+            .l = mreq->num_items
+        };
+        rc = build_message((char *)req->ctx->serv->cache->auth,
+                           req->sig_hdr,
+                           SHC_HDR_RESPONSE,
+                           &record, 1, &out);
+        free(results);
+    }
+
+    if (rc == 0) {
+        send_data(req, &out);
+        ATOMIC_INCREMENT(req->done);
+    } else {
+        SHC_ERROR("Can't build the response for a multi-item request");
+        write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+    }
+    fbuf_destroy(&out);
+
+    for (i = 0; i < mreq->num_items; i++)
+        fbuf_destroy(&mreq->items[i].value);
+    free(mreq->items);
+    free(mreq->fields);
+    free(mreq);
+}
+
+static inline void
+multi_request_release(shardcache_multi_request_t *mreq)
+{
+    if (ATOMIC_DECREASE(mreq->pending, 1) == 0)
+        multi_request_complete(mreq);
+}
+
+static int
+get_multi_item_handler(void *key,
+                       size_t klen,
+                       void *data,
+                       size_t dlen,
+                       size_t total_size,
+                       struct timeval *timestamp,
+                       void *priv)
+{
+    shardcache_multi_item_t *item = (shardcache_multi_item_t *)priv;
+
+    if (item->done)
+        return -1;
+
+    if (dlen)
+        fbuf_add_binary(&item->value, data, dlen);
+
+    if (dlen == 0 && total_size == 0) {
+        // no timestamp means there was an error, we can't tell it apart
+        // from an empty value in the response anyway so we drop what we
+        // might have received so far
+        if (!timestamp)
+            fbuf_clear(&item->value);
+        item->done = 1;
+        multi_request_release(item->mreq);
+        return !timestamp ? -1 : 0;
+    }
+
+    if (total_size > 0 && timestamp) {
+        item->done = 1;
+        multi_request_release(item->mreq);
+    }
+
+    return 0;
+}
+
+static void
+set_multi_item_handler(void *key, size_t klen, int ret, void *priv)
+{
+    shardcache_multi_item_t *item = (shardcache_multi_item_t *)priv;
+    item->status = ret;
+    item->done = 1;
+    multi_request_release(item->mreq);
+}
+
+static int
+process_multi_request(shardcache_t *cache, shardcache_request_t *req)
+{
+    shardcache_record_t *fields = NULL;
+    int num_fields = unpack_multi_record(fbuf_data(&req->records[0]),
+                                         fbuf_used(&req->records[0]),
+                                         &fields);
+
+    int fields_per_item = (req->hdr == SHC_HDR_SET_MULTI) ? 2 : 1;
+    if (num_fields <= 0 || num_fields % fields_per_item != 0) {
+        free(fields);
+        return -1;
+    }
+
+    uint32_t expire = 0;
+    if (req->hdr == SHC_HDR_SET_MULTI && fbuf_used(&req->records[1]) == 4) {
+        memcpy(&expire, fbuf_data(&req->records[1]), sizeof(uint32_t));
+        expire = ntohl(expire);
+    }
+
+    shardcache_multi_request_t *mreq = calloc(1, sizeof(shardcache_multi_request_t));
+    mreq->req = req;
+    mreq->fields = fields;
+    mreq->num_items = num_fields / fields_per_item;
+    mreq->items = calloc(mreq->num_items, sizeof(shardcache_multi_item_t));
+    // the extra reference is held until all the commands have been issued,
+    // so that the response can't be sent while we are still looping
+    mreq->pending = mreq->num_items + 1;
+
+    int i;
+    for (i = 0; i < mreq->num_items; i++) {
+        shardcache_multi_item_t *item = &mreq->items[i];
+        shardcache_record_t *key = &fields[i * fields_per_item];
+        int rc;
+
+        item->mreq = mreq;
+        fbuf_minlen(&item->value, 64);
+        fbuf_fastgrowsize(&item->value, 1024);
+        fbuf_slowgrowsize(&item->value, 512);
+
+        if (req->hdr == SHC_HDR_GET_MULTI) {
+            rc = shardcache_get_async(cache, key->v, key->l, get_multi_item_handler, item);
+        } else {
+            shardcache_record_t *value = &fields[i * fields_per_item + 1];
+            rc = shardcache_set_async(cache, key->v, key->l, value->v, value->l,
+                                      expire, 0, set_multi_item_handler, item);
+        }
+
+        if (rc != 0 && !item->done) {
+            // the callback won't be called for this item
+            item->status = -1;
+            item->done = 1;
+            multi_request_release(mreq);
+        }
+    }
+
+    multi_request_release(mreq);
+    return 0;
+}
+
 static void
 process_request(shardcache_request_t *req)
 {
@@ -567,6 +1105,17 @@ process_request(shardcache_request_t *req)
                 }
             }
 
+            if (req->hdr != SHC_HDR_GET_OFFSET) {
+                // if the value is already in the cache there is no need
+                // to copy it, the response will be written from the cached object
+                shardcache_resource_t *resource = shardcache_get_cached_resource(cache, key, klen);
+                if (resource) {
+                    if (send_resource_response(req, resource) == 0)
+                        break;
+                    shardcache_resource_release(resource);
+                }
+            }
+
             get_async_data(cache, key, klen, get_async_data_handler, req);
             break;
         }
@@ -587,6 +1136,16 @@ process_request(shardcache_request_t *req)
                                  req);
             break;
         }
+        case SHC_HDR_GET_MULTI:
+        case SHC_HDR_SET_MULTI:
+        {
+            if (process_multi_request(cache, req) != 0) {
+                SHC_WARNING("Bad record (0) format for message %s",
+                            req->hdr == SHC_HDR_GET_MULTI ? "GET_MULTI" : "SET_MULTI");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+            }
+            break;
+        }
         case SHC_HDR_EXISTS:
         {
             shardcache_exists_async(cache, key, klen, shardcache_async_command_response, req);
@@ -609,6 +1168,23 @@ process_request(shardcache_request_t *req)
             write_status(req, 0, WRITE_STATUS_MODE_SIMPLE);
             break;
         }
+        case SHC_HDR_EVICT_MULTI:
+        {
+            shardcache_record_t *keys = NULL;
+            int num_keys = unpack_multi_record(key, klen, &keys);
+            if (num_keys <= 0) {
+                SHC_WARNING("Bad record (0) format for message EVICT_MULTI");
+                write_status(req, -1, WRITE_STATUS_MODE_SIMPLE);
+                free(keys);
+                break;
+            }
+            int i;
+            for (i = 0; i < num_keys; i++)
+                shardcache_evict(cache, keys[i].v, keys[i].l);
+            free(keys);
+            write_status(req, 0, WRITE_STATUS_MODE_SIMPLE);
+            break;
+        }
         case SHC_HDR_MIGRATION_BEGIN:
         {
             int num_shards = 0;
@@ -809,16 +1385,80 @@ process_request(shardcache_request_t *req)
 
 static void * worker(void *priv);
 
+typedef struct {
+    shardcache_worker_context_t *selected;
+    uint64_t load;  // the load of the selected worker
+    int start;      // the index from which the ties are broken
+    int distance;   // the distance of the selected worker from start
+    int num_workers;
+} shardcache_select_worker_arg_t;
+
+static inline uint64_t
+shardcache_worker_load(shardcache_worker_context_t *wrk)
+{
+    // a request being served weighs more than an idle (persistent) connection
+    return ATOMIC_READ(wrk->stats->num_connections) +
+           ATOMIC_READ(wrk->stats->num_requests) * SHARDCACHE_WORKER_REQUEST_LOAD;
+}
+
+static int
+shardcache_select_worker_helper(void *item, size_t idx, void *user)
+{
+    shardcache_worker_context_t *wrk = (shardcache_worker_context_t *)item;
+    shardcache_select_worker_arg_t *arg = (shardcache_select_worker_arg_t *)user;
+
+    uint64_t load = shardcache_worker_load(wrk);
+    int distance = (idx + arg->num_workers - arg->start) % arg->num_workers;
+    if (!arg->selected || load < arg->load ||
+        (load == arg->load && distance < arg->distance))
+    {
+        arg->selected = wrk;
+        arg->load = load;
+        arg->distance = distance;
+    }
+    return 1;
+}
+
+// selects the least loaded worker, workers equally loaded
+// are selected in turn (as a plain round-robin would do)
 static shardcache_worker_context_t *
 shardcache_select_worker(shardcache_serving_t *serv)
 {
     if (ATOMIC_READ(serv->leave))
         return NULL;
 
-    shardcache_worker_context_t *wrk = list_pick_value(serv->workers,
-            __sync_fetch_and_add(&serv->next_worker_index, 1)%list_count(serv->workers));
+    int num_workers = list_count(serv->workers);
+    if (!num_workers)
+        return NULL;
+
+    shardcache_select_worker_arg_t arg = {
+        .selected = NULL,
+        .load = 0,
+        .start = __sync_fetch_and_add(&serv->next_worker_index, 1) % num_workers,
+        .distance = 0,
+        .num_workers = num_workers
+    };
+    list_foreach_value(serv->workers, shardcache_select_worker_helper, &arg);
 
-    return wrk;
+    return arg.selected;
+}
+
+// queues the connection to the least loaded worker,
+// returns -1 if no worker could take the connection
+static int
+shardcache_assign_worker(shardcache_serving_t *serv, shardcache_connection_context_t *ctx)
+{
+    int rc = -1;
+    MUTEX_LOCK(serv->select_lock);
+    shardcache_worker_context_t *wrkctx = shardcache_select_worker(serv);
+    shardcache_connection_context_set_worker(ctx, wrkctx);
+    if (wrkctx && queue_push_right(wrkctx->jobs, ctx) == 0) {
+        // the worker might be sleeping if it has no connections
+        CONDITION_SIGNAL(wrkctx->wakeup_cond, wrkctx->wakeup_lock);
+        rc = 0;
+    }
+    MUTEX_UNLOCK(serv->select_lock);
+    return rc;
 }
 
 shardcache_request_t *
@@ -842,6 +1482,7 @@ shardcache_request_create(shardcache_connection_context_t *ctx)
 
     FBUF_STATIC_INITIALIZER_POINTER(&req->fetch_accumulator, FBUF_MAXLEN_NONE, 64, 1024, 512);
     FBUF_STATIC_INITIALIZER_POINTER(&req->output, FBUF_MAXLEN_NONE, 64, 1024, 512);
+    FBUF_STATIC_INITIALIZER_POINTER(&req->framing, FBUF_MAXLEN_NONE, 64, 1024, 512);
 
     return req;
 }
@@ -858,10 +1499,10 @@ shardcache_check_context_state(iomux_t *iomux,
         // create a new request
         ctx->retries = 0;
         shardcache_request_t *req = shardcache_request_create(ctx);
-        TAILQ_INSERT_TAIL(&ctx->requests, req, next);
-        ctx->num_requests++;
+        shardcache_connection_context_add_request(ctx, req);
         process_request(req);
         iomux_set_output_callback(iomux, fd, shardcache_output_handler);
+        ctx->writing = 1;
     }
     else if (UNLIKELY(state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR))
     {
@@ -900,6 +1541,35 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             return IOMUX_OUTPUT_MODE_NONE;
         }
 
+        if (req->iov) {
+            // NOTE: the iomux calls the output callback only once the data
+            //       previously returned has been completely written, so
+            //       writing directly to the socket here preserves the order
+            int rc = write_resource_response(fd, req);
+            if (rc == 0) {
+                // the socket is not writable, hand the rest of the current
+                // segment to the iomux (without copying it, the resource is
+                // retained by the request) so that it will be written, and
+                // we will be called again, once the socket is writable
+                struct iovec *iov = &req->iov[req->iov_index];
+                size_t wlen = MIN(iov->iov_len, (size_t)INT_MAX);
+                *out = (unsigned char *)iov->iov_base;
+                *len = wlen;
+                iov->iov_base = (char *)iov->iov_base + wlen;
+                iov->iov_len -= wlen;
+                if (!iov->iov_len)
+                    req->iov_index++;
+                return IOMUX_OUTPUT_MODE_NONE;
+            }
+            if (rc == -1) {
+                if (!iomux_close(iomux, fd)) {
+                    close(fd);
+                    shardcache_connection_context_destroy(ctx);
+                }
+                return IOMUX_OUTPUT_MODE_NONE;
+            }
+        }
+
         int done = ATOMIC_READ(req->done);
 
         SPIN_LOCK(req->output_lock);
@@ -907,9 +1577,11 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
             *len = fbuf_detach(&req->output, (char **)out, NULL);
         SPIN_UNLOCK(req->output_lock);
 
-        if (done) {
-            TAILQ_REMOVE(&ctx->requests, req, next);
-            ctx->num_requests--;
+        if (!done && !*len && ATOMIC_READ(req->paused)) {
+            // the client got everything we had for it, keep reading the value
+            resume_async_data(req);
+        } else if (done) {
+            shardcache_connection_context_remove_request(ctx, req);
             shardcache_request_destroy(req);
             // if we have pending input data this is time
             // to process it and move to the next request
@@ -921,6 +1593,7 @@ shardcache_output_handler(iomux_t *iomux, int fd, unsigned char **out, int *len,
         }
     } else {
         iomux_unset_output_callback(iomux, fd);
+        ctx->writing = 0;
     }
     return IOMUX_OUTPUT_MODE_FREE;
 }
@@ -966,6 +1639,7 @@ shardcache_eof_handler(iomux_t *iomux, int fd, void *priv)
     close(fd);
 
     if (ctx) {
+        shardcache_connection_context_detach(ctx);
         if (TAILQ_FIRST(&ctx->requests) != NULL) {
             ctx->closed = 1;
             gettimeofday(&ctx->in_prune_since, NULL);
@@ -983,25 +1657,281 @@ shardcache_connection_handler(iomux_t *iomux, int fd, void *priv)
     shardcache_serving_t *serv = (shardcache_serving_t *)priv;
 
     if (!ATOMIC_READ(serv->leave)) {
-        shardcache_worker_context_t *wrkctx = shardcache_select_worker(serv);
-        if (wrkctx) {
-            shardcache_connection_context_t *ctx =
-                shardcache_connection_context_create(serv, fd);
+        shardcache_connection_context_t *ctx =
+            shardcache_connection_context_create(serv, fd);
 
-            ctx->worker = wrkctx;
-            if (queue_push_right(wrkctx->jobs, ctx) != 0) {
-                close(fd);
-                SHC_WARNING("Can't push the new job to the worker queue");
-                return;
-            }
-        } else {
+        if (shardcache_assign_worker(serv, ctx) != 0) {
             close(fd);
+            shardcache_connection_context_destroy(ctx);
             SHC_WARNING("Can't find any usable worker to handle the new connection");
         }
+    } else {
+        close(fd);
     }
 }
 
 
+// Hand over the connections of a retiring worker to the workers still in the pool.
+// Connections waiting in the jobs queue can always be moved, while connections
+// already in the iomux are moved only when idle (no pending requests and no
+// pending output) so that nothing buffered in the iomux gets lost.
+// Returns the number of connections still owned by the worker
+static int
+shardcache_worker_handover(shardcache_worker_context_t *wrkctx)
+{
+    shardcache_serving_t *serv = wrkctx->serv;
+
+    shardcache_connection_context_t *ctx = queue_pop_left(wrkctx->jobs);
+    while (ctx) {
+        if (shardcache_assign_worker(serv, ctx) != 0) {
+            close(ctx->fd);
+            shardcache_connection_context_destroy(ctx);
+        }
+        ctx = queue_pop_left(wrkctx->jobs);
+    }
+
+    int count = 0;
+    shardcache_connection_context_t *next = NULL;
+    for (ctx = TAILQ_FIRST(&wrkctx->connections); ctx; ctx = next) {
+        next = TAILQ_NEXT(ctx, wnext);
+        if (ctx->writing || TAILQ_FIRST(&ctx->requests) != NULL ||
+            async_read_context_state(ctx->reader_ctx) != SHC_STATE_READING_NONE)
+        {
+            count++;
+            continue;
+        }
+
+        if (ATOMIC_READ(serv->leave) || list_count(serv->workers) == 0) {
+            count++;
+            continue;
+        }
+        shardcache_connection_context_detach(ctx);
+        iomux_remove(wrkctx->iomux, ctx->fd);
+        if (shardcache_assign_worker(serv, ctx) != 0) {
+            close(ctx->fd);
+            shardcache_connection_context_destroy(ctx);
+        }
+    }
+
+    return count + list_count(wrkctx->prune);
+}
+
+// closes the connections of a retiring worker which didn't become idle in time
+// (the requests still being served are then released by the prune list)
+static void
+shardcache_worker_close_busy_connections(shardcache_worker_context_t *wrkctx)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (!TAILQ_FIRST(&wrkctx->connections) || timercmp(&now, &wrkctx->retire_deadline, <))
+        return;
+
+    shardcache_connection_context_t *ctx = NULL;
+    shardcache_connection_context_t *next = NULL;
+    for (ctx = TAILQ_FIRST(&wrkctx->connections); ctx; ctx = next) {
+        next = TAILQ_NEXT(ctx, wnext);
+        SHC_WARNING("Closing busy connection %d of retiring worker %d", ctx->fd, wrkctx->index);
+        // the eof handler detaches (and eventually destroys) the context
+        iomux_close(wrkctx->iomux, ctx->fd);
+    }
+}
+
+// adds a connection assigned to the worker to its iomux
+// (must be called by the worker thread)
+static void
+shardcache_worker_attach(shardcache_worker_context_t *wrkctx, shardcache_connection_context_t *ctx)
+{
+    iomux_callbacks_t connection_callbacks = {
+        .mux_connection = NULL,
+        .mux_input = shardcache_input_handler,
+        .mux_output = NULL,
+        .mux_eof = shardcache_eof_handler,
+        .priv = ctx
+    };
+    if (!iomux_add(wrkctx->iomux, ctx->fd, &connection_callbacks)) {
+        close(ctx->fd);
+        shardcache_connection_context_destroy(ctx);
+    } else {
+        TAILQ_INSERT_TAIL(&wrkctx->connections, ctx, wnext);
+        ctx->attached = 1;
+        // a connection handed over by a retiring worker
+        // might have some pipelined input still to process
+        int state = async_read_context_update(ctx->reader_ctx);
+        if (shardcache_check_context_state(wrkctx->iomux, ctx->fd, ctx, state) != 0)
+            iomux_close(wrkctx->iomux, ctx->fd);
+    }
+}
+
+// connections accepted on the worker's own listening socket
+// are served directly by the worker (no handoff through the jobs queue)
+static void
+shardcache_worker_connection_handler(iomux_t *iomux, int fd, void *priv)
+{
+    shardcache_worker_context_t *wrkctx = (shardcache_worker_context_t *)priv;
+
+    if (ATOMIC_READ(wrkctx->serv->leave) || ATOMIC_READ(wrkctx->retire)) {
+        close(fd);
+        return;
+    }
+
+    shardcache_connection_context_t *ctx =
+        shardcache_connection_context_create(wrkctx->serv, fd);
+    shardcache_connection_context_set_worker(ctx, wrkctx);
+    shardcache_worker_attach(wrkctx, ctx);
+}
+
+/*
+ * The listening sockets are opened (and bound) by the thread changing the
+ * configuration, but they are added to (or removed from) the mux only by the
+ * thread owning it: the requests are queued as shardcache_listen_job_t
+ * and applied by the worker (or by the listener thread for the shared socket).
+ * Since the sockets are opened with SO_REUSEPORT, the new ones are already
+ * accepting connections before the old ones are closed.
+ */
+typedef struct {
+    int fd; // the socket to listen on, -1 to stop listening
+} shardcache_listen_job_t;
+
+static void
+shardcache_queue_listen_job(queue_t *jobs, int fd)
+{
+    shardcache_listen_job_t *job = malloc(sizeof(shardcache_listen_job_t));
+    job->fd = fd;
+    queue_push_right(jobs, job);
+}
+
+// closes the sockets of the requests which won't be applied
+static void
+shardcache_clear_listen_jobs(queue_t *jobs)
+{
+    shardcache_listen_job_t *job = queue_pop_left(jobs);
+    while (job) {
+        if (job->fd >= 0)
+            close(job->fd);
+        free(job);
+        job = queue_pop_left(jobs);
+    }
+}
+
+// accepts the connections already waiting in the backlog of a listening
+// socket which is going to be closed (they would be reset otherwise)
+static void
+shardcache_drain_listener(int listener, iomux_t *iomux, iomux_connection_callback_t cb, void *priv)
+{
+    int flags = fcntl(listener, F_GETFL, 0);
+    if (flags == -1 || fcntl(listener, F_SETFL, flags | O_NONBLOCK) == -1)
+        return;
+
+    int fd = accept(listener, NULL, NULL);
+    while (fd >= 0) {
+        cb(iomux, fd, priv);
+        fd = accept(listener, NULL, NULL);
+    }
+}
+
+// opens the listening socket of the worker and asks the worker to use it
+// (must be called holding the workers_lock)
+static int
+shardcache_worker_listen(shardcache_worker_context_t *wrkctx)
+{
+    shardcache_serving_t *serv = wrkctx->serv;
+
+    if (wrkctx->listening)
+        return 0;
+
+    int fd = open_reuseport_socket(serv->listen_host, serv->listen_port);
+    if (fd == -1) {
+        SHC_ERROR("Can't open the listening socket for worker %d: %s",
+                  wrkctx->index, strerror(errno));
+        return -1;
+    }
+
+    shardcache_queue_listen_job(wrkctx->listen_jobs, fd);
+    wrkctx->listening = 1;
+
+    // the worker might be sleeping if it has no connections
+    CONDITION_SIGNAL(wrkctx->wakeup_cond, wrkctx->wakeup_lock);
+    return 0;
+}
+
+// asks the worker to stop listening on its own socket
+// (must be called holding the workers_lock)
+static void
+shardcache_worker_unlisten(shardcache_worker_context_t *wrkctx)
+{
+    if (!wrkctx->listening)
+        return;
+
+    shardcache_queue_listen_job(wrkctx->listen_jobs, -1);
+    wrkctx->listening = 0;
+
+    CONDITION_SIGNAL(wrkctx->wakeup_cond, wrkctx->wakeup_lock);
+}
+
+// connections still in the backlog of the worker's socket when it stops
+// listening are served by the worker itself (or handed over if retiring)
+static void
+shardcache_worker_drained_connection_handler(iomux_t *iomux, int fd, void *priv)
+{
+    shardcache_worker_context_t *wrkctx = (shardcache_worker_context_t *)priv;
+
+    if (ATOMIC_READ(wrkctx->serv->leave)) {
+        close(fd);
+        return;
+    }
+
+    shardcache_connection_context_t *ctx =
+        shardcache_connection_context_create(wrkctx->serv, fd);
+    shardcache_connection_context_set_worker(ctx, wrkctx);
+    shardcache_worker_attach(wrkctx, ctx);
+}
+
+static void
+shardcache_worker_close_listener(shardcache_worker_context_t *wrkctx)
+{
+    if (wrkctx->listener < 0)
+        return;
+
+    iomux_remove(wrkctx->iomux, wrkctx->listener);
+    shardcache_drain_listener(wrkctx->listener, wrkctx->iomux,
+                              shardcache_worker_drained_connection_handler, wrkctx);
+    close(wrkctx->listener);
+    wrkctx->listener = -1;
+}
+
+// applies the changes to the listening socket requested to the worker
+// (must be called by the worker thread)
+static void
+shardcache_worker_update_listener(shardcache_worker_context_t *wrkctx)
+{
+    shardcache_listen_job_t *job = queue_pop_left(wrkctx->listen_jobs);
+    while (job) {
+        shardcache_worker_close_listener(wrkctx);
+
+        if (job->fd >= 0) {
+            iomux_callbacks_t listener_callbacks = {
+                .mux_connection = shardcache_worker_connection_handler,
+                .mux_input = NULL,
+                .mux_eof = NULL,
+                .mux_output = NULL,
+                .mux_timeout = NULL,
+                .priv = wrkctx
+            };
+
+            if (iomux_add(wrkctx->iomux, job->fd, &listener_callbacks)) {
+                iomux_listen(wrkctx->iomux, job->fd);
+                wrkctx->listener = job->fd;
+            } else {
+                SHC_ERROR("Can't add the listening socket to the mux of worker %d", wrkctx->index);
+                close(job->fd);
+            }
+        }
+
+        free(job);
+        job = queue_pop_left(wrkctx->listen_jobs);
+    }
+}
+
 static void *
 worker(void *priv)
 {
@@ -1011,19 +1941,20 @@ worker(void *priv)
     shardcache_thread_init(wrkctx->serv->cache);
 
     while (ATOMIC_READ(wrkctx->leave) == 0) {
+        // NOTE: a retiring worker has been asked to stop listening before
+        //       being flagged, so the connections accepted by its socket
+        //       are handed over as well
+        shardcache_worker_update_listener(wrkctx);
+
+        if (UNLIKELY(ATOMIC_READ(wrkctx->retire))) {
+            if (shardcache_worker_handover(wrkctx) == 0 || ATOMIC_READ(wrkctx->serv->leave))
+                break;
+            shardcache_worker_close_busy_connections(wrkctx);
+        }
+
         shardcache_connection_context_t *ctx = queue_pop_left(jobs);
         while(ctx) {
-            iomux_callbacks_t connection_callbacks = {
-                .mux_connection = NULL,
-                .mux_input = shardcache_input_handler,
-                .mux_output = NULL,
-                .mux_eof = shardcache_eof_handler,
-                .priv = ctx
-            };
-            if (!iomux_add(wrkctx->iomux, ctx->fd, &connection_callbacks)) {
-                close(ctx->fd);
-                shardcache_connection_context_destroy(ctx);
-            }
+            shardcache_worker_attach(wrkctx, ctx);
             ctx = queue_pop_left(jobs);
         }
 
@@ -1039,9 +1970,10 @@ worker(void *priv)
             shardcache_request_t *req = TAILQ_FIRST(&to_prune->requests);
             int done = 0;
             if (req) {
-                if (ATOMIC_READ(req->done)) {
-                    // the request is served, we can destroy it
-                    TAILQ_REMOVE(&to_prune->requests, req, next);
+                if (ATOMIC_READ(req->done) || ATOMIC_READ(req->paused)) {
+                    // the request is served (or paused, so not referenced
+                    // by any fetch anymore), we can destroy it
+                    shardcache_connection_context_remove_request(to_prune, req);
                     shardcache_request_destroy(req);
                     done = (TAILQ_FIRST(&to_prune->requests) == NULL);
                 }
@@ -1058,7 +1990,7 @@ worker(void *priv)
             }
         }
 
-        ATOMIC_SET(wrkctx->numfds, iomux_num_fds(wrkctx->iomux));
+        ATOMIC_SET(wrkctx->stats->numfds, iomux_num_fds(wrkctx->iomux));
 
         if (iomux_isempty(wrkctx->iomux)) {
             // we don't have any filedescriptor to handle in the mux,
@@ -1082,21 +2014,31 @@ worker(void *priv)
     }
 
     shardcache_thread_end(wrkctx->serv->cache);
+    ATOMIC_INCREMENT(wrkctx->exited);
     return NULL;
 }
 
-void *
-serve_cache(void *priv)
+// opens the shared listening socket, with SO_REUSEPORT (if supported)
+// so that the workers' sockets can be bound before closing it
+static int
+shardcache_serving_open_socket(const char *host, int port)
 {
-    shardcache_serving_t *serv = (shardcache_serving_t *)priv;
-
-    SHC_NOTICE("Listening on %s (num_workers: %d)",
-               serv->cache->addr, serv->num_workers);
+    int fd = open_reuseport_socket(host, port);
+    if (fd == -1 && errno == ENOTSUP)
+        fd = open_socket(host, port);
+    return fd;
+}
 
-    if (listen(serv->sock, -1) != 0) {
+// adds the shared listening socket to the listener's mux
+// (must be called by the listener thread)
+static int
+shardcache_serving_add_listener(shardcache_serving_t *serv, int fd)
+{
+    if (listen(fd, -1) != 0) {
         SHC_ERROR("Error listening on fd %d: %s",
-                  serv->sock, strerror(errno));
-        return NULL;
+                  fd, strerror(errno));
+        close(fd);
+        return -1;
     }
 
     iomux_callbacks_t connection_callbacks = {
@@ -1108,21 +2050,327 @@ serve_cache(void *priv)
         .priv = serv
     };
 
-    if (!iomux_add(serv->io_mux, serv->sock, &connection_callbacks)) {
+    if (!iomux_add(serv->io_mux, fd, &connection_callbacks)) {
         SHC_ERROR("Can't add the listening socket to the mux");
-        return NULL;
+        close(fd);
+        return -1;
+    }
+    iomux_listen(serv->io_mux, fd);
+    serv->sock = fd;
+    return 0;
+}
+
+// must be called by the listener thread
+// (or once the listener thread has exited)
+static void
+shardcache_serving_close_listener(shardcache_serving_t *serv)
+{
+    if (serv->sock == -1)
+        return;
+
+    iomux_remove(serv->io_mux, serv->sock);
+    shardcache_drain_listener(serv->sock, serv->io_mux, shardcache_connection_handler, serv);
+    close(serv->sock);
+    serv->sock = -1;
+}
+
+// applies the changes to the shared listening socket
+// (must be called by the listener thread)
+static void
+shardcache_serving_update_listener(shardcache_serving_t *serv)
+{
+    shardcache_listen_job_t *job = queue_pop_left(serv->listen_jobs);
+    while (job) {
+        shardcache_serving_close_listener(serv);
+        if (job->fd >= 0)
+            shardcache_serving_add_listener(serv, job->fd);
+        free(job);
+        job = queue_pop_left(serv->listen_jobs);
     }
-    iomux_listen(serv->io_mux, serv->sock);
+}
+
+// opens the shared listening socket and asks the listener thread to use it
+// (must be called holding the workers_lock)
+static int
+shardcache_serving_listen(shardcache_serving_t *serv)
+{
+    int fd = shardcache_serving_open_socket(serv->listen_host, serv->listen_port);
+    if (fd == -1) {
+        SHC_ERROR("Can't open listening socket %s:%d : %s",
+                  serv->listen_host, serv->listen_port, strerror(errno));
+        return -1;
+    }
+    shardcache_queue_listen_job(serv->listen_jobs, fd);
+    return 0;
+}
+
+// asks the listener thread to stop accepting connections on the shared socket
+// (must be called holding the workers_lock)
+static void
+shardcache_serving_unlisten(shardcache_serving_t *serv)
+{
+    shardcache_queue_listen_job(serv->listen_jobs, -1);
+}
+
+static void shardcache_serving_collect_retired_workers(shardcache_serving_t *s);
+
+void *
+serve_cache(void *priv)
+{
+    shardcache_serving_t *serv = (shardcache_serving_t *)priv;
+
+    SHC_NOTICE("Listening on %s (num_workers: %d)",
+               serv->cache->addr, serv->num_workers);
+
+    // the socket has been opened by start_serving()
+    int fd = serv->sock;
+    serv->sock = -1;
+    if (shardcache_serving_add_listener(serv, fd) != 0)
+        return NULL;
 
     while (!ATOMIC_READ(serv->leave)) {
         int timeout = ATOMIC_READ(serv->cache->iomux_run_timeout_high);
         struct timeval tv = { timeout/1e6, timeout%(int)1e6 };
         iomux_run(serv->io_mux, &tv);
+        shardcache_serving_update_listener(serv);
+        // don't wait for a reconfiguration in progress, the workers
+        // will be collected at the next iteration
+        if (pthread_mutex_trylock(&serv->workers_lock) == 0) {
+            shardcache_serving_collect_retired_workers(serv);
+            MUTEX_UNLOCK(serv->workers_lock);
+        }
     }
 
     return NULL;
 }
 
+static shardcache_worker_context_t *
+shardcache_worker_create(shardcache_serving_t *s, int index)
+{
+    shardcache_t *cache = s->cache;
+    shardcache_worker_context_t *wrk = calloc(1, sizeof(shardcache_worker_context_t));
+    wrk->serv = s;
+    wrk->index = index;
+    wrk->jobs = queue_create();
+    queue_set_free_value_callback(wrk->jobs,
+            (queue_free_value_callback_t)shardcache_connection_context_destroy);
+    int rc = posix_memalign((void **)&wrk->stats, SHARDCACHE_CACHE_LINE_SIZE,
+                            sizeof(shardcache_worker_stats_t));
+    if (rc != 0) {
+        SHC_ERROR("Can't allocate the stats of the worker %d: %s", index, strerror(rc));
+        queue_destroy(wrk->jobs);
+        free(wrk);
+        return NULL;
+    }
+    memset(wrk->stats, 0, sizeof(shardcache_worker_stats_t));
+    wrk->prune = list_create();
+    list_set_free_value_callback(wrk->prune, (free_value_callback_t)shardcache_connection_context_destroy);
+    TAILQ_INIT(&wrk->connections);
+    wrk->listener = -1;
+    wrk->listen_jobs = queue_create();
+
+    char label[64];
+    snprintf(label, sizeof(label), "worker[%d].numfds", index);
+    shardcache_counter_add(cache->counters, label, &wrk->stats->numfds);
+    /*
+    snprintf(label, sizeof(label), "worker[%d].pruning", index);
+    shardcache_counter_add(cache->counters, label, &wrk->pruning);
+    */
+
+    MUTEX_INIT(wrk->wakeup_lock);
+    CONDITION_INIT(wrk->wakeup_cond);
+    wrk->iomux = iomux_create(1<<13, 0);
+    pthread_create(&wrk->thread, NULL, worker, wrk);
+    list_push_value(s->workers, wrk);
+    ATOMIC_INCREMENT(s->total_workers);
+    if (s->listen_per_worker)
+        shardcache_worker_listen(wrk);
+    return wrk;
+}
+
+static void
+shardcache_worker_destroy(shardcache_worker_context_t *wrk)
+{
+    // a retiring worker will exit by itself once all its connections
+    // have been handed over, don't force it to leave earlier
+    if (!ATOMIC_READ(wrk->retire))
+        ATOMIC_INCREMENT(wrk->leave);
+
+    // wake up the worker if slacking
+    CONDITION_SIGNAL(wrk->wakeup_cond, wrk->wakeup_lock);
+
+    pthread_join(wrk->thread, NULL);
+
+    // the worker is gone, nobody else is using its mux
+    // NOTE: a retiring worker stopped listening before exiting
+    if (wrk->listener >= 0) {
+        iomux_remove(wrk->iomux, wrk->listener);
+        close(wrk->listener);
+    }
+    shardcache_clear_listen_jobs(wrk->listen_jobs);
+    queue_destroy(wrk->listen_jobs);
+
+    queue_destroy(wrk->jobs);
+
+    MUTEX_DESTROY(wrk->wakeup_lock);
+    CONDITION_DESTROY(wrk->wakeup_cond);
+    SHC_DEBUG3("Worker thread %p exited", wrk);
+
+    shardcache_connection_context_t *ctx = list_shift_value(wrk->prune);
+    while (ctx) {
+        //ATOMIC_DECREMENT(wrk->pruning);
+        shardcache_request_t *req = TAILQ_FIRST(&ctx->requests);
+        while (req) {
+            shardcache_connection_context_remove_request(ctx, req);
+            shardcache_request_destroy(req);
+            req = TAILQ_FIRST(&ctx->requests);
+        }
+        shardcache_connection_context_destroy(ctx);
+        ctx = list_shift_value(wrk->prune);
+    }
+
+    // the counter of a retiring worker has been removed already,
+    // its index might be in use by a new worker
+    if (!ATOMIC_READ(wrk->retire)) {
+        char label[64];
+        snprintf(label, sizeof(label), "worker[%d].numfds", wrk->index);
+        shardcache_counter_remove(wrk->serv->cache->counters, label);
+    }
+    //snprintf(label, sizeof(label), "worker[%d].pruning", wrk->index);
+    //shardcache_counter_remove(wrk->serv->cache->counters, label);
+
+    iomux_destroy(wrk->iomux);
+
+    list_destroy(wrk->prune);
+
+    ATOMIC_DECREMENT(wrk->serv->total_workers);
+
+    free(wrk->stats);
+    free(wrk);
+}
+
+// collects the retiring workers which have exited
+// (must be called holding the workers_lock)
+static void
+shardcache_serving_collect_retired_workers(shardcache_serving_t *s)
+{
+    int count = list_count(s->retiring);
+    while (count--) {
+        shardcache_worker_context_t *wrk = list_shift_value(s->retiring);
+        if (ATOMIC_READ(wrk->exited))
+            shardcache_worker_destroy(wrk);
+        else
+            list_push_value(s->retiring, wrk);
+    }
+}
+
+int
+shardcache_serving_set_num_workers(shardcache_serving_t *s, int num_workers)
+{
+    if (num_workers < 0)
+        return -1;
+
+    if (num_workers == 0)
+        return list_count(s->workers);
+
+    MUTEX_LOCK(s->workers_lock);
+
+    shardcache_serving_collect_retired_workers(s);
+
+    int old_value = list_count(s->workers);
+
+    while (list_count(s->workers) < num_workers) {
+        if (!shardcache_worker_create(s, list_count(s->workers)))
+            break;
+    }
+
+    while (list_count(s->workers) > num_workers) {
+        // once out of the list the worker won't be selected
+        // anymore to handle new connections
+        MUTEX_LOCK(s->select_lock);
+        shardcache_worker_context_t *wrk = list_pop_value(s->workers);
+        MUTEX_UNLOCK(s->select_lock);
+        shardcache_worker_unlisten(wrk);
+
+        char label[64];
+        snprintf(label, sizeof(label), "worker[%d].numfds", wrk->index);
+        shardcache_counter_remove(s->cache->counters, label);
+
+        // the worker hands over its connections and exits by itself, it will
+        // be collected afterwards (without blocking the caller meanwhile)
+        gettimeofday(&wrk->retire_deadline, NULL);
+        wrk->retire_deadline.tv_sec += SHARDCACHE_WORKER_RETIRE_TIMEOUT;
+        ATOMIC_INCREMENT(wrk->retire);
+        CONDITION_SIGNAL(wrk->wakeup_cond, wrk->wakeup_lock);
+        list_push_value(s->retiring, wrk);
+    }
+
+    if (old_value != num_workers)
+        SHC_NOTICE("Number of workers changed from %d to %d", old_value, num_workers);
+
+    MUTEX_UNLOCK(s->workers_lock);
+    return old_value;
+}
+
+static int
+shardcache_serving_listen_worker_helper(void *item, size_t idx, void *user)
+{
+    shardcache_worker_context_t *wrk = (shardcache_worker_context_t *)item;
+    if (shardcache_worker_listen(wrk) != 0) {
+        *((int *)user) = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static int
+shardcache_serving_unlisten_worker_helper(void *item, size_t idx, void *user)
+{
+    shardcache_worker_unlisten((shardcache_worker_context_t *)item);
+    return 1;
+}
+
+int
+shardcache_serving_listen_per_worker(shardcache_serving_t *s, int new_value)
+{
+    if (new_value == -1)
+        return ATOMIC_READ(s->listen_per_worker);
+
+    new_value = !!new_value;
+
+    MUTEX_LOCK(s->workers_lock);
+
+    int old_value = s->listen_per_worker;
+    if (new_value == old_value || ATOMIC_READ(s->leave)) {
+        MUTEX_UNLOCK(s->workers_lock);
+        return old_value;
+    }
+
+    // the new sockets are bound (and listening) before the old ones are
+    // closed, so that no connection is refused while switching
+    int rc = 0;
+    if (new_value) {
+        list_foreach_value(s->workers, shardcache_serving_listen_worker_helper, &rc);
+        if (rc == 0)
+            shardcache_serving_unlisten(s);
+        else
+            list_foreach_value(s->workers, shardcache_serving_unlisten_worker_helper, NULL);
+    } else {
+        rc = shardcache_serving_listen(s);
+        if (rc == 0)
+            list_foreach_value(s->workers, shardcache_serving_unlisten_worker_helper, NULL);
+    }
+
+    if (rc == 0) {
+        ATOMIC_SET(s->listen_per_worker, new_value);
+        SHC_NOTICE("Connections are now accepted by %s",
+                   new_value ? "each worker on its own socket" : "the listener thread");
+    }
+
+    MUTEX_UNLOCK(s->workers_lock);
+    return rc == 0 ? old_value : -1;
+}
+
 shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
 {
     shardcache_serving_t *s = calloc(1, sizeof(shardcache_serving_t));
@@ -1136,7 +2384,7 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
     char *port_string = strtok_r(NULL, ":", &brkt);
     int port = port_string ? atoi(port_string) : SHARDCACHE_PORT_DEFAULT;
 
-    s->sock = open_socket(host, port);
+    s->sock = shardcache_serving_open_socket(host, port);
     if (s->sock == -1) {
         fprintf(stderr, "Can't open listening socket %s:%d : %s\n",
                 host, port, strerror(errno));
@@ -1145,41 +2393,29 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
         return NULL;
     }
 
-    free(addr); // we don't need it anymore
+    // keep the address to be able to open the listening sockets again
+    // when switching between the shared socket and the per worker ones
+    s->listen_host = host ? strdup(host) : NULL;
+    s->listen_port = port;
+    free(addr);
+
+    MUTEX_INIT(s->workers_lock);
+    MUTEX_INIT(s->select_lock);
+    s->listen_jobs = queue_create();
 
     // create the workers' pool
     s->workers = list_create();
+    s->retiring = list_create();
 
     if (cache->counters) {
         shardcache_counter_add(cache->counters, "connections", &s->num_connections);
         shardcache_counter_add(cache->counters, "num_workers", &s->total_workers);
+        shardcache_counter_add(cache->counters, "paused_requests", &s->paused_requests);
     }
 
     int i;
-    for (i = 0; i < ATOMIC_READ(num_workers); i++) {
-        shardcache_worker_context_t *wrk = calloc(1, sizeof(shardcache_worker_context_t));
-        wrk->serv = s;
-        wrk->jobs = queue_create();
-        queue_set_free_value_callback(wrk->jobs,
-                (queue_free_value_callback_t)shardcache_connection_context_destroy);
-        wrk->prune = list_create();
-        list_set_free_value_callback(wrk->prune, (free_value_callback_t)shardcache_connection_context_destroy);
-
-        char label[64];
-        snprintf(label, sizeof(label), "worker[%d].numfds", i);
-        shardcache_counter_add(cache->counters, label, &wrk->numfds);
-        /*
-        snprintf(label, sizeof(label), "worker[%d].pruning", i);
-        shardcache_counter_add(cache->counters, label, &wrk->pruning);
-        */
-
-        MUTEX_INIT(wrk->wakeup_lock);
-        CONDITION_INIT(wrk->wakeup_cond);
-        wrk->iomux = iomux_create(1<<13, 0);
-        pthread_create(&wrk->thread, NULL, worker, wrk);
-        list_push_value(s->workers, wrk);
-        ATOMIC_INCREMENT(s->total_workers);
-    }
+    for (i = 0; i < ATOMIC_READ(num_workers); i++)
+        shardcache_worker_create(s, i);
 
     s->io_mux = iomux_create(0, 0);
 
@@ -1195,54 +2431,17 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers)
 }
 
 static void
-clear_workers_list(linked_list_t *list)
+clear_workers_list(shardcache_serving_t *s)
 {
-    shardcache_worker_context_t *wrk = list_shift_value(list);
-
-    int cnt = 0;
+    MUTEX_LOCK(s->select_lock);
+    shardcache_worker_context_t *wrk = list_shift_value(s->workers);
+    MUTEX_UNLOCK(s->select_lock);
     while (wrk) {
-        ATOMIC_INCREMENT(wrk->leave);
-
-        // wake up the worker if slacking
-        CONDITION_SIGNAL(wrk->wakeup_cond, wrk->wakeup_lock);
-
-        pthread_join(wrk->thread, NULL);
-
-        queue_destroy(wrk->jobs);
-
-        MUTEX_DESTROY(wrk->wakeup_lock);
-        CONDITION_DESTROY(wrk->wakeup_cond);
-        SHC_DEBUG3("Worker thread %p exited", wrk);
-
-        shardcache_connection_context_t *ctx = list_shift_value(wrk->prune);
-        while (ctx) {
-            //ATOMIC_DECREMENT(wrk->pruning);
-            shardcache_request_t *req = TAILQ_FIRST(&ctx->requests);
-            while (req) {
-                TAILQ_REMOVE(&ctx->requests, req, next);
-                ctx->num_requests--;
-                shardcache_request_destroy(req);
-                req = TAILQ_FIRST(&ctx->requests);
-            }
-            shardcache_connection_context_destroy(ctx);
-            ctx = list_shift_value(wrk->prune);
-        }
-
-        char label[64];
-        snprintf(label, sizeof(label), "worker[%d].numfds", cnt);
-        shardcache_counter_remove(wrk->serv->cache->counters, label);
-        //snprintf(label, sizeof(label), "worker[%d].pruning", cnt);
-        //shardcache_counter_remove(wrk->serv->cache->counters, label);
-        cnt++;
-
-        iomux_destroy(wrk->iomux);
-
-        list_destroy(wrk->prune);
-
-        free(wrk);
-        wrk = list_shift_value(list);
+        shardcache_worker_destroy(wrk);
+        MUTEX_LOCK(s->select_lock);
+        wrk = list_shift_value(s->workers);
+        MUTEX_UNLOCK(s->select_lock);
     }
-
 }
 
 void
@@ -1250,25 +2449,39 @@ stop_serving(shardcache_serving_t *s)
 {
     ATOMIC_INCREMENT(s->leave);
 
-    iomux_remove(s->io_mux, s->sock);
-    close(s->sock);
+    // stop accepting new connections
+    pthread_join(s->io_thread, NULL);
+    MUTEX_LOCK(s->workers_lock);
+    shardcache_serving_close_listener(s);
+    shardcache_clear_listen_jobs(s->listen_jobs);
+    MUTEX_UNLOCK(s->workers_lock);
 
     // now the workers
     SHC_NOTICE("Collecting worker threads (might have to wait until i/o is finished)");
-    clear_workers_list(s->workers);
+    clear_workers_list(s);
+    // the retiring workers leave as well since the serving instance is leaving
+    shardcache_worker_context_t *wrk = list_shift_value(s->retiring);
+    while (wrk) {
+        shardcache_worker_destroy(wrk);
+        wrk = list_shift_value(s->retiring);
+    }
     SHC_DEBUG2("All worker threads have been collected");
 
     // unregister our counters if we did at creation time
     if (s->cache->counters) {
         shardcache_counter_remove(s->cache->counters, "connections");
         shardcache_counter_remove(s->cache->counters, "num_workers");
+        shardcache_counter_remove(s->cache->counters, "paused_requests");
     }
 
-    pthread_join(s->io_thread, NULL);
-
     iomux_destroy(s->io_mux);
+    queue_destroy(s->listen_jobs);
     list_destroy(s->workers);
+    list_destroy(s->retiring);
 
+    MUTEX_DESTROY(s->workers_lock);
+    MUTEX_DESTROY(s->select_lock);
+    free(s->listen_host);
     free(s);
 }
 
@@ -11,6 +11,13 @@ shardcache_serving_t *start_serving(shardcache_t *cache, int num_workers);
 
 void stop_serving(shardcache_serving_t *s);
 
+int shardcache_serving_set_num_workers(shardcache_serving_t *s, int num_workers);
+
+// switches between accepting connections in the listener thread (which hands
+// them to the workers) and letting each worker accept connections on its own
+// SO_REUSEPORT socket. Returns the previous value (or -1 in case of errors)
+int shardcache_serving_listen_per_worker(shardcache_serving_t *s, int new_value);
+
 #endif
 
 // vim: tabstop=4 shiftwidth=4 expandtab:
@@ -35,6 +35,168 @@ extern int shardcache_log_initialized;
 extern unsigned int shardcache_loglevel;
 
 
+static void
+shardcache_continuum_terminate(refcnt_node_t *node, void *priv)
+{
+    // continuum snapshots don't hold links to other nodes
+}
+
+static void
+shardcache_continuum_destroy(void *ptr)
+{
+    shardcache_continuum_t *continuum = (shardcache_continuum_t *)ptr;
+    chash_free(continuum->chash);
+    free(continuum);
+}
+
+static char *
+shardcache_intern_label(shardcache_t *cache, const char *label, size_t len)
+{
+    char *interned = ht_get(cache->node_labels, (void *)label, len, NULL);
+    if (!interned) {
+        interned = strndup(label, len);
+        int rc = ht_set_if_not_exists(cache->node_labels, (void *)label, len, interned, len + 1);
+        if (rc != 0) {
+            // someone else interned the same label in the meanwhile
+            // (or we failed storing ours), let's use the one in the table
+            free(interned);
+            interned = ht_get(cache->node_labels, (void *)label, len, NULL);
+        }
+    }
+    return interned;
+}
+
+static shardcache_continuum_t *
+shardcache_continuum_create(shardcache_t *cache,
+                            const char **node_names,
+                            size_t *name_lens,
+                            int num_nodes)
+{
+    shardcache_continuum_t *continuum = calloc(1, sizeof(shardcache_continuum_t));
+    continuum->chash = chash_create(node_names, name_lens, num_nodes, 200);
+    continuum->num_nodes = num_nodes;
+    continuum->me_interned = 1;
+
+    int i;
+    for (i = 0; i < num_nodes; i++)
+        shardcache_intern_label(cache, node_names[i], name_lens[i]);
+
+    size_t me_len = strlen(cache->me);
+    for (i = 0; i < num_nodes; i++) {
+        if (name_lens[i] == me_len && memcmp(node_names[i], cache->me, me_len) == 0)
+            break;
+    }
+
+    if (i == num_nodes)
+        return continuum; // we are not part of this continuum
+
+    // chash hands out pointers to its own copy of the labels, let's find
+    // the one matching our label so that the ownership can be tested by
+    // comparing pointers. If our label shows up at different addresses
+    // we need to fall back to comparing strings
+    uint32_t probe;
+    for (probe = 0; probe < num_nodes * 256; probe++) {
+        const char *node_name = NULL;
+        size_t name_len = 0;
+        chash_lookup(continuum->chash, &probe, sizeof(probe), &node_name, &name_len);
+        if (name_len != me_len || memcmp(node_name, cache->me, me_len) != 0)
+            continue;
+        if (!continuum->me) {
+            continuum->me = node_name;
+        } else if (continuum->me != node_name) {
+            continuum->me_interned = 0;
+            break;
+        }
+    }
+
+    if (!continuum->me)
+        continuum->me_interned = 0;
+
+    if (!continuum->me_interned) {
+        SHC_DEBUG("Can't intern the label %s in the continuum, "
+                  "ownership will be tested comparing strings", cache->me);
+    }
+
+    return continuum;
+}
+
+static inline int
+shardcache_continuum_is_me(shardcache_t *cache,
+                           shardcache_continuum_t *continuum,
+                           const char *node_name,
+                           size_t name_len)
+{
+    if (LIKELY(continuum->me_interned))
+        return (node_name == continuum->me);
+
+    return (name_len == strlen(cache->me) && memcmp(node_name, cache->me, name_len) == 0);
+}
+
+// returns a reference to the continuum published in the link (if any)
+// which must be released using shardcache_continuum_release()
+static inline shardcache_continuum_t *
+shardcache_continuum_get(shardcache_t *cache, refcnt_node_t **link, refcnt_node_t **ref)
+{
+    *ref = deref_link(cache->continuum_refcnt, link);
+    return *ref ? (shardcache_continuum_t *)get_node_ptr(*ref) : NULL;
+}
+
+static inline void
+shardcache_continuum_release(shardcache_t *cache, refcnt_node_t *ref)
+{
+    if (ref)
+        release_ref(cache->continuum_refcnt, ref);
+}
+
+// publishes a new continuum (or NULL) in the link, the previous one will be
+// released once the last reader holding a reference to it is done.
+// NOTE: writers must be serialized by the caller (holding the migration_lock)
+static void
+shardcache_continuum_publish(shardcache_t *cache, refcnt_node_t **link, refcnt_node_t *ref)
+{
+    refcnt_node_t *old = ATOMIC_READ(*link);
+    compare_and_swap_ref(cache->continuum_refcnt, link, old, ref);
+    // invalidate the owner hints (only after the swap, see shardcache_get_owner())
+    ATOMIC_INCREMENT(cache->continuum_gen);
+}
+
+static void
+shardcache_continuum_set(shardcache_t *cache, refcnt_node_t **link, shardcache_continuum_t *continuum)
+{
+    refcnt_node_t *ref = NULL;
+    if (continuum)
+        ref = new_node(cache->continuum_refcnt, continuum, NULL);
+    shardcache_continuum_publish(cache, link, ref);
+    // the link now holds its own reference
+    shardcache_continuum_release(cache, ref);
+}
+
+// looks up the node responsible for a key in the current (or in the migration)
+// continuum. The returned label belongs to the continuum and can be accessed
+// only until the reference is released
+static shardcache_continuum_t *
+shardcache_continuum_lookup(shardcache_t *cache,
+                            void *key,
+                            size_t klen,
+                            int migration,
+                            const char **node_name,
+                            size_t *name_len,
+                            refcnt_node_t **ref)
+{
+    // only one of the callers noticing that the migration is complete
+    // will take care of swapping the continua
+    if (ATOMIC_READ(cache->migration_done) && ATOMIC_CAS(cache->migration_done, 1, 0))
+        shardcache_migration_end(cache);
+
+    shardcache_continuum_t *continuum =
+        shardcache_continuum_get(cache, migration ? &cache->migration : &cache->chash, ref);
+
+    if (continuum)
+        chash_lookup(continuum->chash, key, klen, node_name, name_len);
+
+    return continuum;
+}
+
 static int
 shardcache_test_ownership_internal(shardcache_t *cache,
                                    void *key,
@@ -49,28 +211,17 @@ shardcache_test_ownership_internal(shardcache_t *cache,
     if (len && *len == 0)
         return -1;
 
-    if (cache->num_shards == 1)
+    if (!migration && cache->num_shards == 1)
         return 1;
 
-    SPIN_LOCK(cache->migration_lock);
-
-    chash_t *continuum = NULL;
-    if (cache->migration && cache->migration_done) { 
-        shardcache_migration_end(cache);
-    } 
+    refcnt_node_t *ref = NULL;
+    shardcache_continuum_t *continuum =
+        shardcache_continuum_lookup(cache, key, klen, migration, &node_name, &name_len, &ref);
 
-    if (migration) {
-        if (cache->migration) {
-            continuum = cache->migration;
-        } else {
-            SPIN_UNLOCK(cache->migration_lock);
-            return -1;
-        }
-    } else {
-        continuum = cache->chash;
-    }
+    if (!continuum)
+        return -1;
 
-    chash_lookup(continuum, key, klen, &node_name, &name_len);
+    int is_mine = shardcache_continuum_is_me(cache, continuum, node_name, name_len);
     if (owner) {
         if (len && name_len + 1 > *len)
             name_len = *len - 1;
@@ -80,8 +231,43 @@ shardcache_test_ownership_internal(shardcache_t *cache,
     if (len)
         *len = name_len;
 
-    SPIN_UNLOCK(cache->migration_lock);
-    return (strcmp(owner, cache->me) == 0);
+    shardcache_continuum_release(cache, ref);
+    return is_mine;
+}
+
+int
+shardcache_get_owner(shardcache_t *cache,
+                     void *key,
+                     size_t klen,
+                     int migration,
+                     const char **owner,
+                     uint32_t *generation)
+{
+    // read the generation before looking up the continuum so that a concurrent
+    // swap can only make the caller discard a good result (and not keep a stale one)
+    if (generation)
+        *generation = ATOMIC_READ(cache->continuum_gen);
+
+    if (!migration && cache->num_shards == 1) {
+        *owner = cache->me_label;
+        return 1;
+    }
+
+    const char *node_name;
+    size_t name_len = 0;
+    refcnt_node_t *ref = NULL;
+    shardcache_continuum_t *continuum =
+        shardcache_continuum_lookup(cache, key, klen, migration, &node_name, &name_len, &ref);
+
+    if (!continuum) {
+        *owner = NULL;
+        return -1;
+    }
+
+    *owner = ht_get(cache->node_labels, (void *)node_name, name_len, NULL);
+    shardcache_continuum_release(cache, ref);
+
+    return (*owner == cache->me_label);
 }
 
 int
@@ -105,15 +291,67 @@ shardcache_test_ownership(shardcache_t *cache,
     return shardcache_test_ownership_internal(cache, key, klen, owner, len, 0);
 }
 
+char *
+shardcache_node_select_address(shardcache_t *cache, shardcache_node_t *node)
+{
+    int num_addresses = shardcache_node_num_addresses(node);
+    char *addresses[num_addresses];
+    shardcache_node_get_all_addresses(node, addresses, num_addresses);
+    return peer_selector_pick(cache->peer_selector, addresses, num_addresses);
+}
+
+void
+shardcache_report_peer(shardcache_t *cache, char *addr, int success, uint64_t latency)
+{
+    peer_selector_report(cache->peer_selector, addr, success, latency);
+}
+
+static void
+shardcache_tinylfu_record(void *key, size_t klen, void *priv)
+{
+    tinylfu_record((tinylfu_t *)priv, key, klen);
+}
+
+static int
+shardcache_tinylfu_admit(void *key, size_t klen, void *priv)
+{
+    return tinylfu_admit((tinylfu_t *)priv, key, klen);
+}
+
+int
+shardcache_admit(shardcache_t *cache, void *key, size_t klen)
+{
+    shardcache_admission_policy_t *policy = ATOMIC_READ(cache->admission_policy);
+    if (policy->record)
+        policy->record(key, klen, policy->priv);
+    return ATOMIC_READ(cache->force_caching) || policy->admit(key, klen, policy->priv);
+}
+
+unsigned char
+shardcache_sig_hdr(shardcache_t *cache, int chunked)
+{
+    // V2 messages aren't signed, so they are never used if we have a secret
+    if (ATOMIC_READ(cache->protocol_version) > 1 && !cache->auth)
+        return SHC_HDR_CHECKSUM_CRC32C;
+    return chunked ? SHC_HDR_CSIGNATURE_SIP : SHC_HDR_SIGNATURE_SIP;
+}
+
 int
 shardcache_get_connection_for_peer(shardcache_t *cache, char *peer)
 {
-    if (!ATOMIC_READ(cache->use_persistent_connections))
-        return connect_to_peer(peer, cache->tcp_timeout);
+    int fd;
+    if (!ATOMIC_READ(cache->use_persistent_connections)) {
+        fd = connect_to_peer(peer, cache->tcp_timeout);
+    } else {
+        // this will reuse an available filedescriptor already connected to peer
+        // or create a new connection if there isn't any available
+        fd = connections_pool_get(cache->connections_pool, peer);
+    }
 
-    // this will reuse an available filedescriptor already connected to peer
-    // or create a new connection if there isn't any available
-    return connections_pool_get(cache->connections_pool, peer);
+    if (fd < 0)
+        shardcache_report_peer(cache, peer, 0, 0);
+
+    return fd;
 }
 
 void
@@ -141,12 +379,6 @@ typedef struct {
     size_t klen;
 } shardcache_key_t;
 
-typedef struct {
-    shardcache_t *cache;
-    shardcache_key_t item;
-    int is_volatile;
-} expire_key_ctx_t;
-
 typedef shardcache_key_t shardcache_evictor_job_t;
 
 static void
@@ -166,17 +398,6 @@ shardcache_evictor_job_t *create_evictor_job(void *key, size_t klen)
     return job;
 }
 
-static int
-evict_key(hashtable_t *table, void *value, size_t vlen, void *user)
-{
-    shardcache_evictor_job_t **job = (shardcache_evictor_job_t **)user;
-    *job = (shardcache_evictor_job_t *)value;
-    // remove the value from the table and stop the iteration 
-    // and since there is no free value callback the job won't
-    // be released on removal 
-    return -2;
-}
-
 static inline void
 shardcache_update_size_counters(shardcache_t *cache)
 {
@@ -186,8 +407,337 @@ shardcache_update_size_counters(shardcache_t *cache)
                ATOMIC_READ(*cache->arc_lists_size[1]) +
                ATOMIC_READ(*cache->arc_lists_size[2]) +
                ATOMIC_READ(*cache->arc_lists_size[3]));
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_ARENA_USED].value, arc_arena_used(cache->arc));
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_ARENA_RESERVED].value, arc_arena_reserved(cache->arc));
+}
+
+
+typedef struct {
+    shardcache_t *cache;
+    iomux_t *mux;
+    hashtable_t *peers; // the connection (int *) opened to each peer (by address)
+    hashtable_t *legacy_peers; // the peers not understanding EVICT_MULTI (by address)
+    linked_list_t *fallbacks;  // the EVICT_MULTI commands to send again as separate
+                               // EVICT commands (once out of the iomux callbacks)
+} shardcache_evictor_t;
+
+// an eviction command waiting for the response of a peer
+typedef struct {
+    // the same keys as separate EVICT commands, to be sent
+    // if the peer doesn't understand EVICT_MULTI (NULL for EVICT)
+    void *fallback;
+    size_t fallback_len;
+    int fallback_count;
+    char *addr; // the peer the fallback has to be sent to
+} shardcache_evictor_request_t;
+
+typedef struct {
+    shardcache_evictor_t *evictor;
+    char *addr;
+    int fd;
+    async_read_ctx_t *reader;
+    linked_list_t *requests; // the commands sent and not yet answered (in order)
+    int status; // the status carried by the response being read
+} shardcache_evictor_peer_t;
+
+static void
+evictor_request_destroy(shardcache_evictor_request_t *request)
+{
+    free(request->fallback);
+    free(request->addr);
+    free(request);
+}
+
+static shardcache_evictor_peer_t *evictor_peer_get(shardcache_evictor_t *evictor, char *addr);
+
+// the fallback is sent by the evictor loop since the connection
+// the command has been sent to might be released meanwhile
+static void
+evictor_queue_fallback(shardcache_evictor_t *evictor, char *addr, shardcache_evictor_request_t *request)
+{
+    request->addr = strdup(addr);
+    list_push_value(evictor->fallbacks, request);
 }
 
+// queues a message to the peer, the request is released if it can't be sent
+static int
+evictor_peer_write(shardcache_evictor_peer_t *peer,
+                   void *msg,
+                   size_t len,
+                   shardcache_evictor_request_t *request)
+{
+    shardcache_evictor_t *evictor = peer->evictor;
+    if (iomux_write(evictor->mux, peer->fd, (unsigned char *)msg, len, IOMUX_OUTPUT_MODE_COPY) != (int)len) {
+        SHC_WARNING("Can't send the eviction command to peer %s", peer->addr);
+        evictor_request_destroy(request);
+        shardcache_report_peer(evictor->cache, peer->addr, 0, 0);
+        iomux_close(evictor->mux, peer->fd);
+        return -1;
+    }
+    list_push_value(peer->requests, request);
+    return 0;
+}
+
+// sends the keys of an EVICT_MULTI command as separate EVICT commands
+static void
+evictor_send_fallback(shardcache_evictor_t *evictor, shardcache_evictor_request_t *multi)
+{
+    shardcache_evictor_peer_t *peer = evictor_peer_get(evictor, multi->addr);
+    if (!peer)
+        return;
+
+    SHC_DEBUG2("Sending %d separate eviction commands to peer %s", multi->fallback_count, multi->addr);
+    // all the commands are written at once, but a response is expected for each of them
+    int i;
+    for (i = 1; i < multi->fallback_count; i++)
+        list_push_value(peer->requests, calloc(1, sizeof(shardcache_evictor_request_t)));
+    evictor_peer_write(peer, multi->fallback, multi->fallback_len,
+                       calloc(1, sizeof(shardcache_evictor_request_t)));
+}
+
+static int
+evictor_peer_read_cb(void *data, size_t len, int idx, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+
+    if (idx == 0 && len && peer->status == -1)
+        peer->status = *((unsigned char *)data);
+
+    if (idx != -1)
+        return 0;
+
+    shardcache_evictor_request_t *request = list_shift_value(peer->requests);
+    int status = peer->status;
+    peer->status = -1;
+    if (!request) {
+        SHC_WARNING("Unexpected response from peer %s to the evictor", peer->addr);
+        return -1;
+    }
+
+    if (request->fallback && status != SHC_RES_OK) {
+        // the peer runs an older release, from now on it will
+        // receive only separate EVICT commands
+        static int legacy = 1;
+        SHC_NOTICE("Peer %s doesn't support EVICT_MULTI, sending separate eviction commands", peer->addr);
+        ht_set(peer->evictor->legacy_peers, peer->addr, strlen(peer->addr), &legacy, sizeof(legacy));
+        evictor_queue_fallback(peer->evictor, peer->addr, request);
+    } else {
+        evictor_request_destroy(request);
+    }
+    return 0;
+}
+
+static int
+evictor_peer_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    int processed = 0;
+
+    // the responses are consumed so that the connection doesn't get stuck,
+    // but only the ones to EVICT_MULTI commands are actually interesting
+    async_read_context_state_t state = async_read_context_input_data(peer->reader, data, len, &processed);
+    while (state == SHC_STATE_READING_DONE)
+        state = async_read_context_update(peer->reader);
+
+    if (state == SHC_STATE_READING_ERR || state == SHC_STATE_AUTH_ERR) {
+        SHC_WARNING("Bad response from peer %s to the evictor", peer->addr);
+        iomux_close(iomux, fd);
+    }
+
+    return processed;
+}
+
+static void
+evictor_peer_eof(iomux_t *iomux, int fd, void *priv)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)priv;
+    shardcache_evictor_t *evictor = peer->evictor;
+    SHC_DEBUG3("Connection to peer %s closed by the evictor", peer->addr);
+    close(fd);
+
+    // the EVICT_MULTI commands not answered might have been refused
+    // by the peer, so their keys are sent again as separate commands
+    shardcache_evictor_request_t *request = list_shift_value(peer->requests);
+    while (request) {
+        if (request->fallback)
+            evictor_queue_fallback(evictor, peer->addr, request);
+        else
+            evictor_request_destroy(request);
+        request = list_shift_value(peer->requests);
+    }
+
+    // the peer will be released by the free callback of the table
+    ht_delete(evictor->peers, peer->addr, strlen(peer->addr), NULL, NULL);
+}
+
+static void
+evictor_peer_destroy(shardcache_evictor_peer_t *peer)
+{
+    if (peer->requests) {
+        shardcache_evictor_request_t *request = list_shift_value(peer->requests);
+        while (request) {
+            evictor_request_destroy(request);
+            request = list_shift_value(peer->requests);
+        }
+        list_destroy(peer->requests);
+    }
+    async_read_context_destroy(peer->reader);
+    free(peer->addr);
+    free(peer);
+}
+
+static int
+evictor_peer_close(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    shardcache_evictor_peer_t *peer = (shardcache_evictor_peer_t *)value;
+    iomux_remove(peer->evictor->mux, peer->fd);
+    close(peer->fd);
+    return -1;
+}
+
+static shardcache_evictor_peer_t *
+evictor_peer_get(shardcache_evictor_t *evictor, char *addr)
+{
+    shardcache_evictor_peer_t *peer = ht_get(evictor->peers, addr, strlen(addr), NULL);
+    if (peer)
+        return peer;
+
+    int fd = connect_to_peer(addr, ATOMIC_READ(evictor->cache->tcp_timeout));
+    if (fd < 0) {
+        SHC_WARNING("Evictor can't connect to peer %s", addr);
+        shardcache_report_peer(evictor->cache, addr, 0, 0);
+        return NULL;
+    }
+
+    peer = calloc(1, sizeof(shardcache_evictor_peer_t));
+    peer->evictor = evictor;
+    peer->addr = strdup(addr);
+    peer->fd = fd;
+    peer->reader = async_read_context_create((char *)evictor->cache->auth, evictor_peer_read_cb, peer);
+    peer->requests = list_create();
+    peer->status = -1;
+
+    iomux_callbacks_t cbs = {
+        .mux_input = evictor_peer_input,
+        .mux_eof = evictor_peer_eof,
+        .priv = peer
+    };
+
+    if (!iomux_add(evictor->mux, fd, &cbs)) {
+        close(fd);
+        evictor_peer_destroy(peer);
+        return NULL;
+    }
+
+    ht_set(evictor->peers, addr, strlen(addr), peer, sizeof(shardcache_evictor_peer_t));
+    return peer;
+}
+
+typedef struct {
+    shardcache_record_t keys[SHARDCACHE_EVICTOR_BATCH_SIZE];
+    shardcache_evictor_job_t *jobs[SHARDCACHE_EVICTOR_BATCH_SIZE];
+    int count;
+} shardcache_evictor_batch_t;
+
+static int
+evict_keys(hashtable_t *table, void *value, size_t vlen, void *user)
+{
+    shardcache_evictor_batch_t *batch = (shardcache_evictor_batch_t *)user;
+    shardcache_evictor_job_t *job = (shardcache_evictor_job_t *)value;
+    batch->jobs[batch->count] = job;
+    batch->keys[batch->count].v = job->key;
+    batch->keys[batch->count].l = job->klen;
+    batch->count++;
+    // remove the value from the table (since there is no free value callback
+    // the job won't be released on removal) and stop once the batch is full
+    return (batch->count < SHARDCACHE_EVICTOR_BATCH_SIZE) ? -1 : -2;
+}
+
+static void
+evictor_send_batch(shardcache_evictor_t *evictor, shardcache_evictor_batch_t *batch)
+{
+    shardcache_t *cache = evictor->cache;
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    fbuf_t single_msgs = FBUF_STATIC_INITIALIZER;
+    int rc = 0;
+    int i;
+
+    // the keys are also sent as separate EVICT commands to the peers not
+    // understanding EVICT_MULTI (and to the ones refusing it)
+    for (i = 0; i < batch->count && rc == 0; i++) {
+        rc = build_message((char *)cache->auth, shardcache_sig_hdr(cache, 0), SHC_HDR_EVICT,
+                           &batch->keys[i], 1, &single_msgs);
+    }
+
+    // a single key can still be sent using a plain EVICT command
+    if (batch->count > 1 && rc == 0) {
+        fbuf_t keys = FBUF_STATIC_INITIALIZER;
+        pack_multi_record(batch->keys, batch->count, &keys);
+        shardcache_record_t record = {
+            .v = fbuf_data(&keys),
+            .l = fbuf_used(&keys)
+        };
+        rc = build_message((char *)cache->auth, shardcache_sig_hdr(cache, 0), SHC_HDR_EVICT_MULTI,
+                           &record, 1, &msg);
+        fbuf_destroy(&keys);
+    }
+
+    if (rc != 0) {
+        SHC_ERROR("Can't build the eviction message for %d keys", batch->count);
+        fbuf_destroy(&msg);
+        fbuf_destroy(&single_msgs);
+        return;
+    }
+
+    SHC_DEBUG2("Sending eviction command for %d keys", batch->count);
+
+    // the same message is queued for all the peers at once and
+    // it will be written to all of them by the next iomux run
+    int num_nodes = 0;
+    shardcache_node_t **nodes = shardcache_get_nodes(cache, &num_nodes);
+    for (i = 0; i < num_nodes; i++) {
+        char *label = shardcache_node_get_label(nodes[i]);
+        if (strcmp(label, cache->me) == 0)
+            continue;
+
+        char *addr = shardcache_node_select_address(cache, nodes[i]);
+        shardcache_evictor_peer_t *peer = evictor_peer_get(evictor, addr);
+        if (!peer)
+            continue;
+
+        SHC_DEBUG3("Sending Eviction command to %s", label);
+        shardcache_evictor_request_t *request = calloc(1, sizeof(shardcache_evictor_request_t));
+        if (batch->count == 1 || ht_exists(evictor->legacy_peers, addr, strlen(addr))) {
+            int j;
+            for (j = 1; j < batch->count; j++)
+                list_push_value(peer->requests, calloc(1, sizeof(shardcache_evictor_request_t)));
+            evictor_peer_write(peer, fbuf_data(&single_msgs), fbuf_used(&single_msgs), request);
+        } else {
+            request->fallback = malloc(fbuf_used(&single_msgs));
+            memcpy(request->fallback, fbuf_data(&single_msgs), fbuf_used(&single_msgs));
+            request->fallback_len = fbuf_used(&single_msgs);
+            request->fallback_count = batch->count;
+            evictor_peer_write(peer, fbuf_data(&msg), fbuf_used(&msg), request);
+        }
+    }
+    shardcache_free_nodes(nodes, num_nodes);
+    fbuf_destroy(&msg);
+    fbuf_destroy(&single_msgs);
+}
+
+// runs the iomux and sends the fallbacks queued by its callbacks
+static void
+evictor_run(shardcache_evictor_t *evictor, struct timeval *timeout)
+{
+    iomux_run(evictor->mux, timeout);
+
+    shardcache_evictor_request_t *request = list_shift_value(evictor->fallbacks);
+    while (request) {
+        evictor_send_fallback(evictor, request);
+        evictor_request_destroy(request);
+        request = list_shift_value(evictor->fallbacks);
+    }
+}
 
 static void *
 evictor(void *priv)
@@ -195,135 +745,140 @@ evictor(void *priv)
     shardcache_t *cache = (shardcache_t *)priv;
     hashtable_t *jobs = cache->evictor_jobs;
 
-    connections_pool_t *connections = connections_pool_create(ATOMIC_READ(cache->tcp_timeout),
-                                                              SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
-                                                              1);
+    shardcache_evictor_t evictor = {
+        .cache = cache,
+        .mux = iomux_create(0, 0),
+        .peers = ht_create(32, 0, (ht_free_item_callback_t)evictor_peer_destroy),
+        .legacy_peers = ht_create(32, 0, NULL),
+        .fallbacks = list_create()
+    };
+
+    shardcache_evictor_batch_t batch;
+    struct timeval flush_time = { 0, 0 };
 
     while (!ATOMIC_READ(cache->quit))
     {
-
-        // this will extract only the first value
-        shardcache_evictor_job_t *job = NULL;
-        ht_foreach_value(jobs, evict_key, &job);
-        if (job) {
-            char keystr[1024] = { 0 };
-
-            if (shardcache_loglevel >= LOG_DEBUG)
-                KEY2STR(job->key, job->klen, keystr, sizeof(keystr));
-
-            SHC_DEBUG2("Eviction job for key '%s' started", keystr);
-
-            int i;
-            for (i = 0; i < cache->num_shards; i++) {
-                char *peer = shardcache_node_get_label(cache->shards[i]);
-                if (strcmp(peer, cache->me) != 0) {
-                    SHC_DEBUG3("Sending Eviction command to %s", peer);
-                    int rindex = random()%shardcache_node_num_addresses(cache->shards[i]);
-                    char *addr = shardcache_node_get_address_at_index(cache->shards[i], rindex);
-                    int fd = connections_pool_get(connections, addr);
-                    if (fd < 0)
-                        break;
-
-                    int retries = 0;
-                    for (;;) {
-                        int flags = fcntl(fd, F_GETFL, 0);
-                        if (flags == -1) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            continue;
-                        }
-
-                        flags |= O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
-
-                        int rb = 0;
-                        do {
-                            char discard[1<<16];
-                            rb = read(fd, &discard, sizeof(discard));
-                        } while (rb > 0);
-
-                        if (rb == 0 || (rb == -1 && errno != EINTR && errno != EAGAIN)) {
-                            close(fd);
-                            fd = connections_pool_get(connections, addr);
-                            if (fd < 0)
-                                break;
-                            if (retries++ < 5)
-                                continue;
-                        }
-                        flags &= ~O_NONBLOCK;
-                        fcntl(fd, F_SETFL, flags);
-                        break;
-                    }
-
-                    int rc = evict_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, job->key, job->klen, fd, 0);
-                    if (rc == 0) {
-                        connections_pool_add(connections, addr, fd);
-                    } else {
-                        SHC_WARNING("evict_from_peer return %d for peer %s", rc, peer);
-                        close(fd);
-                    }
-                }
+        size_t pending = ht_count(jobs);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        if (pending && pending < SHARDCACHE_EVICTOR_BATCH_SIZE) {
+            // give other keys the chance to join the batch but
+            // don't hold the first one for more than the flush interval
+            if (!timerisset(&flush_time)) {
+                struct timeval interval = { 0, SHARDCACHE_EVICTOR_FLUSH_INTERVAL * 1000 };
+                timeradd(&now, &interval, &flush_time);
             }
+            if (timercmp(&now, &flush_time, <)) {
+                struct timeval wait;
+                timersub(&flush_time, &now, &wait);
+                evictor_run(&evictor, &wait);
+                continue;
+            }
+        }
 
-            SHC_DEBUG2("Eviction job for key '%s' completed", keystr);
-            destroy_evictor_job(job);
+        if (pending) {
+            timerclear(&flush_time);
+            batch.count = 0;
+            // duplicated keys have been already coalesced by
+            // shardcache_commence_eviction() while waiting in the table
+            ht_foreach_value(jobs, evict_keys, &batch);
+            if (batch.count) {
+                evictor_send_batch(&evictor, &batch);
+                int i;
+                for (i = 0; i < batch.count; i++)
+                    destroy_evictor_job(batch.jobs[i]);
+            }
+            struct timeval flush = { 0, 0 };
+            evictor_run(&evictor, &flush);
         }
 
         if (!ht_count(jobs)) {
-            // if we have no more jobs to handle let's sleep a bit
-            struct timeval now;
-            int rc = 0;
-            rc = gettimeofday(&now, NULL);
-            if (rc == 0) {
-                struct timespec abstime = { now.tv_sec + 1, now.tv_usec * 1000 };
-                MUTEX_LOCK(cache->evictor_lock);
-                pthread_cond_timedwait(&cache->evictor_cond, &cache->evictor_lock, &abstime);
-                MUTEX_UNLOCK(cache->evictor_lock);
-            } else {
-                // TODO - Error messsages
+            // if we have no more jobs to handle let's sleep a bit, but wake up
+            // more often if there are connections to serve (pending output
+            // and responses from the peers)
+            struct timeval wait = { 1, 0 };
+            if (!iomux_isempty(evictor.mux)) {
+                struct timeval flush = { 0, 0 };
+                evictor_run(&evictor, &flush);
+                wait.tv_sec = 0;
+                wait.tv_usec = ATOMIC_READ(cache->iomux_run_timeout_low);
             }
+            struct timeval deadline;
+            timeradd(&now, &wait, &deadline);
+            struct timespec abstime = { deadline.tv_sec, deadline.tv_usec * 1000 };
+            MUTEX_LOCK(cache->evictor_lock);
+            pthread_cond_timedwait(&cache->evictor_cond, &cache->evictor_lock, &abstime);
+            MUTEX_UNLOCK(cache->evictor_lock);
         }
         shardcache_update_size_counters(cache);
     }
-    connections_pool_destroy(connections);
+
+    ht_foreach_value(evictor.peers, evictor_peer_close, NULL);
+    ht_destroy(evictor.peers);
+    ht_destroy(evictor.legacy_peers);
+    list_set_free_value_callback(evictor.fallbacks, (free_value_callback_t)evictor_request_destroy);
+    list_destroy(evictor.fallbacks);
+    iomux_destroy(evictor.mux);
     return NULL;
 }
 
+// called by the volatile storage, with the shard still locked,
+// when it needs to make room for new items
 static void
-destroy_volatile(volatile_object_t *obj)
+shardcache_volatile_evicting(void *key, size_t klen, size_t vlen, void *priv)
 {
-    free(obj->data);
-    free(obj);
+    shardcache_t *cache = (shardcache_t *)priv;
+    // the timer would otherwise remove a value stored later for the same key.
+    // NOTE: the job is queued before the shard is unlocked, so it can't
+    //       cancel the expiration scheduled by a later set of the same key
+    shardcache_unschedule_expiration(cache, key, klen, 1);
 }
 
+// called by the volatile storage when it needs to make room for new items
 static void
-shardcache_expire_key_cb(iomux_t *iomux, void *priv)
+shardcache_volatile_evicted(void *key, size_t klen, size_t vlen, void *priv)
 {
-    expire_key_ctx_t *ctx = (expire_key_ctx_t *)priv;
-    void *ptr = NULL;
-    if (ctx->is_volatile) {
-        ht_delete(ctx->cache->volatile_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
+    shardcache_t *cache = (shardcache_t *)priv;
+    ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+    arc_remove(cache->arc, (const void *)key, klen);
+    if (shardcache_log_level() >= LOG_DEBUG) {
+        char keystr[1024];
+        KEY2STR(key, klen, keystr, sizeof(keystr));
+        SHC_DEBUG("Volatile item %s evicted to make room for new items", keystr);
+    }
+}
 
-        free(ptr);
-        ht_delete(ctx->cache->volatile_storage, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (ptr) {
-            volatile_object_t *prev = (volatile_object_t *)ptr;
-            ATOMIC_DECREASE(ctx->cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev->dlen);
-            destroy_volatile(prev);
-        }
+typedef struct {
+    timer_wheel_entry_t timer; // must be the first member
+    int is_volatile;
+    size_t klen;
+    char key[];
+} shardcache_expiration_t;
+
+static void
+shardcache_expire_key_cb(timer_wheel_entry_t *timer, void *priv)
+{
+    shardcache_t *cache = (shardcache_t *)priv;
+    shardcache_expiration_t *exp = (shardcache_expiration_t *)timer;
+
+    if (exp->is_volatile) {
+        size_t prev_len = 0;
+        ht_delete(cache->volatile_timeouts, exp->key, exp->klen, NULL, NULL);
+        if (volatile_store_delete(cache->volatile_storage, exp->key, exp->klen, &prev_len) == 0)
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
     } else {
-        ht_delete(ctx->cache->cache_timeouts, ctx->item.key, ctx->item.klen, &ptr, NULL);
-        if (!ptr)
-            return;
-        free(ptr);
+        ht_delete(cache->cache_timeouts, exp->key, exp->klen, NULL, NULL);
     }
-    ATOMIC_INCREMENT(ctx->cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
-    arc_remove(ctx->cache->arc, (const void *)ctx->item.key, ctx->item.klen);
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
+    arc_remove(cache->arc, (const void *)exp->key, exp->klen);
+    free(exp);
+}
+
+static void
+shardcache_expiration_destroy(timer_wheel_entry_t *timer, void *priv)
+{
+    free(timer);
 }
 
 typedef struct {
@@ -336,13 +891,6 @@ typedef struct {
     int is_volatile;
 } shardcache_expire_job_t;
 
-static void
-shardcache_expire_context_destroy(expire_key_ctx_t *ctx)
-{
-    free(ctx->item.key);
-    free(ctx);
-}
-
 void *
 shardcache_expire_keys(void *priv)
 {
@@ -351,68 +899,39 @@ shardcache_expire_keys(void *priv)
     {
         shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
         while (job) {
+            hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
+            shardcache_expiration_t *exp = NULL;
+
             if (job->cmd == SHARDACHE_EXPIRE_UNSCHEDULE) {
                 void *ptr = NULL;
-                hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-
                 ht_delete(table, job->key, job->klen, &ptr, NULL);
                 if (ptr) {
-                    iomux_timeout_id_t *tid = (iomux_timeout_id_t *)ptr;
-                    iomux_unschedule(cache->expirer_mux, *tid);
-                    free(tid);
-                } else {
-                    // TODO - Error messages ?
+                    exp = (shardcache_expiration_t *)ptr;
+                    timer_wheel_unschedule(cache->expirer_wheel, &exp->timer);
+                    free(exp);
                 }
-                free(job->key);
-                free(job);
-                job = queue_pop_left(cache->expirer_queue);
-                continue;
-            }
-
-            expire_key_ctx_t *ctx = calloc(1, sizeof(expire_key_ctx_t));
-            ctx->item.key = job->key;
-            ctx->item.klen = job->klen;
-            ctx->cache = cache;
-            ctx->is_volatile = job->is_volatile;
-            hashtable_t *table = job->is_volatile ? cache->volatile_timeouts : cache->cache_timeouts;
-            struct timeval timeout = { job->expire, (int)random()%(int)1e6 };
-            iomux_timeout_id_t *tid_ptr = NULL;
-            void *prev = NULL;
-            iomux_timeout_id_t tid = 0;
-            ht_delete(table, job->key, job->klen, &prev, NULL);
-
-            if (prev) {
-                tid_ptr = (iomux_timeout_id_t *)prev;
-                tid = iomux_reschedule(cache->expirer_mux,
-                                       *tid_ptr,
-                                       &timeout,
-                                       shardcache_expire_key_cb,
-                                       ctx,
-                                       (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                *tid_ptr = tid;
-            } else {
-                tid = iomux_schedule(cache->expirer_mux,
-                                     &timeout, shardcache_expire_key_cb,
-                                     ctx,
-                                     (iomux_timeout_free_context_cb)shardcache_expire_context_destroy);
-                tid_ptr = malloc(sizeof(iomux_timeout_id_t));
-                *tid_ptr = tid;
-            }
-            if (tid && tid_ptr) {
-                ht_set(table, job->key, job->klen, tid_ptr, sizeof(iomux_timeout_id_t));
             } else {
-                free(tid_ptr);
-                shardcache_expire_context_destroy(ctx);
-                // TODO - Erro message
+                exp = ht_get(table, job->key, job->klen, NULL);
+                if (!exp) {
+                    exp = calloc(1, sizeof(shardcache_expiration_t) + job->klen);
+                    exp->is_volatile = job->is_volatile;
+                    exp->klen = job->klen;
+                    memcpy(exp->key, job->key, job->klen);
+                    ht_set(table, job->key, job->klen, exp, sizeof(shardcache_expiration_t));
+                }
+                // rescheduling an already scheduled timer is fine
+                timer_wheel_schedule(cache->expirer_wheel, &exp->timer, (uint64_t)job->expire * 1000);
             }
 
+            free(job->key);
             free(job);
             job = queue_pop_left(cache->expirer_queue);
         }
 
-        struct timeval tv = { 1, 0 };
-        iomux_run(cache->expirer_mux, &tv);
+        // all the keys expiring in the elapsed ticks are expired at once
+        timer_wheel_run(cache->expirer_wheel, shardcache_expire_key_cb, cache);
         shardcache_update_size_counters(cache);
+        usleep(SHARDCACHE_EXPIRER_RESOLUTION * 1000);
     }
     return NULL;
 }
@@ -423,6 +942,12 @@ shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk)
     queue_push_right(cache->async_context[ATOMIC_INCREASE(cache->async_index, 1) % cache->num_async].queue, wrk);
 }
 
+static void
+shardcache_attach_pipelined_connection(async_read_wrk_t *wrk, void *priv)
+{
+    shardcache_queue_async_read_wrk((shardcache_t *)priv, wrk);
+}
+
 typedef struct {
     shardcache_t *cache;
     int index;
@@ -478,6 +1003,10 @@ shardcache_create(char *me,
 
     cache->evict_on_delete = 1;
     cache->use_persistent_connections = 1;
+    cache->migration_workers = SHARDCACHE_MIGRATION_WORKERS_DEFAULT;
+    cache->migration_batch_size = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    cache->streaming_threshold = SHARDCACHE_STREAMING_THRESHOLD_DEFAULT;
+    cache->protocol_version = SHARDCACHE_PROTOCOL_VERSION_DEFAULT;
     cache->tcp_timeout = SHARDCACHE_TCP_TIMEOUT_DEFAULT;
     cache->expire_time = SHARDCACHE_EXPIRE_TIME_DEFAULT;
     cache->serving_look_ahead = SHARDCACHE_SERVING_LOOK_AHEAD_DEFAULT;
@@ -498,6 +1027,12 @@ shardcache_create(char *me,
             shardcache_destroy(cache);
             return NULL;
         }
+        // fetch_async (if any) is used only by the asynchronous API
+        if (!st->fetch) {
+            SHC_ERROR("The storage doesn't provide the (mandatory) fetch callback");
+            shardcache_destroy(cache);
+            return NULL;
+        }
         memcpy(&cache->storage, st, sizeof(cache->storage));
         cache->use_persistent_storage = 1;
     } else {
@@ -556,13 +1091,41 @@ shardcache_create(char *me,
 
     cache->num_shards = nnodes;
 
-    cache->chash = chash_create((const char **)shard_names, shard_lens, cache->num_shards, 200);
+    cache->peer_selector = peer_selector_create();
+
+    cache->node_labels = ht_create(16, 0, free);
+    cache->me_label = shardcache_intern_label(cache, cache->me, strlen(cache->me));
+
+    cache->continuum_refcnt = refcnt_create(1, shardcache_continuum_terminate, shardcache_continuum_destroy);
+    shardcache_continuum_t *continuum = shardcache_continuum_create(cache,
+                                                                    (const char **)shard_names,
+                                                                    shard_lens,
+                                                                    cache->num_shards);
+    shardcache_continuum_set(cache, &cache->chash, continuum);
 
     // we need to tell the arc subsystem how big are the cached objects (well ... at least the container struct
-    // which is attached to each cached object to encapsulate its actual data and extra flags/members
-    cache->arc = arc_create(&cache->ops, cache_size, sizeof(cached_object_t), cache->arc_lists_size, cache->arc_mode);
+    // which is attached to each cached object to encapsulate its actual data and extra flags/members.
+    // The arc is also partitioned (one partition for each worker) so that concurrent
+    // lookups from the serving workers won't all contend on a single lock
+    cache->arc = arc_create(&cache->ops,
+                            cache_size,
+                            sizeof(cached_object_t),
+                            cache->arc_lists_size,
+                            cache->arc_mode,
+                            num_workers > 0 ? num_workers : 1);
     cache->arc_size = cache_size;
 
+    size_t sketch_width = cache_size / SHARDCACHE_ADMISSION_ITEM_SIZE;
+    if (sketch_width < SHARDCACHE_ADMISSION_MIN_WIDTH)
+        sketch_width = SHARDCACHE_ADMISSION_MIN_WIDTH;
+    else if (sketch_width > SHARDCACHE_ADMISSION_MAX_WIDTH)
+        sketch_width = SHARDCACHE_ADMISSION_MAX_WIDTH;
+    cache->tinylfu = tinylfu_create(sketch_width, SHARDCACHE_ADMISSION_THRESHOLD);
+    cache->tinylfu_policy.record = shardcache_tinylfu_record;
+    cache->tinylfu_policy.admit = shardcache_tinylfu_admit;
+    cache->tinylfu_policy.priv = cache->tinylfu;
+    cache->admission_policy = &cache->tinylfu_policy;
+
     // check if there is already signal handler registered on SIGPIPE
     struct sigaction sa;
     if (sigaction(SIGPIPE, NULL, &sa) != 0) {
@@ -610,7 +1173,11 @@ shardcache_create(char *me,
     gettimeofday(&tv, NULL);
     srandom((unsigned)tv.tv_usec);
 
-    cache->volatile_storage = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)destroy_volatile);
+    cache->volatile_storage = volatile_store_create(SHARDCACHE_VOLATILE_STORAGE_SHARDS,
+                                                    0,
+                                                    shardcache_volatile_evicted,
+                                                    shardcache_volatile_evicting,
+                                                    cache);
 
     cache->connections_pool = connections_pool_create(cache->tcp_timeout,
                                                       SHARDCACHE_CONNECTION_EXPIRE_DEFAULT,
@@ -618,6 +1185,15 @@ shardcache_create(char *me,
 
     global_tcp_timeout(ATOMIC_READ(cache->tcp_timeout));
 
+    cache->connections_pipeline = connections_pipeline_create((char *)cache->auth,
+                                                              SHARDCACHE_PIPELINE_CONNECTIONS_DEFAULT,
+                                                              SHARDCACHE_PIPELINE_DEPTH_DEFAULT,
+                                                              shardcache_attach_pipelined_connection,
+                                                              cache);
+
+    // NOTE: the entries are owned by the fetch they refer to
+    cache->inflight_fetches = ht_create(128, 0, NULL);
+
     cache->async_context = calloc(1, sizeof(shardcache_async_io_context_t) * cache->num_async);
 
     for (i = 0; i < cache->num_async; i++) {
@@ -643,9 +1219,10 @@ shardcache_create(char *me,
         return NULL;
     }
 
-    cache->cache_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->volatile_timeouts = ht_create(1<<16, 1<<20, (ht_free_item_callback_t)free);
-    cache->expirer_mux = iomux_create(0, 1);
+    // NOTE: the items in the timeouts tables are owned by the timer wheel
+    cache->cache_timeouts = ht_create(1<<16, 1<<20, NULL);
+    cache->volatile_timeouts = ht_create(1<<16, 1<<20, NULL);
+    cache->expirer_wheel = timer_wheel_create(SHARDCACHE_EXPIRER_RESOLUTION);
     cache->expirer_queue = queue_create();
     pthread_create(&cache->expirer_th, NULL, shardcache_expire_keys, cache);
 
@@ -705,6 +1282,14 @@ shardcache_destroy(shardcache_t *cache)
         free(cache->async_context);
     }
 
+    // NOTE: all the pipelined connections have been closed
+    //       together with the async i/o contexts
+    if (cache->connections_pipeline)
+        connections_pipeline_destroy(cache->connections_pipeline);
+
+    if (cache->inflight_fetches)
+        ht_destroy(cache->inflight_fetches);
+
     if (ATOMIC_READ(cache->evict_on_delete) && cache->evictor_jobs)
     {
         SHC_DEBUG2("Stopping evictor thread");
@@ -745,18 +1330,24 @@ shardcache_destroy(shardcache_t *cache)
     }
 
     if (cache->volatile_storage)
-        ht_destroy(cache->volatile_storage);
+        volatile_store_destroy(cache->volatile_storage);
 
     free((void *)cache->auth);
 
     if (cache->arc)
         arc_destroy(cache->arc);
 
-    if (cache->chash)
-        chash_free(cache->chash);
+    if (cache->continuum_refcnt) {
+        shardcache_continuum_set(cache, &cache->chash, NULL);
+        shardcache_continuum_set(cache, &cache->migration, NULL);
+        refcnt_destroy(cache->continuum_refcnt);
+    }
+
+    if (cache->node_labels)
+        ht_destroy(cache->node_labels);
 
-    if (cache->expirer_mux)
-        iomux_destroy(cache->expirer_mux);
+    if (cache->expirer_wheel)
+        timer_wheel_destroy(cache->expirer_wheel, shardcache_expiration_destroy, NULL);
 
     if (cache->expirer_queue) {
         shardcache_expire_job_t *job = queue_pop_left(cache->expirer_queue);
@@ -784,6 +1375,12 @@ shardcache_destroy(shardcache_t *cache)
     if (cache->connections_pool)
         connections_pool_destroy(cache->connections_pool);
 
+    if (cache->peer_selector)
+        peer_selector_destroy(cache->peer_selector);
+
+    if (cache->tinylfu)
+        tinylfu_destroy(cache->tinylfu);
+
     free(cache);
     SHC_DEBUG("Shardcache node stopped");
 }
@@ -842,9 +1439,9 @@ shardcache_get_async_helper(void *key,
 
     int error = (!dlen && !total_size);
     if (rc != 0 || error) { // error
+        // NOTE: the callback has already been notified of the error
+        //       by one of the branches above
         ATOMIC_SET(arg->stat, -1);
-        if (error)
-            arg->cb(key, klen, NULL, 0, 0, timestamp, arg->priv);
         arc_release_resource(arc, arg->res);
         free(arg);
         return -1;
@@ -888,10 +1485,10 @@ shardcache_get_offset_async(shardcache_t *cache,
     }
 
     cached_object_t *obj = (cached_object_t *)obj_ptr;
-    MUTEX_LOCK(obj->lock);
+    COBJ_LOCK(obj);
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED)) {
         // if marked for eviction we don't want to return this object
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         arc_release_resource(cache->arc, res);
         // but we will try to fetch it again
         SHC_DEBUG("The retreived object has been already evicted, try fetching it again (offset)");
@@ -904,7 +1501,7 @@ shardcache_get_offset_async(shardcache_t *cache,
                 dlen -= offset;
             } else {
                 cb(key, klen, NULL, 0, 0, &obj->ts, priv);
-                MUTEX_UNLOCK(obj->lock);
+                COBJ_UNLOCK(obj);
                 arc_release_resource(cache->arc, res);
                 free(data);
                 return 0;
@@ -924,14 +1521,14 @@ shardcache_get_offset_async(shardcache_t *cache,
         if (UNLIKELY(cache->lazy_expiration && obj_expiration &&
             cache->expire_time > 0 && obj_expiration < time(NULL)))
         {
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             arc_drop_resource(cache->arc, res);
             free(data);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get_offset_async(cache, key, klen, offset, length, cb, priv);
         } else {
             cb(key, klen, data, dlen, dlen, &obj->ts, priv);
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             arc_release_resource(cache->arc, res);
             free(data);
             return 0;
@@ -966,7 +1563,7 @@ shardcache_get_offset_async(shardcache_t *cache,
         listener->cb = shardcache_get_async_helper;
         listener->priv = arg;
         list_push_value(obj->listeners, listener);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
     }
 
     arc_release_resource(cache->arc, res);
@@ -996,7 +1593,7 @@ size_t shardcache_get_offset(shardcache_t *cache,
 
     if (obj_ptr) {
         cached_object_t *obj = (cached_object_t *)obj_ptr;
-        MUTEX_LOCK(obj->lock);
+        COBJ_LOCK(obj);
         if (obj->data) {
             if (dlen && data) {
                 if (offset < obj->dlen) {
@@ -1010,7 +1607,7 @@ size_t shardcache_get_offset(shardcache_t *cache,
                 memcpy(timestamp, &obj->ts, sizeof(struct timeval));
         }
         vlen = obj->dlen;
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
     }
     arc_release_resource(cache->arc, res);
     return (offset < vlen + copied) ? (vlen - offset - copied) : 0;
@@ -1045,13 +1642,25 @@ shardcache_get_async(shardcache_t *cache,
     }
 
     cached_object_t *obj = (cached_object_t *)obj_ptr;
-    MUTEX_LOCK(obj->lock);
+
+    // fast path for hits: complete objects are never modified, so they can be
+    // served without taking the lock (unless they might need to be expired)
+    if (LIKELY(COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+               !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) &&
+               !cache->lazy_expiration))
+    {
+        cb(key, klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
+        arc_release_resource(cache->arc, res);
+        return 0;
+    }
+
+    COBJ_LOCK(obj);
 
     uint32_t retry_timeout = 1<<7;
     while (UNLIKELY(COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED))) {
         // if marked for eviction we don't want to return this object
         // but we will try to fetch it again
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
         arc_release_resource(cache->arc, res);
 
         if (retry_timeout > 1<<11) {
@@ -1074,7 +1683,7 @@ shardcache_get_async(shardcache_t *cache,
         }
 
         obj = (cached_object_t *)obj_ptr;
-        MUTEX_LOCK(obj->lock);
+        COBJ_LOCK(obj);
     }
 
     if (COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE)) {
@@ -1084,14 +1693,14 @@ shardcache_get_async(shardcache_t *cache,
         if (UNLIKELY(cache->lazy_expiration && obj_expiration &&
                      cache->expire_time > 0 && obj_expiration < time(NULL)))
         {
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             arc_drop_resource(cache->arc, res);
             ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_EXPIRES].value);
             return shardcache_get_async(cache, key, klen, cb, priv);
 
         } else {
             cb(key, klen, obj->data, obj->dlen, obj->dlen, &obj->ts, priv);
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             arc_release_resource(cache->arc, res);
         }
     } else {
@@ -1108,7 +1717,7 @@ shardcache_get_async(shardcache_t *cache,
         listener->cb = shardcache_get_async_helper;
         listener->priv = arg;
         list_push_value(obj->listeners, listener);
-        MUTEX_UNLOCK(obj->lock);
+        COBJ_UNLOCK(obj);
     }
 
     return 0;
@@ -1232,6 +1841,103 @@ shardcache_get(shardcache_t *cache,
     return NULL;
 }
 
+struct _shardcache_resource_s {
+    shardcache_t *cache;
+    arc_resource_t res; // the retained cached object (NULL if data is a private copy)
+    void *data;
+    size_t dlen;
+    struct timeval ts;
+};
+
+shardcache_resource_t *
+shardcache_get_cached_resource(shardcache_t *cache, void *key, size_t klen)
+{
+    if (!key)
+        return NULL;
+
+    void *obj_ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, (const void *)key, klen, &obj_ptr);
+    if (!res)
+        return NULL;
+
+    // the flags can be checked without locking the object
+    // and the data of a complete object is never modified
+    cached_object_t *obj = (cached_object_t *)obj_ptr;
+    int usable = COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) &&
+                 !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) &&
+                 obj->data && obj->dlen;
+    if (usable && cache->lazy_expiration && cache->expire_time > 0 &&
+        !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) && !COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) &&
+        obj->ts.tv_sec + cache->expire_time < time(NULL))
+    {
+        // let the normal path take care of the expired object
+        usable = 0;
+    }
+
+    if (!usable) {
+        arc_release_resource(cache->arc, res);
+        return NULL;
+    }
+
+    shardcache_resource_t *resource = malloc(sizeof(shardcache_resource_t));
+    resource->cache = cache;
+    resource->res = res;
+    resource->data = obj->data;
+    resource->dlen = obj->dlen;
+    resource->ts = obj->ts;
+
+    ATOMIC_INCREMENT(cache->cnt[SHARDCACHE_COUNTER_GETS].value);
+
+    return resource;
+}
+
+shardcache_resource_t *
+shardcache_get_resource(shardcache_t *cache, void *key, size_t klen)
+{
+    shardcache_resource_t *resource = shardcache_get_cached_resource(cache, key, klen);
+    if (resource)
+        return resource;
+
+    struct timeval ts = { 0, 0 };
+    size_t vlen = 0;
+    void *value = shardcache_get(cache, key, klen, &vlen, &ts);
+    if (!value)
+        return NULL;
+
+    resource = malloc(sizeof(shardcache_resource_t));
+    resource->cache = cache;
+    resource->res = NULL;
+    resource->data = value;
+    resource->dlen = vlen;
+    resource->ts = ts;
+
+    return resource;
+}
+
+const void *
+shardcache_resource_data(shardcache_resource_t *res, size_t *vlen)
+{
+    if (vlen)
+        *vlen = res->dlen;
+    return res->data;
+}
+
+void
+shardcache_resource_timestamp(shardcache_resource_t *res, struct timeval *timestamp)
+{
+    memcpy(timestamp, &res->ts, sizeof(struct timeval));
+}
+
+void
+shardcache_resource_release(shardcache_resource_t *res)
+{
+    if (res->res)
+        arc_release_resource(res->cache->arc, res->res);
+    else
+        free(res->data);
+    free(res);
+}
+
 size_t
 shardcache_head(shardcache_t *cache,
                 void *key,
@@ -1343,7 +2049,7 @@ shardcache_exists_async(shardcache_t *cache,
     if (is_mine == 1)
     {
         // TODO - clean this bunch of nested conditions
-        if (!ht_exists(cache->volatile_storage, key, klen)) {
+        if (!volatile_store_exists(cache->volatile_storage, key, klen)) {
             if (cache->use_persistent_storage && cache->storage.exist) {
                 if (!cache->storage.exist(key, klen, cache->storage.priv)) {
                     rc = 0;
@@ -1368,10 +2074,10 @@ shardcache_exists_async(shardcache_t *cache,
                 cb(key, klen, -1, priv);
             return -1;
         }
-        char *addr = shardcache_node_get_address(peer);
+        char *addr = shardcache_node_select_address(cache, peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
         if (cb) {
-            rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
+            rc = exists_on_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, fd, 0);
             if (rc == 0) {
                 shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                 arg->key = malloc(klen);
@@ -1392,7 +2098,7 @@ shardcache_exists_async(shardcache_t *cache,
                 cb(key, klen, -1, priv);
             }
         } else {
-            rc = exists_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
+            rc = exists_on_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, fd, 1);
             shardcache_release_connection_for_peer(cache, addr, fd);
         }
     }
@@ -1428,9 +2134,9 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
         arc_resource_t res = arc_lookup(cache->arc, (const void *)key, klen, &obj_ptr, 0);
         if (res) {
             cached_object_t *obj = (cached_object_t *)obj_ptr;
-            MUTEX_LOCK(obj->lock);
+            COBJ_LOCK(obj);
             gettimeofday(&obj->ts, NULL);
-            MUTEX_UNLOCK(obj->lock);
+            COBJ_UNLOCK(obj);
             arc_release_resource(cache->arc, res);
             return obj ? 0 : -1;
         }
@@ -1440,9 +2146,9 @@ shardcache_touch(shardcache_t *cache, void *key, size_t klen)
             SHC_ERROR("Can't find address for node %s", peer);
             return -1;
         }
-        char *addr = shardcache_node_get_address(peer);
+        char *addr = shardcache_node_select_address(cache, peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
-        int rc = touch_on_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd);
+        int rc = touch_on_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, fd);
         shardcache_release_connection_for_peer(cache, addr, fd);
         return rc;
     }
@@ -1519,26 +2225,28 @@ shardcache_store(shardcache_t *cache,
                  int replica)
 
 {
-    void *prev_ptr = NULL;
-    
     int rc = 0;
 
     if (!cache->storage.store) { // the storage is readonly
-        if (inx) {
-            rc = ht_set_if_not_exists(cache->volatile_storage, key, klen, value, vlen);
-        } else {
-            rc = ht_get_and_set(cache->volatile_storage, key, klen, value, vlen, &prev_ptr, NULL);
-            if (prev_ptr) {
-                volatile_object_t *prev = (volatile_object_t *)prev_ptr;
-                ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev->dlen);
-                destroy_volatile(prev);
-            }
+        size_t prev_len = 0;
+        switch (volatile_store_set(cache->volatile_storage, key, klen, value, vlen, 0, inx, &prev_len)) {
+            case VOLATILE_STORE_REPLACED:
+                ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
+                // fall through
+            case VOLATILE_STORE_INSERTED:
+                ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+                rc = 0;
+                break;
+            case VOLATILE_STORE_EXISTS:
+                return 1;
+            default:
+                // the previous value (if any) is still there
+                return -1;
         }
-        return rc;
+    } else {
+        rc = cache->storage.store(key, klen, value, vlen, cache->storage.priv);
     }
 
-    rc = cache->storage.store(key, klen, value, vlen, cache->storage.priv);
-
     if (cache->cache_on_set)
         arc_load(cache->arc, (const void *)key, klen, value, vlen);
     else
@@ -1590,64 +2298,64 @@ shardcache_set_internal(shardcache_t *cache,
                    (int)vlen, keystr);
 
         if (!cache->use_persistent_storage || expire) {
-            volatile_object_t *prev = NULL;
             // ensure removing this key from the persistent storage (if present)
             // since it's now going to be a volatile item
             if (cache->use_persistent_storage && cache->storage.remove)
                 cache->storage.remove(key, klen, cache->storage.priv);
 
-            if (inx && ht_exists(cache->volatile_storage, key, klen)) {
-                SHC_DEBUG("A volatile value already exists for key %s", keystr);
-                if (cb)
-                    cb(key, klen, 1, priv);
-                return 1;
-            }
-
-            volatile_object_t *obj = malloc(sizeof(volatile_object_t));
-            obj->data = malloc(vlen);
-            memcpy(obj->data, value, vlen);
-            obj->dlen = vlen;
             time_t now = time(NULL);
-            time_t real_expire = expire ? time(NULL) + expire : 0;
-            obj->expire = real_expire;
+            time_t real_expire = expire ? now + expire : 0;
 
             SHC_DEBUG2("Setting volatile item %s to expire %d (now: %d)", 
-                keystr, obj->expire, (int)now);
-
-            void *prev_ptr = NULL;
-            if (inx) {
-                rc = ht_set(cache->volatile_storage, key, klen,
-                             obj, sizeof(volatile_object_t));
-            } else {
-                rc = ht_get_and_set(cache->volatile_storage, key, klen,
-                                     obj, sizeof(volatile_object_t),
-                                     &prev_ptr, NULL);
-            }
-
-            if (prev_ptr) {
-                prev = (volatile_object_t *)prev_ptr;
-                if (vlen > prev->dlen) {
-                    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                                    vlen - prev->dlen);
-                } else {
-                    ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                                    prev->dlen - vlen);
-                }
-                destroy_volatile(prev); 
-                if (cache->cache_on_set)
-                    arc_load(cache->arc, (const void *)key, klen, value, vlen);
-                else
-                    arc_remove(cache->arc, (const void *)key, klen);
-
-                if (!replica)
-                    shardcache_commence_eviction(cache, key, klen);
+                keystr, (int)real_expire, (int)now);
+
+            size_t prev_len = 0;
+            volatile_store_set_result_t res = volatile_store_set(cache->volatile_storage,
+                                                                 key,
+                                                                 klen,
+                                                                 value,
+                                                                 vlen,
+                                                                 real_expire,
+                                                                 inx,
+                                                                 &prev_len);
+            switch (res) {
+                case VOLATILE_STORE_EXISTS:
+                    SHC_DEBUG("A volatile value already exists for key %s", keystr);
+                    if (cb)
+                        cb(key, klen, 1, priv);
+                    return 1;
+                case VOLATILE_STORE_ERROR:
+                    SHC_WARNING("Can't store volatile item %s (%d bytes) in the volatile storage",
+                                keystr, (int)vlen);
+                    rc = -1;
+                    break;
+                case VOLATILE_STORE_REPLACED:
+                    if (vlen > prev_len) {
+                        ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                                        vlen - prev_len);
+                    } else {
+                        ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
+                                        prev_len - vlen);
+                    }
+                    if (cache->cache_on_set)
+                        arc_load(cache->arc, (const void *)key, klen, value, vlen);
+                    else
+                        arc_remove(cache->arc, (const void *)key, klen);
 
-            } else {
-                ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+                    if (!replica)
+                        shardcache_commence_eviction(cache, key, klen);
+                    rc = 0;
+                    break;
+                case VOLATILE_STORE_INSERTED:
+                    ATOMIC_INCREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+                    rc = 0;
+                    break;
             }
 
-            if (obj->expire)
+            if (rc == 0 && real_expire)
                 shardcache_schedule_expiration(cache, key, klen, expire, 1);
+            else if (rc == 0 && res == VOLATILE_STORE_REPLACED)
+                shardcache_unschedule_expiration(cache, key, klen, 1);
         } else {
             rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
         }
@@ -1669,13 +2377,13 @@ shardcache_set_internal(shardcache_t *cache,
 
             return rc;
         }
-        char *addr = shardcache_node_get_address(peer);
+        char *addr = shardcache_node_select_address(cache, peer);
 
         int fd = shardcache_get_connection_for_peer(cache, addr);
 
         if (inx) {
             if (cb) {
-                rc = add_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 0);
+                rc = add_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, value, vlen, expire, fd, 0);
                 if (rc == 0) {
                     shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                     arg->key = malloc(klen);
@@ -1701,7 +2409,7 @@ shardcache_set_internal(shardcache_t *cache,
                         rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
                 }
             } else {
-                rc = add_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 1);
+                rc = add_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, value, vlen, expire, fd, 1);
                 if (rc == 0) {
                     shardcache_release_connection_for_peer(cache, addr, fd);
                 } else {
@@ -1711,7 +2419,7 @@ shardcache_set_internal(shardcache_t *cache,
                 }
             }
         } else if (cb) {
-            rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 0);
+            rc = send_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, value, vlen, expire, fd, 0);
             if (rc == 0) {
                 shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                 arg->key = malloc(klen);
@@ -1736,7 +2444,7 @@ shardcache_set_internal(shardcache_t *cache,
                 rc = shardcache_store(cache, key, klen, value, vlen, inx, replica);
             }
         } else {
-            rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, expire, fd, 1);
+            rc = send_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, value, vlen, expire, fd, 1);
             if (rc == 0) {
                 shardcache_release_connection_for_peer(cache, addr, fd);
             } else {
@@ -1884,8 +2592,8 @@ shardcache_del_internal(shardcache_t *cache,
 
     if (is_mine == 1)
     {
-        void *prev_ptr;
-        rc = ht_delete(cache->volatile_storage, key, klen, &prev_ptr, NULL);
+        size_t prev_len = 0;
+        rc = volatile_store_delete(cache->volatile_storage, key, klen, &prev_len);
 
         if (rc != 0) {
             if (cache->use_persistent_storage) {
@@ -1900,12 +2608,9 @@ shardcache_del_internal(shardcache_t *cache,
                     rc = 0;
                 }
             }
-        } else if (prev_ptr) {
+        } else {
             shardcache_unschedule_expiration(cache, key, klen, 1);
-            volatile_object_t *prev_item = (volatile_object_t *)prev_ptr;
-            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value,
-                            prev_item->dlen);
-            destroy_volatile(prev_item);
+            ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, prev_len);
         }
 
         if (ATOMIC_READ(cache->evict_on_delete))
@@ -1927,11 +2632,11 @@ shardcache_del_internal(shardcache_t *cache,
                 cb(key, klen, -1, priv);
             return -1;
         }
-        char *addr = shardcache_node_get_address(peer);
+        char *addr = shardcache_node_select_address(cache, peer);
         int fd = shardcache_get_connection_for_peer(cache, addr);
         int rc = -1;
         if (cb) {
-            rc = delete_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 0);
+            rc = delete_from_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, fd, 0);
             if (rc == 0) {
                 shardcache_async_command_helper_arg_t *arg = calloc(1, sizeof(shardcache_async_command_helper_arg_t));
                 arg->key = malloc(klen);
@@ -1956,7 +2661,7 @@ shardcache_del_internal(shardcache_t *cache,
                 cb(key, klen, -1, priv);
             }
         } else {
-            rc = delete_from_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, fd, 1);
+            rc = delete_from_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0), key, klen, fd, 1);
             if (rc == 0)
                 shardcache_release_connection_for_peer(cache, addr, fd);
             else
@@ -2093,11 +2798,10 @@ shardcache_free_index(shardcache_storage_index_t *index)
     free(index);
 }
 
-static int
-expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t vlen, void *user)
+static volatile_store_iterator_status_t
+expire_migrated(void *key, size_t klen, void *value, size_t vlen, time_t expire, void *user)
 {
     shardcache_t *cache = (shardcache_t *)user;
-    volatile_object_t *v = (volatile_object_t *)value;
 
     char node_name[1024];
     size_t node_len = sizeof(node_name);
@@ -2105,17 +2809,282 @@ expire_migrated(hashtable_t *table, void *key, size_t klen, void *value, size_t
     int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
     if (is_mine == -1) {
         SHC_WARNING("expire_migrated running while no migration continuum present ... aborting");
-        return 0;
+        return VOLATILE_STORE_ITERATOR_STOP;
     } else if (!is_mine) {
         char keystr[1024];
         KEY2STR(key, klen, keystr, sizeof(keystr));
         SHC_DEBUG("Forcing Key %s to expire because not owned anymore", keystr);
 
-        v->expire = 0;
+        ATOMIC_DECREASE(cache->cnt[SHARDCACHE_COUNTER_TABLE_SIZE].value, vlen);
+        return VOLATILE_STORE_ITERATOR_REMOVE;
     }
-    return 1;
+    return VOLATILE_STORE_ITERATOR_CONTINUE;
+}
+
+
+typedef struct {
+    shardcache_t *cache;
+    uint64_t migrated_items;
+    uint64_t scanned_items;
+    uint64_t total_items;
+    uint64_t errors;
+    linked_list_t *to_delete;  // the index items successfully copied to their new owner
+    int aborted;
+    pthread_mutex_t throttle_lock;
+    uint64_t throttle_next;    // the time (in microseconds) when the next batch can be sent
+} shardcache_migration_t;
+
+typedef struct {
+    shardcache_migration_t *migration;
+    char *label;               // the label of the destination peer
+    linked_list_t *items;      // the index items to be copied to the peer
+    pthread_t *workers;
+    int num_workers;
+} shardcache_migration_peer_t;
+
+static int
+migration_aborted(shardcache_t *cache)
+{
+    SPIN_LOCK(cache->migration_lock);
+    int aborted = (cache->migration == NULL);
+    SPIN_UNLOCK(cache->migration_lock);
+    return aborted;
+}
+
+// Reserve a time slot for a batch of items according to the configured
+// rate limits and wait until it begins. All the workers share the same slots
+// so the limits apply to the migration as a whole and not to each worker
+static void
+migration_throttle(shardcache_migration_t *mg, int num_items, size_t num_bytes)
+{
+    shardcache_t *cache = mg->cache;
+    uint64_t max_ops = ATOMIC_READ(cache->migration_max_ops);
+    uint64_t max_bytes = ATOMIC_READ(cache->migration_max_bytes);
+
+    if (!max_ops && !max_bytes)
+        return;
+
+    uint64_t cost = 0;
+    if (max_ops)
+        cost = (num_items * 1000000ULL) / max_ops;
+    if (max_bytes) {
+        uint64_t bytes_cost = (num_bytes * 1000000ULL) / max_bytes;
+        if (bytes_cost > cost)
+            cost = bytes_cost;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    MUTEX_LOCK(mg->throttle_lock);
+    if (mg->throttle_next < now)
+        mg->throttle_next = now;
+    uint64_t wait = mg->throttle_next - now;
+    mg->throttle_next += cost;
+    MUTEX_UNLOCK(mg->throttle_lock);
+
+    while (wait && !ATOMIC_READ(mg->aborted)) {
+        uint64_t chunk = wait > 100000 ? 100000 : wait;
+        usleep(chunk);
+        wait -= chunk;
+    }
+}
+
+static void
+migration_item_done(shardcache_migration_t *mg,
+                    shardcache_migration_peer_t *mpeer,
+                    shardcache_storage_index_item_t *item,
+                    char *addr,
+                    int success)
+{
+    if (success) {
+        ATOMIC_INCREMENT(mg->migrated_items);
+        list_push_value(mg->to_delete, item);
+    } else {
+        char keystr[1024];
+        KEY2STR(item->key, item->klen, keystr, sizeof(keystr));
+        SHC_WARNING("Errors copying %s to peer %s (%s)", keystr, mpeer->label, addr);
+        ATOMIC_INCREMENT(mg->errors);
+    }
+}
+
+static void
+migrate_batch(shardcache_migration_peer_t *mpeer,
+              shardcache_storage_index_item_t **items,
+              shardcache_record_t *keys,
+              shardcache_record_t *values,
+              int num_items)
+{
+    shardcache_migration_t *mg = mpeer->migration;
+    shardcache_t *cache = mg->cache;
+    int i;
+
+    shardcache_node_t *peer = shardcache_node_select(cache, mpeer->label);
+    if (!peer) {
+        SHC_ERROR("Can't find address for peer %s (me : %s)", mpeer->label, cache->me);
+        ATOMIC_INCREASE(mg->errors, num_items);
+        return;
+    }
+
+    char *addr = shardcache_node_select_address(cache, peer);
+    SHC_DEBUG("Migrator copying %d items to peer %s (%s)", num_items, mpeer->label, addr);
+
+    int fd = shardcache_get_connection_for_peer(cache, addr);
+
+    char *results = (num_items > 1) ? malloc(num_items) : NULL;
+    if (results) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        int rc = set_multi_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0),
+                                   keys, values, num_items, 0, results, fd);
+        gettimeofday(&end, NULL);
+        shardcache_report_peer(cache, addr, rc == 0, shardcache_elapsed_usecs(&start, &end));
+        if (rc == 0) {
+            if (fd >= 0)
+                shardcache_release_connection_for_peer(cache, addr, fd);
+            for (i = 0; i < num_items; i++)
+                migration_item_done(mg, mpeer, items[i], addr, results[i] == SHC_RES_OK);
+            free(results);
+            return;
+        }
+        free(results);
+        // peers not supporting SET_MULTI will reject the whole batch,
+        // so let's fall back to copying the items one by one
+        if (fd >= 0)
+            close(fd);
+        fd = shardcache_get_connection_for_peer(cache, addr);
+    }
+
+    for (i = 0; i < num_items; i++) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        int rc = send_to_peer(addr, (char *)cache->auth, shardcache_sig_hdr(cache, 0),
+                              keys[i].v, keys[i].l, values[i].v, values[i].l, 0, fd, 1);
+        gettimeofday(&end, NULL);
+        shardcache_report_peer(cache, addr, rc == 0, shardcache_elapsed_usecs(&start, &end));
+        if (rc != 0 && fd >= 0) {
+            close(fd);
+            fd = shardcache_get_connection_for_peer(cache, addr);
+        }
+        migration_item_done(mg, mpeer, items[i], addr, rc == 0);
+    }
+
+    if (fd >= 0)
+        shardcache_release_connection_for_peer(cache, addr, fd);
+}
+
+static void *
+migrate_worker(void *priv)
+{
+    shardcache_migration_peer_t *mpeer = (shardcache_migration_peer_t *)priv;
+    shardcache_migration_t *mg = mpeer->migration;
+    shardcache_t *cache = mg->cache;
+
+    // the batch size is user-provided, don't allocate more
+    // than what is needed to hold all the queued items
+    int batch_size = ATOMIC_READ(cache->migration_batch_size);
+    int queued = list_count(mpeer->items);
+    if (batch_size > queued)
+        batch_size = queued;
+    if (batch_size < 1)
+        batch_size = 1;
+
+    shardcache_storage_index_item_t **items = malloc(batch_size * sizeof(shardcache_storage_index_item_t *));
+    shardcache_record_t *keys = malloc(batch_size * sizeof(shardcache_record_t));
+    shardcache_record_t *values = malloc(batch_size * sizeof(shardcache_record_t));
+    if (!items || !keys || !values) {
+        SHC_ERROR("Can't allocate a migration batch of %d items", batch_size);
+        ATOMIC_SET(mg->aborted, 1);
+        free(items);
+        free(keys);
+        free(values);
+        return NULL;
+    }
+
+    shardcache_thread_init(cache);
+
+    while (!ATOMIC_READ(mg->aborted)) {
+        if (migration_aborted(cache)) {
+            SHC_WARNING("Migrator running while no migration continuum present ... aborting");
+            ATOMIC_SET(mg->aborted, 1);
+            break;
+        }
+
+        int num_items = 0;
+        size_t num_bytes = 0;
+        shardcache_storage_index_item_t *item = NULL;
+        while (num_items < batch_size && (item = list_shift_value(mpeer->items))) {
+            void *value = NULL;
+            size_t vlen = 0;
+            int rc = cache->storage.fetch(item->key, item->klen, &value, &vlen, cache->storage.priv);
+            if (rc == -1) {
+                SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
+                ATOMIC_INCREMENT(mg->errors);
+                ATOMIC_INCREMENT(mg->scanned_items);
+                continue;
+            }
+            if (!value) {
+                ATOMIC_INCREMENT(mg->scanned_items);
+                continue;
+            }
+            items[num_items] = item;
+            keys[num_items].v = item->key;
+            keys[num_items].l = item->klen;
+            values[num_items].v = value;
+            values[num_items].l = vlen;
+            num_bytes += vlen;
+            num_items++;
+        }
+
+        if (!num_items)
+            break; // the queue was filled before starting the workers, so we are done
+
+        migration_throttle(mg, num_items, num_bytes);
+
+        if (!ATOMIC_READ(mg->aborted))
+            migrate_batch(mpeer, items, keys, values, num_items);
+
+        int i;
+        for (i = 0; i < num_items; i++)
+            free(values[i].v);
+
+        ATOMIC_INCREASE(mg->scanned_items, num_items);
+    }
+
+    free(items);
+    free(keys);
+    free(values);
+
+    shardcache_thread_end(cache);
+    return NULL;
+}
+
+static shardcache_migration_peer_t *
+migration_peer_get(shardcache_migration_t *mg, linked_list_t *peers, char *label)
+{
+    int i;
+    for (i = 0; i < list_count(peers); i++) {
+        shardcache_migration_peer_t *mpeer = list_pick_value(peers, i);
+        if (strcmp(mpeer->label, label) == 0)
+            return mpeer;
+    }
+    shardcache_migration_peer_t *mpeer = calloc(1, sizeof(shardcache_migration_peer_t));
+    mpeer->migration = mg;
+    mpeer->label = strdup(label);
+    mpeer->items = list_create();
+    list_push_value(peers, mpeer);
+    return mpeer;
 }
 
+static void
+migration_peer_destroy(shardcache_migration_peer_t *mpeer)
+{
+    list_destroy(mpeer->items);
+    free(mpeer->workers);
+    free(mpeer->label);
+    free(mpeer);
+}
 
 void *
 migrate(void *priv)
@@ -2124,25 +3093,29 @@ migrate(void *priv)
 
     shardcache_storage_index_t *index = shardcache_get_index(cache);
     int aborted = 0;
-    linked_list_t *to_delete = list_create();
 
-    uint64_t migrated_items = 0;
-    uint64_t scanned_items = 0;
-    uint64_t errors = 0;
-    uint64_t total_items = 0;
+    shardcache_migration_t mg = {
+        .cache = cache,
+        .to_delete = list_create()
+    };
+    MUTEX_INIT(mg.throttle_lock);
+
+    linked_list_t *peers = list_create();
 
     shardcache_thread_init(cache);
 
     if (index) {
-        total_items = index->size;
+        mg.total_items = index->size;
 
-        shardcache_counter_add(cache->counters, "migrated_items", &migrated_items);
-        shardcache_counter_add(cache->counters, "scanned_items", &scanned_items);
-        shardcache_counter_add(cache->counters, "total_items", &total_items);
-        shardcache_counter_add(cache->counters, "migration_errors", &errors);
+        shardcache_counter_add(cache->counters, "migrated_items", &mg.migrated_items);
+        shardcache_counter_add(cache->counters, "scanned_items", &mg.scanned_items);
+        shardcache_counter_add(cache->counters, "total_items", &mg.total_items);
+        shardcache_counter_add(cache->counters, "migration_errors", &mg.errors);
 
-        SHC_INFO("Migrator starting (%d items to precess)", total_items);
+        SHC_INFO("Migrator starting (%d items to precess)", mg.total_items);
 
+        // first distribute the items we don't own anymore among
+        // the queues of their new owners ...
         int i;
         for (i = 0; i < index->size; i++) {
             size_t klen = index->items[i].klen;
@@ -2152,56 +3125,56 @@ migrate(void *priv)
             size_t node_len = sizeof(node_name);
             memset(node_name, 0, node_len);
 
-            char keystr[1024];
-            KEY2STR(key, klen, keystr, sizeof(keystr));
-
-            SHC_DEBUG("Migrator processign key %s", keystr);
-
             int is_mine = shardcache_test_migration_ownership(cache, key, klen, node_name, &node_len);
 
-            int rc = 0;
-            
             if (is_mine == -1) {
                 SHC_WARNING("Migrator running while no migration continuum present ... aborting");
-                ATOMIC_INCREMENT(errors);
+                ATOMIC_INCREMENT(mg.errors);
                 aborted = 1;
                 break;
-            } else if (!is_mine) {
-                // if we are not the owner try asking our peer responsible for this data
-                void *value = NULL;
-                size_t vlen = 0;
-                if (cache->storage.fetch) {
-                    rc = cache->storage.fetch(key, klen, &value, &vlen, cache->storage.priv);
-                    if (rc == -1) {
-                        SHC_ERROR("Fetch storage callback retunrned an error during migration (%d)", rc);
-                        ATOMIC_INCREMENT(errors);
-                        ATOMIC_INCREMENT(scanned_items);
-                        continue;
+            } else if (!is_mine && cache->storage.fetch) {
+                // if we are not the owner the item needs to be copied to our peer responsible for it
+                shardcache_migration_peer_t *mpeer = migration_peer_get(&mg, peers, node_name);
+                list_push_value(mpeer->items, &index->items[i]);
+            } else {
+                ATOMIC_INCREMENT(mg.scanned_items);
+            }
+        }
+
+        // ... and then start the workers copying them in parallel
+        if (!aborted) {
+            int num_workers = ATOMIC_READ(cache->migration_workers);
+            if (num_workers < 1)
+                num_workers = 1;
+
+            for (i = 0; i < list_count(peers); i++) {
+                shardcache_migration_peer_t *mpeer = list_pick_value(peers, i);
+                int count = list_count(mpeer->items);
+                int n = (count < num_workers) ? count : num_workers;
+                SHC_DEBUG("Migrator starting %d workers to copy %d items to peer %s",
+                          n, count, mpeer->label);
+                mpeer->workers = calloc(n, sizeof(pthread_t));
+                for (mpeer->num_workers = 0; mpeer->num_workers < n; mpeer->num_workers++) {
+                    if (pthread_create(&mpeer->workers[mpeer->num_workers], NULL, migrate_worker, mpeer) != 0) {
+                        SHC_ERROR("Can't create a new migration worker: %s", strerror(errno));
+                        break;
                     }
                 }
-                if (value) {
-                    shardcache_node_t *peer = shardcache_node_select(cache, (char *)node_name);
-                    if (peer) {
-                        char *addr = shardcache_node_get_address(peer);
-                        SHC_DEBUG("Migrator copying %s to peer %s (%s)", keystr, node_name, addr);
-                        int fd = shardcache_get_connection_for_peer(cache, addr);
-                        rc = send_to_peer(addr, (char *)cache->auth, SHC_HDR_SIGNATURE_SIP, key, klen, value, vlen, 0, fd, 1);
-                        if (rc == 0) {
-                            shardcache_release_connection_for_peer(cache, addr, fd);
-                            ATOMIC_INCREMENT(migrated_items);
-                            list_push_value(to_delete, &index->items[i]);
-                        } else {
-                            close(fd);
-                            SHC_WARNING("Errors copying %s to peer %s (%s)", keystr, node_name, addr);
-                            ATOMIC_INCREMENT(errors);
-                        }
-                    } else {
-                        SHC_ERROR("Can't find address for peer %s (me : %s)", node_name, cache->me);
-                        ATOMIC_INCREMENT(errors);
-                    }
+                if (!mpeer->num_workers) {
+                    ATOMIC_INCREASE(mg.errors, count);
+                    aborted = 1;
                 }
             }
-            ATOMIC_INCREMENT(scanned_items);
+
+            for (i = 0; i < list_count(peers); i++) {
+                shardcache_migration_peer_t *mpeer = list_pick_value(peers, i);
+                int j;
+                for (j = 0; j < mpeer->num_workers; j++)
+                    pthread_join(mpeer->workers[j], NULL);
+            }
+
+            if (ATOMIC_READ(mg.aborted))
+                aborted = 1;
         }
 
         shardcache_counter_remove(cache->counters, "migrated_items");
@@ -2212,7 +3185,7 @@ migrate(void *priv)
 
     if (!aborted) {
             SHC_INFO("Migration completed, now removing not-owned  items");
-        shardcache_storage_index_item_t *item = list_shift_value(to_delete);
+        shardcache_storage_index_item_t *item = list_shift_value(mg.to_delete);
         while (item) {
             if (cache->storage.remove)
                 cache->storage.remove(item->key, item->klen, cache->storage.priv);
@@ -2221,22 +3194,25 @@ migrate(void *priv)
             KEY2STR(item->key, item->klen, ikeystr, sizeof(ikeystr));
             SHC_DEBUG2("removed item %s", ikeystr);
 
-            item = list_shift_value(to_delete);
+            item = list_shift_value(mg.to_delete);
         }
 
         // and now let's expire all the volatile keys that don't belong to us anymore
-        ht_foreach_pair(cache->volatile_storage, expire_migrated, cache);
+        volatile_store_foreach(cache->volatile_storage, expire_migrated, cache);
         //ATOMIC_SET(cache->next_expire, 0);
     }
 
-    list_destroy(to_delete);
+    list_destroy(mg.to_delete);
+    list_set_free_value_callback(peers, (free_value_callback_t)migration_peer_destroy);
+    list_destroy(peers);
+    MUTEX_DESTROY(mg.throttle_lock);
 
     SPIN_LOCK(cache->migration_lock);
     cache->migration_done = 1;
     SPIN_UNLOCK(cache->migration_lock);
     if (index) {
         SHC_INFO("Migrator ended: processed %d items, migrated %d, errors %d",
-                total_items, migrated_items, errors);
+                mg.total_items, mg.migrated_items, mg.errors);
     }
 
     if (index)
@@ -2315,10 +3291,11 @@ shardcache_set_migration_continuum(shardcache_t *cache,
         shard_lens[i] = strlen(shard_names[i]);
     }
 
-    cache->migration = chash_create((const char **)shard_names,
-                                    shard_lens,
-                                    num_nodes,
-                                    200);
+    shardcache_continuum_t *continuum = shardcache_continuum_create(cache,
+                                                                    (const char **)shard_names,
+                                                                    shard_lens,
+                                                                    num_nodes);
+    shardcache_continuum_set(cache, &cache->migration, continuum);
 
     SPIN_UNLOCK(cache->migration_lock);
     return 0;
@@ -2363,7 +3340,7 @@ shardcache_migration_begin_internal(shardcache_t *cache,
                 int fd = shardcache_get_connection_for_peer(cache, addr);
                 int rc = migrate_peer(addr,
                                       (char *)cache->auth,
-                                      SHC_HDR_SIGNATURE_SIP,
+                                      shardcache_sig_hdr(cache, 0),
                                       fbuf_data(&mgb_message),
                                       fbuf_used(&mgb_message), fd);
                 shardcache_release_connection_for_peer(cache, addr, fd);
@@ -2397,12 +3374,11 @@ shardcache_migration_abort_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->migration);
+        shardcache_continuum_set(cache, &cache->migration, NULL);
         free(cache->migration_shards);
         SHC_NOTICE("Migration aborted");
         ret = 0;
     }
-    cache->migration = NULL;
     cache->migration_shards = NULL;
     cache->num_migration_shards = 0;
 
@@ -2425,12 +3401,15 @@ shardcache_migration_end_internal(shardcache_t *cache)
     int ret = -1;
     SPIN_LOCK(cache->migration_lock);
     if (cache->migration) {
-        chash_free(cache->chash);
+        // readers still using the old continuum will keep it alive
+        // until they release it
+        refcnt_node_t *ref = deref_link(cache->continuum_refcnt, &cache->migration);
+        shardcache_continuum_publish(cache, &cache->chash, ref);
+        shardcache_continuum_publish(cache, &cache->migration, NULL);
+        shardcache_continuum_release(cache, ref);
         shardcache_free_nodes(cache->shards, cache->num_shards);
-        cache->chash = cache->migration;
         cache->shards = cache->migration_shards;
         cache->num_shards = cache->num_migration_shards;
-        cache->migration = NULL;
         cache->migration_shards = NULL;
         cache->num_migration_shards = 0;
         SHC_NOTICE("Migration ended");
@@ -2488,6 +3467,66 @@ shardcache_use_persistent_connections(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->use_persistent_connections, new_value);
 }
 
+int
+shardcache_pipeline_depth(shardcache_t *cache, int new_value)
+{
+    return connections_pipeline_max_depth(cache->connections_pipeline, new_value);
+}
+
+int
+shardcache_migration_workers(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_WORKERS_DEFAULT;
+    return shardcache_get_set_option(&cache->migration_workers, new_value);
+}
+
+int
+shardcache_migration_batch_size(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT;
+    return shardcache_get_set_option(&cache->migration_batch_size, new_value);
+}
+
+int
+shardcache_migration_rate_limit(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_ops, new_value);
+}
+
+int
+shardcache_migration_bandwidth_limit(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->migration_max_bytes, new_value);
+}
+
+int
+shardcache_protocol_version(shardcache_t *cache, int new_value)
+{
+    if (new_value == 0)
+        new_value = SHARDCACHE_PROTOCOL_VERSION_DEFAULT;
+
+    if (new_value > SHC_PROTOCOL_VERSION) {
+        SHC_ERROR("Unsupported protocol version %d", new_value);
+        return -1;
+    }
+
+    // V2 messages are checksummed but not signed
+    if (new_value > 1 && cache->auth) {
+        SHC_ERROR("Protocol version %d can't be used if a secret is configured", new_value);
+        return -1;
+    }
+
+    return shardcache_get_set_option(&cache->protocol_version, new_value);
+}
+
+int
+shardcache_streaming_threshold(shardcache_t *cache, int new_value)
+{
+    return shardcache_get_set_option(&cache->streaming_threshold, new_value);
+}
+
 int
 shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value)
 {
@@ -2515,6 +3554,15 @@ shardcache_force_caching(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->force_caching, new_value);
 }
 
+int
+shardcache_set_admission_policy(shardcache_t *cache, shardcache_admission_policy_t *policy)
+{
+    if (policy && !policy->admit)
+        return -1;
+    ATOMIC_SET(cache->admission_policy, policy ? policy : &cache->tinylfu_policy);
+    return 0;
+}
+
 int
 shardcache_iomux_run_timeout_low(shardcache_t *cache, int new_value)
 {
@@ -2549,6 +3597,289 @@ shardcache_lazy_expiration(shardcache_t *cache, int new_value)
     return shardcache_get_set_option(&cache->lazy_expiration, new_value);
 }
 
+size_t
+shardcache_set_cache_size(shardcache_t *cache, size_t new_size)
+{
+    size_t old_size = ATOMIC_READ(cache->arc_size);
+    if (new_size > 0 && new_size != old_size) {
+        ATOMIC_SET(cache->arc_size, new_size);
+        arc_set_size(cache->arc, new_size);
+        shardcache_update_size_counters(cache);
+        ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+        SHC_NOTICE("Cache size changed from %zu to %zu", old_size, new_size);
+    }
+    return old_size;
+}
+
+/*
+ * Snapshot format:
+ *   [ magic (4 bytes) | version (uint32) ] followed by a record for each
+ *   object in the arc lists:
+ *   [ list (uint8) | klen (uint32) | vlen (uint32) | key | value ]
+ *   integers are in network byte order and ghost objects have no value
+ */
+typedef struct {
+    shardcache_t *cache;
+    FILE *file;
+    int count;
+    int error;
+} shardcache_snapshot_arg_t;
+
+static int
+shardcache_snapshot_object(const void *key, size_t klen, void *ptr, arc_list_id_t list, void *priv)
+{
+    shardcache_snapshot_arg_t *arg = (shardcache_snapshot_arg_t *)priv;
+    cached_object_t *obj = (cached_object_t *)ptr;
+
+    // volatile values are not saved, they would outlive their expiration
+    // once restored (the snapshot doesn't carry their ttl)
+    if (volatile_store_exists(arg->cache->volatile_storage, (void *)key, klen))
+        return 1;
+
+    void *data = NULL;
+    uint32_t dlen = 0;
+    if (list == ARC_LIST_MRU || list == ARC_LIST_MFU) {
+        // only complete objects can be accessed without locking them
+        // (and those being evicted are not worth saving)
+        if (!COBJ_CHECK_FLAGS(obj, COBJ_FLAG_COMPLETE) ||
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICT) ||
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_EVICTED) ||
+            COBJ_CHECK_FLAGS(obj, COBJ_FLAG_DROP) ||
+            !obj->data || !obj->dlen)
+        {
+            return 1;
+        }
+        data = obj->data;
+        dlen = obj->dlen;
+    }
+
+    uint8_t type = (uint8_t)list;
+    uint32_t nklen = htonl((uint32_t)klen);
+    uint32_t ndlen = htonl(dlen);
+    if (fwrite(&type, 1, 1, arg->file) != 1 ||
+        fwrite(&nklen, sizeof(nklen), 1, arg->file) != 1 ||
+        fwrite(&ndlen, sizeof(ndlen), 1, arg->file) != 1 ||
+        fwrite(key, klen, 1, arg->file) != 1 ||
+        (dlen && fwrite(data, dlen, 1, arg->file) != 1))
+    {
+        arg->error = errno;
+        return 0;
+    }
+    arg->count++;
+    return 1;
+}
+
+int
+shardcache_snapshot(shardcache_t *cache, char *filename)
+{
+    // write to a temporary file first so that an existing
+    // snapshot is replaced only by a complete one
+    char tmpname[PATH_MAX];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    FILE *file = fopen(tmpname, "w");
+    if (!file) {
+        SHC_ERROR("Can't open the snapshot file %s: %s", tmpname, strerror(errno));
+        return -1;
+    }
+
+    shardcache_snapshot_arg_t arg = {
+        .cache = cache,
+        .file = file,
+        .count = 0,
+        .error = 0
+    };
+
+    uint32_t version = htonl(SHARDCACHE_SNAPSHOT_VERSION);
+    if (fwrite(SHARDCACHE_SNAPSHOT_MAGIC, 4, 1, file) != 1 ||
+        fwrite(&version, sizeof(version), 1, file) != 1)
+    {
+        arg.error = errno;
+    }
+
+    if (!arg.error)
+        arc_foreach(cache->arc, shardcache_snapshot_object, &arg);
+
+    if (fclose(file) != 0 && !arg.error)
+        arg.error = errno;
+
+    if (arg.error || rename(tmpname, filename) != 0) {
+        SHC_ERROR("Can't write the snapshot file %s: %s",
+                  filename, strerror(arg.error ? arg.error : errno));
+        unlink(tmpname);
+        return -1;
+    }
+
+    SHC_NOTICE("Saved %d cached objects to %s", arg.count, filename);
+    return arg.count;
+}
+
+int
+shardcache_restore(shardcache_t *cache, char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        SHC_ERROR("Can't open the snapshot file %s: %s", filename, strerror(errno));
+        return -1;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    if (fread(magic, 4, 1, file) != 1 ||
+        memcmp(magic, SHARDCACHE_SNAPSHOT_MAGIC, 4) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 ||
+        ntohl(version) != SHARDCACHE_SNAPSHOT_VERSION)
+    {
+        SHC_ERROR("%s is not a valid snapshot file", filename);
+        fclose(file);
+        return -1;
+    }
+
+    shardcache_admission_policy_t *policy = ATOMIC_READ(cache->admission_policy);
+    int count = 0;
+    int skipped = 0;
+    void *key = NULL;
+    void *data = NULL;
+    size_t key_size = 0;
+    size_t data_size = 0;
+    for (;;) {
+        uint8_t type;
+        uint32_t klen, dlen;
+        if (fread(&type, 1, 1, file) != 1)
+            break; // end of the snapshot
+
+        if (fread(&klen, sizeof(klen), 1, file) != 1 ||
+            fread(&dlen, sizeof(dlen), 1, file) != 1)
+        {
+            SHC_WARNING("Truncated snapshot file %s", filename);
+            break;
+        }
+        klen = ntohl(klen);
+        dlen = ntohl(dlen);
+
+        if (klen > SHARDCACHE_MSG_MAX_RECORD_LEN || dlen > SHARDCACHE_MSG_MAX_RECORD_LEN) {
+            SHC_WARNING("Corrupted snapshot file %s (record of %u + %u bytes)", filename, klen, dlen);
+            break;
+        }
+
+        if (klen > key_size) {
+            void *new_key = realloc(key, klen);
+            if (!new_key) {
+                SHC_ERROR("Can't allocate %u bytes while restoring %s", klen, filename);
+                break;
+            }
+            key = new_key;
+            key_size = klen;
+        }
+        if (dlen > data_size) {
+            void *new_data = realloc(data, dlen);
+            if (!new_data) {
+                SHC_ERROR("Can't allocate %u bytes while restoring %s", dlen, filename);
+                break;
+            }
+            data = new_data;
+            data_size = dlen;
+        }
+
+        if ((klen && fread(key, klen, 1, file) != 1) ||
+            (dlen && fread(data, dlen, 1, file) != 1))
+        {
+            SHC_WARNING("Truncated snapshot file %s", filename);
+            break;
+        }
+
+        if (type == ARC_LIST_MRU || type == ARC_LIST_MFU) {
+            // the owners of the keys might have changed since the snapshot was
+            // taken, the copies of the keys owned by other nodes might be stale
+            int is_mine = shardcache_test_migration_ownership(cache, key, klen, NULL, NULL);
+            if (is_mine == -1)
+                is_mine = shardcache_test_ownership(cache, key, klen, NULL, NULL);
+            if (!is_mine) {
+                skipped++;
+                continue;
+            }
+        }
+
+        switch (type) {
+            case ARC_LIST_MRU:
+                if (dlen && arc_load(cache->arc, key, klen, data, dlen) == 0)
+                    count++;
+                break;
+            case ARC_LIST_MFU:
+                if (dlen && arc_load(cache->arc, key, klen, data, dlen) == 0) {
+                    // a hit promotes the object to the mfu list
+                    arc_resource_t res = arc_lookup_cached(cache->arc, key, klen, NULL);
+                    if (res)
+                        arc_release_resource(cache->arc, res);
+                    count++;
+                }
+                break;
+            case ARC_LIST_MRUG:
+            case ARC_LIST_MFUG:
+                // ghost objects can't be restored without their data,
+                // but they were requested recently so the admission
+                // policy can take them into account
+                if (policy->record)
+                    policy->record(key, klen, policy->priv);
+                break;
+            default:
+                SHC_WARNING("Unknown record type %d in the snapshot file %s", type, filename);
+                break;
+        }
+    }
+    free(key);
+    free(data);
+    fclose(file);
+
+    shardcache_update_size_counters(cache);
+    ATOMIC_SET(cache->cnt[SHARDCACHE_COUNTER_CACHED_ITEMS].value, arc_count(cache->arc));
+
+    SHC_NOTICE("Restored %d cached objects from %s (%d objects not owned by this node skipped)",
+               count, filename, skipped);
+    return count;
+}
+
+size_t
+shardcache_set_volatile_storage_size(shardcache_t *cache, size_t new_size)
+{
+    size_t old_size = volatile_store_max_size(cache->volatile_storage, new_size);
+    if (new_size > 0 && new_size != old_size) {
+        char old_str[32];
+        char new_str[32];
+        if (old_size == SHARDCACHE_VOLATILE_STORAGE_UNLIMITED)
+            snprintf(old_str, sizeof(old_str), "unlimited");
+        else
+            snprintf(old_str, sizeof(old_str), "%zu", old_size);
+        if (new_size == SHARDCACHE_VOLATILE_STORAGE_UNLIMITED)
+            snprintf(new_str, sizeof(new_str), "unlimited");
+        else
+            snprintf(new_str, sizeof(new_str), "%zu", new_size);
+        SHC_NOTICE("Volatile storage size limit changed from %s to %s", old_str, new_str);
+    }
+    return old_size;
+}
+
+int
+shardcache_set_num_workers(shardcache_t *cache, int num_workers)
+{
+    if (!cache->serv)
+        return -1;
+
+    if (num_workers < 0)
+        return -1;
+
+    return shardcache_serving_set_num_workers(cache->serv, num_workers);
+}
+
+int
+shardcache_listen_per_worker(shardcache_t *cache, int new_value)
+{
+    if (!cache->serv)
+        return -1;
+
+    return shardcache_serving_listen_per_worker(cache->serv, new_value);
+}
+
 void shardcache_thread_init(shardcache_t *cache)
 {
     if (cache->storage.thread_start)
@@ -2627,6 +3958,12 @@ shardcache_storage_load(char *filename, char **options)
         free(st);
         return NULL;
     }
+
+    if (!st->fetch) {
+        SHC_ERROR("The storage module doesn't provide the (mandatory) fetch callback: %s", filename);
+        shardcache_storage_dispose(st);
+        return NULL;
+    }
     return st;
 }
 
@@ -34,6 +34,18 @@ typedef struct _shardcache_s shardcache_t;
                                                      // requests to handle ahead
 #define SHARDCACHE_ASYNC_THREADS_NUM_DEFAULT  1      // number of async i/o threads used
                                                      // for inter-node communication
+#define SHARDCACHE_PIPELINE_DEPTH_DEFAULT     64     // max number of outstanding async
+                                                     // requests on a shared connection
+#define SHARDCACHE_PIPELINE_CONNECTIONS_DEFAULT 2    // max number of shared connections
+                                                     // opened to each peer
+#define SHARDCACHE_MIGRATION_WORKERS_DEFAULT  4      // number of workers copying items
+                                                     // to each peer during a migration
+#define SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT 32   // max number of items copied to a peer
+                                                     // with a single message during a migration
+#define SHARDCACHE_PROTOCOL_VERSION_DEFAULT   1      // protocol version used to talk to
+                                                     // the peers (1 == signatures, 2 == checksums)
+#define SHARDCACHE_STREAMING_THRESHOLD_DEFAULT (1<<24) // values received from peers beyond
+                                                       // this size are streamed (not cached)
 extern const char *LIBSHARDCACHE_VERSION;
 extern const char *LIBSHARDCACHE_BUILD_INFO;
 
@@ -75,7 +87,9 @@ int shardcache_storage_reset(shardcache_storage_t *st);
  * @param storage         A shardcache_storage_t structure holding pointers to the
  *                        storage callbacks.\n If NULL the internal (memory-only)
  *                        volatile storage will be used for all the keys (and not
- *                        only the ones being set with an expiration time)
+ *                        only the ones being set with an expiration time).\n
+ *                        The fetch callback is mandatory, storages providing only
+ *                        fetch_async are refused
  * @param secret          A null-terminated string containing the shared secret used to
  *                        authenticate incoming messages
  * @param num_workers     The number of worker threads taking care of serving input connections
@@ -108,7 +122,10 @@ shardcache_t *shardcache_create(char *me,
 
 typedef enum {
     SHARDCACHE_ARC_MODE_STRICT = 0,
-    SHARDCACHE_ARC_MODE_LOOSE = 1
+    SHARDCACHE_ARC_MODE_LOOSE = 1,
+    // hits on cached objects are recorded in a per-partition buffer
+    // and promoted in batches (so hits don't take the partition lock)
+    SHARDCACHE_ARC_MODE_BUFFERED = 2
 } arc_mode_t;
 
 int shardcache_arc_mode(shardcache_t *cache, arc_mode_t new_value);
@@ -155,6 +172,36 @@ int shardcache_use_persistent_connections(shardcache_t *cache, int new_value);
  */
 int shardcache_force_caching(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Callbacks deciding which items fetched from remote peers
+ *        should be kept in the cache (unless force_caching is enabled)
+ */
+typedef struct {
+    // called each time an item is fetched from a remote peer
+    void (*record)(void *key, size_t klen, void *priv);
+    // returns 1 if the item should be kept in the cache, 0 if it should be
+    // dropped as soon as it has been served
+    int (*admit)(void *key, size_t klen, void *priv);
+    // private pointer passed to the callbacks
+    void *priv;
+} shardcache_admission_policy_t;
+
+/*
+ * @brief Allows to replace the admission policy applied to remote items
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param policy      A pointer to the shardcache_admission_policy_t
+ *                    structure holding the callbacks to use.
+
+ *                    If NULL is provided the default policy is restored
+ * @return 0 on success, -1 otherwise
+ * @note The policy structure is not copied and MUST remain valid until
+ *       replaced by a new one or until the cache is destroyed
+ * @note The default policy keeps an item once it has been requested
+ *       at least twice within a recent window (TinyLFU), so that keys
+ *       requested only once don't evict the hot ones
+ */
+int shardcache_set_admission_policy(shardcache_t *cache, shardcache_admission_policy_t *policy);
+
 /*
  * @brief Allows to change the timeout used when creating tcp connections
  * @param cache       A valid pointer to a shardcache_t structure
@@ -231,6 +278,134 @@ int shardcache_expire_time(shardcache_t *cache, int new_value);
  */
 int shardcache_serving_look_ahead(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Allows to change the maximum number of asynchronous fetches which
+ *        can be outstanding at the same time on a connection shared with a peer
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum amount of pipelined requests.\n
+ *                  If 0 pipelining will be disabled and each asynchronous
+ *                  fetch will use its own connection;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the pipeline_depth setting
+ * @note Requests exceeding the limit on all the connections already
+ *       shared with a peer will use a dedicated connection.
+ *       Pipelining is used only if persistent connections are enabled
+ * @note defaults to SHARDCACHE_PIPELINE_DEPTH_DEFAULT
+ */
+int shardcache_pipeline_depth(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the number of workers copying items in parallel
+ *        to each of the peers during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The number of workers per destination peer.\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_workers setting
+ * @note the new value will be used by the next migration
+ * @note defaults to SHARDCACHE_MIGRATION_WORKERS_DEFAULT
+ */
+int shardcache_migration_workers(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the maximum number of items copied to a peer
+ *        with a single message during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum amount of items in a batch.\n
+ *                  If 1 items will be copied one by one;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_batch_size setting
+ * @note the new value will be used by the next migration
+ * @note defaults to SHARDCACHE_MIGRATION_BATCH_SIZE_DEFAULT
+ */
+int shardcache_migration_batch_size(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to limit the rate at which items are copied to the peers
+ *        during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum number of items migrated per second.\n
+ *                  If 0 no limit will be applied;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_rate_limit setting
+ * @note the limit applies to the migration as a whole (not to each worker)
+ *       and can be changed while a migration is in progress
+ * @note defaults to 0
+ */
+int shardcache_migration_rate_limit(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to limit the bandwidth used to copy items to the peers
+ *        during a migration
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The maximum number of bytes (of values) migrated per second.\n
+ *                  If 0 no limit will be applied;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the migration_bandwidth_limit setting
+ * @note the limit applies to the migration as a whole (not to each worker)
+ *       and can be changed while a migration is in progress
+ * @note defaults to 0
+ */
+int shardcache_migration_bandwidth_limit(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the protocol version used for the messages
+ *        sent to the peers
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The protocol version to use.\n
+ *                  If 1 messages are signed (using siphash) if a secret
+ *                  has been configured, or sent as they are otherwise;\n
+ *                  If 2 messages carry a crc32c checksum (not available
+ *                  if a secret has been configured);\n
+ *                  If 0 the default version will be used;\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the protocol_version setting,
+ *         -1 if the requested version is not supported or if the version 2
+ *         is requested and a secret has been configured
+ * @note responses are sent using the same version of the request and
+ *       the version 2 should be enabled only once all the nodes have been
+ *       upgraded to a release understanding it
+ * @note the checksum only detects corrupted messages, it doesn't protect them
+ *       against deliberate tampering. For this reason nodes configured with
+ *       a secret keep using (and accept only) the siphash signatures
+ * @note defaults to SHARDCACHE_PROTOCOL_VERSION_DEFAULT
+ */
+int shardcache_protocol_version(shardcache_t *cache, int new_value);
+
+/*
+ * @brief Allows to change the size beyond which values fetched from the peers
+ *        are streamed to the clients instead of being cached
+ * @param cache A valid pointer to a shardcache_t structure
+ * @param new_value The size (in bytes) beyond which values are streamed.\n
+ *                  If 0 values are never streamed (and always fully loaded);\n
+ *                  If -1 is provided as new_value, no change will be applied
+ *                  but the actual value will still be returned
+ *                  (effectively querying the actual status).
+ * @return the previous value for the streaming_threshold setting
+ * @note once a value being received exceeds the threshold, the data received
+ *       so far is released and the following chunks are only forwarded to the
+ *       clients already waiting for it, so the memory used doesn't depend on
+ *       the size of the value. Streamed values are never cached and each
+ *       further get will fetch them again from the owner
+ * @note once the data pending to be sent to a client not keeping up with a
+ *       streamed value exceeds the threshold, its request stops following the
+ *       fetch and is resumed (fetching the value again from the owner and
+ *       skipping what has been already sent) when the client catches up
+ * @note defaults to SHARDCACHE_STREAMING_THRESHOLD_DEFAULT
+ */
+int shardcache_streaming_threshold(shardcache_t *cache, int new_value);
+
 /*
  * @brief Allows to enable/disable the 'lazy_expiration' mode
  * @param cache       A valid pointer to a shardcache_t structure
@@ -246,6 +421,106 @@ int shardcache_serving_look_ahead(shardcache_t *cache, int new_value);
  */
 int shardcache_lazy_expiration(shardcache_t *cache, int new_value);
 
+/*
+ * @brief Change the size of the cache at runtime
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_size    The new size (in bytes) of the cache.\n
+ *                    If 0 is provided as new_size, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual size).
+ * @return the previous size of the cache
+ * @note When shrinking, the exceeding objects are evicted incrementally
+ *       (in small batches) so that the cache keeps serving requests
+ *       while being resized. The warm contents are preserved otherwise.
+ */
+size_t shardcache_set_cache_size(shardcache_t *cache, size_t new_size);
+
+/*
+ * @brief Limit the memory used by the volatile storage at runtime
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_size    The maximum amount of memory (in bytes) used by the
+ *                    volatile items.\n
+ *                    If 0 is provided as new_size, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual limit).\n
+ *                    SHARDCACHE_VOLATILE_STORAGE_UNLIMITED removes the limit
+ * @return the previous limit (SHARDCACHE_VOLATILE_STORAGE_UNLIMITED
+ *         if there was no limit)
+ * @note When the limit is reached the least recently accessed volatile items
+ *       are evicted (expired items first) to make room for the new ones.
+ *       The limit is split evenly among the internal shards of the storage,
+ *       so a single item can't be bigger than a fraction of it
+ * @note defaults to SHARDCACHE_VOLATILE_STORAGE_UNLIMITED
+ */
+#define SHARDCACHE_VOLATILE_STORAGE_UNLIMITED ((size_t)-1)
+size_t shardcache_set_volatile_storage_size(shardcache_t *cache, size_t new_size);
+
+/*
+ * @brief Save the contents of the cache to a file
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param filename    The path of the snapshot file (replaced only once
+ *                    the new snapshot has been completely written)
+ * @return the number of objects saved (including the ghost keys), -1 on errors
+ * @note The objects are saved together with the list (mru, mfu or ghost)
+ *       holding them so that shardcache_restore() can warm up the cache
+ *       preserving their recency and frequency. Only the keys are saved
+ *       for the ghost lists
+ * @note The keys having a volatile value are not saved since their
+ *       expiration time isn't part of the snapshot
+ * @see shardcache_restore()
+ */
+int shardcache_snapshot(shardcache_t *cache, char *filename);
+
+/*
+ * @brief Load the cache contents saved by shardcache_snapshot()
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param filename    The path of the snapshot file
+ * @return the number of objects loaded into the cache, -1 on errors
+ * @note The ghost keys are reported to the admission policy as accesses
+ *       (see shardcache_set_admission_policy()). Objects not fitting in the
+ *       cache are evicted as usual, least recently used first
+ * @note Only the objects owned by this node (according to the current
+ *       continuum) are loaded, the copies of the keys owned by the other
+ *       nodes are skipped since they might be stale
+ * @see shardcache_snapshot()
+ */
+int shardcache_restore(shardcache_t *cache, char *filename);
+
+/*
+ * @brief Change the number of worker threads serving connections at runtime
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param num_workers The new number of workers (must be greater than 0).\n
+ *                    If 0 is provided as num_workers, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual number of workers).
+ * @return the previous number of workers, -1 in case of errors
+ * @note When shrinking, the retiring workers stop receiving new connections
+ *       and hand over their queued and idle connections to the remaining workers.
+ *       This function doesn't wait for the retiring workers to exit: they are
+ *       collected in the background once done, and the connections still busy
+ *       after 10 seconds are closed
+ */
+int shardcache_set_num_workers(shardcache_t *cache, int num_workers);
+
+/*
+ * @brief Allows each worker to accept connections on its own listening socket
+ * @param cache       A valid pointer to a shardcache_t structure
+ * @param new_value   1 if each worker should listen on its own socket,
+ *                    0 if the connections should be accepted by the listener
+ *                    thread and handed to the workers.\n
+ *                    If -1 is provided as new_value, no change will be applied
+ *                    but the actual value will still be returned
+ *                    (effectively querying the actual status).
+ * @return the previous value for the listen_per_worker setting,
+ *         -1 in case of errors (e.g. SO_REUSEPORT not supported)
+ * @note The per-worker sockets share the address using SO_REUSEPORT, so the
+ *       kernel spreads the incoming connections among the workers.
+ *       Connections waiting to be accepted on the sockets being closed
+ *       when switching mode are lost.
+ * @note defaults to 0
+ */
+int shardcache_listen_per_worker(shardcache_t *cache, int new_value);
+
 /**
  * @brief Release all the resources used by the shardcache instance
  * @param cache   the instance to release
@@ -272,6 +547,56 @@ void *shardcache_get(shardcache_t *cache,
                      size_t *vlen,
                      struct timeval *timestamp);
 
+/**
+ * @brief Opaque structure holding a reference to a value retrieved from the cache
+ * @see shardcache_get_resource()
+ */
+typedef struct _shardcache_resource_s shardcache_resource_t;
+
+/**
+ * @brief Get the value for a key without copying it
+ * @param cache   A valid pointer to a shardcache_t structure
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ *
+ * @return A pointer to a shardcache_resource_t giving access to the value
+ *         if any, NULL otherwise
+ * @note If the value is in the cache, the cached object is retained (and
+ *       won't be released even if evicted or replaced) until the resource
+ *       is released, so no copy of the data is necessary.\n
+ *       If the value can't be kept in the cache (for instance because it's
+ *       owned by a peer and not considered hot) the resource will hold a copy
+ *       of the data, exactly as the one returned by shardcache_get()
+ * @note The caller MUST release the resource using shardcache_resource_release()
+ */
+shardcache_resource_t *shardcache_get_resource(shardcache_t *cache,
+                                               void *key,
+                                               size_t klen);
+
+/**
+ * @brief Access the value held by a resource
+ * @param res     A valid pointer to a shardcache_resource_t structure
+ * @param vlen    If provided the length of the value will be stored
+ *                at the location pointed by vlen
+ * @return A read-only pointer to the value which is valid until the resource
+ *         is released
+ */
+const void *shardcache_resource_data(shardcache_resource_t *res, size_t *vlen);
+
+/**
+ * @brief Get the timestamp of when the value held by a resource
+ *        was loaded into the cache
+ * @param res       A valid pointer to a shardcache_resource_t structure
+ * @param timestamp A pointer to the timeval structure where to store the timestamp
+ */
+void shardcache_resource_timestamp(shardcache_resource_t *res, struct timeval *timestamp);
+
+/**
+ * @brief Release a resource obtained using shardcache_get_resource()
+ * @param res     A valid pointer to a shardcache_resource_t structure
+ */
+void shardcache_resource_release(shardcache_resource_t *res);
+
 /**
  * @brief Get partial value data value for a key
  * @param cache   A valid pointer to a shardcache_t structure
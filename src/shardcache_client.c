@@ -1137,6 +1137,110 @@ shardcache_client_set_multi(shardcache_client_t *c,
     return shardcache_client_multi(c, items, SHC_HDR_SET);
 }
 
+static int
+shardcache_client_multi_via(shardcache_client_t *c,
+                            char *node_name,
+                            shc_multi_item_t **items,
+                            shardcache_hdr_t hdr)
+{
+    shardcache_node_t *node = shardcache_get_node(c, node_name);
+    if (!node)
+        return -1;
+
+    int num_items = 0;
+    while (items[num_items])
+        num_items++;
+
+    if (!num_items)
+        return 0;
+
+    char *addr = shardcache_node_get_address(node);
+    int fd = connections_pool_get(c->connections, addr);
+    if (fd < 0) {
+        c->errno = SHARDCACHE_CLIENT_ERROR_NETWORK;
+        snprintf(c->errstr, sizeof(c->errstr), "Can't connect to '%s'", addr);
+        return -1;
+    }
+
+    shardcache_record_t *keys = calloc(num_items, sizeof(shardcache_record_t));
+    int i;
+    for (i = 0; i < num_items; i++) {
+        keys[i].v = items[i]->key;
+        keys[i].l = items[i]->klen;
+    }
+
+    int rc;
+    if (hdr == SHC_HDR_GET_MULTI) {
+        fbuf_t *values = calloc(num_items, sizeof(fbuf_t));
+        fbuf_t **out = calloc(num_items, sizeof(fbuf_t *));
+        for (i = 0; i < num_items; i++)
+            out[i] = &values[i];
+
+        rc = get_multi_from_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP,
+                                 keys, num_items, out, fd);
+        for (i = 0; i < num_items; i++) {
+            free(items[i]->data);
+            items[i]->data = NULL;
+            items[i]->dlen = 0;
+            if (rc == 0 && fbuf_used(&values[i])) {
+                items[i]->dlen = fbuf_detach(&values[i], (char **)&items[i]->data, NULL);
+            }
+            items[i]->status = rc;
+            fbuf_destroy(&values[i]);
+        }
+        free(out);
+        free(values);
+    } else {
+        shardcache_record_t *values = calloc(num_items, sizeof(shardcache_record_t));
+        char *results = calloc(1, num_items);
+        uint32_t expire = 0;
+        for (i = 0; i < num_items; i++) {
+            values[i].v = items[i]->data;
+            values[i].l = items[i]->dlen;
+            // the TTL applies to all the items in a SET_MULTI request
+            if (items[i]->expire > expire)
+                expire = items[i]->expire;
+        }
+        rc = set_multi_to_peer(addr, (char *)c->auth, SHC_HDR_SIGNATURE_SIP,
+                               keys, values, num_items, expire, results, fd);
+        for (i = 0; i < num_items; i++)
+            items[i]->status = (rc == 0 && results[i] == SHC_RES_OK) ? 0 : -1;
+        free(results);
+        free(values);
+    }
+    free(keys);
+
+    if (rc != 0) {
+        close(fd);
+        c->errno = SHARDCACHE_CLIENT_ERROR_NODE;
+        snprintf(c->errstr, sizeof(c->errstr), "Node '%s' (%s) failed to handle the %s request",
+                 shardcache_node_get_label(node), addr,
+                 hdr == SHC_HDR_GET_MULTI ? "GET_MULTI" : "SET_MULTI");
+        return -1;
+    }
+
+    connections_pool_add(c->connections, addr, fd);
+    c->errno = SHARDCACHE_CLIENT_OK;
+    c->errstr[0] = 0;
+    return 0;
+}
+
+int
+shardcache_client_get_multi_via(shardcache_client_t *c,
+                                char *node_name,
+                                shc_multi_item_t **items)
+{
+    return shardcache_client_multi_via(c, node_name, items, SHC_HDR_GET_MULTI);
+}
+
+int
+shardcache_client_set_multi_via(shardcache_client_t *c,
+                                char *node_name,
+                                shc_multi_item_t **items)
+{
+    return shardcache_client_multi_via(c, node_name, items, SHC_HDR_SET_MULTI);
+}
+
 shardcache_node_t *
 shardcache_client_current_node(shardcache_client_t *c)
 {
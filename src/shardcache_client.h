@@ -395,6 +395,42 @@ int shardcache_client_get_multi(shardcache_client_t *c,
 int shardcache_client_set_multi(shardcache_client_t *c,
                                 shc_multi_item_t **items);
 
+/**
+ * @brief Get multiple keys at once sending a single GET_MULTI request
+ *        to a specific node
+ *
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node which will receive the request
+ * @param items      A NULL-terminated array of shc_multi_item_t structures
+ * @return 0 on success, -1 otherwise
+ *
+ * @note The node takes care of fetching the keys it doesn't own from the
+ *       responsible nodes (in parallel), so this is useful for clients
+ *       which don't know (or don't want to connect to) the whole shard
+ * @note A missing key is reported as an item with no data
+ */
+int shardcache_client_get_multi_via(shardcache_client_t *c,
+                                    char *node_name,
+                                    shc_multi_item_t **items);
+
+/**
+ * @brief Set multiple keys at once sending a single SET_MULTI request
+ *        to a specific node
+ *
+ * @param c          A valid pointer to a shardcache_client_t structure
+ * @param node_name  The name of the node which will receive the request
+ * @param items      A NULL-terminated array of shc_multi_item_t structures
+ * @return 0 on success, -1 otherwise
+ *
+ * @note The status member of each item is set to 0 if the item has been
+ *       stored or to -1 otherwise
+ * @note The protocol allows a single TTL per request, so the highest expire
+ *       among the items is applied to all of them
+ */
+int shardcache_client_set_multi_via(shardcache_client_t *c,
+                                    char *node_name,
+                                    shc_multi_item_t **items);
+
 /**
  * @brief Get the node used to fulfil last request
  * @param c          A valid pointer to a shardcache_Client_t structure
@@ -9,14 +9,21 @@
 
 #define THREAD_SAFE
 #include <atomic_defs.h>
+#include <sys/time.h>
 
 #include <linklist.h>
 #include <chash.h>
+#include <refcnt.h>
 #include <hashtable.h>
 #include <queue.h>
 #include <iomux.h>
 
 #include "connections_pool.h"
+#include "connections_pipeline.h"
+#include "peer_selector.h"
+#include "tinylfu.h"
+#include "timer_wheel.h"
+#include "volatile_store.h"
 #include "arc.h"
 #include "serving.h"
 #include "counters.h"
@@ -25,6 +32,29 @@
 
 #define DEBUG_DUMP_MAXSIZE 128
 
+// the duration (in milliseconds) of a tick of the timer wheel used for expirations
+#define SHARDCACHE_EXPIRER_RESOLUTION 100
+
+// the max number of keys sent to the peers with a single EVICT_MULTI command
+#define SHARDCACHE_EVICTOR_BATCH_SIZE 256
+// the max time (in milliseconds) an eviction is delayed waiting for other keys
+// to be sent in the same batch
+#define SHARDCACHE_EVICTOR_FLUSH_INTERVAL 10
+
+// the number of requests needed by a remote item to be admitted by the default policy
+#define SHARDCACHE_ADMISSION_THRESHOLD 2
+// the average item size assumed to size the admission sketch
+#define SHARDCACHE_ADMISSION_ITEM_SIZE 4096
+#define SHARDCACHE_ADMISSION_MIN_WIDTH 1024
+#define SHARDCACHE_ADMISSION_MAX_WIDTH (1<<22)
+
+// the number of independently locked shards of the volatile storage
+#define SHARDCACHE_VOLATILE_STORAGE_SHARDS 64
+
+// the header of the files written by shardcache_snapshot()
+#define SHARDCACHE_SNAPSHOT_MAGIC "SHCS"
+#define SHARDCACHE_SNAPSHOT_VERSION 1
+
 #define KEY2STR(_k, _l, _o, _ol) \
 { \
     size_t _s = (_l < _ol) ? _l : _ol; \
@@ -32,6 +62,15 @@
     _o[_s] = 0; \
 }
 
+// the microseconds elapsed between two timestamps (0 if end precedes start)
+static inline uint64_t
+shardcache_elapsed_usecs(struct timeval *start, struct timeval *end)
+{
+    int64_t elapsed = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+                      (end->tv_usec - start->tv_usec);
+    return elapsed > 0 ? (uint64_t)elapsed : 0;
+}
+
 #define LIKELY(_e) __builtin_expect((_e), 1)
 #define UNLIKELY(_e) __builtin_expect((_e), 0)
 
@@ -75,6 +114,15 @@
 
 typedef struct chash_t chash_t;
 
+typedef struct {
+    chash_t *chash;
+    const char *me; // the label of this node as interned by chash
+                    // (NULL if this node is not part of the continuum)
+    int me_interned; // 0 if chash doesn't expose a unique pointer for our
+                     // label and ownership must be tested comparing strings
+    int num_nodes;
+} shardcache_continuum_t;
+
 typedef struct {
     pthread_t io_th; // the thread taking care of spooling the asynchronous
                      // i/o operations
@@ -111,27 +159,52 @@ struct _shardcache_s {
     pthread_spinlock_t migration_lock;
 #endif
 
-    chash_t *chash;   // the internal chash instance
+    // NOTE: the continua are immutable snapshots (shardcache_continuum_t)
+    //       published through refcnt links, readers get them using
+    //       shardcache_continuum_get()/shardcache_continuum_release() and
+    //       never need to take the migration_lock. Writers (still serialized
+    //       by the migration_lock) replace them using compare_and_swap_ref()
+    //       and the old snapshot is released once the last reader is gone
+    refcnt_t *continuum_refcnt;
+
+    refcnt_node_t *chash;   // the current continuum
+
+    refcnt_node_t *migration;            // the migration continuum
 
-    chash_t *migration;                  // the migration continuum
+    uint32_t continuum_gen; // bumped each time one of the continua is replaced,
+                            // invalidates the owner hints kept by the cached objects
+
+    hashtable_t *node_labels; // the labels of all the nodes ever part of a continuum,
+                              // kept until destruction so that they can be compared by pointer
+    char *me_label;           // our label as interned in node_labels
     shardcache_node_t **migration_shards; // the new shards array after the migration
     int num_migration_shards;            // the new number of shards in the migration_shards array
     int migration_done;                  // boolean value indicating that the migration is complete
                                          // (to be accessed using ATOMIC_READ())
 
+    int migration_workers;    // the number of workers copying items to each destination peer
+    int migration_batch_size; // the max number of items copied to a peer with a single message
+    int migration_max_ops;    // the max number of items migrated per second (0 == unlimited)
+    int migration_max_bytes;  // the max number of bytes migrated per second (0 == unlimited)
+
+    int protocol_version;     // the protocol version used for the messages sent to the peers
+
+    int streaming_threshold;  // the size beyond which values received from peers are
+                              // streamed to the clients instead of being cached (0 == never)
+
     int use_persistent_storage;    // boolean flag indicating if a persistent storage should be used  
 
 
     shardcache_storage_t storage;  // the structure holding the callbacks for the persistent storage 
 
-    hashtable_t *volatile_storage; // an hashtable used as volatile storage
+    volatile_store_t *volatile_storage; // the sharded in-memory volatile storage
 
-    hashtable_t *cache_timeouts; // hashtable holding the timeout_id of the expiration timers
+    hashtable_t *cache_timeouts; // hashtable holding the expiration timers
                                  // for cached objects
-    hashtable_t *volatile_timeouts; // hashtable holding the timeout_id for the expiration timers
+    hashtable_t *volatile_timeouts; // hashtable holding the expiration timers
                                     // for volatile items
 
-    iomux_t *expirer_mux; // iomux used to handle the expiration timers
+    timer_wheel_t *expirer_wheel; // the timer wheel driving the expiration timers
     pthread_t expirer_th; // the thread taking care of propagating expiration commands
     queue_t *expirer_queue; // the queue holding shedule/unschedule expiration jobs
 
@@ -151,7 +224,12 @@ struct _shardcache_s {
                          // by a background thread
 
     int force_caching; // boolean flag indicating if the items fetched from remote peers should be
-                       // always cached instead of applying th 10% chance of being kept
+                       // always cached instead of applying the admission policy
+
+    shardcache_admission_policy_t *admission_policy; // decides which remote items are kept
+                                                     // (to be accessed using ATOMIC_READ())
+    shardcache_admission_policy_t tinylfu_policy;    // the default admission policy
+    tinylfu_t *tinylfu;                              // the sketch used by the default policy
 
     int expire_time;   // global expire time for cached items, if 0 items in the cache will never
                        // expire and will need to be either explicitly or naturally evicted to be
@@ -187,7 +265,8 @@ struct _shardcache_s {
 #define SHARDCACHE_COUNTER_LABELS_ARRAY  \
         { "gets", "sets", "dels", "heads", "evicts", "expires", \
           "cache_misses", "fetch_remote", "fetch_local", "not_found", \
-          "volatile_table_size", "cache_size", "cached_items", "errors" }
+          "volatile_table_size", "cache_size", "cached_items", "errors", \
+          "arena_used", "arena_reserved", "streamed" }
 
 #define SHARDCACHE_COUNTER_GETS             0
 #define SHARDCACHE_COUNTER_SETS             1
@@ -203,7 +282,10 @@ struct _shardcache_s {
 #define SHARDCACHE_COUNTER_CACHE_SIZE       11
 #define SHARDCACHE_COUNTER_CACHED_ITEMS     12
 #define SHARDCACHE_COUNTER_ERRORS           13
-#define SHARDCACHE_NUM_COUNTERS             14
+#define SHARDCACHE_COUNTER_ARENA_USED       14
+#define SHARDCACHE_COUNTER_ARENA_RESERVED   15
+#define SHARDCACHE_COUNTER_STREAMED         16
+#define SHARDCACHE_NUM_COUNTERS             17
     struct {
         const char *name; // the exported label of the counter
         uint64_t value;   // the actual value (accessed using the atomic builtins)
@@ -214,6 +296,16 @@ struct _shardcache_s {
                                           // filedescriptors // when using persistent
                                           // connections
 
+    connections_pipeline_t *connections_pipeline; // multiplexes the async fetches
+                                                  // directed to the same peer over
+                                                  // shared persistent connections
+
+    hashtable_t *inflight_fetches; // the async fetches from peers currently in flight
+                                   // (indexed by key) which concurrent misses can join
+
+    peer_selector_t *peer_selector; // picks the address to use for nodes reachable
+                                    // at multiple addresses (based on latency and failures)
+
     int tcp_timeout;        // the tcp timeout to use when setting up new connections
 
     shardcache_async_io_context_t *async_context;
@@ -224,15 +316,34 @@ struct _shardcache_s {
     int quit;
 };
 
-typedef struct {
-    void *data;
-    size_t dlen;
-    uint32_t expire;
-} volatile_object_t;
-
 int shardcache_test_migration_ownership(shardcache_t *cache,
         void *key, size_t klen, char *owner, size_t *len);
 
+// resolves the node responsible for a key in the current continuum (or in the
+// migration continuum if migration is true). The owner is returned as a label
+// interned by the cache (it can be compared by pointer and stays valid until
+// the cache is destroyed) together with the generation of the continua it
+// refers to. Returns 1 if we are the owner, 0 if not and -1 if there is no
+// migration continuum
+int shardcache_get_owner(shardcache_t *cache, void *key, size_t klen,
+        int migration, const char **owner, uint32_t *generation);
+
+// returns the address (among the ones configured for the node) where requests
+// should be sent, outcomes and latencies of the requests should be reported
+// using shardcache_report_peer()
+char *shardcache_node_select_address(shardcache_t *cache, shardcache_node_t *node);
+
+// latency is in microseconds (0 if not measured)
+void shardcache_report_peer(shardcache_t *cache, char *addr, int success, uint64_t latency);
+
+// records a fetch of a remote item and returns 1 if the item should be
+// kept in the cache according to the admission policy, 0 otherwise
+int shardcache_admit(shardcache_t *cache, void *key, size_t klen);
+
+// the signature (V1) or checksum (V2) header to use for the messages sent to
+// the peers, chunked selects the chunk-signing (meaningful only for V1)
+unsigned char shardcache_sig_hdr(shardcache_t *cache, int chunked);
+
 int shardcache_get_connection_for_peer(shardcache_t *cache, char *peer);
 
 void shardcache_release_connection_for_peer(shardcache_t *cache, char *peer, int fd);
@@ -262,5 +373,9 @@ int shardcache_unschedule_expiration(shardcache_t *cache, void *key, size_t klen
 
 void shardcache_queue_async_read_wrk(shardcache_t *cache, async_read_wrk_t *wrk);
 
+// returns a resource only if the complete value is already in the cache
+// (it never triggers a fetch, so it never blocks the caller)
+shardcache_resource_t *shardcache_get_cached_resource(shardcache_t *cache, void *key, size_t klen);
+
 // vim: tabstop=4 shiftwidth=4 expandtab:
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
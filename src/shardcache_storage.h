@@ -62,6 +62,47 @@ typedef int (*shardcache_fetch_item_callback_t)
 typedef int (*shardcache_fetch_items_callback_t)
     (void **keys, size_t *klens, int nkeys, void **values, size_t *vlens, void *priv);
 
+/**
+ * @brief Callback used by the storage to notify the completion of an
+ *        asynchronous fetch started by a shardcache_fetch_item_async_callback_t
+ *
+ * @param key    The key which has been requested
+ * @param klen   The length of the key
+ * @param value  The retrieved value (NULL if not found or in case of errors).
+ *               As for the synchronous fetch callback, this MUST be a volatile
+ *               copy whose ownership is passed to libshardcache
+ * @param vlen   The length of the value
+ * @param status 0 on success (also if the item was not found); -1 otherwise
+ * @param cb_priv The 'cb_priv' pointer provided to the fetch_async callback
+ */
+typedef void (*shardcache_fetch_async_done_callback_t)
+    (void *key, size_t klen, void *value, size_t vlen, int status, void *cb_priv);
+
+/**
+ * @brief Callback to asynchronously provide the value for a given key.
+ *
+ *        If set, the shardcache instance will call this callback instead of
+ *        the synchronous fetch one when the value is requested through the
+ *        asynchronous API (which is what happens when serving clients),
+ *        so that a slow storage won't block the calling worker thread
+ *
+ * @param key     A valid pointer to the key
+ * @param klen    The length of the key
+ * @param cb      The callback to call once the value has been retrieved
+ * @param cb_priv The private pointer to pass back to the callback
+ * @param priv    The 'priv' pointer previously stored in the shardcache_storage_t
+ *                structure at initialization time
+ * @return 0 if the fetch has been started (in which case the callback MUST be
+ *         called exactly once); -1 otherwise (and the callback MUST NOT be called)
+ *
+ * @note The callback can be called from any thread and also before the
+ *       fetch_async callback returns
+ * @note The key pointer is guaranteed to be valid only until the callback
+ *       has been called
+ */
+typedef int (*shardcache_fetch_item_async_callback_t)
+    (void *key, size_t klen, shardcache_fetch_async_done_callback_t cb, void *cb_priv, void *priv);
+
 /**
  * @brief Callback to store a new value for a given key.
  *
@@ -205,7 +246,7 @@ typedef void (*shardcache_thread_start_callback_t)(void *priv);
 typedef void (*shardcache_thread_exit_callback_t)(void *priv);
 
 
-#define SHARDCACHE_STORAGE_API_VERSION 0x01
+#define SHARDCACHE_STORAGE_API_VERSION 0x02
 
 typedef struct _shardcache_storage_s shardcache_storage_t;
 typedef int (*shardcache_storage_init_t)(shardcache_storage_t *, char **);
@@ -228,6 +269,13 @@ struct _shardcache_storage_s {
     //! The fetch multiple items callback (XXX - still unused)
     shardcache_fetch_items_callback_t      fetch_multi;
 
+    /**
+     * @brief Optional callback used (instead of fetch) when the value is requested
+     *        through the asynchronous API
+     * @note The synchronous fetch callback is still mandatory
+     */
+    shardcache_fetch_item_async_callback_t fetch_async;
+
     //! The store callback (optional if the storage is indended to be read-only)
     shardcache_store_item_callback_t       store;
     //! The remove callback (optional if the storage is intended to be read-only)
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS   8
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+
+// timers scheduled further than this (in ticks) will be clamped
+#define TIMER_WHEEL_MAX_DELTA ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct _timer_wheel_s {
+    struct timer_wheel_slot_s slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t current;    // the next tick to process
+    uint64_t start;      // the time (in milliseconds) of tick 0
+    uint32_t resolution; // the duration of a tick in milliseconds
+    uint64_t count;
+};
+
+static inline uint64_t
+timer_wheel_now(timer_wheel_t *wheel)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    return (now_ms > wheel->start) ? (now_ms - wheel->start) / wheel->resolution : 0;
+}
+
+timer_wheel_t *
+timer_wheel_create(uint32_t resolution_ms)
+{
+    timer_wheel_t *wheel = calloc(1, sizeof(timer_wheel_t));
+    int i, j;
+    for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+        for (j = 0; j < TIMER_WHEEL_SLOTS; j++)
+            TAILQ_INIT(&wheel->slots[i][j]);
+    }
+    wheel->resolution = resolution_ms ? resolution_ms : 1;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    wheel->start = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    return wheel;
+}
+
+void
+timer_wheel_destroy(timer_wheel_t *wheel, timer_wheel_expire_cb cb, void *priv)
+{
+    int i, j;
+    for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+        for (j = 0; j < TIMER_WHEEL_SLOTS; j++) {
+            struct timer_wheel_slot_s *slot = &wheel->slots[i][j];
+            timer_wheel_entry_t *entry = TAILQ_FIRST(slot);
+            while (entry) {
+                TAILQ_REMOVE(slot, entry, next);
+                entry->slot = NULL;
+                if (cb)
+                    cb(entry, priv);
+                entry = TAILQ_FIRST(slot);
+            }
+        }
+    }
+    free(wheel);
+}
+
+static void
+timer_wheel_add(timer_wheel_t *wheel, timer_wheel_entry_t *entry)
+{
+    // timers already due will be expired at the next run
+    if (entry->expire < wheel->current)
+        entry->expire = wheel->current;
+
+    uint64_t delta = entry->expire - wheel->current;
+    if (delta > TIMER_WHEEL_MAX_DELTA) {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        entry->expire = wheel->current + delta;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    int idx = (entry->expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer_wheel_slot_s *slot = &wheel->slots[level][idx];
+    TAILQ_INSERT_TAIL(slot, entry, next);
+    entry->slot = slot;
+}
+
+void
+timer_wheel_schedule(timer_wheel_t *wheel, timer_wheel_entry_t *entry, uint64_t timeout_ms)
+{
+    if (entry->slot)
+        timer_wheel_unschedule(wheel, entry);
+
+    entry->expire = timer_wheel_now(wheel) + (timeout_ms + wheel->resolution - 1) / wheel->resolution;
+    timer_wheel_add(wheel, entry);
+    wheel->count++;
+}
+
+void
+timer_wheel_unschedule(timer_wheel_t *wheel, timer_wheel_entry_t *entry)
+{
+    if (!entry->slot)
+        return;
+
+    TAILQ_REMOVE(entry->slot, entry, next);
+    entry->slot = NULL;
+    wheel->count--;
+}
+
+// move the timers of a slot at an higher level to the lower levels
+static void
+timer_wheel_cascade(timer_wheel_t *wheel, int level, int idx)
+{
+    struct timer_wheel_slot_s *slot = &wheel->slots[level][idx];
+    timer_wheel_entry_t *entry = TAILQ_FIRST(slot);
+    while (entry) {
+        TAILQ_REMOVE(slot, entry, next);
+        timer_wheel_add(wheel, entry);
+        entry = TAILQ_FIRST(slot);
+    }
+}
+
+int
+timer_wheel_run(timer_wheel_t *wheel, timer_wheel_expire_cb cb, void *priv)
+{
+    struct timer_wheel_slot_s expired;
+    TAILQ_INIT(&expired);
+
+    uint64_t now = timer_wheel_now(wheel);
+    while (wheel->current <= now) {
+        int idx = wheel->current & TIMER_WHEEL_MASK;
+        if (idx == 0) {
+            int level;
+            for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                int lidx = (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+                timer_wheel_cascade(wheel, level, lidx);
+                if (lidx != 0)
+                    break;
+            }
+        }
+
+        // collect all the timers due in this tick
+        struct timer_wheel_slot_s *slot = &wheel->slots[0][idx];
+        timer_wheel_entry_t *entry = TAILQ_FIRST(slot);
+        while (entry) {
+            TAILQ_REMOVE(slot, entry, next);
+            TAILQ_INSERT_TAIL(&expired, entry, next);
+            // the callback might unschedule timers which are expiring
+            // in the same batch, so they must point to the right list
+            entry->slot = &expired;
+            entry = TAILQ_FIRST(slot);
+        }
+        wheel->current++;
+    }
+
+    int count = 0;
+    timer_wheel_entry_t *entry = TAILQ_FIRST(&expired);
+    while (entry) {
+        TAILQ_REMOVE(&expired, entry, next);
+        entry->slot = NULL;
+        wheel->count--;
+        count++;
+        if (cb)
+            cb(entry, priv);
+        entry = TAILQ_FIRST(&expired);
+    }
+
+    return count;
+}
+
+uint64_t
+timer_wheel_count(timer_wheel_t *wheel)
+{
+    return wheel->count;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
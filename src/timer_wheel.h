@@ -0,0 +1,54 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <bsd_queue.h>
+
+/*
+ * Hierarchical timer wheel (4 levels of 256 slots each).
+ * Scheduling and unscheduling a timer are O(1) operations, timers far in the
+ * future are cascaded to the lower levels as time goes by and all the timers
+ * falling in the same slot are expired at once.
+ *
+ * Timers are intrusive: the caller embeds a timer_wheel_entry_t in its own
+ * structure, so no memory is allocated by the wheel when scheduling.
+ *
+ * NOTE: the timer wheel is not thread-safe, all the operations are expected
+ *       to be performed by the same thread
+ */
+typedef struct _timer_wheel_s timer_wheel_t;
+
+TAILQ_HEAD(timer_wheel_slot_s, _timer_wheel_entry_s);
+
+typedef struct _timer_wheel_entry_s {
+    TAILQ_ENTRY(_timer_wheel_entry_s) next;
+    uint64_t expire;                 // the tick when the timer expires
+    struct timer_wheel_slot_s *slot; // the slot holding the timer (NULL if not scheduled)
+} timer_wheel_entry_t;
+
+typedef void (*timer_wheel_expire_cb)(timer_wheel_entry_t *entry, void *priv);
+
+// resolution_ms is the duration of a tick
+timer_wheel_t *timer_wheel_create(uint32_t resolution_ms);
+
+// the callback (if provided) is called for each timer still scheduled
+// (so that the caller can release the memory of the structures embedding them)
+void timer_wheel_destroy(timer_wheel_t *wheel, timer_wheel_expire_cb cb, void *priv);
+
+// (re)schedule the timer to expire in timeout_ms milliseconds
+void timer_wheel_schedule(timer_wheel_t *wheel, timer_wheel_entry_t *entry, uint64_t timeout_ms);
+
+void timer_wheel_unschedule(timer_wheel_t *wheel, timer_wheel_entry_t *entry);
+
+// expires all the timers due by now, the callback is called for each of them
+// once the timer has been already unscheduled (so it can be released or
+// scheduled again). Returns the number of expired timers
+int timer_wheel_run(timer_wheel_t *wheel, timer_wheel_expire_cb cb, void *priv);
+
+// the number of scheduled timers
+uint64_t timer_wheel_count(timer_wheel_t *wheel);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
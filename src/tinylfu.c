@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic_defs.h>
+
+#include "tinylfu.h"
+
+#define TINYLFU_DEPTH 4
+
+// counters saturate at this value (as 4-bit counters would do)
+#define TINYLFU_MAX_COUNT 15
+
+// the number of accesses (relative to the width) after which the counters are halved
+#define TINYLFU_SAMPLE_FACTOR 10
+
+struct _tinylfu_s {
+    uint8_t *counters;  // TINYLFU_DEPTH rows of width counters
+    size_t width;
+    size_t mask;
+    uint64_t samples;   // the accesses recorded since the last reset
+    uint64_t sample_size;
+    uint32_t threshold;
+};
+
+// 64bit FNV-1a
+static inline uint64_t
+tinylfu_hash(void *key, size_t klen)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char *p = (unsigned char *)key;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// the index of the counter for the key in the given row
+// (using double hashing to derive the TINYLFU_DEPTH indexes from one hash)
+static inline size_t
+tinylfu_index(tinylfu_t *lfu, uint64_t hash, int row)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return (size_t)row * lfu->width + ((h1 + row * h2) & lfu->mask);
+}
+
+tinylfu_t *
+tinylfu_create(size_t width, uint32_t threshold)
+{
+    tinylfu_t *lfu = calloc(1, sizeof(tinylfu_t));
+    lfu->width = 1;
+    while (lfu->width < width)
+        lfu->width <<= 1;
+    lfu->mask = lfu->width - 1;
+    lfu->counters = calloc(TINYLFU_DEPTH, lfu->width);
+    lfu->sample_size = lfu->width * TINYLFU_SAMPLE_FACTOR;
+    lfu->threshold = threshold ? threshold : 1;
+    return lfu;
+}
+
+void
+tinylfu_destroy(tinylfu_t *lfu)
+{
+    free(lfu->counters);
+    free(lfu);
+}
+
+static void
+tinylfu_reset(tinylfu_t *lfu)
+{
+    size_t i;
+    for (i = 0; i < TINYLFU_DEPTH * lfu->width; i++) {
+        uint8_t count = ATOMIC_READ(lfu->counters[i]);
+        while (count && !ATOMIC_CAS(lfu->counters[i], count, count >> 1))
+            count = ATOMIC_READ(lfu->counters[i]);
+    }
+}
+
+void
+tinylfu_record(tinylfu_t *lfu, void *key, size_t klen)
+{
+    uint64_t hash = tinylfu_hash(key, klen);
+
+    // conservative update: only the smallest counters are incremented,
+    // which reduces the overestimation caused by collisions
+    uint8_t min = TINYLFU_MAX_COUNT;
+    int i;
+    for (i = 0; i < TINYLFU_DEPTH; i++) {
+        uint8_t count = ATOMIC_READ(lfu->counters[tinylfu_index(lfu, hash, i)]);
+        if (count < min)
+            min = count;
+    }
+
+    // saturated counters are left untouched but the access still counts
+    // towards the sample size, otherwise hot keys would delay the aging
+    if (min < TINYLFU_MAX_COUNT) {
+        for (i = 0; i < TINYLFU_DEPTH; i++) {
+            size_t idx = tinylfu_index(lfu, hash, i);
+            ATOMIC_CAS(lfu->counters[idx], min, min + 1);
+        }
+    }
+
+    // only the thread reaching the sample size takes care of the reset
+    if (ATOMIC_INCREASE(lfu->samples, 1) == lfu->sample_size) {
+        tinylfu_reset(lfu);
+        ATOMIC_DECREASE(lfu->samples, lfu->sample_size / 2);
+    }
+}
+
+uint32_t
+tinylfu_estimate(tinylfu_t *lfu, void *key, size_t klen)
+{
+    uint64_t hash = tinylfu_hash(key, klen);
+    uint8_t min = TINYLFU_MAX_COUNT;
+    int i;
+    for (i = 0; i < TINYLFU_DEPTH; i++) {
+        uint8_t count = ATOMIC_READ(lfu->counters[tinylfu_index(lfu, hash, i)]);
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+int
+tinylfu_admit(tinylfu_t *lfu, void *key, size_t klen)
+{
+    return tinylfu_estimate(lfu, key, klen) >= lfu->threshold;
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,42 @@
+#ifndef TINYLFU_H
+#define TINYLFU_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Frequency based admission filter (TinyLFU).
+ *
+ * The access frequency of the keys is approximated using a count-min sketch
+ * (4 rows of small saturating counters) so that the memory used doesn't
+ * depend on the number of distinct keys. Once the number of recorded accesses
+ * reaches the sample size (10 times the width of the sketch) all the counters
+ * are halved, so that the estimates reflect the recent popularity of the keys.
+ *
+ * A key is admitted once it has been accessed at least 'threshold' times
+ * within the sample window, which keeps one-hit wonders out of the cache.
+ *
+ * NOTE: all the functions are thread-safe, concurrent updates might get lost
+ *       but that's acceptable since the counters are approximated anyway
+ */
+typedef struct _tinylfu_s tinylfu_t;
+
+// width is the number of counters in each row of the sketch (rounded up to
+// a power of two), it should be in the order of the number of cached items
+tinylfu_t *tinylfu_create(size_t width, uint32_t threshold);
+
+void tinylfu_destroy(tinylfu_t *lfu);
+
+// records an access to the key
+void tinylfu_record(tinylfu_t *lfu, void *key, size_t klen);
+
+// returns the estimated number of recent accesses to the key
+uint32_t tinylfu_estimate(tinylfu_t *lfu, void *key, size_t klen);
+
+// returns 1 if the key has been accessed often enough to be admitted, 0 otherwise
+int tinylfu_admit(tinylfu_t *lfu, void *key, size_t klen);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
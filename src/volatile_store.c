@@ -0,0 +1,481 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <atomic_defs.h>
+
+#include "volatile_store.h"
+
+#define VOLATILE_STORE_MIN_SLOTS 64
+
+// the tables are grown once they are 3/4 full
+#define VOLATILE_STORE_LOAD_NUM 3
+#define VOLATILE_STORE_LOAD_DEN 4
+
+typedef struct {
+    time_t expire;
+    uint8_t referenced; // set on access, cleared by the clock hand
+    size_t klen;
+    size_t vlen;
+    char data[];        // the key followed by the value
+} volatile_store_item_t;
+
+#define VOLATILE_STORE_ITEM_KEY(_i) ((_i)->data)
+#define VOLATILE_STORE_ITEM_VALUE(_i) ((_i)->data + (_i)->klen)
+#define VOLATILE_STORE_ITEM_SIZE(_klen, _vlen) (sizeof(volatile_store_item_t) + (_klen) + (_vlen))
+
+typedef struct {
+    uint64_t hash;
+    volatile_store_item_t *item; // NULL if the slot is empty
+} volatile_store_slot_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    volatile_store_slot_t *slots;
+    size_t num_slots; // always a power of two
+    size_t count;
+    size_t size;      // the memory used by the items
+    size_t hand;      // the position of the clock hand
+} volatile_store_shard_t;
+
+struct _volatile_store_s {
+    volatile_store_shard_t *shards;
+    int num_shards;   // always a power of two
+    size_t max_size;
+    volatile_store_evict_cb evict_cb;
+    volatile_store_evict_cb locked_evict_cb;
+    void *priv;
+};
+
+// 64bit FNV-1a
+static inline uint64_t
+volatile_store_hash(void *key, size_t klen)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char *p = (unsigned char *)key;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// the low bits of the hash select the slot, the high ones the shard
+static inline volatile_store_shard_t *
+volatile_store_shard(volatile_store_t *store, uint64_t hash)
+{
+    return &store->shards[(hash >> 32) & (store->num_shards - 1)];
+}
+
+static inline int
+volatile_store_item_expired(volatile_store_item_t *item, time_t now)
+{
+    return item->expire && item->expire <= now;
+}
+
+volatile_store_t *
+volatile_store_create(int num_shards,
+                      size_t max_size,
+                      volatile_store_evict_cb evict_cb,
+                      volatile_store_evict_cb locked_evict_cb,
+                      void *priv)
+{
+    volatile_store_t *store = calloc(1, sizeof(volatile_store_t));
+    store->num_shards = 1;
+    while (store->num_shards < num_shards)
+        store->num_shards <<= 1;
+    store->max_size = max_size;
+    store->evict_cb = evict_cb;
+    store->locked_evict_cb = locked_evict_cb;
+    store->priv = priv;
+    store->shards = calloc(store->num_shards, sizeof(volatile_store_shard_t));
+    int i;
+    for (i = 0; i < store->num_shards; i++) {
+        volatile_store_shard_t *shard = &store->shards[i];
+        MUTEX_INIT(shard->lock);
+        shard->num_slots = VOLATILE_STORE_MIN_SLOTS;
+        shard->slots = calloc(shard->num_slots, sizeof(volatile_store_slot_t));
+    }
+    return store;
+}
+
+void
+volatile_store_destroy(volatile_store_t *store)
+{
+    int i;
+    for (i = 0; i < store->num_shards; i++) {
+        volatile_store_shard_t *shard = &store->shards[i];
+        size_t j;
+        for (j = 0; j < shard->num_slots; j++)
+            free(shard->slots[j].item);
+        free(shard->slots);
+        MUTEX_DESTROY(shard->lock);
+    }
+    free(store->shards);
+    free(store);
+}
+
+size_t
+volatile_store_max_size(volatile_store_t *store, size_t new_size)
+{
+    size_t old_size = ATOMIC_READ(store->max_size);
+    if (!old_size)
+        old_size = (size_t)-1;
+    if (new_size == (size_t)-1) {
+        ATOMIC_SET(store->max_size, 0);
+    } else if (new_size > 0) {
+        ATOMIC_SET(store->max_size, new_size);
+    }
+    return old_size;
+}
+
+size_t
+volatile_store_size(volatile_store_t *store)
+{
+    size_t size = 0;
+    int i;
+    for (i = 0; i < store->num_shards; i++)
+        size += ATOMIC_READ(store->shards[i].size);
+    return size;
+}
+
+size_t
+volatile_store_count(volatile_store_t *store)
+{
+    size_t count = 0;
+    int i;
+    for (i = 0; i < store->num_shards; i++)
+        count += ATOMIC_READ(store->shards[i].count);
+    return count;
+}
+
+// returns the index of the slot holding the key or -1 if not found
+// (the shard must be locked)
+static ssize_t
+volatile_store_lookup(volatile_store_shard_t *shard, uint64_t hash, void *key, size_t klen)
+{
+    size_t mask = shard->num_slots - 1;
+    size_t idx = hash & mask;
+    while (shard->slots[idx].item) {
+        volatile_store_slot_t *slot = &shard->slots[idx];
+        if (slot->hash == hash &&
+            slot->item->klen == klen &&
+            memcmp(VOLATILE_STORE_ITEM_KEY(slot->item), key, klen) == 0)
+        {
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return -1;
+}
+
+// places an item in the first free slot of its probe sequence
+// (the shard must be locked and have at least one free slot)
+static void
+volatile_store_place(volatile_store_shard_t *shard, uint64_t hash, volatile_store_item_t *item)
+{
+    size_t mask = shard->num_slots - 1;
+    size_t idx = hash & mask;
+    while (shard->slots[idx].item)
+        idx = (idx + 1) & mask;
+    shard->slots[idx].hash = hash;
+    shard->slots[idx].item = item;
+}
+
+static void
+volatile_store_grow(volatile_store_shard_t *shard)
+{
+    volatile_store_slot_t *old_slots = shard->slots;
+    size_t old_num_slots = shard->num_slots;
+
+    shard->num_slots <<= 1;
+    shard->slots = calloc(shard->num_slots, sizeof(volatile_store_slot_t));
+    shard->hand = 0;
+
+    size_t i;
+    for (i = 0; i < old_num_slots; i++) {
+        if (old_slots[i].item)
+            volatile_store_place(shard, old_slots[i].hash, old_slots[i].item);
+    }
+    free(old_slots);
+}
+
+// empties the slot and moves back the items following it in the same cluster
+// so that no tombstones are needed. Returns the item which was in the slot
+static volatile_store_item_t *
+volatile_store_remove_slot(volatile_store_shard_t *shard, size_t idx)
+{
+    volatile_store_item_t *item = shard->slots[idx].item;
+    size_t mask = shard->num_slots - 1;
+    size_t hole = idx;
+    size_t next = (idx + 1) & mask;
+
+    while (shard->slots[next].item) {
+        size_t home = shard->slots[next].hash & mask;
+        // the item can fill the hole only if its home slot
+        // doesn't fall cyclically in (hole, next]
+        int movable = (hole <= next)
+                    ? (home <= hole || home > next)
+                    : (home <= hole && home > next);
+        if (movable) {
+            shard->slots[hole] = shard->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    shard->slots[hole].item = NULL;
+    shard->slots[hole].hash = 0;
+
+    shard->count--;
+    shard->size -= VOLATILE_STORE_ITEM_SIZE(item->klen, item->vlen);
+    return item;
+}
+
+// the items evicted while the shard is locked, reported (and released)
+// once it has been unlocked
+typedef struct {
+    volatile_store_item_t **items;
+    size_t count;
+    size_t size;
+} volatile_store_evicted_t;
+
+static void
+volatile_store_evicted_add(volatile_store_evicted_t *evicted, volatile_store_item_t *item)
+{
+    if (evicted->count == evicted->size) {
+        size_t new_size = evicted->size ? evicted->size << 1 : 16;
+        volatile_store_item_t **items = realloc(evicted->items, new_size * sizeof(volatile_store_item_t *));
+        if (!items) {
+            // the callback can't be notified, but the memory must be released anyway
+            free(item);
+            return;
+        }
+        evicted->items = items;
+        evicted->size = new_size;
+    }
+    evicted->items[evicted->count++] = item;
+}
+
+static void
+volatile_store_evicted_release(volatile_store_t *store, volatile_store_evicted_t *evicted)
+{
+    size_t i;
+    for (i = 0; i < evicted->count; i++) {
+        volatile_store_item_t *item = evicted->items[i];
+        if (store->evict_cb)
+            store->evict_cb(VOLATILE_STORE_ITEM_KEY(item), item->klen, item->vlen, store->priv);
+        free(item);
+    }
+    free(evicted->items);
+}
+
+// returns 1 if an item of the given size fits in the share of memory of a shard
+static inline int
+volatile_store_fits(volatile_store_t *store, size_t item_size)
+{
+    size_t max_size = ATOMIC_READ(store->max_size);
+    return (!max_size || item_size <= max_size / store->num_shards);
+}
+
+// evicts items (following the clock hand) until there is room for
+// needed more bytes, expired items are evicted regardless of their
+// referenced bit. The caller must have checked that the item fits
+static void
+volatile_store_make_room(volatile_store_t *store,
+                         volatile_store_shard_t *shard,
+                         size_t needed,
+                         volatile_store_evicted_t *evicted)
+{
+    size_t max_size = ATOMIC_READ(store->max_size);
+    if (!max_size)
+        return;
+
+    size_t shard_max_size = max_size / store->num_shards;
+    time_t now = time(NULL);
+    while (shard->size + needed > shard_max_size && shard->count) {
+        volatile_store_slot_t *slot = &shard->slots[shard->hand];
+        volatile_store_item_t *item = slot->item;
+        if (item && (!item->referenced || volatile_store_item_expired(item, now))) {
+            // the next item might be moved back into this slot,
+            // so the hand must not advance
+            volatile_store_remove_slot(shard, shard->hand);
+            if (store->locked_evict_cb)
+                store->locked_evict_cb(VOLATILE_STORE_ITEM_KEY(item), item->klen, item->vlen, store->priv);
+            volatile_store_evicted_add(evicted, item);
+            continue;
+        }
+        if (item)
+            item->referenced = 0;
+        shard->hand = (shard->hand + 1) & (shard->num_slots - 1);
+    }
+}
+
+int
+volatile_store_get(volatile_store_t *store,
+                   void *key,
+                   size_t klen,
+                   volatile_store_copy_cb cb,
+                   void *priv)
+{
+    uint64_t hash = volatile_store_hash(key, klen);
+    volatile_store_shard_t *shard = volatile_store_shard(store, hash);
+    int rc = -1;
+
+    MUTEX_LOCK(shard->lock);
+    ssize_t idx = volatile_store_lookup(shard, hash, key, klen);
+    if (idx >= 0) {
+        volatile_store_item_t *item = shard->slots[idx].item;
+        if (!volatile_store_item_expired(item, time(NULL))) {
+            item->referenced = 1;
+            if (cb)
+                cb(VOLATILE_STORE_ITEM_VALUE(item), item->vlen, priv);
+            rc = 0;
+        }
+    }
+    MUTEX_UNLOCK(shard->lock);
+
+    return rc;
+}
+
+int
+volatile_store_exists(volatile_store_t *store, void *key, size_t klen)
+{
+    return (volatile_store_get(store, key, klen, NULL, NULL) == 0);
+}
+
+volatile_store_set_result_t
+volatile_store_set(volatile_store_t *store,
+                   void *key,
+                   size_t klen,
+                   void *value,
+                   size_t vlen,
+                   time_t expire,
+                   int if_not_exists,
+                   size_t *prev_len)
+{
+    uint64_t hash = volatile_store_hash(key, klen);
+    volatile_store_shard_t *shard = volatile_store_shard(store, hash);
+    size_t item_size = VOLATILE_STORE_ITEM_SIZE(klen, vlen);
+    volatile_store_set_result_t rc = VOLATILE_STORE_INSERTED;
+    volatile_store_evicted_t evicted = { NULL, 0, 0 };
+
+    volatile_store_item_t *item = malloc(item_size);
+    if (!item)
+        return VOLATILE_STORE_ERROR;
+
+    MUTEX_LOCK(shard->lock);
+
+    ssize_t idx = volatile_store_lookup(shard, hash, key, klen);
+    if (idx >= 0) {
+        volatile_store_item_t *prev = shard->slots[idx].item;
+        if (if_not_exists && !volatile_store_item_expired(prev, time(NULL))) {
+            MUTEX_UNLOCK(shard->lock);
+            free(item);
+            return VOLATILE_STORE_EXISTS;
+        }
+    }
+
+    // check before touching the previous item so that
+    // it's left in place if the new one can't be stored
+    if (!volatile_store_fits(store, item_size)) {
+        MUTEX_UNLOCK(shard->lock);
+        free(item);
+        return VOLATILE_STORE_ERROR;
+    }
+
+    if (idx >= 0) {
+        volatile_store_item_t *prev = shard->slots[idx].item;
+        // remove the previous item first so that its memory
+        // is accounted as available when making room
+        volatile_store_remove_slot(shard, idx);
+        if (prev_len)
+            *prev_len = prev->vlen;
+        free(prev);
+        rc = VOLATILE_STORE_REPLACED;
+    }
+
+    volatile_store_make_room(store, shard, item_size, &evicted);
+
+    if ((shard->count + 1) * VOLATILE_STORE_LOAD_DEN > shard->num_slots * VOLATILE_STORE_LOAD_NUM)
+        volatile_store_grow(shard);
+
+    item->expire = expire;
+    item->referenced = 0;
+    item->klen = klen;
+    item->vlen = vlen;
+    memcpy(VOLATILE_STORE_ITEM_KEY(item), key, klen);
+    memcpy(VOLATILE_STORE_ITEM_VALUE(item), value, vlen);
+
+    volatile_store_place(shard, hash, item);
+    shard->count++;
+    shard->size += item_size;
+
+    MUTEX_UNLOCK(shard->lock);
+
+    volatile_store_evicted_release(store, &evicted);
+
+    return rc;
+}
+
+int
+volatile_store_delete(volatile_store_t *store, void *key, size_t klen, size_t *prev_len)
+{
+    uint64_t hash = volatile_store_hash(key, klen);
+    volatile_store_shard_t *shard = volatile_store_shard(store, hash);
+    volatile_store_item_t *item = NULL;
+
+    MUTEX_LOCK(shard->lock);
+    ssize_t idx = volatile_store_lookup(shard, hash, key, klen);
+    if (idx >= 0)
+        item = volatile_store_remove_slot(shard, idx);
+    MUTEX_UNLOCK(shard->lock);
+
+    if (!item)
+        return -1;
+
+    if (prev_len)
+        *prev_len = item->vlen;
+    free(item);
+    return 0;
+}
+
+void
+volatile_store_foreach(volatile_store_t *store, volatile_store_iterator_cb cb, void *priv)
+{
+    int i;
+    for (i = 0; i < store->num_shards; i++) {
+        volatile_store_shard_t *shard = &store->shards[i];
+        MUTEX_LOCK(shard->lock);
+        size_t j = 0;
+        while (j < shard->num_slots) {
+            volatile_store_item_t *item = shard->slots[j].item;
+            if (!item) {
+                j++;
+                continue;
+            }
+            volatile_store_iterator_status_t rc = cb(VOLATILE_STORE_ITEM_KEY(item),
+                                                     item->klen,
+                                                     VOLATILE_STORE_ITEM_VALUE(item),
+                                                     item->vlen,
+                                                     item->expire,
+                                                     priv);
+            if (rc == VOLATILE_STORE_ITERATOR_STOP) {
+                MUTEX_UNLOCK(shard->lock);
+                return;
+            }
+            if (rc == VOLATILE_STORE_ITERATOR_REMOVE) {
+                // the slot might now hold the next item of the cluster
+                volatile_store_remove_slot(shard, j);
+                free(item);
+                continue;
+            }
+            j++;
+        }
+        MUTEX_UNLOCK(shard->lock);
+    }
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -0,0 +1,110 @@
+#ifndef VOLATILE_STORE_H
+#define VOLATILE_STORE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * In-memory storage for the volatile items.
+ *
+ * The keyspace is split among a fixed number of shards, each protected by its
+ * own lock, so that concurrent operations on different keys rarely contend.
+ * Each shard is an open-addressing table (linear probing, backward shift on
+ * removal) holding the hash of the key and a pointer to the item, while the
+ * key and the value are stored inline in the same allocation as the item.
+ *
+ * If a maximum size is set, items are evicted (CLOCK order, expired items
+ * first) from the shard which is going to exceed its share of the memory.
+ * Items whose expiration time has passed are reported as missing even if
+ * they haven't been removed yet by the caller.
+ *
+ * NOTE: all the functions are thread-safe
+ */
+typedef struct _volatile_store_s volatile_store_t;
+
+// called for each item evicted to make room for new ones
+typedef void (*volatile_store_evict_cb)(void *key, size_t klen, size_t vlen, void *priv);
+
+// max_size is the maximum amount of memory (in bytes) used by the items,
+// 0 means no limit. evict_cb is called once the shard has been unlocked,
+// locked_evict_cb (if any) is called before, with the shard still locked,
+// so that nothing can be stored for the same key in the meanwhile
+// (it must not access the store)
+volatile_store_t *volatile_store_create(int num_shards,
+                                        size_t max_size,
+                                        volatile_store_evict_cb evict_cb,
+                                        volatile_store_evict_cb locked_evict_cb,
+                                        void *priv);
+
+void volatile_store_destroy(volatile_store_t *store);
+
+// returns the previous maximum size ((size_t)-1 if there was no limit),
+// 0 doesn't change it and (size_t)-1 removes the limit. When shrinking, the exceeding items are
+// evicted lazily on the next insertions
+size_t volatile_store_max_size(volatile_store_t *store, size_t new_size);
+
+// the amount of memory used by the items
+size_t volatile_store_size(volatile_store_t *store);
+
+// the number of items in the store
+size_t volatile_store_count(volatile_store_t *store);
+
+// called (with the shard locked) to copy the value of an item out of the store
+typedef void (*volatile_store_copy_cb)(void *value, size_t vlen, void *priv);
+
+// returns 0 if the item has been found (and the callback called), -1 otherwise
+int volatile_store_get(volatile_store_t *store,
+                       void *key,
+                       size_t klen,
+                       volatile_store_copy_cb cb,
+                       void *priv);
+
+// returns 1 if the key exists (and is not expired), 0 otherwise
+int volatile_store_exists(volatile_store_t *store, void *key, size_t klen);
+
+typedef enum {
+    VOLATILE_STORE_ERROR = -1,   // the item doesn't fit in the store (nothing changed)
+    VOLATILE_STORE_INSERTED = 0, // the key didn't exist
+    VOLATILE_STORE_EXISTS = 1,   // the key exists (and if_not_exists was set)
+    VOLATILE_STORE_REPLACED = 2  // the previous value has been replaced
+} volatile_store_set_result_t;
+
+// stores a copy of the value, expire is the absolute time (in seconds) when the
+// item expires (0 for never). If replaced, the size of the previous value is
+// returned in prev_len (if not NULL). On error the previous value is left in place
+volatile_store_set_result_t volatile_store_set(volatile_store_t *store,
+                                               void *key,
+                                               size_t klen,
+                                               void *value,
+                                               size_t vlen,
+                                               time_t expire,
+                                               int if_not_exists,
+                                               size_t *prev_len);
+
+// returns 0 if the item has been removed (its size is returned in prev_len
+// if not NULL), -1 if not found
+int volatile_store_delete(volatile_store_t *store, void *key, size_t klen, size_t *prev_len);
+
+typedef enum {
+    VOLATILE_STORE_ITERATOR_REMOVE = -1,
+    VOLATILE_STORE_ITERATOR_STOP = 0,
+    VOLATILE_STORE_ITERATOR_CONTINUE = 1
+} volatile_store_iterator_status_t;
+
+// called (with the shard locked) for each item, the callback must not access the store
+typedef volatile_store_iterator_status_t (*volatile_store_iterator_cb)(void *key,
+                                                                      size_t klen,
+                                                                      void *value,
+                                                                      size_t vlen,
+                                                                      time_t expire,
+                                                                      void *priv);
+
+// iterates over all the items (including the expired ones not yet removed).
+// NOTE: an item moved back by the removal of a previous one might be visited twice
+void volatile_store_foreach(volatile_store_t *store, volatile_store_iterator_cb cb, void *priv);
+
+#endif
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
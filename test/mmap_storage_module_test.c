@@ -0,0 +1,175 @@
+// the module is an example built as a separate shared object,
+// it's included here so that its internals can be checked as well
+#include "../examples/mmap_storage_module.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <ut.h>
+
+static char test_dir[] = "/tmp/mmap_storage_test.XXXXXX";
+
+static mmst_t *
+test_storage_init(shardcache_storage_t *storage)
+{
+    char *options[] = {
+        "path", test_dir,
+        "segment_size", "4096",
+        "compact_ratio", "50",
+        NULL
+    };
+    memset(storage, 0, sizeof(shardcache_storage_t));
+    if (storage_init(storage, options) != 0)
+        return NULL;
+    return (mmst_t *)storage->priv;
+}
+
+// returns 1 if the stored value matches the expected one
+// (or if the key is not stored and no value is expected)
+static int
+test_fetch(shardcache_storage_t *storage, char *key, void *expected, size_t elen)
+{
+    void *value = NULL;
+    size_t vlen = 0;
+    if (storage->fetch(key, strlen(key), &value, &vlen, storage->priv) != 0)
+        return 0;
+
+    int match = expected ? (value && vlen == elen && memcmp(value, expected, vlen) == 0)
+                         : (value == NULL);
+    free(value);
+    return match;
+}
+
+static int
+segment_exists(uint32_t id)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/segment.%08u", test_dir, id);
+    return (access(path, F_OK) == 0);
+}
+
+static void
+remove_test_dir(void)
+{
+    DIR *dir = opendir(test_dir);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (strncmp(entry->d_name, "segment.", 8) == 0) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", test_dir, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(test_dir);
+}
+
+int
+main(int argc, char **argv)
+{
+    shardcache_storage_t storage;
+    int i;
+
+    if (!mkdtemp(test_dir)) {
+        fprintf(stderr, "Can't create the test directory: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    ut_init(basename(argv[0]));
+
+    ut_testing("storage_init(path=%s)", test_dir);
+    mmst_t *st = test_storage_init(&storage);
+    if (!st) {
+        ut_failure("Can't initialize the storage");
+        remove_test_dir();
+        ut_summary();
+        exit(ut_failed);
+    }
+    ut_success();
+
+    ut_testing("store(), overwrite and remove()");
+    int rc = storage.store("mmst_key1", 9, "value1", 6, storage.priv);
+    rc |= storage.store("mmst_key2", 9, "value2", 6, storage.priv);
+    rc |= storage.store("mmst_key1", 9, "value1_new", 10, storage.priv);
+    rc |= storage.remove("mmst_key2", 9, storage.priv);
+    ut_validate_int(rc, 0);
+
+    ut_testing("fetch() returns the last stored values");
+    ut_validate_int((test_fetch(&storage, "mmst_key1", "value1_new", 10) &&
+                     test_fetch(&storage, "mmst_key2", NULL, 0) &&
+                     storage.count(storage.priv) == 1), 1);
+
+    ut_testing("the values are found after reloading the segments");
+    storage_destroy(storage.priv);
+    st = test_storage_init(&storage);
+    if (!st) {
+        ut_failure("Can't initialize the storage");
+        remove_test_dir();
+        ut_summary();
+        exit(ut_failed);
+    }
+    ut_validate_int((test_fetch(&storage, "mmst_key1", "value1_new", 10) &&
+                     test_fetch(&storage, "mmst_key2", NULL, 0) &&
+                     storage.exist("mmst_key1", 9, storage.priv) &&
+                     !storage.exist("mmst_key2", 9, storage.priv) &&
+                     storage.count(storage.priv) == 1), 1);
+
+    ut_testing("overwrites fill more segments");
+    // each record takes more than a quarter of a segment, so the overwrites
+    // leave only garbage in all the segments but the active one
+    char value[1024];
+    for (i = 0; i < 16; i++) {
+        memset(value, 'a' + i, sizeof(value));
+        if (storage.store("mmst_big_key", 12, value, sizeof(value), storage.priv) != 0)
+            break;
+    }
+    pthread_rwlock_rdlock(&st->lock);
+    uint32_t active_id = st->active->id;
+    pthread_rwlock_unlock(&st->lock);
+    ut_validate_int((i == 16 && active_id > 1), 1);
+
+    ut_testing("the compactor removes the segments holding only garbage");
+    int waited;
+    int compacted = 0;
+    for (waited = 0; !compacted && waited < 50; waited++) {
+        usleep(100000);
+        pthread_rwlock_rdlock(&st->lock);
+        compacted = 1;
+        uint32_t id;
+        for (id = 0; id < active_id; id++) {
+            if (st->segments[id])
+                compacted = 0;
+        }
+        pthread_rwlock_unlock(&st->lock);
+    }
+    ut_validate_int((compacted && !segment_exists(0) && !segment_exists(active_id - 1)), 1);
+
+    ut_testing("the compacted values are still found");
+    ut_validate_int((test_fetch(&storage, "mmst_key1", "value1_new", 10) &&
+                     test_fetch(&storage, "mmst_key2", NULL, 0) &&
+                     test_fetch(&storage, "mmst_big_key", value, sizeof(value))), 1);
+
+    ut_testing("the compacted values are found after reloading the segments");
+    storage_destroy(storage.priv);
+    st = test_storage_init(&storage);
+    if (st) {
+        ut_validate_int((test_fetch(&storage, "mmst_key1", "value1_new", 10) &&
+                         test_fetch(&storage, "mmst_key2", NULL, 0) &&
+                         test_fetch(&storage, "mmst_big_key", value, sizeof(value)) &&
+                         storage.count(storage.priv) == 2), 1);
+        storage_destroy(storage.priv);
+    } else {
+        ut_failure("Can't initialize the storage");
+    }
+
+    remove_test_dir();
+
+    ut_summary();
+    exit(ut_failed);
+}
+
+// vim: tabstop=4 shiftwidth=4 expandtab:
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
@@ -1,9 +1,1346 @@
 #include <shardcache_client.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <ut.h>
 #include <libgen.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <arc.h>
+#include <arc_slab.h>
+#include <timer_wheel.h>
+#include <shardcache_internal.h>
+#include <messaging.h>
+#include <connections.h>
+#include <arc_ops.h>
+
+static void
+count_admission_record(void *key, size_t klen, void *priv)
+{
+    (*(int *)priv)++;
+}
+
+static int
+count_admission_admit(void *key, size_t klen, void *priv)
+{
+    return 1;
+}
+
+typedef struct {
+    char value[64];
+    size_t len;
+    int done;
+    int failed;
+} async_get_result_t;
+
+static int
+collect_async_get(void *key, size_t klen, void *data, size_t dlen,
+                  size_t total_size, struct timeval *timestamp, void *priv)
+{
+    async_get_result_t *result = (async_get_result_t *)priv;
+    if (dlen && result->len + dlen <= sizeof(result->value)) {
+        memcpy(result->value + result->len, data, dlen);
+        result->len += dlen;
+    }
+    if (!data && !dlen && !total_size && !timestamp)
+        result->failed = 1;
+    if (total_size || timestamp || result->failed)
+        __sync_fetch_and_add(&result->done, 1);
+    return 0;
+}
+
+static int storage_fetch_calls = 0;
+static int storage_fetch_async_calls = 0;
+
+static int
+test_storage_fetch(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    __sync_fetch_and_add(&storage_fetch_calls, 1);
+    *value = strdup("storage_value");
+    if (vlen)
+        *vlen = 13;
+    return 0;
+}
+
+typedef struct {
+    shardcache_fetch_async_done_callback_t cb;
+    void *cb_priv;
+    void *key;
+    size_t klen;
+} test_storage_fetch_async_arg_t;
+
+static void *
+test_storage_fetch_async_thread(void *priv)
+{
+    test_storage_fetch_async_arg_t *arg = (test_storage_fetch_async_arg_t *)priv;
+    usleep(10000);
+    arg->cb(arg->key, arg->klen, strdup("async_storage_value"), 19, 0, arg->cb_priv);
+    free(arg);
+    return NULL;
+}
+
+static int
+test_storage_fetch_async(void *key, size_t klen, shardcache_fetch_async_done_callback_t cb, void *cb_priv, void *priv)
+{
+    __sync_fetch_and_add(&storage_fetch_async_calls, 1);
+    // complete the fetch from another thread (after fetch_async returned)
+    test_storage_fetch_async_arg_t *arg = malloc(sizeof(test_storage_fetch_async_arg_t));
+    arg->cb = cb;
+    arg->cb_priv = cb_priv;
+    arg->key = key;
+    arg->klen = klen;
+    pthread_t th;
+    if (pthread_create(&th, NULL, test_storage_fetch_async_thread, arg) != 0) {
+        free(arg);
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+static void
+test_async_storage(shardcache_node_t *node)
+{
+    char *label = shardcache_node_get_label(node);
+    shardcache_storage_t storage = {
+        .version = SHARDCACHE_STORAGE_API_VERSION,
+        .fetch_async = test_storage_fetch_async
+    };
+
+    ut_testing("shardcache_create() refuses a storage without the fetch callback");
+    shardcache_t *cache = shardcache_create(label, &node, 1, &storage, NULL, 1, 0, 1<<20);
+    ut_validate_int((cache == NULL), 1);
+    if (cache)
+        shardcache_destroy(cache);
+
+    storage.fetch = test_storage_fetch;
+    cache = shardcache_create(label, &node, 1, &storage, NULL, 1, 0, 1<<20);
+    if (!cache) {
+        ut_testing("shardcache_create() with an asynchronous storage");
+        ut_failure("Errors creating the shardcache instance");
+        return;
+    }
+
+    ut_testing("shardcache_get_async() uses the fetch_async storage callback");
+    async_get_result_t result;
+    memset(&result, 0, sizeof(result));
+    shardcache_get_async(cache, "async_storage_key", 17, collect_async_get, &result);
+    int waited = 0;
+    while (!__sync_fetch_and_add(&result.done, 0) && waited++ < 5000)
+        usleep(1000);
+    if (result.done && !result.failed && storage_fetch_async_calls == 1 && storage_fetch_calls == 0)
+        ut_validate_buffer(result.value, result.len, "async_storage_value", 19);
+    else
+        ut_failure("fetch_async calls: %d, fetch calls: %d, failed: %d",
+                   storage_fetch_async_calls, storage_fetch_calls, result.failed);
+
+    ut_testing("shardcache_get() uses the synchronous fetch storage callback");
+    size_t vlen = 0;
+    void *value = shardcache_get(cache, "sync_storage_key", 16, &vlen, NULL);
+    if (value && storage_fetch_calls == 1)
+        ut_validate_buffer(value, vlen, "storage_value", 13);
+    else
+        ut_failure("No value returned by the synchronous fetch");
+    free(value);
+
+    shardcache_destroy(cache);
+}
+
+#define TEST_STORAGE_MAX_ITEMS 256
+
+// a trivial in-memory storage (providing an index) used by the migration test
+typedef struct {
+    char *keys[TEST_STORAGE_MAX_ITEMS];
+    char *values[TEST_STORAGE_MAX_ITEMS];
+    int count;
+    pthread_mutex_t lock;
+} test_storage_t;
+
+static int
+test_storage_find(test_storage_t *st, void *key, size_t klen)
+{
+    int i;
+    for (i = 0; i < st->count; i++) {
+        if (strlen(st->keys[i]) == klen && memcmp(st->keys[i], key, klen) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int
+test_storage_get(void *key, size_t klen, void **value, size_t *vlen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    *value = (i >= 0) ? strdup(st->values[i]) : NULL;
+    if (vlen)
+        *vlen = (i >= 0) ? strlen(st->values[i]) : 0;
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int
+test_storage_store(void *key, size_t klen, void *value, size_t vlen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    int rc = 0;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    if (i < 0 && st->count < TEST_STORAGE_MAX_ITEMS) {
+        i = st->count++;
+        st->keys[i] = strndup(key, klen);
+        st->values[i] = NULL;
+    }
+    if (i >= 0) {
+        free(st->values[i]);
+        st->values[i] = strndup(value, vlen);
+    } else {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return rc;
+}
+
+static int
+test_storage_remove(void *key, size_t klen, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    int i = test_storage_find(st, key, klen);
+    if (i >= 0) {
+        free(st->keys[i]);
+        free(st->values[i]);
+        st->count--;
+        st->keys[i] = st->keys[st->count];
+        st->values[i] = st->values[st->count];
+    }
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static size_t
+test_storage_count(void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    size_t count = st->count;
+    pthread_mutex_unlock(&st->lock);
+    return count;
+}
+
+static size_t
+test_storage_index(shardcache_storage_index_item_t *index, size_t isize, void *priv)
+{
+    test_storage_t *st = (test_storage_t *)priv;
+    pthread_mutex_lock(&st->lock);
+    size_t i;
+    for (i = 0; i < isize && i < st->count; i++) {
+        index[i].klen = strlen(st->keys[i]);
+        index[i].key = malloc(index[i].klen);
+        memcpy(index[i].key, st->keys[i], index[i].klen);
+        index[i].vlen = strlen(st->values[i]);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return i;
+}
+
+static void
+test_storage_init(test_storage_t *st, shardcache_storage_t *storage)
+{
+    memset(st, 0, sizeof(test_storage_t));
+    pthread_mutex_init(&st->lock, NULL);
+    memset(storage, 0, sizeof(shardcache_storage_t));
+    storage->version = SHARDCACHE_STORAGE_API_VERSION;
+    storage->fetch = test_storage_get;
+    storage->store = test_storage_store;
+    storage->remove = test_storage_remove;
+    storage->count = test_storage_count;
+    storage->index = test_storage_index;
+    storage->priv = st;
+}
+
+static void
+test_storage_clear(test_storage_t *st)
+{
+    int i;
+    for (i = 0; i < st->count; i++) {
+        free(st->keys[i]);
+        free(st->values[i]);
+    }
+    pthread_mutex_destroy(&st->lock);
+}
+
+typedef struct {
+    shardcache_t *cache;
+    int stop;
+    int lookups;
+    int errors;
+} ownership_reader_t;
+
+// keeps looking up the owners while the continua are being swapped,
+// each lookup must resolve to one of the two nodes taking part in the migration
+static void *
+ownership_reader(void *priv)
+{
+    ownership_reader_t *reader = (ownership_reader_t *)priv;
+    while (!__sync_fetch_and_add(&reader->stop, 0)) {
+        int i;
+        for (i = 0; i < 64; i++) {
+            char k[32];
+            char owner[64] = { 0 };
+            size_t len = sizeof(owner);
+            sprintf(k, "migration_key%d", i);
+            int rc = shardcache_test_ownership(reader->cache, k, strlen(k), owner, &len);
+            // a single shard owns everything (and the owner is not filled in)
+            if (rc == -1 || (rc == 0 && strcmp(owner, "migration_peer_b") != 0) ||
+                (rc == 1 && owner[0] && strcmp(owner, "migration_peer_a") != 0))
+            {
+                reader->errors++;
+            }
+            reader->lookups++;
+        }
+    }
+    return NULL;
+}
+
+static void
+test_parallel_migration(void)
+{
+    char *address_a[1] = { "127.0.0.1:9761" };
+    char *address_b[1] = { "127.0.0.1:9762" };
+    shardcache_node_t *mg_nodes[2] = {
+        shardcache_node_create("migration_peer_a", address_a, 1),
+        shardcache_node_create("migration_peer_b", address_b, 1)
+    };
+
+    test_storage_t st_a, st_b;
+    shardcache_storage_t storage_a, storage_b;
+    test_storage_init(&st_a, &storage_a);
+    test_storage_init(&st_b, &storage_b);
+
+    int i;
+    for (i = 0; i < 64; i++) {
+        char k[32], v[32];
+        sprintf(k, "migration_key%d", i);
+        sprintf(v, "migration_value%d", i);
+        test_storage_store(k, strlen(k), v, strlen(v), &st_a);
+    }
+
+    // a owns all the keys until b joins
+    shardcache_t *a = shardcache_create("migration_peer_a", mg_nodes, 1, &storage_a, NULL, 2, 0, 1<<20);
+    shardcache_t *b = shardcache_create("migration_peer_b", mg_nodes, 2, &storage_b, NULL, 2, 0, 1<<20);
+    if (!a || !b) {
+        ut_testing("shardcache_migration_begin() with parallel workers");
+        ut_failure("Errors creating the shardcache instances");
+    } else {
+        ut_testing("shardcache_migration_workers(a, 8) == SHARDCACHE_MIGRATION_WORKERS_DEFAULT");
+        ut_validate_int(shardcache_migration_workers(a, 8), SHARDCACHE_MIGRATION_WORKERS_DEFAULT);
+        // much bigger than the number of items to copy
+        shardcache_migration_batch_size(a, 1<<30);
+
+        ut_testing("shardcache_migration_begin() copies the items to the new owner (8 workers)");
+        int expected_b = 0;
+        for (i = 0; i < 64; i++) {
+            char k[32];
+            sprintf(k, "migration_key%d", i);
+            if (!shardcache_test_ownership(b, k, strlen(k), NULL, NULL))
+                continue;
+            expected_b++;
+        }
+        ownership_reader_t readers[4];
+        pthread_t reader_threads[4];
+        memset(readers, 0, sizeof(readers));
+        for (i = 0; i < 4; i++) {
+            readers[i].cache = a;
+            pthread_create(&reader_threads[i], NULL, ownership_reader, &readers[i]);
+        }
+        shardcache_migration_begin(a, mg_nodes, 2, 0);
+        // the items are removed from a once all of them have been copied
+        int waited = 0;
+        while (test_storage_count(&st_a) != 64 - expected_b && waited++ < 10000)
+            usleep(1000);
+        // the first lookup noticing the completed migration swaps the continua
+        int swapped = 0;
+        for (waited = 0; !swapped && waited < 10000; waited++) {
+            swapped = 1;
+            for (i = 0; swapped && i < 64; i++) {
+                char k[32];
+                sprintf(k, "migration_key%d", i);
+                if (shardcache_test_ownership(a, k, strlen(k), NULL, NULL) ==
+                    shardcache_test_ownership(b, k, strlen(k), NULL, NULL))
+                {
+                    swapped = 0;
+                }
+            }
+            if (!swapped)
+                usleep(1000);
+        }
+        int lookups = 0, errors = 0;
+        for (i = 0; i < 4; i++) {
+            __sync_fetch_and_add(&readers[i].stop, 1);
+            pthread_join(reader_threads[i], NULL);
+            lookups += readers[i].lookups;
+            errors += readers[i].errors;
+        }
+        int failed = 0;
+        for (i = 0; !failed && i < 64; i++) {
+            char k[32], v[32];
+            sprintf(k, "migration_key%d", i);
+            sprintf(v, "migration_value%d", i);
+            int owned_by_b = shardcache_test_ownership(b, k, strlen(k), NULL, NULL);
+            test_storage_t *owner = owned_by_b ? &st_b : &st_a;
+            test_storage_t *other = owned_by_b ? &st_a : &st_b;
+            void *value = NULL;
+            size_t vlen = 0;
+            test_storage_get(k, strlen(k), &value, &vlen, owner);
+            if (!value || vlen != strlen(v) || memcmp(value, v, vlen) != 0 ||
+                test_storage_find(other, k, strlen(k)) >= 0)
+            {
+                ut_failure("Key %s not migrated to its new owner (%s)", k, owned_by_b ? "b" : "a");
+                failed = 1;
+            }
+            free(value);
+        }
+        if (!failed)
+            ut_validate_int((expected_b > 0 && st_b.count == expected_b), 1);
+
+        ut_testing("lookups during the migration resolve to the old or the new owner");
+        if (errors)
+            ut_failure("%d out of %d lookups returned an unexpected owner", errors, lookups);
+        else
+            ut_validate_int((lookups > 0), 1);
+
+        ut_testing("the continua are swapped once the migration is complete");
+        ut_validate_int(swapped, 1);
+
+        ut_testing("shardcache_test_migration_ownership() fails once the migration is over");
+        ut_validate_int(shardcache_test_migration_ownership(a, "migration_key0", 14, NULL, NULL), -1);
+    }
+
+    if (a)
+        shardcache_destroy(a);
+    if (b)
+        shardcache_destroy(b);
+    test_storage_clear(&st_a);
+    test_storage_clear(&st_b);
+    shardcache_node_destroy(mg_nodes[0]);
+    shardcache_node_destroy(mg_nodes[1]);
+}
+
+static void
+test_owner_hints(void)
+{
+    char *address_a[1] = { "127.0.0.1:9763" };
+    char *address_b[1] = { "127.0.0.1:9764" };
+    shardcache_node_t *hint_nodes[2] = {
+        shardcache_node_create("hint_peer_a", address_a, 1),
+        shardcache_node_create("hint_peer_b", address_b, 1)
+    };
+
+    test_storage_t st_a, st_b;
+    shardcache_storage_t storage_a, storage_b;
+    test_storage_init(&st_a, &storage_a);
+    test_storage_init(&st_b, &storage_b);
+
+    // a owns everything until b joins, while b already knows both nodes
+    shardcache_t *a = shardcache_create("hint_peer_a", hint_nodes, 1, &storage_a, NULL, 2, 0, 1<<20);
+    shardcache_t *b = shardcache_create("hint_peer_b", hint_nodes, 2, &storage_b, NULL, 2, 0, 1<<20);
+
+    ut_testing("shardcache_get_owner() resolves our own label with a single shard");
+    if (!a || !b) {
+        ut_failure("Errors creating the shardcache instances");
+    } else {
+        char key[32];
+        int i;
+        for (i = 0; i < 1024; i++) {
+            sprintf(key, "hint_key%d", i);
+            if (shardcache_test_ownership(b, key, strlen(key), NULL, NULL) == 0)
+                break;
+        }
+        size_t klen = strlen(key);
+        test_storage_store(key, klen, "hint_value", 10, &st_a);
+
+        const char *owner = NULL;
+        uint32_t gen = 0;
+        int rc = shardcache_get_owner(a, key, klen, 0, &owner, &gen);
+        ut_validate_int((rc == 1 && owner == a->me_label), 1);
+
+        ut_testing("shardcache_get_owner() fails on the migration continuum if not migrating");
+        ut_validate_int(shardcache_get_owner(a, key, klen, 1, &owner, NULL), -1);
+
+        // load the key (remembering a as its owner) and push it to the ghost
+        // lists by filling up the cache with bigger items
+        size_t vlen = 0;
+        free(shardcache_get(a, key, klen, &vlen, NULL));
+        char *filler = malloc(1<<15);
+        memset(filler, 'x', 1<<15);
+        for (i = 0; i < 64; i++) {
+            char k[32];
+            sprintf(k, "hint_filler%d", i);
+            test_storage_store(k, strlen(k), filler, 1<<15, &st_a);
+            free(shardcache_get(a, k, strlen(k), &vlen, NULL));
+        }
+        free(filler);
+
+        shardcache_migration_begin(a, hint_nodes, 2, 0);
+        // the continua are swapped by the first lookup after the migration is complete
+        int waited = 0;
+        while (shardcache_test_ownership(a, key, klen, NULL, NULL) != 0 && waited++ < 10000)
+            usleep(1000);
+
+        ut_testing("shardcache_get_owner() resolves the new owner once the continua are swapped");
+        uint32_t new_gen = 0;
+        rc = shardcache_get_owner(a, key, klen, 0, &owner, &new_gen);
+        ut_validate_int((rc == 0 && new_gen != gen && owner && strcmp(owner, "hint_peer_b") == 0), 1);
+
+        ut_testing("shardcache_get_owner() returns the interned label");
+        const char *interned = owner;
+        rc = shardcache_get_owner(a, key, klen, 0, &owner, NULL);
+        ut_validate_int((rc == 0 && owner == interned), 1);
+
+        // the key has been moved to b, if the stale hint was used
+        // a would look for it in its own storage
+        ut_testing("stale owner hints are discarded after a continuum change");
+        char *value = shardcache_get(a, key, klen, &vlen, NULL);
+        if (value && test_storage_find(&st_a, key, klen) >= 0)
+            ut_failure("The key has not been migrated");
+        else
+            ut_validate_buffer(value, vlen, "hint_value", 10);
+        free(value);
+    }
+
+    if (a)
+        shardcache_destroy(a);
+    if (b)
+        shardcache_destroy(b);
+    test_storage_clear(&st_a);
+    test_storage_clear(&st_b);
+    shardcache_node_destroy(hint_nodes[0]);
+    shardcache_node_destroy(hint_nodes[1]);
+}
+
+#define EVICTOR_TEST_KEYS (SHARDCACHE_EVICTOR_BATCH_SIZE + 44)
+
+static int
+count_cached(shardcache_t *cache, char keys[][32], int num_keys, const char *value)
+{
+    int i, count = 0;
+    for (i = 0; i < num_keys; i++) {
+        size_t vlen = 0;
+        char *v = shardcache_get(cache, keys[i], strlen(keys[i]), &vlen, NULL);
+        if (v && vlen == strlen(value) && memcmp(v, value, vlen) == 0)
+            count++;
+        free(v);
+    }
+    return count;
+}
+
+// the peer caches items owned by the owner, updates on the owner
+// must be propagated to the peer (in batches) by the evictor
+static void
+test_evictor_batches(shardcache_t *owner, shardcache_t *peer, char *peer_address)
+{
+    static char keys[EVICTOR_TEST_KEYS][32];
+    int i, n;
+    for (i = 0, n = 0; n < EVICTOR_TEST_KEYS; i++) {
+        sprintf(keys[n], "evictor_key%d", i);
+        if (shardcache_test_ownership(owner, keys[n], strlen(keys[n]), NULL, NULL) == 1)
+            n++;
+    }
+
+    for (i = 0; i < EVICTOR_TEST_KEYS; i++)
+        shardcache_set(owner, keys[i], strlen(keys[i]), "evictor_old", 11);
+
+    // let the evictions triggered by the sets reach the peer
+    int waited = 0;
+    while (ht_count(owner->evictor_jobs) && waited++ < 5000)
+        usleep(1000);
+    usleep(100000);
+
+    int admission_count = 0;
+    shardcache_admission_policy_t admission_policy = {
+        .record = count_admission_record,
+        .admit = count_admission_admit,
+        .priv = &admission_count
+    };
+    shardcache_set_admission_policy(peer, &admission_policy);
+
+    ut_testing("the peer caches %d remote items", EVICTOR_TEST_KEYS);
+    count_cached(peer, keys, EVICTOR_TEST_KEYS, "evictor_old");
+    uint64_t misses = ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+    int count = count_cached(peer, keys, EVICTOR_TEST_KEYS, "evictor_old");
+    if (count != EVICTOR_TEST_KEYS)
+        ut_failure("Only %d out of %d items have been retrieved", count, EVICTOR_TEST_KEYS);
+    else
+        ut_validate_int(ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value) - misses, 0);
+
+    ut_testing("EVICT_MULTI evicts all the keys it carries");
+    int fd = connect_to_peer(peer_address, 1000);
+    if (fd < 0) {
+        ut_failure("Can't connect to %s", peer_address);
+    } else {
+        shardcache_record_t evicted[3];
+        for (i = 0; i < 3; i++) {
+            evicted[i].v = keys[i];
+            evicted[i].l = strlen(keys[i]);
+        }
+        fbuf_t packed = FBUF_STATIC_INITIALIZER;
+        pack_multi_record(evicted, 3, &packed);
+        shardcache_record_t record = {
+            .v = fbuf_data(&packed),
+            .l = fbuf_used(&packed)
+        };
+        int rc = write_message(fd, NULL, SHC_HDR_SIGNATURE_SIP, SHC_HDR_EVICT_MULTI, &record, 1);
+        fbuf_destroy(&packed);
+
+        shardcache_hdr_t hdr = 0;
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        if (rc == 0 && read_message(fd, NULL, &respp, 1, &hdr, 0) == 1 &&
+            hdr == SHC_HDR_RESPONSE && fbuf_used(&resp) &&
+            *((char *)fbuf_data(&resp)) == SHC_RES_OK)
+        {
+            misses = ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+            count = count_cached(peer, keys, 3, "evictor_old");
+            ut_validate_int((count == 3 &&
+                ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value) - misses == 3), 1);
+        } else {
+            ut_failure("Bad response to the EVICT_MULTI command");
+        }
+        fbuf_destroy(&resp);
+        close(fd);
+    }
+
+    ut_testing("updates of %d keys are propagated to the peer in batches of %d",
+               EVICTOR_TEST_KEYS, SHARDCACHE_EVICTOR_BATCH_SIZE);
+    for (i = 0; i < EVICTOR_TEST_KEYS; i++)
+        shardcache_set(owner, keys[i], strlen(keys[i]), "evictor_new", 11);
+    count = 0;
+    for (waited = 0; count != EVICTOR_TEST_KEYS && waited < 50; waited++) {
+        usleep(100000);
+        count = count_cached(peer, keys, EVICTOR_TEST_KEYS, "evictor_new");
+    }
+    ut_validate_int(count, EVICTOR_TEST_KEYS);
+
+    shardcache_set_admission_policy(peer, NULL);
+    for (i = 0; i < EVICTOR_TEST_KEYS; i++)
+        shardcache_del(owner, keys[i], strlen(keys[i]));
+}
+
+// a peer running a release which doesn't understand EVICT_MULTI
+typedef struct {
+    int listen_fd;
+    int multi;
+    int evict;
+} legacy_peer_t;
+
+static void *
+legacy_peer(void *priv)
+{
+    legacy_peer_t *peer = (legacy_peer_t *)priv;
+    struct pollfd pfd = { .fd = peer->listen_fd, .events = POLLIN };
+    if (poll(&pfd, 1, 5000) != 1)
+        return NULL;
+
+    int fd = accept(peer->listen_fd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+
+    for (;;) {
+        shardcache_hdr_t hdr = 0;
+        fbuf_t msg = FBUF_STATIC_INITIALIZER;
+        fbuf_t *msgp = &msg;
+        int rc = read_message(fd, NULL, &msgp, 1, &hdr, 1);
+        fbuf_destroy(&msg);
+        if (rc < 0)
+            break;
+
+        // unknown commands are answered with an error
+        unsigned char status = SHC_RES_ERR;
+        if (hdr == SHC_HDR_EVICT) {
+            __sync_add_and_fetch(&peer->evict, 1);
+            status = SHC_RES_OK;
+        } else if (hdr == SHC_HDR_EVICT_MULTI) {
+            __sync_add_and_fetch(&peer->multi, 1);
+        }
+        shardcache_record_t record = {
+            .v = &status,
+            .l = 1
+        };
+        if (write_message(fd, NULL, 0, SHC_HDR_RESPONSE, &record, 1) != 0)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void
+test_evictor_legacy_peers(void)
+{
+    char *addresses[2] = { "127.0.0.1:9767", "127.0.0.1:9768" };
+    shardcache_node_t *nodes[2] = {
+        shardcache_node_create("legacy_owner", &addresses[0], 1),
+        shardcache_node_create("legacy_peer", &addresses[1], 1)
+    };
+    legacy_peer_t peer = {
+        .listen_fd = open_socket("127.0.0.1", 9768),
+        .multi = 0,
+        .evict = 0
+    };
+
+    ut_testing("evictions refused as EVICT_MULTI are sent again as separate EVICT commands");
+    shardcache_t *owner = shardcache_create("legacy_owner", nodes, 2, NULL, NULL, 2, 0, 1<<20);
+    pthread_t th;
+    if (!owner || peer.listen_fd < 0 || pthread_create(&th, NULL, legacy_peer, &peer) != 0) {
+        ut_failure("Can't setup the legacy peer");
+        if (owner)
+            shardcache_destroy(owner);
+        if (peer.listen_fd >= 0)
+            close(peer.listen_fd);
+        shardcache_node_destroy(nodes[0]);
+        shardcache_node_destroy(nodes[1]);
+        return;
+    }
+
+    char keys[4][32];
+    int i, n;
+    for (i = 0, n = 0; n < 4; i++) {
+        snprintf(keys[n], sizeof(keys[n]), "legacy_key%d", i);
+        if (shardcache_test_ownership(owner, keys[n], strlen(keys[n]), NULL, NULL) == 1)
+            n++;
+    }
+
+    // only the replaced values are evicted from the peers
+    for (i = 0; i < 4; i++)
+        shardcache_set(owner, keys[i], strlen(keys[i]), "legacy_old", 10);
+    for (i = 0; i < 2; i++)
+        shardcache_set(owner, keys[i], strlen(keys[i]), "legacy_new", 10);
+
+    int waited;
+    for (waited = 0; __sync_fetch_and_add(&peer.evict, 0) < 2 && waited < 50; waited++)
+        usleep(100000);
+    ut_validate_int((__sync_fetch_and_add(&peer.multi, 0) == 1 &&
+                     __sync_fetch_and_add(&peer.evict, 0) == 2), 1);
+
+    ut_testing("peers refusing EVICT_MULTI receive only separate EVICT commands");
+    for (i = 2; i < 4; i++)
+        shardcache_set(owner, keys[i], strlen(keys[i]), "legacy_new", 10);
+    for (waited = 0; __sync_fetch_and_add(&peer.evict, 0) < 4 && waited < 50; waited++)
+        usleep(100000);
+    ut_validate_int((__sync_fetch_and_add(&peer.multi, 0) == 1 &&
+                     __sync_fetch_and_add(&peer.evict, 0) == 4), 1);
+
+    // the connection to the legacy peer is closed by the evictor
+    shardcache_destroy(owner);
+    pthread_join(th, NULL);
+    close(peer.listen_fd);
+    shardcache_node_destroy(nodes[0]);
+    shardcache_node_destroy(nodes[1]);
+}
+
+static void
+test_tinylfu(void)
+{
+    tinylfu_t *lfu = tinylfu_create(16, 2);
+
+    ut_testing("tinylfu_admit() refuses a key accessed only once");
+    tinylfu_record(lfu, "tinylfu_key", 11);
+    ut_validate_int(tinylfu_admit(lfu, "tinylfu_key", 11), 0);
+
+    ut_testing("tinylfu_admit() admits a key accessed twice");
+    tinylfu_record(lfu, "tinylfu_key", 11);
+    ut_validate_int(tinylfu_admit(lfu, "tinylfu_key", 11), 1);
+
+    ut_testing("accesses to saturated keys still age the counters");
+    // the sample size is 10 times the width of the sketch
+    int i;
+    for (i = 0; i < 16 * 10; i++)
+        tinylfu_record(lfu, "tinylfu_key", 11);
+    ut_validate_int((tinylfu_estimate(lfu, "tinylfu_key", 11) < 15), 1);
+
+    tinylfu_destroy(lfu);
+}
+
+static int
+discard_message_data(void *data, size_t len, int idx, void *priv)
+{
+    return 0;
+}
+
+// returns the state of a reader (using the given secret) fed with the message
+// built by the sender (using its own secret)
+static int
+read_v2_message(char *sender_auth, char *auth, unsigned char sig_hdr, int *version)
+{
+    fbuf_t msg = FBUF_STATIC_INITIALIZER;
+    shardcache_record_t record = {
+        .v = "v2_key",
+        .l = 6
+    };
+    build_message(sender_auth, sig_hdr, SHC_HDR_GET, &record, 1, &msg);
+    if (version)
+        *version = fbuf_data(&msg)[3];
+
+    async_read_ctx_t *ctx = async_read_context_create(auth, discard_message_data, NULL);
+    int state = async_read_context_input_data(ctx, fbuf_data(&msg), fbuf_used(&msg), NULL);
+    async_read_context_destroy(ctx);
+    fbuf_destroy(&msg);
+    return state;
+}
+
+static void
+test_v2_framing(void)
+{
+    char auth[16] = { 's', 'h', 'a', 'r', 'd', 'c', 'a', 'c', 'h', 'e', '_', 't', 'e', 's', 't', 0 };
+    int version = 0;
+
+    ut_testing("V2 messages are accepted when no secret is configured");
+    ut_validate_int(read_v2_message(NULL, NULL, SHC_HDR_CHECKSUM_CRC32C, &version), SHC_STATE_READING_DONE);
+
+    ut_testing("V2 messages are sent with the V2 magic when no secret is configured");
+    ut_validate_int(version, 2);
+
+    ut_testing("V2 messages are refused when a secret is configured");
+    ut_validate_int(read_v2_message(NULL, auth, SHC_HDR_CHECKSUM_CRC32C, NULL), SHC_STATE_AUTH_ERR);
+
+    ut_testing("messages are signed (V1) when a secret is configured, even if V2 is requested");
+    ut_validate_int(read_v2_message(auth, auth, SHC_HDR_CHECKSUM_CRC32C, &version), SHC_STATE_READING_DONE);
+    ut_testing("signed messages are sent with the V1 magic");
+    ut_validate_int(version, 1);
+
+    ut_testing("V1 signed messages are accepted when a secret is configured");
+    ut_validate_int(read_v2_message(auth, auth, SHC_HDR_SIGNATURE_SIP, NULL), SHC_STATE_READING_DONE);
+}
+
+// returns 1 if the cached copy of the key holds the expected value in
+// the inline buffer, 0 if it's stored elsewhere and -1 if the value is wrong
+static int
+check_inline_value(shardcache_t *cache, char *key, void *value, size_t vlen, size_t *isize)
+{
+    void *ptr = NULL;
+    arc_resource_t res = arc_lookup_cached(cache->arc, key, strlen(key), &ptr);
+    if (!res)
+        return -1;
+    int rc = -1;
+    cached_object_t *obj = (cached_object_t *)ptr;
+    COBJ_LOCK(obj);
+    if (obj->data && obj->dlen == vlen && memcmp(obj->data, value, vlen) == 0)
+        rc = COBJ_DATA_IS_INLINE(obj) ? 1 : 0;
+    if (isize)
+        *isize = obj->isize;
+    COBJ_UNLOCK(obj);
+    arc_release_resource(cache->arc, res);
+    return rc;
+}
+
+static void
+test_inline_values(void)
+{
+    char *address[1] = { "127.0.0.1:9765" };
+    shardcache_node_t *node = shardcache_node_create("inline_peer", address, 1);
+    shardcache_t *cache = shardcache_create("inline_peer", &node, 1, NULL, NULL, 1, 1, 1<<20);
+
+    ut_testing("small values are stored in the inline buffer of the cached object");
+    if (!cache) {
+        ut_failure("Errors creating the shardcache instance");
+        shardcache_node_destroy(node);
+        return;
+    }
+
+    // the size of the inline buffer depends on the length of the key
+    // (it's what is left in the slab chunk), look for a reasonable one
+    char key[64];
+    size_t isize = 0;
+    int i, rc = -1;
+    for (i = 0; i < 32 && isize < 8; i++) {
+        sprintf(key, "inline_key%0*d", i + 1, 0);
+        shardcache_set(cache, key, strlen(key), "s", 1);
+        free(shardcache_get(cache, key, strlen(key), NULL, NULL));
+        rc = check_inline_value(cache, key, "s", 1, &isize);
+    }
+    if (isize < 8) {
+        ut_failure("No inline buffer big enough for the test (%d bytes)", (int)isize);
+    } else {
+        ut_validate_int(rc, 1);
+
+        char big[isize + 1];
+        memset(big, 'b', isize + 1);
+        ut_testing("growing the value beyond the inline buffer moves it out");
+        shardcache_set(cache, key, strlen(key), big, isize + 1);
+        ut_validate_int(check_inline_value(cache, key, big, isize + 1, NULL), 0);
+
+        ut_testing("shrinking the value moves it back to the inline buffer");
+        shardcache_set(cache, key, strlen(key), big, isize);
+        ut_validate_int(check_inline_value(cache, key, big, isize, NULL), 1);
+    }
+
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+}
+
+typedef struct {
+    shardcache_t *cache;
+    char *key;
+    int stop;
+    int hits;
+    int errors;
+} hot_key_reader_t;
+
+static void *
+hot_key_reader(void *priv)
+{
+    hot_key_reader_t *reader = (hot_key_reader_t *)priv;
+    size_t klen = strlen(reader->key);
+    while (!__sync_fetch_and_add(&reader->stop, 0)) {
+        size_t vlen = 0;
+        char *value = shardcache_get(reader->cache, reader->key, klen, &vlen, NULL);
+        if (!value || vlen != 11 ||
+            (memcmp(value, "hot_value_a", 11) != 0 && memcmp(value, "hot_value_b", 11) != 0))
+        {
+            reader->errors++;
+        }
+        free(value);
+        reader->hits++;
+    }
+    return NULL;
+}
+
+// the hits served without locking the object must not be
+// affected by the object being concurrently evicted and reloaded
+static void
+test_hits_during_evictions(shardcache_t *cache)
+{
+    char key[32];
+    int i;
+    for (i = 0; ; i++) {
+        sprintf(key, "hot_key%d", i);
+        if (shardcache_test_ownership(cache, key, strlen(key), NULL, NULL) == 1)
+            break;
+    }
+    size_t klen = strlen(key);
+    shardcache_set(cache, key, klen, "hot_value_a", 11);
+
+    hot_key_reader_t readers[4];
+    pthread_t reader_threads[4];
+    memset(readers, 0, sizeof(readers));
+    for (i = 0; i < 4; i++) {
+        readers[i].cache = cache;
+        readers[i].key = key;
+        pthread_create(&reader_threads[i], NULL, hot_key_reader, &readers[i]);
+    }
+
+    for (i = 0; i < 1000; i++) {
+        shardcache_set(cache, key, klen, (i % 2) ? "hot_value_a" : "hot_value_b", 11);
+        shardcache_evict(cache, key, klen);
+        if (i % 10 == 0)
+            usleep(100);
+    }
+
+    int hits = 0, errors = 0;
+    for (i = 0; i < 4; i++) {
+        __sync_fetch_and_add(&readers[i].stop, 1);
+        pthread_join(reader_threads[i], NULL);
+        hits += readers[i].hits;
+        errors += readers[i].errors;
+    }
+
+    ut_testing("concurrent hits on an item being evicted return a consistent value");
+    if (errors)
+        ut_failure("%d out of %d hits returned an unexpected value", errors, hits);
+    else
+        ut_validate_int((hits > 0), 1);
+
+    shardcache_del(cache, key, klen);
+}
+
+// returns the total number of connections handled by the workers
+// (the increment over the provided baseline, if any)
+static int
+get_worker_fds(shardcache_t *cache, int *fds, int num_workers, int *baseline)
+{
+    memset(fds, 0, sizeof(int) * num_workers);
+    shardcache_counter_t *counters = NULL;
+    int num_counters = shardcache_get_counters(cache, &counters);
+    int i, total = 0;
+    for (i = 0; i < num_counters; i++) {
+        int index = -1;
+        if (sscanf(counters[i].name, "worker[%d].numfds", &index) == 1 &&
+            index >= 0 && index < num_workers)
+        {
+            fds[index] = (int)counters[i].value - (baseline ? baseline[index] : 0);
+            total += fds[index];
+        }
+    }
+    free(counters);
+    return total;
+}
+
+static int
+wait_worker_fds(shardcache_t *cache, int *fds, int num_workers, int *baseline, int expected)
+{
+    int total = 0, waited = 0;
+    while ((total = get_worker_fds(cache, fds, num_workers, baseline)) != expected && waited++ < 500)
+        usleep(10000);
+    return total;
+}
+
+static uint64_t
+get_named_counter(shardcache_t *cache, char *name)
+{
+    shardcache_counter_t *counters = NULL;
+    int num_counters = shardcache_get_counters(cache, &counters);
+    int i;
+    uint64_t value = 0;
+    for (i = 0; i < num_counters; i++) {
+        if (strcmp(counters[i].name, name) == 0) {
+            value = counters[i].value;
+            break;
+        }
+    }
+    free(counters);
+    return value;
+}
+
+static void
+test_worker_selection(void)
+{
+    char *address[1] = { "127.0.0.1:9766" };
+    shardcache_node_t *node = shardcache_node_create("worker_peer", address, 1);
+    shardcache_t *cache = shardcache_create("worker_peer", &node, 1, NULL, NULL, 4, 0, 1<<20);
+
+    ut_testing("new connections are spread evenly among idle workers");
+    if (!cache) {
+        ut_failure("Errors creating the shardcache instance");
+        shardcache_node_destroy(node);
+        return;
+    }
+    shardcache_iomux_run_timeout_low(cache, 5000);
+
+    int baseline[4], fds[4], conns[8];
+    int i;
+    get_worker_fds(cache, baseline, 4, NULL);
+    for (i = 0; i < 8; i++)
+        conns[i] = connect_to_peer(address[0], 1000);
+    wait_worker_fds(cache, fds, 4, baseline, 8);
+    ut_validate_int((fds[0] == 2 && fds[1] == 2 && fds[2] == 2 && fds[3] == 2), 1);
+
+    // the connections have been assigned in turn, free the first two workers
+    for (i = 0; i < 8; i++) {
+        if (i % 4 < 2 && conns[i] >= 0) {
+            close(conns[i]);
+            conns[i] = -1;
+        }
+    }
+    wait_worker_fds(cache, fds, 4, baseline, 4);
+
+    ut_testing("new connections are assigned to the least loaded workers");
+    // a plain round-robin would assign one connection to each worker
+    for (i = 0; i < 8; i++) {
+        if (conns[i] < 0)
+            conns[i] = connect_to_peer(address[0], 1000);
+    }
+    wait_worker_fds(cache, fds, 4, baseline, 8);
+    ut_validate_int((fds[0] == 2 && fds[1] == 2 && fds[2] == 2 && fds[3] == 2), 1);
+
+    // the last worker is the one removed when shrinking the pool,
+    // keep one of its connections busy with an incomplete message
+    ut_testing("shardcache_set_num_workers() doesn't wait for busy connections");
+    uint32_t magic = htonl(SHC_MAGIC);
+    if (conns[3] < 0 || write(conns[3], &magic, sizeof(magic)) != sizeof(magic)) {
+        ut_failure("Can't write to the connection");
+    } else {
+        usleep(100000);
+        time_t start = time(NULL);
+        int old_workers = shardcache_set_num_workers(cache, 3);
+        if (old_workers != 4)
+            ut_failure("Wrong number of workers returned (%d)", old_workers);
+        else
+            ut_validate_int((time(NULL) - start < 2), 1);
+
+        ut_testing("busy connections of a retired worker are closed after the timeout");
+        struct timeval rcv_timeout = { 20, 0 };
+        setsockopt(conns[3], SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
+        char byte;
+        ut_validate_int(read(conns[3], &byte, 1), 0);
+    }
+
+    for (i = 0; i < 8; i++) {
+        if (conns[i] >= 0)
+            close(conns[i]);
+    }
+    shardcache_destroy(cache);
+    shardcache_node_destroy(node);
+}
+
+// with the default (TinyLFU) admission policy a remote item is
+// cached only once it has been requested at least twice
+static void
+test_default_admission(shardcache_t *owner, shardcache_t *peer)
+{
+    char key[32];
+    int i;
+    for (i = 0; ; i++) {
+        sprintf(key, "tinylfu_key%d", i);
+        if (shardcache_test_ownership(owner, key, strlen(key), NULL, NULL) == 1)
+            break;
+    }
+    size_t klen = strlen(key);
+    shardcache_set(owner, key, klen, "tinylfu_value", 13);
+    // don't let the eviction triggered by the set reach the peer while testing
+    int waited = 0;
+    while (ht_count(owner->evictor_jobs) && waited++ < 5000)
+        usleep(1000);
+    usleep(100000);
+
+    size_t vlen = 0;
+    int j;
+    uint64_t misses[3];
+    for (j = 0; j < 3; j++) {
+        misses[j] = ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+        free(shardcache_get(peer, key, klen, &vlen, NULL));
+    }
+    uint64_t last_misses = ATOMIC_READ(peer->cnt[SHARDCACHE_COUNTER_CACHE_MISSES].value);
+
+    ut_testing("the first miss on a remote item doesn't cache it");
+    ut_validate_int((misses[1] - misses[0] == 1 && misses[2] - misses[1] == 1), 1);
+
+    ut_testing("the second miss on a remote item admits it to the cache");
+    ut_validate_int(last_misses - misses[2], 0);
+
+    shardcache_del(owner, key, klen);
+}
+
+// returns how many times each of the two addresses has been picked
+static void
+count_peer_picks(peer_selector_t *selector, char **addresses, int picks, int *counts)
+{
+    counts[0] = counts[1] = 0;
+    int i;
+    for (i = 0; i < picks; i++) {
+        char *addr = peer_selector_pick(selector, addresses, 2);
+        counts[addr == addresses[0] ? 0 : 1]++;
+    }
+}
+
+static void
+test_peer_selector(void)
+{
+    peer_selector_t *selector = peer_selector_create();
+    char *addresses[2] = { "127.0.0.1:9001", "127.0.0.1:9002" };
+    int counts[2];
+
+    ut_testing("peer_selector_pick() returns the only address available");
+    ut_validate_int((peer_selector_pick(selector, addresses + 1, 1) == addresses[1]), 1);
+
+    peer_selector_report(selector, addresses[0], 1, 1000);
+    peer_selector_report(selector, addresses[1], 1, 2000);
+
+    ut_testing("peer_selector_pick() prefers the fastest address");
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int((counts[0] > counts[1]), 1);
+
+    ut_testing("peer_selector_pick() still explores the slower addresses");
+    ut_validate_int((counts[1] > 0), 1);
+
+    ut_testing("a single fast sample doesn't overturn the moving average");
+    // 2000 - 2000/8 + 100/8 = 1763
+    peer_selector_report(selector, addresses[1], 1, 100);
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int((counts[0] > counts[1]), 1);
+
+    ut_testing("the moving average converges to the recent samples");
+    int i;
+    for (i = 0; i < 64; i++)
+        peer_selector_report(selector, addresses[1], 1, 100);
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int((counts[1] > counts[0]), 1);
+
+    ut_testing("an address failing repeatedly is avoided (even when exploring)");
+    for (i = 0; i < 3; i++)
+        peer_selector_report(selector, addresses[1], 0, 0);
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int(counts[1], 0);
+
+    ut_testing("the address which failed least recently is used if all of them are failing");
+    usleep(1000);
+    for (i = 0; i < 3; i++)
+        peer_selector_report(selector, addresses[0], 0, 0);
+    count_peer_picks(selector, addresses, 64, counts);
+    ut_validate_int(counts[1], 64);
+
+    ut_testing("a successful request makes the address healthy again");
+    peer_selector_report(selector, addresses[0], 1, 0);
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int(counts[0], 4096);
+
+    ut_testing("the backoff period of a failing address expires");
+    // the address has failed 3 times, it will be avoided for 1 second
+    usleep(1100000);
+    count_peer_picks(selector, addresses, 4096, counts);
+    ut_validate_int((counts[1] > counts[0]), 1);
+
+    peer_selector_destroy(selector);
+}
+
+static void
+test_arc_init(const void *key, size_t klen, int async, arc_resource_t res, void *ptr, void *priv)
+{
+}
+
+static int
+test_arc_fetch(void *obj, size_t *size, void *priv)
+{
+    *size = 10;
+    return 0;
+}
+
+static size_t
+test_arc_store(void *obj, void *data, size_t size, void *priv)
+{
+    return size;
+}
+
+static void
+test_arc_evict(void *obj, void *priv)
+{
+}
+
+static void
+test_arc_buffered_mode(void)
+{
+    arc_ops_t ops = {
+        .init = test_arc_init,
+        .fetch = test_arc_fetch,
+        .store = test_arc_store,
+        .evict = test_arc_evict
+    };
+    size_t *lists_size[4];
+    arc_t *arc = arc_create(&ops, 1<<20, sizeof(int), lists_size, SHARDCACHE_ARC_MODE_BUFFERED, 1);
+
+    ut_testing("hits in buffered mode are not applied until the buffer is drained");
+    void *ptr = NULL;
+    arc_resource_t res = arc_lookup(arc, "buffered_key", 12, &ptr, 0);
+    arc_release_resource(arc, res);
+    res = arc_lookup(arc, "buffered_key", 12, &ptr, 0);
+    arc_release_resource(arc, res);
+    ut_validate_int((arc_mru_size(arc) > 0 && arc_mfu_size(arc) == 0), 1);
+
+    ut_testing("buffered hits are applied when leaving the buffered mode");
+    arc_set_mode(arc, SHARDCACHE_ARC_MODE_STRICT);
+    ut_validate_int((arc_mru_size(arc) == 0 && arc_mfu_size(arc) > 0), 1);
+
+    ut_testing("buffered hits are applied once the buffer is full");
+    arc_set_mode(arc, SHARDCACHE_ARC_MODE_BUFFERED);
+    res = arc_lookup(arc, "other_key", 9, &ptr, 0);
+    arc_release_resource(arc, res);
+    int i;
+    for (i = 0; i < 64 && arc_mru_size(arc) > 0; i++) {
+        res = arc_lookup(arc, "other_key", 9, &ptr, 0);
+        arc_release_resource(arc, res);
+    }
+    ut_validate_int((arc_mru_size(arc) == 0 && arc_count(arc) == 2), 1);
+
+    arc_destroy(arc);
+}
+
+static void
+test_arc_slab(void)
+{
+    arc_slab_t *slab = arc_slab_create();
+
+    ut_testing("arc_slab_alloc() accounts the size of the chunk serving the allocation");
+    void *small = arc_slab_alloc(slab, 20);
+    void *big = arc_slab_alloc(slab, 100000);
+    ut_validate_int((small && big && arc_slab_used(slab) == arc_slab_chunk_size(20) + 100000), 1);
+
+    ut_testing("arc_slab_realloc() within the same size class doesn't move the chunk");
+    memcpy(small, "slab_data", 9);
+    ut_validate_int((arc_slab_realloc(slab, small, 20, 24) == small), 1);
+
+    ut_testing("arc_slab_realloc() to a bigger size class preserves the data");
+    small = arc_slab_realloc(slab, small, 20, 200);
+    if (small && arc_slab_used(slab) == arc_slab_chunk_size(200) + 100000)
+        ut_validate_buffer(small, 9, "slab_data", 9);
+    else
+        ut_failure("Wrong accounting after realloc (used: %zu)", arc_slab_used(slab));
+
+    ut_testing("arc_slab_free() releases all the used memory");
+    arc_slab_free(slab, small, 200);
+    arc_slab_free(slab, big, 100000);
+    ut_validate_int((arc_slab_used(slab) == 0 && arc_slab_reserved(slab) > 0), 1);
+
+    ut_testing("arc_slab_trim() gives back the free slabs");
+    arc_slab_trim(slab);
+    ut_validate_int(arc_slab_reserved(slab), 0);
+
+    arc_slab_destroy(slab);
+}
+
+typedef struct {
+    timer_wheel_entry_t entry; // must be the first member
+    int id;
+    struct timeval scheduled;
+    int elapsed_ms;
+} test_timer_t;
+
+typedef struct {
+    int order[4];
+    int count;
+} test_timer_expired_t;
+
+static void
+test_timer_expired(timer_wheel_entry_t *entry, void *priv)
+{
+    test_timer_t *timer = (test_timer_t *)entry;
+    test_timer_expired_t *expired = (test_timer_expired_t *)priv;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    timer->elapsed_ms = (now.tv_sec - timer->scheduled.tv_sec) * 1000 +
+                        (now.tv_usec - timer->scheduled.tv_usec) / 1000;
+    if (expired->count < 4)
+        expired->order[expired->count] = timer->id;
+    expired->count++;
+}
+
+static void
+test_timer_wheel(void)
+{
+    timer_wheel_t *wheel = timer_wheel_create(1);
+    // 300 ticks fall in the second level and must be cascaded
+    int timeouts[4] = { 300, 5, 2, 50 };
+    test_timer_t timers[4];
+    memset(timers, 0, sizeof(timers));
+    test_timer_expired_t expired;
+    memset(&expired, 0, sizeof(expired));
+
+    int i;
+    for (i = 0; i < 4; i++) {
+        timers[i].id = i;
+        gettimeofday(&timers[i].scheduled, NULL);
+        timer_wheel_schedule(wheel, &timers[i].entry, timeouts[i]);
+    }
+
+    ut_testing("timer_wheel_unschedule() removes the timer");
+    timer_wheel_unschedule(wheel, &timers[3].entry);
+    ut_validate_int((int)timer_wheel_count(wheel), 3);
+
+    ut_testing("timer_wheel_run() expires the timers in order (cascading the far ones)");
+    int waited = 0;
+    while (timer_wheel_count(wheel) && waited++ < 2000) {
+        timer_wheel_run(wheel, test_timer_expired, &expired);
+        usleep(1000);
+    }
+    if (expired.count == 3 && expired.order[0] == 2 && expired.order[1] == 1 && expired.order[2] == 0)
+        ut_validate_int((timers[0].elapsed_ms >= 299 && timers[1].elapsed_ms >= 4), 1);
+    else
+        ut_failure("Wrong expiration (count: %d, order: %d %d %d)",
+                   expired.count, expired.order[0], expired.order[1], expired.order[2]);
+
+    timer_wheel_destroy(wheel, NULL, NULL);
+}
 
 int main(int argc, char **argv)
 {
@@ -17,6 +1354,13 @@ int main(int argc, char **argv)
 
     ut_init(basename(argv[0]));
 
+    test_arc_buffered_mode();
+    test_arc_slab();
+    test_timer_wheel();
+    test_peer_selector();
+    test_tinylfu();
+    test_v2_framing();
+
 
     nodes = malloc(sizeof(shardcache_node_t *) * num_nodes);
     for (i = 0; i < num_nodes; i++) {
@@ -306,6 +1650,95 @@ int main(int argc, char **argv)
     for (i = 0; i < 10; i++)
         shc_multi_item_destroy(items[i]);
 
+    for (i = 0; i < 10; i++) {
+        char key[32];
+        char value[32];
+        snprintf(key, sizeof(key), "test_key%d", 300+i);
+        snprintf(value, sizeof(value), "test_value%d", 300+i);
+        items[i] = shc_multi_item_create(key, strlen(key), value, strlen(value));
+    }
+
+    ut_testing("shardcache_client_set_multi_via(c, nodes[0], items)");
+    failed = 0;
+    if (shardcache_client_set_multi_via(client, shardcache_node_get_label(nodes[0]), items) != 0) {
+        ut_failure("%s", shardcache_client_errstr(client));
+        failed = 1;
+    }
+    for (i = 0; !failed && i < 10; i++) {
+        if (items[i]->status != 0) {
+            ut_failure("status for item %d != 0", i);
+            failed = 1;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    for (i = 0; i < 10; i++) {
+        free(items[i]->data);
+        items[i]->data = NULL;
+        items[i]->dlen = 0;
+    }
+
+    ut_testing("shardcache_client_get_multi_via(c, nodes[1], items)");
+    failed = 0;
+    if (shardcache_client_get_multi_via(client, shardcache_node_get_label(nodes[1]), items) != 0) {
+        ut_failure("%s", shardcache_client_errstr(client));
+        failed = 1;
+    }
+    for (i = 0; !failed && i < 10; i++) {
+        char v[64];
+        sprintf(v, "test_value%d", 300+i);
+        if (!items[i]->data || items[i]->dlen != strlen(v) || strncmp(items[i]->data, v, items[i]->dlen) != 0) {
+            ut_failure("item %d != %s", i, v);
+            failed = 1;
+        }
+    }
+    if (!failed)
+        ut_success();
+
+    for (i = 0; i < 10; i++)
+        shc_multi_item_destroy(items[i]);
+
+    // fetch at once many keys owned by the other node,
+    // the requests are multiplexed over the shared connections
+    // (persistent connections are enabled by default)
+    ut_testing("shardcache_get_async() of 32 remote keys at once (pipelined)");
+    int num_remote = 0;
+    char remote_keys[32][32];
+    async_get_result_t remote_results[32];
+    memset(remote_results, 0, sizeof(remote_results));
+    for (i = 0; num_remote < 32; i++) {
+        sprintf(remote_keys[num_remote], "pipelined_key%d", i);
+        if (shardcache_test_ownership(servers[0], remote_keys[num_remote], strlen(remote_keys[num_remote]), NULL, NULL))
+            continue;
+        char v[32];
+        sprintf(v, "pipelined_value%d", i);
+        shardcache_client_set(client, remote_keys[num_remote], strlen(remote_keys[num_remote]), v, strlen(v), 0);
+        num_remote++;
+    }
+    int old_depth = shardcache_pipeline_depth(servers[0], 8);
+    for (i = 0; i < num_remote; i++)
+        shardcache_get_async(servers[0], remote_keys[i], strlen(remote_keys[i]), collect_async_get, &remote_results[i]);
+    int waited = 0;
+    for (i = 0; i < num_remote && waited < 5000; i++) {
+        while (!__sync_fetch_and_add(&remote_results[i].done, 0) && waited++ < 5000)
+            usleep(1000);
+    }
+    failed = 0;
+    for (i = 0; !failed && i < num_remote; i++) {
+        char v[32];
+        sprintf(v, "pipelined_value%s", remote_keys[i] + strlen("pipelined_key"));
+        if (!remote_results[i].done || remote_results[i].failed ||
+            remote_results[i].len != strlen(v) || memcmp(remote_results[i].value, v, remote_results[i].len) != 0)
+        {
+            ut_failure("Wrong value for key %s", remote_keys[i]);
+            failed = 1;
+        }
+    }
+    if (!failed)
+        ut_success();
+    shardcache_pipeline_depth(servers[0], old_depth);
+
     char *volatile_key = "volatile_key";
     char *volatile_value = "volatile_value";
 
@@ -324,6 +1757,303 @@ int main(int argc, char **argv)
     size = shardcache_client_get(client, volatile_key, strlen(volatile_key), (void **)&value);
     ut_validate_int(size, 0);
 
+    ut_testing("shardcache_set_volatile_storage_size(servers[i], 1<<20) == SHARDCACHE_VOLATILE_STORAGE_UNLIMITED");
+    failed = 0;
+    for (i = 0; i < num_nodes; i++) {
+        if (shardcache_set_volatile_storage_size(servers[i], 1<<20) != SHARDCACHE_VOLATILE_STORAGE_UNLIMITED)
+            failed = 1;
+    }
+    ut_validate_int(failed, 0);
+
+    ut_testing("volatile key exists (with a limited volatile storage)");
+    rc = shardcache_client_set(client, volatile_key, strlen(volatile_key), volatile_value, strlen(volatile_value), 10);
+    size = shardcache_client_get(client, volatile_key, strlen(volatile_key), (void **)&value);
+    ut_validate_buffer(value, size, volatile_value, strlen(volatile_value));
+    free(value);
+
+    // bigger than the share of the limit of a single shard of the storage
+    size_t oversized_len = 1<<19;
+    char *oversized_value = malloc(oversized_len);
+    memset(oversized_value, 'x', oversized_len);
+    ut_testing("shardcache_client_set(volatile_key, oversized_value) fails and keeps the previous value");
+    rc = shardcache_client_set(client, volatile_key, strlen(volatile_key), oversized_value, oversized_len, 10);
+    size = shardcache_client_get(client, volatile_key, strlen(volatile_key), (void **)&value);
+    free(oversized_value);
+    if (rc == 0) {
+        free(value);
+        ut_failure("The oversized value has been accepted");
+    } else {
+        ut_validate_buffer(value, size, volatile_value, strlen(volatile_value));
+        free(value);
+    }
+
+    ut_testing("shardcache_set_volatile_storage_size(servers[i], SHARDCACHE_VOLATILE_STORAGE_UNLIMITED) == 1<<20");
+    failed = 0;
+    for (i = 0; i < num_nodes; i++) {
+        if (shardcache_set_volatile_storage_size(servers[i], SHARDCACHE_VOLATILE_STORAGE_UNLIMITED) != 1<<20)
+            failed = 1;
+    }
+    ut_validate_int(failed, 0);
+
+    ut_testing("shardcache_set_num_workers(servers[0], 2) == 5");
+    ut_validate_int(shardcache_set_num_workers(servers[0], 2), 5);
+
+    ut_testing("shardcache_set_num_workers(servers[1], 8) == 5");
+    ut_validate_int(shardcache_set_num_workers(servers[1], 8), 5);
+
+    ut_testing("shardcache_listen_per_worker(servers[0], 1) == 0");
+    ut_validate_int(shardcache_listen_per_worker(servers[0], 1), 0);
+
+    ut_testing("shardcache_client_get(client, test_key2, 9, &value) == test_value2 (listening per worker)");
+    size = shardcache_client_get(client, "test_key2", 9, &value);
+    ut_validate_buffer(value, size, "test_value2", 11);
+    free(value);
+
+    ut_testing("shardcache_listen_per_worker(servers[0], 0) == 1");
+    ut_validate_int(shardcache_listen_per_worker(servers[0], 0), 1);
+
+    ut_testing("shardcache_set_cache_size(servers[0], 1<<20) == 1<<29");
+    ut_validate_int((shardcache_set_cache_size(servers[0], 1<<20) == 1<<29), 1);
+
+    ut_testing("shardcache_client_get(client, test_key2, 9, &value) == test_value2 (after resizing)");
+    size = shardcache_client_get(client, "test_key2", 9, &value);
+    ut_validate_buffer(value, size, "test_value2", 11);
+    free(value);
+
+    ut_testing("shardcache_get_resource(servers[0], test_key2, 9) == test_value2");
+    shardcache_resource_t *resource = shardcache_get_resource(servers[0], "test_key2", 9);
+    if (resource) {
+        size_t rlen = 0;
+        const void *rdata = shardcache_resource_data(resource, &rlen);
+        ut_validate_buffer((void *)rdata, rlen, "test_value2", 11);
+        shardcache_resource_release(resource);
+    } else {
+        ut_failure("No resource returned");
+    }
+
+    ut_testing("shardcache_set_admission_policy() is applied to remote items");
+    int admission_count = 0;
+    shardcache_admission_policy_t admission_policy = {
+        .record = count_admission_record,
+        .admit = count_admission_admit,
+        .priv = &admission_count
+    };
+    shardcache_client_set(client, "admission_key", 13, "admission_value", 15, 0);
+    shardcache_t *non_owner = shardcache_test_ownership(servers[0], "admission_key", 13, NULL, NULL)
+                            ? servers[1] : servers[0];
+    shardcache_set_admission_policy(non_owner, &admission_policy);
+    resource = shardcache_get_resource(non_owner, "admission_key", 13);
+    shardcache_set_admission_policy(non_owner, NULL);
+    if (resource) {
+        shardcache_resource_release(resource);
+        ut_validate_int(admission_count, 1);
+    } else {
+        ut_failure("No resource returned");
+    }
+
+    char snapshot[64];
+    snprintf(snapshot, sizeof(snapshot), "/tmp/shardcache_test_snapshot.%d", (int)getpid());
+    ut_testing("shardcache_snapshot(non_owner, snapshot) > 0");
+    ut_validate_int((shardcache_snapshot(non_owner, snapshot) > 0), 1);
+
+    ut_testing("shardcache_restore(non_owner, snapshot) skips the keys owned by other nodes");
+    shardcache_evict(non_owner, "admission_key", 13);
+    rc = shardcache_restore(non_owner, snapshot);
+    unlink(snapshot);
+    if (rc == -1) {
+        ut_failure("The snapshot can't be restored");
+    } else {
+        arc_resource_t res = arc_lookup_cached(non_owner->arc, "admission_key", 13, NULL);
+        if (res) {
+            arc_release_resource(non_owner->arc, res);
+            ut_failure("admission_key has been restored on a node not owning it");
+        } else {
+            ut_success();
+        }
+    }
+
+    shardcache_t *admission_owner = (non_owner == servers[0]) ? servers[1] : servers[0];
+    resource = shardcache_get_resource(admission_owner, "admission_key", 13);
+    if (resource)
+        shardcache_resource_release(resource);
+    ut_testing("shardcache_snapshot(admission_owner, snapshot) > 0");
+    ut_validate_int((shardcache_snapshot(admission_owner, snapshot) > 0), 1);
+
+    ut_testing("shardcache_restore(admission_owner, snapshot) > 0 (after evicting admission_key)");
+    shardcache_evict(admission_owner, "admission_key", 13);
+    ut_validate_int((shardcache_restore(admission_owner, snapshot) > 0), 1);
+    unlink(snapshot);
+
+    ut_testing("restored items are served from the cache");
+    arc_resource_t restored = arc_lookup_cached(admission_owner->arc, "admission_key", 13, NULL);
+    if (restored) {
+        arc_release_resource(admission_owner->arc, restored);
+        ut_success();
+    } else {
+        ut_failure("admission_key has not been restored");
+    }
+
+    ut_testing("volatile keys are not restored from a snapshot once expired");
+    char snapshot_key[32];
+    for (i = 0; i < 100; i++) {
+        snprintf(snapshot_key, sizeof(snapshot_key), "snapshot_volatile_%d", i);
+        if (shardcache_test_ownership(admission_owner, snapshot_key, strlen(snapshot_key), NULL, NULL))
+            break;
+    }
+    size_t snapshot_klen = strlen(snapshot_key);
+    shardcache_set_volatile(admission_owner, snapshot_key, snapshot_klen, "volatile_value", 14, 1);
+    void *snapshot_value = shardcache_get(admission_owner, snapshot_key, snapshot_klen, NULL, NULL);
+    free(snapshot_value);
+    restored = arc_lookup_cached(admission_owner->arc, snapshot_key, snapshot_klen, NULL);
+    if (!restored) {
+        ut_failure("The volatile key has not been cached");
+    } else {
+        arc_release_resource(admission_owner->arc, restored);
+        shardcache_snapshot(admission_owner, snapshot);
+        // the expiration removes the cached copy as well
+        int waited;
+        for (waited = 0; waited < 50; waited++) {
+            restored = arc_lookup_cached(admission_owner->arc, snapshot_key, snapshot_klen, NULL);
+            if (!restored)
+                break;
+            arc_release_resource(admission_owner->arc, restored);
+            usleep(100000);
+        }
+        shardcache_restore(admission_owner, snapshot);
+        unlink(snapshot);
+        snapshot_value = shardcache_get(admission_owner, snapshot_key, snapshot_klen, NULL, NULL);
+        if (snapshot_value) {
+            free(snapshot_value);
+            ut_failure("The expired volatile key has been restored");
+        } else {
+            ut_success();
+        }
+    }
+
+    shardcache_t *streaming_node = shardcache_test_ownership(servers[0], "stream_key", 10, NULL, NULL)
+                                 ? servers[1] : servers[0];
+    ut_testing("shardcache_streaming_threshold(streaming_node, 16384) == SHARDCACHE_STREAMING_THRESHOLD_DEFAULT");
+    ut_validate_int(shardcache_streaming_threshold(streaming_node, 16384), SHARDCACHE_STREAMING_THRESHOLD_DEFAULT);
+
+    ut_testing("shardcache_get(streaming_node, stream_key) == big_value (streamed twice)");
+    size_t big_len = 1<<18;
+    char *big_value = malloc(big_len);
+    for (i = 0; i < (int)big_len; i++)
+        big_value[i] = 'a' + (i % 26);
+    shardcache_client_set(client, "stream_key", 10, big_value, big_len, 0);
+    uint64_t streamed = ATOMIC_READ(streaming_node->cnt[SHARDCACHE_COUNTER_STREAMED].value);
+    for (i = 0; i < 2; i++) {
+        size_t vlen = 0;
+        void *v = shardcache_get(streaming_node, "stream_key", 10, &vlen, NULL);
+        if (!v) {
+            ut_failure("No value returned");
+            break;
+        }
+        if (vlen != big_len || memcmp(v, big_value, big_len) != 0) {
+            free(v);
+            ut_failure("Wrong value returned");
+            break;
+        }
+        free(v);
+    }
+    if (i == 2)
+        ut_success();
+    free(big_value);
+
+    ut_testing("the streamed value is counted and not left in the cache");
+    arc_resource_t streamed_res = arc_lookup_cached(streaming_node->arc, "stream_key", 10, NULL);
+    if (streamed_res)
+        arc_release_resource(streaming_node->arc, streamed_res);
+    ut_validate_int((!streamed_res &&
+        ATOMIC_READ(streaming_node->cnt[SHARDCACHE_COUNTER_STREAMED].value) - streamed == 2), 1);
+
+    ut_testing("a slow client is paused while streaming and still gets the whole value");
+    // more than what the socket buffers can hold while the client isn't reading
+    big_len = 1<<23;
+    big_value = malloc(big_len);
+    for (i = 0; i < (int)big_len; i++)
+        big_value[i] = 'A' + (i % 26);
+    shardcache_client_set(client, "slow_stream_key", 15, big_value, big_len, 0);
+    shardcache_t *slow_streaming_node = shardcache_test_ownership(servers[0], "slow_stream_key", 15, NULL, NULL)
+                                      ? servers[1] : servers[0];
+    shardcache_streaming_threshold(slow_streaming_node, 16384);
+    char *slow_address = (slow_streaming_node == servers[0]) ? "127.0.0.1:9750" : "127.0.0.1:9751";
+    uint64_t paused = get_named_counter(slow_streaming_node, "paused_requests");
+    int slow_fd = connect_to_peer(slow_address, 1000);
+    shardcache_record_t slow_record = {
+        .v = "slow_stream_key",
+        .l = 15
+    };
+    if (slow_fd < 0 || write_message(slow_fd, NULL, SHC_HDR_SIGNATURE_SIP, SHC_HDR_GET, &slow_record, 1) != 0) {
+        ut_failure("Can't send the request to %s", slow_address);
+    } else {
+        // don't read anything until the request has been paused
+        int waited;
+        for (waited = 0; waited < 100; waited++) {
+            if (get_named_counter(slow_streaming_node, "paused_requests") != paused)
+                break;
+            usleep(50000);
+        }
+        shardcache_hdr_t hdr = 0;
+        fbuf_t resp = FBUF_STATIC_INITIALIZER;
+        fbuf_t *respp = &resp;
+        int rc = read_message(slow_fd, NULL, &respp, 1, &hdr, 0);
+        if (get_named_counter(slow_streaming_node, "paused_requests") == paused)
+            ut_failure("The request has never been paused");
+        else if (rc != 1 || hdr != SHC_HDR_RESPONSE)
+            ut_failure("Bad response to the GET command");
+        else if (fbuf_used(&resp) != big_len || memcmp(fbuf_data(&resp), big_value, big_len) != 0)
+            ut_failure("Wrong value returned (%u bytes)", fbuf_used(&resp));
+        else
+            ut_success();
+        fbuf_destroy(&resp);
+    }
+    if (slow_fd >= 0)
+        close(slow_fd);
+    free(big_value);
+    shardcache_client_del(client, "slow_stream_key", 15);
+    shardcache_streaming_threshold(slow_streaming_node, SHARDCACHE_STREAMING_THRESHOLD_DEFAULT);
+    shardcache_streaming_threshold(streaming_node, SHARDCACHE_STREAMING_THRESHOLD_DEFAULT);
+
+    for (i = 0; i < num_nodes; i++) {
+        ut_testing("shardcache_protocol_version(servers[%d], 2) == 1", i);
+        ut_validate_int(shardcache_protocol_version(servers[i], 2), 1);
+    }
+
+    shardcache_t *v2_node = shardcache_test_ownership(servers[0], "v2_key", 6, NULL, NULL)
+                          ? servers[1] : servers[0];
+    ut_testing("shardcache_set(v2_node, v2_key, 6, v2_value, 8) == 0 (protocol V2)");
+    ut_validate_int(shardcache_set(v2_node, "v2_key", 6, "v2_value", 8), 0);
+
+    ut_testing("shardcache_get(v2_node, v2_key, 6) == v2_value (protocol V2)");
+    shardcache_evict(v2_node, "v2_key", 6);
+    size_t v2_len = 0;
+    void *v2_value = shardcache_get(v2_node, "v2_key", 6, &v2_len, NULL);
+    ut_validate_buffer(v2_value, v2_len, "v2_value", 8);
+    free(v2_value);
+
+    ut_testing("shardcache_client_get(client, v2_key, 6) == v2_value (V1 client)");
+    size = shardcache_client_get(client, "v2_key", 6, &value);
+    ut_validate_buffer(value, size, "v2_value", 8);
+    free(value);
+
+    for (i = 0; i < num_nodes; i++)
+        shardcache_protocol_version(servers[i], 1);
+
+    char *async_storage_address[1] = { "127.0.0.1:9760" };
+    shardcache_node_t *async_storage_node = shardcache_node_create("async_storage_peer", async_storage_address, 1);
+    test_async_storage(async_storage_node);
+    shardcache_node_destroy(async_storage_node);
+
+    test_parallel_migration();
+    test_owner_hints();
+    test_default_admission(servers[1], servers[0]);
+    test_inline_values();
+    test_hits_during_evictions(servers[0]);
+    test_worker_selection();
+    test_evictor_batches(servers[1], servers[0], "127.0.0.1:9750");
+    test_evictor_legacy_peers();
+
     ut_testing("destroying all clients");
     shardcache_client_destroy(client);
     shardcache_client_destroy(client1);